@@ -10,6 +10,7 @@
 #include "log.h"
 #include "hlassert.h"
 #include "blockmem.h"
+#include "profile.h"
 
 // =====================================================================================
 //  AllocBlock
@@ -30,6 +31,7 @@ void*           AllocBlock(const unsigned long size)
 
     if (h)
     {
+        ProfileAllocBlock(GlobalSize(h));
         pointer = GlobalLock(h);
     }
     else
@@ -56,6 +58,7 @@ bool            FreeBlock(void* pointer)
 
     if (h)
     {
+        ProfileFreeBlock(GlobalSize(h));
         GlobalUnlock(h);
         GlobalFree(h);
         return true;
@@ -115,6 +118,29 @@ bool            Free(void* pointer)
 #include "cmdlib.h"
 #include "messages.h"
 #include "log.h"
+#include "profile.h"
+#if defined(__GLIBC__)
+#include <malloc.h>
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#endif
+
+// =====================================================================================
+//  BlockSize
+//      What the allocator actually reserved for a block, so that FreeBlock can report the
+//      same size as AllocBlock did. Returns 0 where the C library can't tell, which leaves
+//      the AllocBlock usage out of the profile report.
+// =====================================================================================
+static size_t   BlockSize(void* pointer)
+{
+#if defined(__GLIBC__)
+    return malloc_usable_size(pointer);
+#elif defined(__APPLE__)
+    return malloc_size(pointer);
+#else
+    return 0;
+#endif
+}
 
 // =====================================================================================
 //  AllocBlock
@@ -125,7 +151,13 @@ void*           AllocBlock(const unsigned long size)
     {
         Warning("Attempting to allocate 0 bytes");
     }
-    return calloc(1, size);
+    void*           pointer = calloc(1, size);
+
+    if (pointer)
+    {
+        ProfileAllocBlock(BlockSize(pointer));
+    }
+    return pointer;
 }
 
 // =====================================================================================
@@ -137,6 +169,10 @@ bool            FreeBlock(void* pointer)
     {
         Warning("Freeing a null pointer");
     }
+    else
+    {
+        ProfileFreeBlock(BlockSize(pointer));
+    }
     free(pointer);
     return true;
 }
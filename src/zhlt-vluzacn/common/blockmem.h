@@ -6,6 +6,7 @@
 #pragma once
 #endif
 
+// blocks from AllocBlock and Alloc are counted by the profile report, release them with FreeBlock or Free, not free
 extern void*    AllocBlock(unsigned long size);
 extern bool     FreeBlock(void* pointer);
 
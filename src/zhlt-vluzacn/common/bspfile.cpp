@@ -1858,8 +1858,8 @@ void			DeleteKey(entity_t* ent, const char* const key)
 		{
 			epair_t *ep = *pep;
 			*pep = ep->next;
-			Free(ep->key);
-			Free(ep->value);
+			free(ep->key);
+			free(ep->value);
 			Free(ep);
 			return;
 		}
@@ -1879,7 +1879,7 @@ void            SetKeyValue(entity_t* ent, const char* const key, const char* co
         if (!strcmp(ep->key, key))
         {
 			char *value2 = strdup (value);
-			Free (ep->value);
+			free (ep->value);
 			ep->value = value2;
             return;
         }
@@ -93,6 +93,29 @@
 #define BSPVERSION  30
 #define TOOLVERSION 2
 
+// Intermediate hull files (.p0-.p3 faces and .b0-.b3 detail brushes) passed from hlcsg to hlbsp.
+// The binary form starts with this header and then holds the same fields as the text form,
+// with ints stored as int and coordinates as double, so nothing is lost in between.
+#define HULLFILE_BINARY_IDENT (('B'<<24)+('L'<<16)+('U'<<8)+'H') // "HULB"
+#define HULLFILE_BINARY_VERSION 1
+
+// Portal file passed from hlbsp to hlvis (mapname_viscache.prt; mapname.prt stays text for the editors).
+// The binary form is this header, then the bsp leaf count of each portal leaf, the number of portals
+// on each portal leaf, the point count and the two leafs of each portal, and last the points of all
+// the portals in order, as double.
+#define PORTALFILE_BINARY_IDENT (('B'<<24)+('T'<<16)+('R'<<8)+'P') // "PRTB"
+#define PORTALFILE_BINARY_VERSION 1
+
+typedef struct
+{
+    int             ident;
+    int             version;
+    int             numleafs;
+    int             numportals;
+    int             numpoints;                             // in all the portals
+}
+portalfileheader_t;
+
 
 //
 // BSP File Structures
@@ -6,6 +6,8 @@
 #include <sys/stat.h>
 #include <io.h>
 #include <fcntl.h>
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
 #endif
 
 #ifdef SYSTEM_POSIX
@@ -20,6 +22,7 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#include <sys/mman.h>
 #endif
 
 #include "cmdlib.h"
@@ -215,3 +218,83 @@ void            SaveFile(const char* const filename, const void* const buffer, i
     fclose(f);
 }
 
+
+/*
+ * ==============
+ * MapFileRead
+ *      Maps a whole file read-only. Returns NULL if it can not be opened or is empty.
+ * ==============
+ */
+void*           MapFileRead(const char* const filename, size_t* size)
+{
+#ifdef SYSTEM_WIN32
+    HANDLE          file;
+    HANDLE          mapping;
+    LARGE_INTEGER   filesize;
+    void*           map;
+
+    file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return NULL;
+    }
+    if (!GetFileSizeEx(file, &filesize) || filesize.QuadPart <= 0
+        || (unsigned long long)filesize.QuadPart != (unsigned long long)(size_t)filesize.QuadPart)
+    {
+        CloseHandle(file);
+        return NULL;
+    }
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL)
+    {
+        return NULL;
+    }
+    map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);                                  // the view keeps its own reference
+    if (map == NULL)
+    {
+        return NULL;
+    }
+    *size = (size_t)filesize.QuadPart;
+    return map;
+#else
+    int             fd;
+    struct stat     st;
+    void*           map;
+
+    fd = open(filename, O_RDONLY);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size <= 0
+        || (unsigned long long)st.st_size != (unsigned long long)(size_t)st.st_size)
+    {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);                                             // the mapping keeps its own reference
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+    *size = (size_t)st.st_size;
+    return map;
+#endif
+}
+
+/*
+ * ==============
+ * UnmapFile
+ * ==============
+ */
+void            UnmapFile(void* const map, const size_t size)
+{
+#ifdef SYSTEM_WIN32
+    UnmapViewOfFile(map);
+#else
+    munmap(map, size);
+#endif
+}
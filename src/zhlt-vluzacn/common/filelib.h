@@ -20,4 +20,7 @@ extern void     SafeWrite(FILE* f, const void* const buffer, int count);
 extern int      LoadFile(const char* const filename, char** bufferptr);
 extern void     SaveFile(const char* const filename, const void* const buffer, int count);
 
+extern void*    MapFileRead(const char* const filename, size_t* size);
+extern void     UnmapFile(void* const map, const size_t size);
+
 #endif //**/ FILELIB_H__
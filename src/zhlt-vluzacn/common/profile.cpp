@@ -0,0 +1,257 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
+
+#include "cmdlib.h"
+#include "messages.h"
+#include "log.h"
+#include "hlassert.h"
+#include "threads.h"
+#include "profile.h"
+
+static const char* const s_countername[eProfileCounterCount] =
+{
+    "rays_traced",
+    "windings_clipped",
+    "portals_flowed",
+    "planes_created",
+};
+
+typedef struct
+{
+    char            name[64];
+    int             depth;
+    int             numthreads;
+    double          start;                                 // seconds since the program started
+    double          elapsed;                               // negative while the stage is still open
+    long long       counters[eProfileCounterCount];        // totals at the start, then the amount counted by this stage
+    long long       peakalloc;                             // highest AllocBlock usage while the stage was open
+    long long       savedpeak;                             // high water mark of the enclosing stage at the start
+}
+profilestage_t;
+
+thread_local long long t_profilecounters[eProfileCounterCount];
+
+static std::atomic<long long> s_counters[eProfileCounterCount];
+static std::atomic<long long> s_allocbytes (0);
+static std::atomic<long long> s_peakalloc (0);            // since the program started
+static std::atomic<long long> s_stagepeakalloc (0);       // since the innermost open stage started
+
+static const double s_programstart = I_FloatTime();
+static const std::thread::id s_mainthread = std::this_thread::get_id();
+static std::vector<profilestage_t> s_stages;
+static std::vector<int> s_openstages;
+
+// =====================================================================================
+//  ProfileFlushThread
+//      Adds the counters of the calling thread to the totals
+// =====================================================================================
+void            ProfileFlushThread()
+{
+    for (int i = 0; i < eProfileCounterCount; i++)
+    {
+        if (t_profilecounters[i])
+        {
+            s_counters[i].fetch_add(t_profilecounters[i], std::memory_order_relaxed);
+            t_profilecounters[i] = 0;
+        }
+    }
+}
+
+static void     RaiseAllocPeak(std::atomic<long long>& peak, const long long value)
+{
+    long long       old = peak.load(std::memory_order_relaxed);
+
+    while (old < value && !peak.compare_exchange_weak(old, value, std::memory_order_relaxed))
+    {
+    }
+}
+
+// =====================================================================================
+//  ProfileAllocBlock / ProfileFreeBlock
+// =====================================================================================
+void            ProfileAllocBlock(const size_t size)
+{
+    const long long now = s_allocbytes.fetch_add(size, std::memory_order_relaxed) + size;
+
+    RaiseAllocPeak(s_peakalloc, now);
+    RaiseAllocPeak(s_stagepeakalloc, now);
+}
+
+void            ProfileFreeBlock(const size_t size)
+{
+    s_allocbytes.fetch_sub(size, std::memory_order_relaxed);
+}
+
+// =====================================================================================
+//  ProfileBeginStage
+//      Stages are only recorded on the main thread, a stage begun by a worker is ignored
+// =====================================================================================
+void            ProfileBeginStage(const char* const name)
+{
+    profilestage_t  stage;
+
+    if (std::this_thread::get_id() != s_mainthread)
+    {
+        return;
+    }
+    ProfileFlushThread();
+
+    memset(&stage, 0, sizeof(stage));
+    safe_strncpy(stage.name, name, sizeof(stage.name));
+    stage.depth = s_openstages.size();
+    stage.numthreads = g_numthreads;
+    stage.start = I_FloatTime() - s_programstart;
+    stage.elapsed = -1;
+    for (int i = 0; i < eProfileCounterCount; i++)
+    {
+        stage.counters[i] = s_counters[i].load(std::memory_order_relaxed);
+    }
+    stage.savedpeak = s_stagepeakalloc.exchange(s_allocbytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+    s_openstages.push_back(s_stages.size());
+    s_stages.push_back(stage);
+}
+
+static void     CloseStage(profilestage_t* const stage)
+{
+    ProfileFlushThread();
+
+    stage->elapsed = I_FloatTime() - s_programstart - stage->start;
+    for (int i = 0; i < eProfileCounterCount; i++)
+    {
+        stage->counters[i] = s_counters[i].load(std::memory_order_relaxed) - stage->counters[i];
+    }
+    stage->peakalloc = s_stagepeakalloc.load(std::memory_order_relaxed);
+    // the enclosing stage saw this peak as well
+    RaiseAllocPeak(s_stagepeakalloc, stage->savedpeak);
+}
+
+// =====================================================================================
+//  ProfileEndStage
+// =====================================================================================
+void            ProfileEndStage()
+{
+    if (std::this_thread::get_id() != s_mainthread)
+    {
+        return;
+    }
+    hlassert(!s_openstages.empty());
+    if (s_openstages.empty())
+    {
+        return;
+    }
+    CloseStage(&s_stages[s_openstages.back()]);
+    s_openstages.pop_back();
+}
+
+static void     WriteJsonString(FILE* const f, const char* s)
+{
+    fputc('"', f);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+        {
+            fprintf(f, "\\%c", *s);
+        }
+        else if ((unsigned char)*s < 0x20)
+        {
+            fprintf(f, "\\u%04x", (unsigned char)*s);
+        }
+        else
+        {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void     WriteJsonCounters(FILE* const f, const long long* const counters)
+{
+    fprintf(f, "{");
+    for (int i = 0; i < eProfileCounterCount; i++)
+    {
+        fprintf(f, "%s\"%s\": %lld", i? ", ": "", s_countername[i], counters[i]);
+    }
+    fprintf(f, "}");
+}
+
+// =====================================================================================
+//  WriteProfileReport
+//      Meant to be registered with atexit, so it also runs after Error. Stages that are
+//      still open at that point are closed and the report is marked as not completed.
+// =====================================================================================
+void            WriteProfileReport()
+{
+    char            filename[_MAX_PATH];
+    FILE*           f;
+    bool            completed;
+    long long       counters[eProfileCounterCount];
+    long long       peakrss = -1;
+
+    if (!g_log || std::this_thread::get_id() != s_mainthread)
+    {
+        return;
+    }
+
+    completed = s_openstages.empty();
+    while (!s_openstages.empty())
+    {
+        CloseStage(&s_stages[s_openstages.back()]);
+        s_openstages.pop_back();
+    }
+    ProfileFlushThread();
+    for (int i = 0; i < eProfileCounterCount; i++)
+    {
+        counters[i] = s_counters[i].load(std::memory_order_relaxed);
+    }
+#ifdef HAVE_SYS_RESOURCE_H
+    {
+        struct rusage   usage;
+
+        if (getrusage(RUSAGE_SELF, &usage) == 0)
+        {
+            peakrss = (long long)usage.ru_maxrss * 1024;
+        }
+    }
+#endif
+
+    safe_snprintf(filename, _MAX_PATH, "%s.%s.json", g_Mapname, g_Program);
+    f = fopen(filename, "w");
+    if (!f)
+    {
+        Warning("Could not write profile report %s", filename);
+        return;
+    }
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"program\": ");
+    WriteJsonString(f, g_Program);
+    fprintf(f, ",\n  \"map\": ");
+    WriteJsonString(f, g_Mapname);
+    fprintf(f, ",\n  \"completed\": %s,\n", completed? "true": "false");
+    fprintf(f, "  \"threads\": %d,\n", g_numthreads);
+    fprintf(f, "  \"elapsed\": %.3f,\n", I_FloatTime() - s_programstart);
+    fprintf(f, "  \"peak_allocblock_bytes\": %lld,\n", s_peakalloc.load(std::memory_order_relaxed));
+    fprintf(f, "  \"peak_rss_bytes\": %lld,\n", peakrss);
+    fprintf(f, "  \"counters\": ");
+    WriteJsonCounters(f, counters);
+    fprintf(f, ",\n  \"stages\": [");
+    for (unsigned i = 0; i < s_stages.size(); i++)
+    {
+        const profilestage_t* const stage = &s_stages[i];
+
+        fprintf(f, "%s\n    {\"name\": ", i? ",": "");
+        WriteJsonString(f, stage->name);
+        fprintf(f, ", \"depth\": %d, \"threads\": %d, \"start\": %.3f, \"elapsed\": %.3f, \"peak_allocblock_bytes\": %lld, \"counters\": ",
+            stage->depth, stage->numthreads, stage->start, stage->elapsed, stage->peakalloc);
+        WriteJsonCounters(f, stage->counters);
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n  ]\n}\n");
+    fclose(f);
+}
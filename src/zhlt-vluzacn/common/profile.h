@@ -0,0 +1,59 @@
+#ifndef PROFILE_H__
+#define PROFILE_H__
+#include "cmdlib.h" //--vluzacn
+
+#if _MSC_VER >= 1000
+#pragma once
+#endif
+
+// =====================================================================================
+//  Stage timing and counters
+//      Named stages are timed on the main thread and may nest. Every NamedRunThreadsOn
+//      is a stage of its own. The counters are kept per thread without locking and are
+//      summed when the worker threads of RunThreadsOn finish; threads started by other
+//      means must call ProfileFlushThread before they exit.
+//      WriteProfileReport writes everything to "<mapname>.<program>.json" next to the log.
+// =====================================================================================
+
+typedef enum
+{
+    eProfileRaysTraced = 0,
+    eProfileWindingsClipped,
+    eProfilePortalsFlowed,
+    eProfilePlanesCreated,
+    eProfileCounterCount
+}
+profilecounter_t;
+
+extern thread_local long long t_profilecounters[eProfileCounterCount];
+
+inline void     ProfileCount(const profilecounter_t counter, const long long amount = 1)
+{
+    t_profilecounters[counter] += amount;
+}
+
+extern void     ProfileFlushThread();
+
+extern void     ProfileBeginStage(const char* const name);
+extern void     ProfileEndStage();
+
+// AllocBlock and FreeBlock report the size of each block here
+extern void     ProfileAllocBlock(const size_t size);
+extern void     ProfileFreeBlock(const size_t size);
+
+extern void     WriteProfileReport();
+
+class ProfileScope
+{
+public:
+    ProfileScope(const char* const name)
+    {
+        ProfileBeginStage(name);
+    }
+    ~ProfileScope()
+    {
+        ProfileEndStage();
+    }
+};
+
+#endif //**/ PROFILE_H__
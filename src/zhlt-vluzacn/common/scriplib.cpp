@@ -3,6 +3,7 @@
 #include "messages.h"
 #include "log.h"
 #include "scriplib.h"
+#include "blockmem.h"
 
 char            g_token[MAXTOKEN];
 char            g_TXcommand;
@@ -125,7 +126,7 @@ bool            EndOfScript(const bool crossline)
         return false;
     }
 
-    free(s_script->buffer);
+    Free(s_script->buffer);
 
     if (s_script == s_scriptstack + 1)
     {
@@ -13,6 +13,7 @@
 #include "log.h"
 #include "threads.h"
 #include "blockmem.h"
+#include "profile.h"
 
 #ifdef SYSTEM_POSIX
 #ifdef HAVE_SYS_TIME_H
@@ -25,8 +26,11 @@
 #ifdef HAVE_PTHREAD_H
 #include <pthread.h>
 #endif
+#include <time.h>
 #endif
 
+#include <atomic>
+
 #include "hlassert.h"
 
 q_threadpriority g_threadpriority = DEFAULT_THREAD_PRIORITY;
@@ -34,7 +38,9 @@ q_threadpriority g_threadpriority = DEFAULT_THREAD_PRIORITY;
 #define THREADTIMES_SIZE 100
 #define THREADTIMES_SIZEf (float)(THREADTIMES_SIZE)
 
-static int      dispatch = 0;
+// How often (in milliseconds) the thread that started the work samples the progress
+#define PACIFIER_INTERVAL 100
+
 static int      workcount = 0;
 static int      oldf = 0;
 static bool     pacifier = false;
@@ -42,54 +48,164 @@ static bool     threaded = false;
 static double   threadstart = 0;
 static double   threadtimes[THREADTIMES_SIZE];
 
-int             GetThreadWork()
+// =====================================================================================
+//  Work queues
+//      Every thread owns a contiguous range of work indices and takes shrinking chunks
+//      from the front of it without touching any lock. A thread whose range has run dry
+//      steals the back half of the fullest range of another thread.
+//      The range is packed as (end << 32) | begin so that taking and stealing are one CAS.
+// =====================================================================================
+#define WORKRANGE_MAKE(begin, end) (((unsigned long long)(unsigned int)(end) << 32) | (unsigned int)(begin))
+#define WORKRANGE_BEGIN(r) ((int)(unsigned int)((r) & 0xFFFFFFFFULL))
+#define WORKRANGE_END(r) ((int)(unsigned int)((r) >> 32))
+
+// Each thread takes 1/WORKCHUNK_DIVISOR of what is left in its range at a time
+#define WORKCHUNK_DIVISOR 8
+
+struct alignas(64) workqueue_t
+{
+    std::atomic<unsigned long long> range;                 // still unclaimed, shared with thieves
+    std::atomic<int> dispatched;                           // written by the owner only, read by the pacifier
+    int             chunkcur;                              // owner only
+    int             chunkend;                              // owner only
+};
+
+static workqueue_t s_workqueues[MAX_THREADS];
+static int      s_numworkqueues = 1;
+static thread_local int s_threadnum = 0;
+
+static void     ResetWorkQueues(int numqueues, int workcnt)
 {
-    int             r, f, i;
+    int             i;
+
+    s_numworkqueues = numqueues;
+    for (i = 0; i < numqueues; i++)
+    {
+        workqueue_t*    q = &s_workqueues[i];
+
+        q->range.store(WORKRANGE_MAKE((long long)workcnt * i / numqueues, (long long)workcnt * (i + 1) / numqueues));
+        q->dispatched.store(0);
+        q->chunkcur = 0;
+        q->chunkend = 0;
+    }
+}
+
+static bool     StealWorkRange(workqueue_t* q)
+{
+    int             i;
+    int             best;
+    int             bestcount;
+    unsigned long long bestrange;
+    unsigned long long r;
+    int             begin, end, count;
+
+    while (1)
+    {
+        best = -1;
+        bestcount = 0;
+        bestrange = 0;
+        for (i = 0; i < s_numworkqueues; i++)
+        {
+            if (&s_workqueues[i] == q)
+            {
+                continue;
+            }
+            r = s_workqueues[i].range.load(std::memory_order_acquire);
+            count = WORKRANGE_END(r) - WORKRANGE_BEGIN(r);
+            if (count > bestcount)
+            {
+                best = i;
+                bestcount = count;
+                bestrange = r;
+            }
+        }
+        if (best == -1)
+        {
+            return false;
+        }
+
+        begin = WORKRANGE_BEGIN(bestrange);
+        end = WORKRANGE_END(bestrange);
+        count = (end - begin + 1) / 2;
+        if (s_workqueues[best].range.compare_exchange_strong(bestrange, WORKRANGE_MAKE(begin, end - count)))
+        {
+            // Nobody steals from an empty range, so the owner can simply overwrite it
+            q->range.store(WORKRANGE_MAKE(end - count, end), std::memory_order_release);
+            return true;
+        }
+    }
+}
+
+static bool     ClaimWorkChunk(workqueue_t* q)
+{
+    unsigned long long r;
+    int             begin, end, count;
+
+    while (1)
+    {
+        r = q->range.load(std::memory_order_acquire);
+        begin = WORKRANGE_BEGIN(r);
+        end = WORKRANGE_END(r);
+        if (begin < end)
+        {
+            count = (end - begin + WORKCHUNK_DIVISOR - 1) / WORKCHUNK_DIVISOR;
+            if (q->range.compare_exchange_weak(r, WORKRANGE_MAKE(begin + count, end)))
+            {
+                q->chunkcur = begin;
+                q->chunkend = begin + count;
+                return true;
+            }
+            continue;
+        }
+        if (!StealWorkRange(q))
+        {
+            return false;
+        }
+    }
+}
+
+// =====================================================================================
+//  ReportThreadProgress
+//      Called periodically by the thread that started the work, never by the workers
+// =====================================================================================
+static void     ReportThreadProgress()
+{
+    int             dispatched, f, i;
     double          ct, finish, finish2, finish3;
 	static const char *s1 = NULL; // avoid frequent call of Localize() in PrintConsole
 	static const char *s2 = NULL;
 
-    ThreadLock();
 	if (s1 == NULL)
 		s1 = Localize ("  (%d%%: est. time to completion %ld/%ld/%ld secs)   ");
 	if (s2 == NULL)
 		s2 = Localize ("  (%d%%: est. time to completion <1 sec)   ");
 
-    if (dispatch == 0)
+    if (workcount <= 0)
     {
-        oldf = 0;
+        return;
     }
 
-    if (dispatch > workcount)
-    {
-        Developer(DEVELOPER_LEVEL_ERROR, "dispatch > workcount!!!\n");
-        ThreadUnlock();
-        return -1;
-    }
-    if (dispatch == workcount)
+    dispatched = 0;
+    for (i = 0; i < s_numworkqueues; i++)
     {
-        Developer(DEVELOPER_LEVEL_MESSAGE, "dispatch == workcount, work is complete\n");
-        ThreadUnlock();
-        return -1;
+        dispatched += s_workqueues[i].dispatched.load(std::memory_order_relaxed);
     }
-    if (dispatch < 0)
+    if (dispatched >= workcount)
     {
-        Developer(DEVELOPER_LEVEL_ERROR, "negative dispatch!!!\n");
-        ThreadUnlock();
-        return -1;
+        dispatched = workcount - 1;                        // the last item is still being worked on as far as the user cares
     }
 
-    f = THREADTIMES_SIZE * dispatch / workcount;
+    f = THREADTIMES_SIZE * dispatched / workcount;
     if (pacifier)
     {
 		PrintConsole
-			("\r%6d /%6d", dispatch, workcount);
+			("\r%6d /%6d", dispatched, workcount);
 
         if (f != oldf)
         {
             ct = I_FloatTime();
             /* Fill in current time for threadtimes record */
-            for (i = oldf; i <= f; i++)
+            for (i = oldf < 0? 0: oldf; i <= f; i++)
             {
                 if (threadtimes[i] < 1)
                 {
@@ -121,46 +237,42 @@ int             GetThreadWork()
     }
     else
     {
-        if (f != oldf)
+        // Samples are coarse, so print every 10% step that was passed since the last one
+        for (i = (oldf < 0? 0: oldf / 10 + 1) ; i * 10 <= f; i++)
         {
-            oldf = f;
-            switch (f)
+            if (i > 0)
             {
-            case 10:
-            case 20:
-            case 30:
-            case 40:
-            case 50:
-            case 60:
-            case 70:
-            case 80:
-            case 90:
-            case 100:
-/*
-            case 5:
-            case 15:
-            case 25:
-            case 35:
-            case 45:
-            case 55:
-            case 65:
-            case 75:
-            case 85:
-            case 95:
-*/
 				PrintConsole
-					("%d%%...", f);
-            default:
-                break;
+					("%d%%...", i * 10);
             }
         }
+        oldf = f;
+    }
+}
+
+int             GetThreadWork()
+{
+    workqueue_t*    q = &s_workqueues[s_threadnum];
+
+    if (q->chunkcur >= q->chunkend)
+    {
+        if (!ClaimWorkChunk(q))
+        {
+            return -1;
+        }
+#ifdef SINGLE_THREADED
+        ReportThreadProgress();
+#endif
     }
 
-    r = dispatch;
-    dispatch++;
+    q->dispatched.store(q->dispatched.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    return q->chunkcur++;
+}
 
-    ThreadUnlock();
-    return r;
+// Index (0 to g_numthreads - 1) of the calling worker thread, 0 outside of RunThreadsOn
+int             GetThreadNum()
+{
+    return s_threadnum;
 }
 
 q_threadfunction workfunction;
@@ -299,7 +411,9 @@ q_threadfunction q_entry;
 
 static DWORD WINAPI ThreadEntryStub(LPVOID pParam)
 {
+    s_threadnum = (int)pParam;
     q_entry((int)pParam);
+    ProfileFlushThread();
     return 0;
 }
 
@@ -327,18 +441,18 @@ void            RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction fu
     {
         threadtimes[i] = 0;
     }
-    dispatch = 0;
     workcount = workcnt;
     oldf = -1;
     pacifier = showpacifier;
     threaded = true;
     q_entry = func;
 
-    if (workcount < dispatch)
+    if (workcount < 0)
     {
-        Developer(DEVELOPER_LEVEL_ERROR, "RunThreadsOn: Workcount(%i) < dispatch(%i)\n", workcount, dispatch);
+        Developer(DEVELOPER_LEVEL_ERROR, "RunThreadsOn: Workcount(%i) < 0\n", workcount);
     }
-    hlassume(workcount >= dispatch, assume_BadWorkcount);
+    hlassume(workcount >= 0, assume_BadWorkcount);
+    ResetWorkQueues(g_numthreads, workcount);
 
     //
     // Create all the threads (suspended)
@@ -398,11 +512,15 @@ void            RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction fu
     }
     CheckFatal();
 
-    // Wait for threads to complete
+    // Wait for threads to complete, sampling the progress meanwhile
+    while (WaitForMultipleObjects(g_numthreads, threadhandle, TRUE, PACIFIER_INTERVAL) == WAIT_TIMEOUT)
+    {
+        ReportThreadProgress();
+    }
+    ReportThreadProgress();
     for (i = 0; i < g_numthreads; i++)
     {
-        Developer(DEVELOPER_LEVEL_MESSAGE, "WaitForSingleObject on thread #%d [%08X]\n", i, threadhandle[i]);
-        WaitForSingleObject(threadhandle[i], INFINITE);
+        CloseHandle(threadhandle[i]);
     }
     threads_UninitCrit();
 
@@ -487,9 +605,21 @@ void            ThreadUnlock()
 
 q_threadfunction q_entry;
 
+// Signalled by each worker as it finishes, so the starting thread can sample the progress until then
+static pthread_mutex_t s_donemutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_donecond = PTHREAD_COND_INITIALIZER;
+static int      s_runningthreads = 0;
+
 static void*    CDECL ThreadEntryStub(void* pParam)
 {
+    s_threadnum = (int)(intptr_t)pParam;
     q_entry((int)(intptr_t)pParam);
+    ProfileFlushThread();
+
+    pthread_mutex_lock(&s_donemutex);
+    s_runningthreads--;
+    pthread_cond_signal(&s_donecond);
+    pthread_mutex_unlock(&s_donemutex);
     return NULL;
 }
 
@@ -537,12 +667,12 @@ void            RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction fu
         threadtimes[i] = 0;
     }
 
-    dispatch = 0;
     workcount = workcnt;
     oldf = -1;
     pacifier = showpacifier;
     threaded = true;
     q_entry = func;
+    ResetWorkQueues(g_numthreads, workcount);
 
     if (pacifier)
     {
@@ -562,6 +692,7 @@ void            RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction fu
     }
 #endif
 
+    s_runningthreads = g_numthreads;
     for (i = 0; i < g_numthreads; i++)
     {
         if (pthread_create(&work_threads[i], &attrib, ThreadEntryStub, (void*)i) == -1)
@@ -570,6 +701,29 @@ void            RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction fu
         }
     }
 
+    // Sample the progress until every worker has finished
+    pthread_mutex_lock(&s_donemutex);
+    while (s_runningthreads > 0)
+    {
+        struct timespec wakeup;
+
+        clock_gettime(CLOCK_REALTIME, &wakeup);
+        wakeup.tv_nsec += PACIFIER_INTERVAL * 1000000L;
+        if (wakeup.tv_nsec >= 1000000000L)
+        {
+            wakeup.tv_sec++;
+            wakeup.tv_nsec -= 1000000000L;
+        }
+        if (pthread_cond_timedwait(&s_donecond, &s_donemutex, &wakeup) != 0)
+        {
+            pthread_mutex_unlock(&s_donemutex);
+            ReportThreadProgress();
+            pthread_mutex_lock(&s_donemutex);
+        }
+    }
+    pthread_mutex_unlock(&s_donemutex);
+    ReportThreadProgress();
+
     for (i = 0; i < g_numthreads; i++)
     {
         if (pthread_join(work_threads[i], &status) == -1)
@@ -638,10 +792,10 @@ void            RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction fu
     int             i;
     double          start, end;
 
-    dispatch = 0;
     workcount = workcnt;
     oldf = -1;
     pacifier = showpacifier;
+    ResetWorkQueues(1, workcount);
     threadstart = I_FloatTime();
     start = threadstart;
     for (i = 0; i < THREADTIMES_SIZE; i++)
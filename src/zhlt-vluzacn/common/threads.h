@@ -1,6 +1,7 @@
 #ifndef THREADS_H__
 #define THREADS_H__
 #include "cmdlib.h" //--vluzacn
+#include "profile.h"
 
 #if _MSC_VER >= 1000
 #pragma once
@@ -33,6 +34,7 @@ extern q_threadpriority g_threadpriority;
 extern void     ThreadSetPriority(q_threadpriority type);
 extern void     ThreadSetDefault();
 extern int      GetThreadWork();
+extern int      GetThreadNum();
 extern void     ThreadLock();
 extern void     ThreadUnlock();
 
@@ -44,7 +46,7 @@ extern void     threads_InitCrit();
 extern void     threads_UninitCrit();
 #endif
 
-#define NamedRunThreadsOn(n,p,f) { Log("%s\n", Localize(#f ":")); RunThreadsOn(n,p,f); }
-#define NamedRunThreadsOnIndividual(n,p,f) { Log("%s\n", Localize(#f ":")); RunThreadsOnIndividual(n,p,f); }
+#define NamedRunThreadsOn(n,p,f) { Log("%s\n", Localize(#f ":")); ProfileBeginStage(#f); RunThreadsOn(n,p,f); ProfileEndStage(); }
+#define NamedRunThreadsOnIndividual(n,p,f) { Log("%s\n", Localize(#f ":")); ProfileBeginStage(#f); RunThreadsOnIndividual(n,p,f); ProfileEndStage(); }
 
 #endif //**/ THREADS_H__
@@ -3,6 +3,7 @@
 #include "winding.h"
 
 #include "cmdlib.h"
+#include "profile.h"
 #include "log.h"
 #include "mathlib.h"
 #include "hlassert.h"
@@ -475,6 +476,8 @@ void            Winding::Clip(const vec3_t normal, const vec_t dist, Winding** f
     unsigned int    i, j;
     unsigned int    maxpts;
 
+    ProfileCount(eProfileWindingsClipped);
+
     counts[0] = counts[1] = counts[2] = 0;
 
     // determine sides for each point
@@ -713,6 +716,8 @@ bool Winding::Clip(const dplane_t& split, bool keepon
     vec_t           dot;
     int             i, j;
 
+    ProfileCount(eProfileWindingsClipped);
+
     counts[0] = counts[1] = counts[2] = 0;
 
     // determine sides for each point
@@ -850,6 +855,8 @@ void Winding::Divide(const dplane_t& split, Winding** front, Winding** back
     int             i, j;
     int             maxpts;
 
+    ProfileCount(eProfileWindingsClipped);
+
     counts[0] = counts[1] = counts[2] = 0;
 
     // determine sides for each point
@@ -174,6 +174,7 @@ node_t;
 extern void     SubdivideFace(face_t* f, face_t** prevptr);
 extern node_t*  SolidBSP(const surfchain_t* const surfhead, 
 						 brush_t *detailbrushes, 
+						 node_t* outside_node, 
 						 bool report_progress);
 
 //=============================================================================
@@ -183,8 +184,10 @@ extern void     MergeAll(surface_t* surfhead);
 
 //=============================================================================
 // surfaces.c
-extern void     MakeFaceEdges();
+extern void     MakeFaceEdges(node_t* headnode);
+extern void     FreeFaceEdges();
 extern int      GetEdge(const vec3_t p1, const vec3_t p2, face_t* f);
+extern int      CountFacePoints(const node_t* const node);
 
 //=============================================================================
 // portals.c
@@ -198,15 +201,41 @@ typedef struct portal_s
 }
 portal_t;
 
-extern node_t   g_outside_node;                            // portals outside the world face this
-
 extern void     AddPortalToNodes(portal_t* p, node_t* front, node_t* back);
 extern void     RemovePortalFromNode(portal_t* portal, node_t* l);
-extern void     MakeHeadnodePortals(node_t* node, const vec3_t mins, const vec3_t maxs);
+extern void     MakeHeadnodePortals(node_t* node, node_t* outside_node, const vec3_t mins, const vec3_t maxs);
 
 extern void     FreePortals(node_t* node);
 extern void     WritePortalfile(node_t* headnode);
 
+//=============================================================================
+// cellhash.cpp
+#define MAX_CELLHASH_NEIGHBORS	8
+
+typedef struct
+{
+    long long       cell;
+    void*           head;                                  // first item in the cell, NULL for an unused slot
+}
+cellslot_t;
+
+typedef struct
+{
+    vec_t           cellsize;
+    vec_t           invcellsize;
+    int             slotbits;
+    int             numslots;                              // 1 << slotbits
+    int             numcells;
+    cellslot_t*     slots;
+}
+cellhash_t;
+
+extern void     CellHashInit(cellhash_t* hash, const vec3_t mins, const vec3_t maxs, int numitems);
+extern void     CellHashFree(cellhash_t* hash);
+extern int      CellHashNeighbors(const cellhash_t* hash, const vec3_t point, vec_t margin, long long* cells);
+extern void*    CellHashFirst(const cellhash_t* hash, long long cell);
+extern void**   CellHashHead(cellhash_t* hash, long long cell);
+
 //=============================================================================
 // tjunc.c
 void            tjunc(node_t* headnode);
@@ -221,10 +250,10 @@ extern void     FinishBSPFile();
 
 //=============================================================================
 // outside.c
-extern node_t*  FillOutside(node_t* node, bool leakfile, unsigned hullnum);
+extern node_t*  FillOutside(node_t* node, node_t* outside_node, bool leakfile, unsigned hullnum);
 extern void     LoadAllowableOutsideList(const char* const filename);
 extern void     FreeAllowableOutsideList();
-extern void		FillInside (node_t* node);
+extern void		FillInside (node_t* node, node_t* outside_node);
 
 //=============================================================================
 // misc functions
@@ -294,7 +323,8 @@ extern bool     g_chart;
 extern bool     g_estimate;
 extern int      g_maxnode_size;
 extern int      g_subdivide_size;
-extern int      g_hullnum;
+extern thread_local int g_hullnum;                      // hull and model being built by this thread
+extern thread_local int g_modelnum;
 extern bool     g_bLeakOnly;
 extern bool     g_bLeaked;
 extern char     g_portfilename[_MAX_PATH];
@@ -0,0 +1,180 @@
+#include "bsp5.h"
+
+//  CellHashInit
+//  CellHashFree
+//  CellHashNeighbors
+//  CellHashFirst
+//  CellHashHead
+
+/* A sparse grid of cubic cells for finding points that are within an epsilon of each other.
+   Only the cells that hold something are stored, in an open addressing table keyed on the
+   64-bit id of the cell, so the grid covers any coordinate range without wrapping around. */
+
+#define CELLHASH_MINCELLSIZE	8.0
+#define CELLHASH_MAXCELLSIZE	4096.0
+#define CELLHASH_MINSLOTS		1024                  // must be a power of 2
+#define CELLHASH_COORDBITS		21                    // per axis in a cell id
+
+// =====================================================================================
+//  CellId
+//      Cells beyond +-2^20 of the origin share ids with other cells, which only makes
+//      their chains longer since the items are always compared by distance
+// =====================================================================================
+static long long CellId(const long long x, const long long y, const long long z)
+{
+    const long long mask = (1LL << CELLHASH_COORDBITS) - 1;
+
+    return ((x & mask) << (2 * CELLHASH_COORDBITS)) | ((y & mask) << CELLHASH_COORDBITS) | (z & mask);
+}
+
+static int      CellSlot(const cellhash_t* const hash, const long long cell)
+{
+    return (int)(((unsigned long long)cell * 0x9E3779B97F4A7C15ULL) >> (64 - hash->slotbits));
+}
+
+static void     AllocSlots(cellhash_t* const hash, const int slotbits)
+{
+    hash->slotbits = slotbits;
+    hash->numslots = 1 << slotbits;
+    hash->slots = (cellslot_t*)calloc(hash->numslots, sizeof(cellslot_t));
+    hlassume(hash->slots != NULL, assume_NoMemory);
+}
+
+// =====================================================================================
+//  CellHashInit
+//      The cells are sized so that numitems points spread over the faces of the bounding
+//      box would get about one cell each, since the points of a map lie on its surfaces
+// =====================================================================================
+void            CellHashInit(cellhash_t* const hash, const vec3_t mins, const vec3_t maxs, const int numitems)
+{
+    vec3_t          size;
+    vec_t           area;
+    int             slotbits;
+
+    VectorSubtract(maxs, mins, size);
+    area = 2 * (qmax(size[0], 0) * qmax(size[1], 0) + qmax(size[1], 0) * qmax(size[2], 0) + qmax(size[2], 0) * qmax(size[0], 0));
+    hash->cellsize = sqrt(area / qmax(numitems, 1));
+    hash->cellsize = qmax(CELLHASH_MINCELLSIZE, qmin(hash->cellsize, CELLHASH_MAXCELLSIZE));
+    hash->invcellsize = 1.0 / hash->cellsize;
+
+    for (slotbits = 0; (1 << slotbits) < CELLHASH_MINSLOTS || (1 << slotbits) < numitems; slotbits++)
+    {
+    }
+    AllocSlots(hash, slotbits);
+    hash->numcells = 0;
+}
+
+// =====================================================================================
+//  CellHashFree
+// =====================================================================================
+void            CellHashFree(cellhash_t* const hash)
+{
+    free(hash->slots);
+    hash->slots = NULL;
+    hash->numslots = 0;
+    hash->numcells = 0;
+}
+
+// =====================================================================================
+//  CellHashNeighbors
+//      cells[0] is the cell of point, where a new item goes. The others are the cells
+//      within margin of point, which must be searched for an existing item as well.
+// =====================================================================================
+int             CellHashNeighbors(const cellhash_t* const hash, const vec3_t point, const vec_t margin, long long* const cells)
+{
+    long long       slot[3];
+    int             side[3];
+    vec_t           normalized;
+    vec_t           slotdiff;
+    int             numcells;
+    int             i;
+
+    hlassert(2 * margin < hash->cellsize);
+    for (i = 0; i < 3; i++)
+    {
+        normalized = point[i] * hash->invcellsize;
+        slot[i] = (long long)floor(normalized);
+        slotdiff = normalized - (vec_t)slot[i];
+        side[i] = slotdiff < margin * hash->invcellsize? -1: slotdiff > 1 - margin * hash->invcellsize? 1: 0;
+    }
+
+    numcells = 0;
+    for (i = 0; i < 8; i++)
+    {
+        if (((i & 1) && !side[0]) || ((i & 2) && !side[1]) || ((i & 4) && !side[2]))
+        {
+            continue;
+        }
+        hlassert(numcells < MAX_CELLHASH_NEIGHBORS);
+        cells[numcells] = CellId(slot[0] + ((i & 1)? side[0]: 0),
+                                 slot[1] + ((i & 2)? side[1]: 0),
+                                 slot[2] + ((i & 4)? side[2]: 0));
+        numcells++;
+    }
+    return numcells;
+}
+
+// =====================================================================================
+//  CellHashFirst
+//      The first item in a cell, NULL if the cell is empty
+// =====================================================================================
+void*           CellHashFirst(const cellhash_t* const hash, const long long cell)
+{
+    int             i;
+
+    for (i = CellSlot(hash, cell); hash->slots[i].head; i = (i + 1) & (hash->numslots - 1))
+    {
+        if (hash->slots[i].cell == cell)
+        {
+            return hash->slots[i].head;
+        }
+    }
+    return NULL;
+}
+
+// =====================================================================================
+//  CellHashHead
+//      The head of the item list of a cell, for inserting an item. The cell is added if
+//      needed, so the caller must store a non NULL head right away; the returned pointer
+//      is invalidated by the next call.
+// =====================================================================================
+void**          CellHashHead(cellhash_t* const hash, const long long cell)
+{
+    int             i;
+
+    for (i = CellSlot(hash, cell); hash->slots[i].head; i = (i + 1) & (hash->numslots - 1))
+    {
+        if (hash->slots[i].cell == cell)
+        {
+            return &hash->slots[i].head;
+        }
+    }
+
+    if (2 * (hash->numcells + 1) > hash->numslots)
+    {
+        // keep the table at most half full
+        cellslot_t*     oldslots = hash->slots;
+        const int       oldnumslots = hash->numslots;
+        int             j;
+
+        AllocSlots(hash, hash->slotbits + 1);
+        for (j = 0; j < oldnumslots; j++)
+        {
+            if (oldslots[j].head)
+            {
+                for (i = CellSlot(hash, oldslots[j].cell); hash->slots[i].head; i = (i + 1) & (hash->numslots - 1))
+                {
+                }
+                hash->slots[i] = oldslots[j];
+            }
+        }
+        free(oldslots);
+        for (i = CellSlot(hash, cell); hash->slots[i].head; i = (i + 1) & (hash->numslots - 1))
+        {
+        }
+    }
+
+    hash->numcells++;
+    hash->slots[i].cell = cell;
+    return &hash->slots[i].head;
+}
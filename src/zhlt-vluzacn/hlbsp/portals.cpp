@@ -2,7 +2,7 @@
 
 #include "bsp5.h"
 
-node_t          g_outside_node;                            // portals outside the world face this
+#include <vector>
 
 //=============================================================================
 
@@ -84,10 +84,10 @@ void            RemovePortalFromNode(portal_t* portal, node_t* l)
  * ================
  * MakeHeadnodePortals
  * 
- * The created portals will face the global g_outside_node
+ * The created portals will face outside_node
  * ================
  */
-void            MakeHeadnodePortals(node_t* node, const vec3_t mins, const vec3_t maxs)
+void            MakeHeadnodePortals(node_t* node, node_t* outside_node, const vec3_t mins, const vec3_t maxs)
 {
     vec3_t          bounds[2];
     int             i, j, n;
@@ -103,8 +103,8 @@ void            MakeHeadnodePortals(node_t* node, const vec3_t mins, const vec3_
         bounds[1][i] = maxs[i] + SIDESPACE;
     }
 
-    g_outside_node.contents = CONTENTS_SOLID;
-    g_outside_node.portals = NULL;
+    outside_node->contents = CONTENTS_SOLID;
+    outside_node->portals = NULL;
 
     for (i = 0; i < 3; i++)
     {
@@ -129,7 +129,7 @@ void            MakeHeadnodePortals(node_t* node, const vec3_t mins, const vec3_
             }
             p->plane = *pl;
             p->winding = new Winding(*pl);
-            AddPortalToNodes(p, node, &g_outside_node);
+            AddPortalToNodes(p, node, outside_node);
         }
     }
 
@@ -155,7 +155,10 @@ void            MakeHeadnodePortals(node_t* node, const vec3_t mins, const vec3_
  * ==============================================================================
  */
 
-static FILE*    visPortalCache; // mapname_viscache.prt <- HLVIS loads this
+// mapname_viscache.prt <- HLVIS loads this, it is gathered here and written in the binary form at the end
+static std::vector<int> visCacheLeafCounts;
+static std::vector<int> visCachePortals; // the point count and the two leafs of each portal
+static std::vector<double> visCachePoints;
 static FILE*	portalFile; // mapname.prt <- This portal file can be opened in the map editor
 static FILE *pf_view;
 extern bool g_viewportal;
@@ -206,21 +209,24 @@ static void     WritePortalFile_r(const node_t* const node)
 						Warning ("Backward portal @");
 						w->Print ();
 					}
-                    fprintf( visPortalCache, "%u %i %i ", w->m_NumPoints, p->nodes[1]->visleafnum, p->nodes[0]->visleafnum );
+                    visCachePortals.push_back( w->m_NumPoints );
+                    visCachePortals.push_back( p->nodes[1]->visleafnum );
+                    visCachePortals.push_back( p->nodes[0]->visleafnum );
                     fprintf( portalFile, "%u %i %i ", w->m_NumPoints, p->nodes[1]->visleafnum, p->nodes[0]->visleafnum );
                 }
                 else
                 {
-                    fprintf( visPortalCache, "%u %i %i ", w->m_NumPoints, p->nodes[0]->visleafnum, p->nodes[1]->visleafnum );
+                    visCachePortals.push_back( w->m_NumPoints );
+                    visCachePortals.push_back( p->nodes[0]->visleafnum );
+                    visCachePortals.push_back( p->nodes[1]->visleafnum );
                     fprintf( portalFile, "%u %i %i ", w->m_NumPoints, p->nodes[0]->visleafnum, p->nodes[1]->visleafnum );
                 }
 
                 for (i = 0; i < w->m_NumPoints; i++)
                 {
-                    fprintf( visPortalCache, "(%f %f %f) ", w->m_Points[i][0], w->m_Points[i][1], w->m_Points[i][2]);
+                    visCachePoints.insert( visCachePoints.end(), w->m_Points[i], w->m_Points[i] + 3 );
                     fprintf( portalFile, "(%f %f %f) ", w->m_Points[i][0], w->m_Points[i][1], w->m_Points[i][2] );
                 }
-                fprintf( visPortalCache, "\n" );
                 fprintf( portalFile, "\n" );
 
 				if (g_viewportal)
@@ -335,10 +341,58 @@ static void WriteLeafCount_r (node_t *node)
 			return;
 		}
 		int count = CountChildLeafs_r (node);
-		fprintf (visPortalCache, "%i\n", count);
+		visCacheLeafCounts.push_back (count);
 	}
 }
 
+/*
+ * ================
+ * WriteVisPortalCache
+ * ================
+ */
+static void WriteVisPortalCache( const char* const filename )
+{
+	portalfileheader_t header;
+	std::vector<int> leafNumPortals( num_visleafs, 0 );
+	FILE* f;
+
+	hlassert( (int)visCacheLeafCounts.size() == num_visleafs && (int)visCachePortals.size() == 3 * num_visportals );
+	// the per leaf index lets hlvis check and size the leafs before it reads any portal
+	for ( int i = 0; i < num_visportals; i++ )
+	{
+		leafNumPortals[ visCachePortals[ 3 * i + 1 ] ]++;
+		leafNumPortals[ visCachePortals[ 3 * i + 2 ] ]++;
+	}
+
+	header.ident = PORTALFILE_BINARY_IDENT;
+	header.version = PORTALFILE_BINARY_VERSION;
+	header.numleafs = num_visleafs;
+	header.numportals = num_visportals;
+	header.numpoints = (int)( visCachePoints.size() / 3 );
+
+	f = fopen( filename, "wb" );
+	if ( !f )
+	{
+		Error( "Error writing portal file %s", filename );
+	}
+	SafeWrite( f, &header, sizeof( header ) );
+	if ( num_visleafs )
+	{
+		SafeWrite( f, &visCacheLeafCounts[ 0 ], num_visleafs * sizeof( int ) );
+		SafeWrite( f, &leafNumPortals[ 0 ], num_visleafs * sizeof( int ) );
+	}
+	if ( num_visportals )
+	{
+		SafeWrite( f, &visCachePortals[ 0 ], visCachePortals.size() * sizeof( int ) );
+		SafeWrite( f, &visCachePoints[ 0 ], visCachePoints.size() * sizeof( double ) );
+	}
+	fclose( f );
+
+	visCacheLeafCounts.clear();
+	visCachePortals.clear();
+	visCachePoints.clear();
+}
+
 void UTIL_GetPortalCacheName( char* portalCacheName )
 {
 	char newCacheName[ _MAX_PATH ];
@@ -372,13 +426,6 @@ void WritePortalfile( node_t* headnode )
 	NumberLeafs_r( headnode );
 
 	// write the files
-	visPortalCache = fopen( portalCacheName, "w" );
-
-	if ( !visPortalCache )
-	{
-		Error( "Error writing portal file %s", g_portfilename );
-	}
-
 	if ( g_viewportal )
 	{
 		char filename[ _MAX_PATH ];
@@ -391,16 +438,13 @@ void WritePortalfile( node_t* headnode )
 		Log( "Writing '%s' ...\n", filename );
 	}
 
-	fprintf( visPortalCache, "%i\n", num_visleafs );
-	fprintf( visPortalCache, "%i\n", num_visportals );
-
 	portalFile = fopen( g_portfilename, "w" );
 	fprintf( portalFile, "%i\n", num_visleafs );
 	fprintf( portalFile, "%i\n", num_visportals );
 
 	WriteLeafCount_r( headnode );
 	WritePortalFile_r( headnode );
-	fclose( visPortalCache );
+	WriteVisPortalCache( portalCacheName );
 	fclose( portalFile );
 
 	if ( g_viewportal )
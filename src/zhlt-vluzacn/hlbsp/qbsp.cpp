@@ -45,7 +45,10 @@ vec3_t          g_hull_size[NUM_HULLS][2] =
 };
 static FILE*    polyfiles[NUM_HULLS];
 static FILE*    brushfiles[NUM_HULLS];
-int             g_hullnum = 0;
+static bool     polyfilesbinary[NUM_HULLS];
+static bool     brushfilesbinary[NUM_HULLS];
+thread_local int g_hullnum = 0;
+thread_local int g_modelnum = 0;
 
 static face_t*  validfaces[MAX_INTERNAL_MAP_PLANES];
 
@@ -833,10 +836,6 @@ static surfchain_t* SurflistFromValidFaces()
         validfaces[i + 1] = NULL;
     }
 
-    // merge all possible polygons
-
-    MergeAll(sc->surfaces);
-
     return sc;
 }
 
@@ -954,10 +953,40 @@ static          facestyle_e SetFaceType(face_t* f)
     return f->facestyle;
 }
 
+// =====================================================================================
+//  OpenHullFile
+//      Opens one of the .p# or .b# files from hlcsg, which can be either text or binary
+// =====================================================================================
+static FILE*    OpenHullFile(const char* const name, bool& binary)
+{
+    FILE*           file;
+    int             header[2];
+
+    file = fopen(name, "rb");
+    if (!file)
+        Error("Can't open %s", name);
+
+    binary = fread(header, sizeof(header), 1, file) == 1 && header[0] == HULLFILE_BINARY_IDENT;
+    if (binary)
+    {
+        if (header[1] != HULLFILE_BINARY_VERSION)
+        {
+            Error("%s is version %i, expected %i. Please rerun hlcsg.", name, header[1], HULLFILE_BINARY_VERSION);
+        }
+        return file;
+    }
+
+    fclose(file);
+    file = fopen(name, "r");
+    if (!file)
+        Error("Can't open %s", name);
+    return file;
+}
+
 // =====================================================================================
 //  ReadSurfs
 // =====================================================================================
-static surfchain_t* ReadSurfs(FILE* file)
+static surfchain_t* ReadSurfs(FILE* file, const bool binary)
 {
     int             r;
 	int				detaillevel;
@@ -974,19 +1003,32 @@ static surfchain_t* ReadSurfs(FILE* file)
 		if (file == polyfiles[2] && g_nohull2)
 			break;
         line++;
+		if (binary)
+		{
+			int summary[5] = {0, 0, 0, 0, 0};
+			r = (int)fread (summary, sizeof (int), 5, file);
+			detaillevel = summary[0];
+			planenum = summary[1];
+			g_texinfo = summary[2];
+			contents = summary[3];
+			numpoints = summary[4];
+		}
+		else
+		{
         r = fscanf(file, "%i %i %i %i %i\n", &detaillevel, &planenum, &g_texinfo, &contents, &numpoints);
+		}
         if (r == 0 || r == -1)
         {
             return NULL;
+        }
+		if (r != 5)                                        // a short read leaves the rest of the fields unset
+        {
+            Error("ReadSurfs (line %i): scanf failure", line);
         }
         if (planenum == -1)                                // end of model
         {
 			Developer (DEVELOPER_LEVEL_MEGASPAM, "inaccuracy: average %.8f max %.8f\n", inaccuracy_total / inaccuracy_count, inaccuracy_max);
             break;
-        }
-		if (r != 5)
-        {
-            Error("ReadSurfs (line %i): scanf failure", line);
         }
         if (numpoints > MAXPOINTS)
         {
@@ -1009,6 +1051,15 @@ static surfchain_t* ReadSurfs(FILE* file)
         {
             Verbose("ReadSurfs (line %i): skipping a surface", line);
 
+			if (binary)
+			{
+				if (fseek (file, numpoints * 3 * sizeof (double), SEEK_CUR))
+				{
+					Error("::ReadSurfs (face_skip), seek past points failed at line %i", line);
+				}
+				line += numpoints;
+				continue;
+			}
             for (i = 0; i < numpoints; i++)
             {
                 line++;
@@ -1037,7 +1088,14 @@ static surfchain_t* ReadSurfs(FILE* file)
         for (i = 0; i < f->numpoints; i++)
         {
             line++;
+			if (binary)
+			{
+				r = (int)fread (v, sizeof (double), 3, file);
+			}
+			else
+			{
             r = fscanf(file, "%lf %lf %lf\n", &v[0], &v[1], &v[2]);
+			}
             if (r != 3)
             {
                 Error("::ReadSurfs (face_normal), fscanf of points failed at line %i", line);
@@ -1052,12 +1110,15 @@ static surfchain_t* ReadSurfs(FILE* file)
 				inaccuracy_max = qmax (inaccuracy, inaccuracy_max);
 			}
         }
+		if (!binary)
+		{
         fscanf(file, "\n");
+		}
     }
 
     return SurflistFromValidFaces();
 }
-static brush_t *ReadBrushes (FILE *file)
+static brush_t *ReadBrushes (FILE *file, const bool binary)
 {
 	brush_t *brushes = NULL;
 	while (1)
@@ -1065,8 +1126,15 @@ static brush_t *ReadBrushes (FILE *file)
 		if (file == brushfiles[2] && g_nohull2)
 			break;
 		int r;
-		int brushinfo;
-		r = fscanf (file, "%i\n", &brushinfo);
+		int brushinfo = 0;
+		if (binary)
+		{
+			r = (int)fread (&brushinfo, sizeof (int), 1, file);
+		}
+		else
+		{
+			r = fscanf (file, "%i\n", &brushinfo);
+		}
 		if (r == 0 || r == -1)
 		{
 			if (brushes == NULL)
@@ -1092,7 +1160,17 @@ static brush_t *ReadBrushes (FILE *file)
 		{
 			int planenum;
 			int numpoints;
-			r = fscanf (file, "%i %u\n", &planenum, &numpoints);
+			if (binary)
+			{
+				int side[2] = {0, 0};
+				r = (int)fread (side, sizeof (int), 2, file);
+				planenum = side[0];
+				numpoints = side[1];
+			}
+			else
+			{
+				r = fscanf (file, "%i %u\n", &planenum, &numpoints);
+			}
 			if (r != 2)
 			{
 				Error ("ReadBrushes: get side failed");
@@ -1109,7 +1187,14 @@ static brush_t *ReadBrushes (FILE *file)
 			for (x = 0; x < numpoints; x++)
 			{
 				double v[3];
-				r = fscanf (file, "%lf %lf %lf\n", &v[0], &v[1], &v[2]);
+				if (binary)
+				{
+					r = (int)fread (v, sizeof (double), 3, file);
+				}
+				else
+				{
+					r = fscanf (file, "%lf %lf %lf\n", &v[0], &v[1], &v[2]);
+				}
 				if (r != 3)
 				{
 					Error ("ReadBrushes: get point failed");
@@ -1126,45 +1211,69 @@ static brush_t *ReadBrushes (FILE *file)
 
 
 // =====================================================================================
-//  ProcessModel
+//  hulljob_t
+//      One hull of one model. The trees are built concurrently, then emitted strictly
+//      in model and hull order so that the bsp file matches a serial compile.
 // =====================================================================================
-static bool     ProcessModel()
+typedef struct
 {
     surfchain_t*    surfs;
 	brush_t			*detailbrushes;
     node_t*         nodes;
+    node_t          outside_node;                          // portals outside the hull face this
+}
+hulljob_t;
+
+static hulljob_t g_hulljobs[MAX_MAP_MODELS][NUM_HULLS];
+static int      g_numjobhulls = NUM_HULLS;                 // 1 when the clipping hulls are skipped
+static int      g_firstjobmodel = 0;
+
+// =====================================================================================
+//  ReadModel
+//      Reads every hull of the next model from the csg output and grows the model bounds
+// =====================================================================================
+static bool     ReadModel()
+{
+    surfchain_t*    surfs;
     dmodel_t*       model;
-    int             startleafs;
+    int             modnum;
+    int             hullnum;
 
-    surfs = ReadSurfs(polyfiles[0]);
+    surfs = ReadSurfs(polyfiles[0], polyfilesbinary[0]);
 
     if (!surfs)
         return false;                                      // all models are done
-	detailbrushes = ReadBrushes (brushfiles[0]);
 
     hlassume(g_nummodels < MAX_MAP_MODELS, assume_MAX_MAP_MODELS);
 
-    startleafs = g_numleafs;
-    int modnum = g_nummodels;
+    modnum = g_nummodels;
     model = &g_dmodels[modnum];
     g_nummodels++;
 
-//    Log("ProcessModel: %i (%i f)\n", modnum, model->numfaces);
-
-	g_hullnum = 0; //vluzacn
 	VectorFill (model->mins, 99999);
 	VectorFill (model->maxs, -99999);
-	{
+    for (hullnum = 0; hullnum < g_numjobhulls; hullnum++)
+    {
+        hulljob_t*      job = &g_hulljobs[modnum][hullnum];
+
+        if (hullnum > 0)
+        {
+            surfs = ReadSurfs(polyfiles[hullnum], polyfilesbinary[hullnum]);
+        }
+        job->surfs = surfs;
+		job->detailbrushes = ReadBrushes (brushfiles[hullnum], brushfilesbinary[hullnum]);
+        job->nodes = NULL;
+
 		if (surfs->mins[0] > surfs->maxs[0])
 		{
-			Developer (DEVELOPER_LEVEL_FLUFF, "model %d hull %d empty\n", modnum, g_hullnum);
+			Developer (hullnum == 0? DEVELOPER_LEVEL_FLUFF: DEVELOPER_LEVEL_MESSAGE, "model %d hull %d empty\n", modnum, hullnum);
 		}
 		else
 		{
 			vec3_t mins, maxs;
 			int i;
-			VectorSubtract (surfs->mins, g_hull_size[g_hullnum][0], mins);
-			VectorSubtract (surfs->maxs, g_hull_size[g_hullnum][1], maxs);
+			VectorSubtract (surfs->mins, g_hull_size[hullnum][0], mins);
+			VectorSubtract (surfs->maxs, g_hull_size[hullnum][1], maxs);
 			for (i = 0; i < 3; i++)
 			{
 				if (mins[i] > maxs[i])
@@ -1181,20 +1290,57 @@ static bool     ProcessModel()
 				model->mins[i] = qmin (model->mins[i], mins[i]);
 			}
 		}
-	}
+    }
+    return true;
+}
+
+// =====================================================================================
+//  BuildHullTree
+//      Thread worker; a hull only touches its own faces, brushes and portals here
+// =====================================================================================
+static void     BuildHullTree(int jobnum)
+{
+    int             modnum = g_firstjobmodel + jobnum / g_numjobhulls;
+    int             hullnum = jobnum % g_numjobhulls;
+    hulljob_t*      job = &g_hulljobs[modnum][hullnum];
+
+    g_modelnum = modnum;
+    g_hullnum = hullnum;
+
+    // merge all possible polygons
+    MergeAll(job->surfs->surfaces);
 
     // SolidBSP generates a node tree
-    nodes = SolidBSP(surfs,
-		detailbrushes,
+    job->nodes = SolidBSP(job->surfs,
+		job->detailbrushes,
+		&job->outside_node,
 		modnum==0);
+}
+
+// =====================================================================================
+//  FinishModel
+//      Fills, fixes and writes the trees of one model; must run in model order
+// =====================================================================================
+static void     FinishModel(const int modnum)
+{
+    hulljob_t*      jobs = g_hulljobs[modnum];
+    node_t*         nodes;
+    dmodel_t*       model;
+    int             startleafs;
+
+    startleafs = g_numleafs;
+    model = &g_dmodels[modnum];
+    g_modelnum = modnum;
+    g_hullnum = 0;
+    nodes = jobs[0].nodes;
 
     // build all the portals in the bsp tree
     // some portals are solid polygons, and some are paths to other leafs
-    if (g_nummodels == 1 && !g_nofill)                       // assume non-world bmodels are simple
+    if (modnum == 0 && !g_nofill)                          // assume non-world bmodels are simple
     {
 		if (!g_noinsidefill)
-			FillInside (nodes);
-        nodes = FillOutside(nodes, (g_bLeaked != true), 0);                  // make a leakfile if bad
+			FillInside (nodes, &jobs[0].outside_node);
+        nodes = FillOutside(nodes, &jobs[0].outside_node, (g_bLeaked != true), 0);                  // make a leakfile if bad
     }
 
     FreePortals(nodes);
@@ -1202,7 +1348,7 @@ static bool     ProcessModel()
     // fix tjunctions
     tjunc(nodes);
 
-    MakeFaceEdges();
+    MakeFaceEdges(nodes);
 
     // emit the faces for the bsp file
     model->headnode[0] = g_numnodes;
@@ -1265,43 +1411,10 @@ static bool     ProcessModel()
     // the clipping hulls are simpler
     for (g_hullnum = 1; g_hullnum < NUM_HULLS; g_hullnum++)
     {
-        surfs = ReadSurfs(polyfiles[g_hullnum]);
-		detailbrushes = ReadBrushes (brushfiles[g_hullnum]);
-		{
-			int hullnum = g_hullnum;
-			if (surfs->mins[0] > surfs->maxs[0])
-			{
-				Developer (DEVELOPER_LEVEL_MESSAGE, "model %d hull %d empty\n", modnum, hullnum);
-			}
-			else
-			{
-				vec3_t mins, maxs;
-				int i;
-				VectorSubtract (surfs->mins, g_hull_size[hullnum][0], mins);
-				VectorSubtract (surfs->maxs, g_hull_size[hullnum][1], maxs);
-				for (i = 0; i < 3; i++)
-				{
-					if (mins[i] > maxs[i])
-					{
-						vec_t tmp;
-						tmp = (mins[i] + maxs[i]) / 2;
-						mins[i] = tmp;
-						maxs[i] = tmp;
-					}
-				}
-				for (i = 0; i < 3; i++)
-				{
-					model->maxs[i] = qmax (model->maxs[i], maxs[i]);
-					model->mins[i] = qmin (model->mins[i], mins[i]);
-				}
-			}
-		}
-        nodes = SolidBSP(surfs,
-			detailbrushes, 
-			modnum==0);
-        if (g_nummodels == 1 && !g_nofill)                   // assume non-world bmodels are simple
+        nodes = jobs[g_hullnum].nodes;
+        if (modnum == 0 && !g_nofill)                      // assume non-world bmodels are simple
         {
-            nodes = FillOutside(nodes, (g_bLeaked != true), g_hullnum);
+            nodes = FillOutside(nodes, &jobs[g_hullnum].outside_node, (g_bLeaked != true), g_hullnum);
         }
         FreePortals(nodes);
 		/*
@@ -1341,13 +1454,13 @@ static bool     ProcessModel()
 		model->mins[0], model->mins[1], model->mins[2], model->maxs[0], model->maxs[1], model->maxs[2]);
 	if (model->mins[0] > model->maxs[0])
 	{
-		entity_t *ent = EntityForModel (g_nummodels - 1);
-		if (g_nummodels - 1 != 0 && ent == &g_entities[0])
+		entity_t *ent = EntityForModel (modnum);
+		if (modnum != 0 && ent == &g_entities[0])
 		{
 			ent = NULL;
 		}
 		Warning ("Empty solid entity: model %d (entity: classname \"%s\", origin \"%s\", targetname \"%s\")", 
-			g_nummodels - 1, 
+			modnum, 
 			(ent? ValueForKey (ent, "classname"): "unknown"), 
 			(ent? ValueForKey (ent, "origin"): "unknown"), 
 			(ent? ValueForKey (ent, "targetname"): "unknown"));
@@ -1356,19 +1469,56 @@ static bool     ProcessModel()
 	}
 	else if (novisiblebrushes)
 	{
-		entity_t *ent = EntityForModel (g_nummodels - 1);
-		if (g_nummodels - 1 != 0 && ent == &g_entities[0])
+		entity_t *ent = EntityForModel (modnum);
+		if (modnum != 0 && ent == &g_entities[0])
 		{
 			ent = NULL;
 		}
 		Warning ("No visible brushes in solid entity: model %d (entity: classname \"%s\", origin \"%s\", targetname \"%s\", range (%.0f,%.0f,%.0f) - (%.0f,%.0f,%.0f))", 
-			g_nummodels - 1, 
+			modnum, 
 			(ent? ValueForKey (ent, "classname"): "unknown"), 
 			(ent? ValueForKey (ent, "origin"): "unknown"), 
 			(ent? ValueForKey (ent, "targetname"): "unknown"), 
 			model->mins[0], model->mins[1], model->mins[2], model->maxs[0], model->maxs[1], model->maxs[2]);
 	}
-    return true;
+}
+
+// =====================================================================================
+//  ProcessModels
+//      The world is built first with the pool to itself, then every brush entity is
+//      built in one batch; the lumps are always written in model order
+// =====================================================================================
+static void     ProcessModels()
+{
+    int             modnum;
+
+    g_numjobhulls = g_noclip? 1: NUM_HULLS;
+
+    if (!ReadModel())
+    {
+        return;
+    }
+    Log("SolidBSP [world] ");
+    ProfileBeginStage("SolidBSP [world]");
+    g_firstjobmodel = 0;
+    RunThreadsOnIndividual(g_numjobhulls, false, BuildHullTree);
+    FinishModel(0);
+    ProfileEndStage();
+
+    while (ReadModel())
+        ;
+    if (g_nummodels > 1)
+    {
+        Log("SolidBSP [%d models] ", g_nummodels - 1);
+        ProfileBeginStage("SolidBSP [models]");
+        g_firstjobmodel = 1;
+        RunThreadsOnIndividual((g_nummodels - 1) * g_numjobhulls, false, BuildHullTree);
+        for (modnum = 1; modnum < g_nummodels; modnum++)
+        {
+            FinishModel(modnum);
+        }
+        ProfileEndStage();
+    }
 }
 
 // =====================================================================================
@@ -1507,14 +1657,9 @@ static void     ProcessFile(const char* const filename)
     {
                    //mapname.p[0-3]
 		sprintf(name, "%s.p%i", filename, i);
-        polyfiles[i] = fopen(name, "r");
-
-        if (!polyfiles[i])
-            Error("Can't open %s", name);
+        polyfiles[i] = OpenHullFile(name, polyfilesbinary[i]);
 		sprintf(name, "%s.b%i", filename, i);
-		brushfiles[i] = fopen(name, "r");
-		if (!brushfiles[i])
-			Error("Can't open %s", name);
+		brushfiles[i] = OpenHullFile(name, brushfilesbinary[i]);
     }
 	{
 		FILE			*f;
@@ -1550,8 +1695,10 @@ static void     ProcessFile(const char* const filename)
 
     // load the output of csg
     safe_snprintf(g_bspfilename, _MAX_PATH, "%s.bsp", filename);
+    ProfileBeginStage("LoadBSPFile");
     LoadBSPFile(g_bspfilename);
     ParseEntities();
+    ProfileEndStage();
 
     Settings(); // AJM: moved here due to info_compile_parameters entity
 
@@ -1588,12 +1735,13 @@ static void     ProcessFile(const char* const filename)
     // init the tables to be shared by all models
     BeginBSPFile();
 
-    // process each model individually
-    while (ProcessModel())
-        ;
+    // process the models, hulls in parallel
+    ProcessModels();
 
     // write the updated bsp file out
+    ProfileBeginStage("FinishBSPFile");
     FinishBSPFile();
+    ProfileEndStage();
 
 	// Because the bsp file has been updated, these polyfiles are no longer valid.
     for (i = 0; i < NUM_HULLS; i++)
@@ -1644,7 +1792,7 @@ int             main(const int argc, char** argv)
         {
             if (i + 1 < argc)	//added "1" .--vluzacn
             {
-                int             g_numthreads = atoi(argv[++i]);
+                g_numthreads = atoi(argv[++i]);
 
                 if (g_numthreads < 1)
                 {
@@ -1934,6 +2082,7 @@ int             main(const int argc, char** argv)
     StripExtension(g_Mapname);
     OpenLog(g_clientid);
     atexit(CloseLog);
+    atexit(WriteProfileReport);
     ThreadSetDefault();
     ThreadSetPriority(g_threadpriority);
     LogStart(argcold, argvold);
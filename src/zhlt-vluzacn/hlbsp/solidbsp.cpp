@@ -25,28 +25,31 @@
 //  Each node or leaf will have a set of portals that completely enclose
 //  the volume of the node and pass into an adjacent node.
 #include <vector>
+#include <atomic>
+#include <thread>
 
 int             g_maxnode_size = DEFAULT_MAXNODE_SIZE;
 
-static bool g_reportProgress = false;
-static int  g_numProcessed = 0;
-static int  g_numReported = 0;
+#define BSP_TASK_MINSURFACES 128                           // smaller subtrees are not worth a thread
+
+static std::atomic<int> g_numbspthreads(0);                // threads that are building trees right now
+
+static thread_local bool g_reportProgress = false;
+static std::atomic<int> g_numProcessed(0);                 // shared by the hulls that are built together
 
 static void ResetStatus(bool report_progress)
 {
 	g_reportProgress = report_progress;
-	g_numProcessed = g_numReported = 0;
 }
 
 static void UpdateStatus(void)
 {
 	if(g_reportProgress)
 	{
-		++g_numProcessed;
-		if((g_numProcessed / 500) > g_numReported)
+		int numprocessed = ++g_numProcessed;
+		if(numprocessed % 500 == 0)
 		{
-			g_numReported = (g_numProcessed / 500);
-			Log("%d...",g_numProcessed);
+			Log("%d...",numprocessed);
 		}
 	}
 }	
@@ -1213,8 +1216,8 @@ static void     LinkLeafFaces(surface_t* planelist, node_t* leafnode)
 
 	if (surf)
 	{
-		entity_t *ent = EntityForModel (g_nummodels - 1);
-		if (g_nummodels - 1 != 0 && ent == &g_entities[0])
+		entity_t *ent = EntityForModel (g_modelnum);
+		if (g_modelnum != 0 && ent == &g_entities[0])
 		{
 			ent = NULL;
 		}
@@ -1222,7 +1225,7 @@ static void     LinkLeafFaces(surface_t* planelist, node_t* leafnode)
 		Warning ("Ambiguous leafnode content ( %s and %s ) at (%.0f,%.0f,%.0f)-(%.0f,%.0f,%.0f) in hull %d of model %d (entity: classname \"%s\", origin \"%s\", targetname \"%s\")", 
 			ContentsToString (ContentsForRank(r)), ContentsToString (ContentsForRank(rank)), 
 			leafnode->mins[0], leafnode->mins[1], leafnode->mins[2], leafnode->maxs[0], leafnode->maxs[1], leafnode->maxs[2], 
-			g_hullnum, g_nummodels - 1, 
+			g_hullnum, g_modelnum, 
 			(ent? ValueForKey (ent, "classname"): "unknown"), 
 			(ent? ValueForKey (ent, "origin"): "unknown"), 
 			(ent? ValueForKey (ent, "targetname"): "unknown"));
@@ -1303,13 +1306,44 @@ static void MakeLeaf (node_t *leafnode)
 
 }
 
+// =====================================================================================
+//  AddCellPortal
+//      Cell portals belong to one node only; the other side is left unlinked
+// =====================================================================================
+static void     AddCellPortal(portal_t* p, node_t* node, const int side)
+{
+    p->nodes[side] = node;
+    p->next[side] = node->portals;
+    node->portals = p;
+    p->nodes[!side] = NULL;
+    p->next[!side] = NULL;
+}
+
+// =====================================================================================
+//  FreeCellPortals
+// =====================================================================================
+static void     FreeCellPortals(node_t* node)
+{
+    portal_t*       p;
+    portal_t*       next_portal;
+
+    for (p = node->portals; p; p = next_portal)
+    {
+        next_portal = p->next[p->nodes[0] == node? 0: 1];
+        delete p->winding;
+        FreePortal(p);
+    }
+    node->portals = NULL;
+}
+
 // =====================================================================================
 //  MakeNodePortal
 //      Create the new portal by taking the full plane winding for the cutting plane and 
 //      clipping it by all of the planes from the other portals.
 //      Each portal tracks the node that created it, so unused nodes can be removed later.
+//      With cell set, each child gets its own copy instead of a shared portal.
 // =====================================================================================
-static void     MakeNodePortal(node_t* node)
+static void     MakeNodePortal(node_t* node, const bool cell)
 {
     portal_t*       new_portal;
     portal_t*       p;
@@ -1355,7 +1389,19 @@ static void     MakeNodePortal(node_t* node)
     }
 
     new_portal->winding = w;
-    AddPortalToNodes(new_portal, node->children[0], node->children[1]);
+    if (cell)
+    {
+        portal_t*       back_portal = AllocPortal();
+
+        *back_portal = *new_portal;
+        back_portal->winding = new Winding(*w);
+        AddCellPortal(new_portal, node->children[0], 0);
+        AddCellPortal(back_portal, node->children[1], 1);
+    }
+    else
+    {
+        AddPortalToNodes(new_portal, node->children[0], node->children[1]);
+    }
 }
 
 // =====================================================================================
@@ -1453,6 +1499,61 @@ static void     SplitNodePortals(node_t *node)
     node->portals = NULL;
 }
 
+// =====================================================================================
+//  SplitNodeCell
+//      SplitNodePortals for cell portals. Nothing outside the node is touched, so the
+//      subtrees can be built on different threads and still see the same bounds.
+// =====================================================================================
+static void     SplitNodeCell(node_t *node)
+{
+    portal_t*       p;
+    portal_t*       next_portal;
+    portal_t*       new_portal;
+    int             side;
+    dplane_t*       plane;
+    Winding*        frontwinding;
+    Winding*        backwinding;
+
+    plane = &g_dplanes[node->planenum];
+
+    for (p = node->portals; p; p = next_portal)
+    {
+        side = p->nodes[0] == node? 0: 1;
+        next_portal = p->next[side];
+
+        p->winding->Divide(*plane, &frontwinding, &backwinding);
+
+		if (!frontwinding && !backwinding)
+		{
+			delete p->winding;
+			FreePortal(p);
+			continue;
+		}
+        if (!frontwinding)
+        {
+            AddCellPortal(p, node->children[1], side);
+            continue;
+        }
+        if (!backwinding)
+        {
+            AddCellPortal(p, node->children[0], side);
+            continue;
+        }
+
+        // the winding is split
+        new_portal = AllocPortal();
+        *new_portal = *p;
+        new_portal->winding = backwinding;
+        delete p->winding;
+        p->winding = frontwinding;
+
+        AddCellPortal(p, node->children[0], side);
+        AddCellPortal(new_portal, node->children[1], side);
+    }
+
+    node->portals = NULL;
+}
+
 // =====================================================================================
 //  CalcNodeBounds
 //      Determines the boundaries of a node by minmaxing all the portal points, whcih 
@@ -1585,8 +1686,42 @@ static void     CopyFacesToNode(node_t* node, surface_t* surf)
     }
 }
 
+// =====================================================================================
+//  CountSurfaces
+// =====================================================================================
+static int      CountSurfaces(const surface_t* surfaces)
+{
+    int             count = 0;
+
+    for (; surfaces; surfaces = surfaces->next)
+    {
+        count++;
+    }
+    return count;
+}
+
+// =====================================================================================
+//  ReserveBspThread
+//      Claims a thread for a subtree if fewer than g_numthreads are busy building trees
+// =====================================================================================
+static bool     ReserveBspThread()
+{
+    int             numthreads = g_numbspthreads.load();
+
+    while (numthreads < g_numthreads)
+    {
+        if (g_numbspthreads.compare_exchange_weak(numthreads, numthreads + 1))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
 // =====================================================================================
 //  BuildBspTree_r
+//      The cell portals that bound each node are private to it, so the real portals are
+//      made afterwards by MakeTreePortals_r
 // =====================================================================================
 static void     BuildBspTree_r(node_t* node)
 {
@@ -1629,6 +1764,7 @@ static void     BuildBspTree_r(node_t* node)
 	}
     if (!split)
     {                                                      // this is a leaf node
+		FreeCellPortals (node);
 		MakeLeaf (node);
         return;
     }
@@ -1682,16 +1818,65 @@ static void     BuildBspTree_r(node_t* node)
 
 	if (!split->detaillevel)
 	{
-		MakeNodePortal (node);
-		SplitNodePortals (node);
+		MakeNodePortal (node, true);
+		SplitNodeCell (node);
+	}
+	else
+	{
+		FreeCellPortals (node);
 	}
 
     // recursively do the children
-    BuildBspTree_r(node->children[0]);
-    BuildBspTree_r(node->children[1]);
+	if (CountSurfaces (node->children[0]->surfaces) >= BSP_TASK_MINSURFACES && ReserveBspThread ())
+	{
+		const bool		reportprogress = g_reportProgress;
+		const int		hullnum = g_hullnum;
+		const int		modelnum = g_modelnum;
+		std::thread		front ([=] ()
+		{
+			g_reportProgress = reportprogress;
+			g_hullnum = hullnum;
+			g_modelnum = modelnum;
+			BuildBspTree_r(node->children[0]);
+			ProfileFlushThread();
+		});
+		BuildBspTree_r(node->children[1]);
+		front.join ();
+		g_numbspthreads--;
+	}
+	else
+	{
+	    BuildBspTree_r(node->children[0]);
+	    BuildBspTree_r(node->children[1]);
+	}
 	UpdateStatus();
 }
 
+// =====================================================================================
+//  MakeTreePortals_r
+//      Builds the real portals in the same order as a serial BuildBspTree_r would have,
+//      so the portal file and the node bounds do not depend on thread timing.
+// =====================================================================================
+static void     MakeTreePortals_r(node_t* node)
+{
+	vec3_t			validmins, validmaxs;
+
+    CalcNodeBounds(node
+		, validmins, validmaxs
+		);
+    if (node->planenum == -1)
+    {
+        return;
+    }
+	if (!node->children[0]->isdetail)
+	{
+		MakeNodePortal (node, false);
+		SplitNodePortals (node);
+	}
+    MakeTreePortals_r(node->children[0]);
+    MakeTreePortals_r(node->children[1]);
+}
+
 // =====================================================================================
 //  SolidBSP
 //      Takes a chain of surfaces plus a split type, and returns a bsp tree with faces 
@@ -1700,17 +1885,16 @@ static void     BuildBspTree_r(node_t* node)
 // =====================================================================================
 node_t*         SolidBSP(const surfchain_t* const surfhead, 
 						 brush_t *detailbrushes, 
+						 node_t* outside_node, 
 						 bool report_progress)
 {
     node_t*         headnode;
+    portal_t*       p;
+
+	g_numbspthreads++;
 
 	ResetStatus(report_progress);
-	double start_time = I_FloatTime();
-	if(report_progress)
-	{
-		Log("SolidBSP [hull %d] ",g_hullnum);
-	}
-	else
+	if(!report_progress)
 	{
 	    Verbose("----- SolidBSP -----\n");
 	}
@@ -1726,16 +1910,21 @@ node_t*         SolidBSP(const surfchain_t* const surfhead,
 
 
     // generate six portals that enclose the entire world
-    MakeHeadnodePortals(headnode, surfhead->mins, surfhead->maxs);
+    // the outside portals of the cell are not linked to anything
+    MakeHeadnodePortals(headnode, outside_node, surfhead->mins, surfhead->maxs);
+    for (p = headnode->portals; p; p = p->next[0])
+    {
+        p->nodes[1] = NULL;
+        p->next[1] = NULL;
+    }
 
     // recursively partition everything
     BuildBspTree_r(headnode);
 
-	double end_time = I_FloatTime();
-	if(report_progress)
-	{
-		Log("%d (%.2f seconds)\n",++g_numProcessed,(end_time - start_time));
-	}
+    // now build the portals for real
+    MakeHeadnodePortals(headnode, outside_node, surfhead->mins, surfhead->maxs);
+    MakeTreePortals_r(headnode);
 
+	g_numbspthreads--;
     return headnode;
 }
@@ -3,13 +3,11 @@
 //  SubdivideFace
 
 //  InitHash
-//  HashVec
 
 //  GetVertex
 //  GetEdge
 //  MakeFaceEdges
-
-static int      subdivides;
+//  FreeFaceEdges
 
 /* a surface has all of the faces that could be drawn on a given plane
    the outside filling stage can remove some of them so a better bsp can be generated */
@@ -85,8 +83,6 @@ void            SubdivideFace(face_t* f, face_t** prevptr)
             }
                 
             // split it
-            subdivides++;
-
             VectorCopy(tex->vecs[axis], temp);
             v = VectorNormalize(temp);
 
@@ -140,109 +136,41 @@ static int      firstmodelface;
 
 //============================================================================
 
-#define	NUM_HASH	4096
-
-static hashvert_t* hashverts[NUM_HASH];
-
-static vec3_t   hash_min;
-static vec3_t   hash_scale;
-// It's okay if the coordinates go under hash_min, because they are hashed in a cyclic way (modulus by hash_numslots)
-// So please don't change the hardcoded hash_min and scale
-static int		hash_numslots[3];
-#define MAX_HASH_NEIGHBORS	4
+static cellhash_t hashverts;
 
 // =====================================================================================
-//  InitHash
+//  CountFacePoints
+//      The points of all faces on the nodes below node, for sizing the vertex hashes
 // =====================================================================================
-static void     InitHash()
+int             CountFacePoints(const node_t* const node)
 {
-    vec3_t          size;
-    vec_t           volume;
-    vec_t           scale;
-    int             newsize[2];
-    int             i;
-
-    memset(hashverts, 0, sizeof(hashverts));
+    const face_t*   f;
+    int             count;
 
-    for (i = 0; i < 3; i++)
+    if (node->planenum == PLANENUM_LEAF)
     {
-        hash_min[i] = -8000;
-        size[i] = 16000;
+        return 0;
     }
 
-    volume = size[0] * size[1];
-
-    scale = sqrt(volume / NUM_HASH);
-
-	hash_numslots[0] = (int)floor (size[0] / scale);
-	hash_numslots[1] = (int)floor (size[1] / scale);
-	while (hash_numslots[0] * hash_numslots[1] > NUM_HASH)
-	{
-		Developer (DEVELOPER_LEVEL_WARNING, "hash_numslots[0] * hash_numslots[1] > NUM_HASH");
-		hash_numslots[0]--;
-		hash_numslots[1]--;
-	}
-
-	hash_scale[0] = hash_numslots[0] / size[0];
-	hash_scale[1] = hash_numslots[1] / size[1];
+    count = 0;
+    for (f = node->faces; f; f = f->next)
+    {
+        count += f->numpoints;
+    }
 
-    hvert_p = hvertex;
+    return count + CountFacePoints(node->children[0]) + CountFacePoints(node->children[1]);
 }
 
 // =====================================================================================
-//  HashVec
+//  InitHash
+//      Sized from the bounds and the faces of the model being written
 // =====================================================================================
-static int HashVec (const vec3_t vec, int *num_hashneighbors, int *hashneighbors)
-	// returned value: the one bucket that a new vertex may "write" into
-	// returned hashneighbors: the buckets that we should "read" to check for an existing vertex
+static void     InitHash(const node_t* const headnode)
 {
-	int h;
-	int i;
-	int x;
-	int y;
-	int slot[2];
-	vec_t normalized[2];
-	vec_t slotdiff[2];
-
-	for (i = 0; i < 2; i++)
-	{
-		normalized[i] = hash_scale[i] * (vec[i] - hash_min[i]);
-		slot[i] = (int)floor (normalized[i]);
-		slotdiff[i] = normalized[i] - (vec_t)slot[i];
-
-		slot[i] = (slot[i] + hash_numslots[i]) % hash_numslots[i];
-		slot[i] = (slot[i] + hash_numslots[i]) % hash_numslots[i]; // do it twice to handle negative values
-	}
+    CellHashFree(&hashverts);
+    CellHashInit(&hashverts, headnode->mins, headnode->maxs, CountFacePoints(headnode));
 
-	h = slot[0] * hash_numslots[1] + slot[1];
-
-	*num_hashneighbors = 0;
-	for (x = -1; x <= 1; x++)
-	{
-		if (x == -1 && slotdiff[0] > hash_scale[0] * (2 * POINT_EPSILON) ||
-			x == 1 && slotdiff[0] < 1 - hash_scale[0] * (2 * POINT_EPSILON))
-		{
-			continue;
-		}
-		for (y = -1; y <= 1; y++)
-		{
-			if (y == -1 && slotdiff[1] > hash_scale[1] * (2 * POINT_EPSILON) ||
-				y == 1 && slotdiff[1] < 1 - hash_scale[1] * (2 * POINT_EPSILON))
-			{
-				continue;
-			}
-			if (*num_hashneighbors >= MAX_HASH_NEIGHBORS)
-			{
-				Error ("HashVec: internal error.");
-			}
-			hashneighbors[*num_hashneighbors] =
-				((slot[0] + x + hash_numslots[0]) % hash_numslots[0]) * hash_numslots[1] +
-				(slot[1] + y + hash_numslots[1]) % hash_numslots[1];
-			(*num_hashneighbors)++;
-		}
-	}
-
-	return h;
+    hvert_p = hvertex;
 }
 
 // =====================================================================================
@@ -250,12 +178,12 @@ static int HashVec (const vec3_t vec, int *num_hashneighbors, int *hashneighbors
 // =====================================================================================
 static int      GetVertex(const vec3_t in, const int planenum)
 {
-    int             h;
     int             i;
     hashvert_t*     hv;
     vec3_t          vert;
+    void**          head;
 	int				num_hashneighbors;
-	int				hashneighbors[MAX_HASH_NEIGHBORS];
+	long long		hashneighbors[MAX_CELLHASH_NEIGHBORS];
 
     for (i = 0; i < 3; i++)
     {
@@ -269,10 +197,10 @@ static int      GetVertex(const vec3_t in, const int planenum)
         }
     }
 
-	h = HashVec(vert, &num_hashneighbors, hashneighbors);
+	num_hashneighbors = CellHashNeighbors(&hashverts, vert, 2 * POINT_EPSILON, hashneighbors);
 
   for (i = 0; i < num_hashneighbors; i++)
-	for (hv = hashverts[hashneighbors[i]]; hv; hv = hv->next)
+	for (hv = (hashvert_t*)CellHashFirst(&hashverts, hashneighbors[i]); hv; hv = hv->next)
     {
         if (fabs(hv->point[0] - vert[0]) < POINT_EPSILON
             && fabs(hv->point[1] - vert[1]) < POINT_EPSILON && fabs(hv->point[2] - vert[2]) < POINT_EPSILON)
@@ -302,8 +230,9 @@ static int      GetVertex(const vec3_t in, const int planenum)
     hv->numedges = 1;
     hv->numplanes = 1;
     hv->planenums[0] = planenum;
-    hv->next = hashverts[h];
-    hashverts[h] = hv;
+    head = CellHashHead(&hashverts, hashneighbors[0]);
+    hv->next = (hashvert_t*)*head;
+    *head = hv;
     VectorCopy(vert, hv->point);
     hv->num = g_numvertexes;
     hlassume(hv->num != MAX_MAP_VERTS, assume_MAX_MAP_VERTS);
@@ -364,9 +293,18 @@ int             GetEdge(const vec3_t p1, const vec3_t p2, face_t* f)
 // =====================================================================================
 //  MakeFaceEdges
 // =====================================================================================
-void            MakeFaceEdges()
+void            MakeFaceEdges(node_t* headnode)
 {
-    InitHash();
+    InitHash(headnode);
     firstmodeledge = g_numedges;
     firstmodelface = g_numfaces;
 }
+
+// =====================================================================================
+//  FreeFaceEdges
+//      Each model frees the vertex hash of the one before, this frees the last one
+// =====================================================================================
+void            FreeFaceEdges()
+{
+    CellHashFree(&hashverts);
+}
@@ -22,107 +22,57 @@ static int      numwverts;
 static int      tjuncs;
 static int      tjuncfaces;
 
-#define MAX_WVERTS   0x40000
-#define MAX_WEDGES   0x20000
+// the wverts link to each other and to the heads in the wedges, so they are allocated in
+// blocks that never move, and all freed at once when the model is done
+#define TJUNC_BLOCKSIZE	0x40000
 
-static wvert_t  wverts[MAX_WVERTS];
-static wedge_t  wedges[MAX_WEDGES];
-
-//============================================================================
+typedef struct tjuncblock_s
+{
+    struct tjuncblock_s* next;
+    int             used;
+    double          data[TJUNC_BLOCKSIZE / sizeof(double)];
+}
+tjuncblock_t;
 
-#define NUM_HASH	4096
+static tjuncblock_t* tjuncblocks;
 
-wedge_t*        wedge_hash[NUM_HASH];
+static void*    TjuncAlloc(const int size)
+{
+    void*           p;
+    // keep every item aligned like the block data
+    const int       alignedsize = (size + sizeof(double) - 1) / sizeof(double) * sizeof(double);
 
-static vec3_t   hash_min;
-static vec3_t   hash_scale;
-// It's okay if the coordinates go under hash_min, because they are hashed in a cyclic way (modulus by hash_numslots)
-// So please don't change the hardcoded hash_min and scale
-static int		hash_numslots[3];
-#define MAX_HASH_NEIGHBORS	4
+    if (!tjuncblocks || tjuncblocks->used + alignedsize > TJUNC_BLOCKSIZE)
+    {
+        tjuncblock_t*   block = (tjuncblock_t*)malloc(sizeof(tjuncblock_t));
 
-static void     InitHash(const vec3_t mins, const vec3_t maxs)
-{
-    vec3_t          size;
-    vec_t           volume;
-    vec_t           scale;
-    int             newsize[2];
-
-	// Let's ignore the parameters and make things more predictable, so there won't be strange cases such as division by 0 or extreme scaling values.
-	VectorFill(hash_min, -8000);
-	VectorFill(size, 16000);
-    memset(wedge_hash, 0, sizeof(wedge_hash));
-
-    volume = size[0] * size[1];
-
-    scale = sqrt(volume / NUM_HASH);
-
-	hash_numslots[0] = (int)floor (size[0] / scale);
-	hash_numslots[1] = (int)floor (size[1] / scale);
-	while (hash_numslots[0] * hash_numslots[1] > NUM_HASH)
-	{
-		Developer (DEVELOPER_LEVEL_WARNING, "hash_numslots[0] * hash_numslots[1] > NUM_HASH");
-		hash_numslots[0]--;
-		hash_numslots[1]--;
-	}
-
-	hash_scale[0] = hash_numslots[0] / size[0];
-	hash_scale[1] = hash_numslots[1] / size[1];
+        hlassume(block != NULL, assume_NoMemory);
+        block->next = tjuncblocks;
+        block->used = 0;
+        tjuncblocks = block;
+    }
+    p = (byte*)tjuncblocks->data + tjuncblocks->used;
+    tjuncblocks->used += alignedsize;
+    return p;
 }
 
-static int HashVec (const vec3_t vec, int *num_hashneighbors, int *hashneighbors)
+static void     FreeTjuncBlocks()
 {
-	int h;
-	int i;
-	int x;
-	int y;
-	int slot[2];
-	vec_t normalized[2];
-	vec_t slotdiff[2];
-
-	for (i = 0; i < 2; i++)
-	{
-		normalized[i] = hash_scale[i] * (vec[i] - hash_min[i]);
-		slot[i] = (int)floor (normalized[i]);
-		slotdiff[i] = normalized[i] - (vec_t)slot[i];
-
-		slot[i] = (slot[i] + hash_numslots[i]) % hash_numslots[i];
-		slot[i] = (slot[i] + hash_numslots[i]) % hash_numslots[i]; // do it twice to handle negative values
-	}
-
-	h = slot[0] * hash_numslots[1] + slot[1];
-
-	*num_hashneighbors = 0;
-	for (x = -1; x <= 1; x++)
-	{
-		if (x == -1 && slotdiff[0] > hash_scale[0] * (2 * ON_EPSILON) ||
-			x == 1 && slotdiff[0] < 1 - hash_scale[0] * (2 * ON_EPSILON))
-		{
-			continue;
-		}
-		for (y = -1; y <= 1; y++)
-		{
-			if (y == -1 && slotdiff[1] > hash_scale[1] * (2 * ON_EPSILON) ||
-				y == 1 && slotdiff[1] < 1 - hash_scale[1] * (2 * ON_EPSILON))
-			{
-				continue;
-			}
-			if (*num_hashneighbors >= MAX_HASH_NEIGHBORS)
-			{
-				Error ("HashVec: internal error.");
-			}
-			hashneighbors[*num_hashneighbors] =
-				((slot[0] + x + hash_numslots[0]) % hash_numslots[0]) * hash_numslots[1] +
-				(slot[1] + y + hash_numslots[1]) % hash_numslots[1];
-			(*num_hashneighbors)++;
-		}
-	}
+    tjuncblock_t*   next;
 
-	return h;
+    for (; tjuncblocks; tjuncblocks = next)
+    {
+        next = tjuncblocks->next;
+        free(tjuncblocks);
+    }
 }
 
 //============================================================================
 
+static cellhash_t wedge_hash;
+
+//============================================================================
+
 static bool     CanonicalVector(vec3_t vec)
 {
     if (VectorNormalize(vec))
@@ -181,9 +131,9 @@ static wedge_t *FindEdge(const vec3_t p1, const vec3_t p2, vec_t* t1, vec_t* t2)
     vec3_t          dir;
     wedge_t*        w;
     vec_t           temp;
-    int             h;
+    void**          head;
 	int				num_hashneighbors;
-	int				hashneighbors[MAX_HASH_NEIGHBORS];
+	long long		hashneighbors[MAX_CELLHASH_NEIGHBORS];
 
     VectorSubtract(p2, p1, dir);
     if (!CanonicalVector(dir))
@@ -205,10 +155,10 @@ static wedge_t *FindEdge(const vec3_t p1, const vec3_t p2, vec_t* t1, vec_t* t2)
         *t2 = temp;
     }
 
-	h = HashVec(origin, &num_hashneighbors, hashneighbors);
+	num_hashneighbors = CellHashNeighbors(&wedge_hash, origin, 2 * ON_EPSILON, hashneighbors);
 
   for (int i = 0; i < num_hashneighbors; ++i)
-	for (w = wedge_hash[hashneighbors[i]]; w; w = w->next)
+	for (w = (wedge_t*)CellHashFirst(&wedge_hash, hashneighbors[i]); w; w = w->next)
     {
 		if (fabs (w->origin[0] - origin[0]) > EQUAL_EPSILON ||
 			fabs (w->origin[1] - origin[1]) > EQUAL_EPSILON ||
@@ -226,12 +176,12 @@ static wedge_t *FindEdge(const vec3_t p1, const vec3_t p2, vec_t* t1, vec_t* t2)
         return w;
     }
 
-    hlassume(numwedges < MAX_WEDGES, assume_MAX_WEDGES);
-    w = &wedges[numwedges];
+    w = (wedge_t*)TjuncAlloc(sizeof(wedge_t));
     numwedges++;
 
-    w->next = wedge_hash[h];
-    wedge_hash[h] = w;
+    head = CellHashHead(&wedge_hash, hashneighbors[0]);
+    w->next = (wedge_t*)*head;
+    *head = w;
 
     VectorCopy(origin, w->origin);
     VectorCopy(dir, w->dir);
@@ -269,9 +219,7 @@ static void     AddVert(const wedge_t* const w, const vec_t t)
     while (1);
 
     // insert a new wvert before v
-    hlassume(numwverts < MAX_WVERTS, assume_MAX_WVERTS);
-
-    newv = &wverts[numwverts];
+    newv = (wvert_t*)TjuncAlloc(sizeof(wvert_t));
     numwverts++;
 
     newv->t = t;
@@ -571,7 +519,7 @@ void            tjunc(node_t* headnode)
     }
     VectorSubtract(vec3_origin, maxs, mins);
 
-    InitHash(mins, maxs);
+    CellHashInit(&wedge_hash, mins, maxs, CountFacePoints(headnode));
 
     numwedges = numwverts = 0;
 
@@ -588,4 +536,7 @@ void            tjunc(node_t* headnode)
 
     Verbose("%i edges added by tjunctions\n", tjuncs);
     Verbose("%i faces added by tjunctions\n", tjuncfaces);
+
+    CellHashFree(&wedge_hash);
+    FreeTjuncBlocks();
 }
@@ -10,24 +10,87 @@
 //  BeginBSPFile
 //  FinishBSPFile
 
-#include <map>
-
-typedef std::map< int, int > PlaneMap;
-static PlaneMap gPlaneMap;
+// the planes and texinfos are remapped through tables indexed by their original number,
+// which hold the new number + 1, or 0 until they are written
+static int gPlaneMap[MAX_INTERNAL_MAP_PLANES];
 static int gNumMappedPlanes;
 static dplane_t gMappedPlanes[MAX_MAP_PLANES];
 extern bool g_noopt;
 
-typedef std::map< int, int > texinfomap_t;
 static int g_nummappedtexinfo;
 static texinfo_t g_mappedtexinfo[MAX_MAP_TEXINFO];
-static texinfomap_t g_texinfomap;
+static int g_texinfomap[MAX_INTERNAL_MAP_TEXINFO];
 
 int count_mergedclipnodes;
-typedef std::map< std::pair< int, std::pair< int, int > >, int > clipnodemap_t;
-inline clipnodemap_t::key_type MakeKey (const dclipnode_t &c)
+
+// =====================================================================================
+//  Clipnode map
+//      Finds the clipnode already written with the same plane and children. It is an open
+//      addressing table of clipnode numbers + 1 (0 for an empty slot); the keys are read
+//      from g_dclipnodes, so nothing else is stored.
+// =====================================================================================
+#define CLIPNODEMAP_MINSLOTS 1024 // must be a power of 2
+
+typedef struct
+{
+	int *slots;
+	int numslots;
+	int numclipnodes;
+}
+clipnodemap_t;
+
+static unsigned ClipnodeHash (const dclipnode_t &c)
+{
+	unsigned h = (unsigned)c.planenum * 0x9E3779B1u;
+	h = (h ^ (unsigned)c.children[0]) * 0x85EBCA77u;
+	h = (h ^ (unsigned)c.children[1]) * 0xC2B2AE3Du;
+	return h ^ (h >> 16);
+}
+
+static int FindClipnode (const clipnodemap_t *map, const dclipnode_t &c)
+{
+	int i;
+	for (i = ClipnodeHash (c) & (map->numslots - 1); map->slots[i]; i = (i + 1) & (map->numslots - 1))
+	{
+		const dclipnode_t *other = &g_dclipnodes[map->slots[i] - 1];
+		if (other->planenum == c.planenum && other->children[0] == c.children[0] && other->children[1] == c.children[1])
+		{
+			return map->slots[i] - 1;
+		}
+	}
+	return -1;
+}
+
+static void AllocClipnodeMap (clipnodemap_t *map, int numslots)
+{
+	map->slots = (int *)calloc (numslots, sizeof (int));
+	hlassume (map->slots != NULL, assume_NoMemory);
+	map->numslots = numslots;
+	map->numclipnodes = 0;
+}
+
+static void AddClipnode (clipnodemap_t *map, int clipnode)
 {
-	return std::make_pair (c.planenum, std::make_pair (c.children[0], c.children[1]));
+	int i;
+	if (2 * (map->numclipnodes + 1) > map->numslots)
+	{
+		// keep the table at most half full
+		clipnodemap_t old = *map;
+		AllocClipnodeMap (map, old.numslots * 2);
+		for (int j = 0; j < old.numslots; j++)
+		{
+			if (old.slots[j])
+			{
+				AddClipnode (map, old.slots[j] - 1);
+			}
+		}
+		free (old.slots);
+	}
+	for (i = ClipnodeHash (g_dclipnodes[clipnode]) & (map->numslots - 1); map->slots[i]; i = (i + 1) & (map->numslots - 1))
+	{
+	}
+	map->slots[i] = clipnode + 1;
+	map->numclipnodes++;
 }
 
 // =====================================================================================
@@ -43,15 +106,14 @@ static int WritePlane(int planenum)
 		return planenum;
 	}
 
-	PlaneMap::iterator item = gPlaneMap.find(planenum);
-	if(item != gPlaneMap.end())
+	if(gPlaneMap[planenum])
 	{
-		return item->second;
+		return gPlaneMap[planenum] - 1;
 	}
 	//add plane to BSP
 	hlassume(gNumMappedPlanes < MAX_MAP_PLANES, assume_MAX_MAP_PLANES);
 	gMappedPlanes[gNumMappedPlanes] = g_dplanes[planenum];
-	gPlaneMap.insert(PlaneMap::value_type(planenum,gNumMappedPlanes));
+	gPlaneMap[planenum] = gNumMappedPlanes + 1;
 
 	return gNumMappedPlanes++;
 }
@@ -71,18 +133,16 @@ static int WriteTexinfo (int texinfo)
 		return texinfo;
 	}
 
-	texinfomap_t::iterator it;
-	it = g_texinfomap.find (texinfo);
-	if (it != g_texinfomap.end ())
+	if (g_texinfomap[texinfo])
 	{
-		return it->second;
+		return g_texinfomap[texinfo] - 1;
 	}
 
 	int c;
 	hlassume (g_nummappedtexinfo < MAX_MAP_TEXINFO, assume_MAX_MAP_TEXINFO);
 	c = g_nummappedtexinfo;
 	g_mappedtexinfo[g_nummappedtexinfo] = g_texinfo[texinfo];
-	g_texinfomap.insert (texinfomap_t::value_type (texinfo, g_nummappedtexinfo));
+	g_texinfomap[texinfo] = g_nummappedtexinfo + 1;
 	g_nummappedtexinfo++;
 	return c;
 }
@@ -143,13 +203,13 @@ static int      WriteClipNodes_r(node_t* node
 			, outputmap
 			);
     }
-	clipnodemap_t::iterator output;
-	output = outputmap->find (MakeKey (*cn));
-	if (g_noclipnodemerge || output == outputmap->end ())
+	int output;
+	output = g_noclipnodemerge? -1: FindClipnode (outputmap, *cn);
+	if (output == -1)
 	{
 		hlassume (c < MAX_MAP_CLIPNODES, assume_MAX_MAP_CLIPNODES);
 		g_dclipnodes[c] = *cn;
-		(*outputmap)[MakeKey (*cn)] = c;
+		AddClipnode (outputmap, c);
 	}
 	else
 	{
@@ -159,7 +219,7 @@ static int      WriteClipNodes_r(node_t* node
 			Error ("Merge clipnodes: internal error");
 		}
 		g_numclipnodes = c;
-		c = output->second; // use existing clipnode
+		c = output; // use existing clipnode
 	}
 
     free(node);
@@ -175,10 +235,12 @@ void            WriteClipNodes(node_t* nodes)
 {
 	// we only merge among the clipnodes of the same hull of the same model
 	clipnodemap_t outputmap;
+	AllocClipnodeMap (&outputmap, CLIPNODEMAP_MINSLOTS);
     WriteClipNodes_r(nodes
 		, NULL
 		, &outputmap
 		);
+	free (outputmap.slots);
 }
 
 // =====================================================================================
@@ -560,10 +622,10 @@ void            BeginBSPFile()
     // these values may actually be initialized
     // if the file existed when loaded, so clear them explicitly
 	gNumMappedPlanes = 0;
-	gPlaneMap.clear();
+	memset(gPlaneMap, 0, sizeof(gPlaneMap));
 
 	g_nummappedtexinfo = 0;
-	g_texinfomap.clear ();
+	memset (g_texinfomap, 0, sizeof (g_texinfomap));
 
 	count_mergedclipnodes = 0;
     g_nummodels = 0;
@@ -862,4 +924,6 @@ void            FinishBSPFile()
 #define dplane_t plane_t
 #define g_dplanes g_mapplanes
     WriteBSPFile(g_bspfilename);
+
+    FreeFaceEdges();
 }
@@ -1,5 +1,7 @@
 #include "csg.h"
 
+#include <atomic>
+
 plane_t         g_mapplanes[MAX_INTERNAL_MAP_PLANES];
 int             g_nummapplanes;
 hullshape_t		g_defaulthulls[NUM_HULLS];
@@ -10,38 +12,106 @@ hullshape_t		g_hullshapes[MAX_HULLSHAPES];
 
 
 // =====================================================================================
-//  FindIntPlane, fast version (replacement by KGP)
-//	This process could be optimized by placing the planes in a (non hash-) set and using
-//	half of the inner loop check below as the comparator; I'd expect the speed gain to be
-//	very large given the change from O(N^2) to O(NlogN) to build the set of planes.
+//  Plane index
+//      The planes are hashed on their quantized normal and distance, so FindIntPlane only
+//      has to look at the few planes that can be within DIR_EPSILON/DIST_EPSILON of the one
+//      asked for. Planes are only added under ThreadLock() and published with a release store,
+//      so looking them up needs no lock.
 // =====================================================================================
+#define PLANEHASH_SIZE 65536                               // must be a power of 2
+#define PLANEHASH_NORMAL_CELL 0.01
+#define PLANEHASH_DIST_CELL 8.0
 
-int FindIntPlane(const vec_t* const normal, const vec_t* const origin)
+static std::atomic<int> s_planehash[PLANEHASH_SIZE];       // first plane + 1 in each bucket, 0 if empty
+static int      s_planehashnext[MAX_INTERNAL_MAP_PLANES];  // next plane + 1 in the same bucket
+static std::atomic<int> s_numhashedplanes(0);
+
+static unsigned PlaneHash(const int nx, const int ny, const int nz, const int d)
 {
-    int             returnval;
-    plane_t*        p;
-    plane_t         temp;
-    vec_t           t;
+	unsigned h = (unsigned)nx * 73856093u ^ (unsigned)ny * 19349663u ^ (unsigned)nz * 83492791u ^ (unsigned)d * 2654435761u;
+	return h & (PLANEHASH_SIZE - 1);
+}
 
-	returnval = 0;
+static void AddPlaneToHash(const int planenum)
+{
+	const plane_t *p = &g_mapplanes[planenum];
+	unsigned h = PlaneHash ((int)floor (p->normal[0] / PLANEHASH_NORMAL_CELL),
+							(int)floor (p->normal[1] / PLANEHASH_NORMAL_CELL),
+							(int)floor (p->normal[2] / PLANEHASH_NORMAL_CELL),
+							(int)floor (p->dist / PLANEHASH_DIST_CELL));
+
+	s_planehashnext[planenum] = s_planehash[h].load (std::memory_order_relaxed);
+	s_planehash[h].store (planenum + 1, std::memory_order_release);
+}
 
-	find_plane:
-	for( ; returnval < g_nummapplanes; returnval++)
+// Returns the lowest numbered plane that matches, which is the one a linear search would find
+static int FindPlaneInHash(const vec_t* const normal, const vec_t* const origin)
+{
+	int lo[4], hi[4];
+	int cell[4];
+	int i, planenum, best;
+	vec_t dist, tolerance, t;
+
+	// Any matching plane has each normal component within DIR_EPSILON, so its distance can differ
+	// from ours by at most DIR_EPSILON * |origin|_1 on top of DIST_EPSILON.
+	dist = DotProduct (origin, normal);
+	tolerance = DIST_EPSILON + DIR_EPSILON * (fabs (origin[0]) + fabs (origin[1]) + fabs (origin[2]));
+	tolerance = tolerance * 1.01 + ON_EPSILON; // leave some room for rounding errors
+	for (i = 0; i < 3; i++)
 	{
-		// BUG: there might be some multithread issue --vluzacn
-		if(	-DIR_EPSILON < (t = normal[0] - g_mapplanes[returnval].normal[0]) && t < DIR_EPSILON &&
-			-DIR_EPSILON < (t = normal[1] - g_mapplanes[returnval].normal[1]) && t < DIR_EPSILON &&
-			-DIR_EPSILON < (t = normal[2] - g_mapplanes[returnval].normal[2]) && t < DIR_EPSILON )
+		lo[i] = (int)floor ((normal[i] - DIR_EPSILON) / PLANEHASH_NORMAL_CELL);
+		hi[i] = (int)floor ((normal[i] + DIR_EPSILON) / PLANEHASH_NORMAL_CELL);
+	}
+	lo[3] = (int)floor ((dist - tolerance) / PLANEHASH_DIST_CELL);
+	hi[3] = (int)floor ((dist + tolerance) / PLANEHASH_DIST_CELL);
+
+	best = -1;
+	for (cell[0] = lo[0]; cell[0] <= hi[0]; cell[0]++)
+	for (cell[1] = lo[1]; cell[1] <= hi[1]; cell[1]++)
+	for (cell[2] = lo[2]; cell[2] <= hi[2]; cell[2]++)
+	for (cell[3] = lo[3]; cell[3] <= hi[3]; cell[3]++)
+	{
+		for (i = s_planehash[PlaneHash (cell[0], cell[1], cell[2], cell[3])].load (std::memory_order_acquire); i; i = s_planehashnext[i - 1])
 		{
-			t = DotProduct (origin, g_mapplanes[returnval].normal) - g_mapplanes[returnval].dist;
+			planenum = i - 1;
+			if (best != -1 && planenum >= best)
+			{
+				continue;
+			}
+			if(	-DIR_EPSILON < (t = normal[0] - g_mapplanes[planenum].normal[0]) && t < DIR_EPSILON &&
+				-DIR_EPSILON < (t = normal[1] - g_mapplanes[planenum].normal[1]) && t < DIR_EPSILON &&
+				-DIR_EPSILON < (t = normal[2] - g_mapplanes[planenum].normal[2]) && t < DIR_EPSILON )
+			{
+				t = DotProduct (origin, g_mapplanes[planenum].normal) - g_mapplanes[planenum].dist;
 
-			if (-DIST_EPSILON < t && t < DIST_EPSILON)
-			{ return returnval; }
+				if (-DIST_EPSILON < t && t < DIST_EPSILON)
+				{ best = planenum; }
+			}
 		}
 	}
+	return best;
+}
+
+// =====================================================================================
+//  FindIntPlane
+//      Returns the first plane within DIR_EPSILON/DIST_EPSILON, or adds a new pair of planes.
+// =====================================================================================
+
+int FindIntPlane(const vec_t* const normal, const vec_t* const origin)
+{
+    int             returnval;
+    int             numplanes;
+    plane_t*        p;
+    plane_t         temp;
+
+	find_plane:
+	numplanes = s_numhashedplanes.load (std::memory_order_acquire);
+	returnval = FindPlaneInHash (normal, origin);
+	if (returnval != -1)
+	{ return returnval; }
 
 	ThreadLock();
-	if(returnval != g_nummapplanes) // make sure we don't race
+	if(numplanes != g_nummapplanes) // make sure we don't race
 	{
 		ThreadUnlock();
 		goto find_plane; //check to see if other thread added plane we need
@@ -84,7 +154,11 @@ int FindIntPlane(const vec_t* const normal, const vec_t* const origin)
 	else
 	{ returnval = g_nummapplanes; }
 
+	AddPlaneToHash (g_nummapplanes);
+	AddPlaneToHash (g_nummapplanes + 1);
 	g_nummapplanes += 2;
+	ProfileCount(eProfilePlanesCreated, 2);
+	s_numhashedplanes.store (g_nummapplanes, std::memory_order_release);
 	ThreadUnlock();
 	return returnval;
 }
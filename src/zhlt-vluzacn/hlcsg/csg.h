@@ -57,6 +57,7 @@
 #define DEFAULT_NOUTF8 false
 #endif
 #define DEFAULT_NULLIFYTRIGGER true
+#define DEFAULT_TEXTHULLS false
 
 // AJM: added in
 #define UNLESS(a)  if (!(a))
@@ -279,6 +280,7 @@ extern bool g_nolightopt;
 extern bool g_noutf8;
 #endif
 extern bool g_nullifytrigger;
+extern bool g_texthulls;
 
 extern vec_t    g_tiny_threshold;
 extern vec_t    g_BrushUnionThreshold;
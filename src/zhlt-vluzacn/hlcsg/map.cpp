@@ -763,8 +763,8 @@ bool            ParseMapEntity()
             }
 
 			SetKeyValue (mapent, e->key, e->value);
-			Free (e->key);
-			Free (e->value);
+			free (e->key);
+			free (e->value);
 			Free (e);
         }
     }
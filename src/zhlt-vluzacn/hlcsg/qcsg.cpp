@@ -17,6 +17,7 @@
 #endif
 
 #include <thread>
+#include <atomic>
 
 /*
 
@@ -33,7 +34,13 @@ static FILE*    out_detailbrush[NUM_HULLS];
 static int      c_tiny;        
 static int      c_tiny_clip;
 static int      c_outfaces;
-static int      c_csgfaces;
+static std::atomic<int> c_csgfaces;
+
+// Each thread collects what it writes to the hull files, and only copies it to the file
+// under ThreadLock() once HULLBUFFER_FLUSH_SIZE bytes have piled up or the model is finished.
+#define HULLBUFFER_FLUSH_SIZE (1024 * 1024)
+static std::string out_buffer[MAX_THREADS][NUM_HULLS];
+static std::string out_detailbrush_buffer[MAX_THREADS][NUM_HULLS];
 BoundingBox     world_bounds;
 
 
@@ -66,6 +73,7 @@ bool g_noutf8 = DEFAULT_NOUTF8;
 #endif
 bool g_nullifytrigger = DEFAULT_NULLIFYTRIGGER;
 bool g_viewsurface = false;
+bool g_texthulls = DEFAULT_TEXTHULLS;
 
 // =====================================================================================
 //  GetParamsFromEnt
@@ -282,6 +290,65 @@ void            FreeFace(bface_t* f)
 }
 
 
+// =====================================================================================
+//  Hull file buffers
+// =====================================================================================
+static void     HullBufferPrintf(std::string& buffer, const char* const format, ...)
+{
+    char            text[256];
+    va_list         argptr;
+    int             len;
+
+    va_start(argptr, format);
+    len = vsnprintf(text, sizeof(text), format, argptr);
+    va_end(argptr);
+    hlassert(len >= 0 && len < (int)sizeof(text));
+    buffer.append(text, len);
+}
+
+static void     HullBufferInts(std::string& buffer, const int* const values, const int count)
+{
+    buffer.append((const char*)values, count * sizeof(int));
+}
+
+static void     HullBufferPoint(std::string& buffer, const vec3_t point)
+{
+    double          v[3];
+
+    VectorCopy(point, v);
+    buffer.append((const char*)v, sizeof(v));
+}
+
+static void     FlushHullBuffer(std::string& buffer, FILE* file, const bool force)
+{
+    if (buffer.empty() || (!force && buffer.size() < HULLBUFFER_FLUSH_SIZE))
+    {
+        return;
+    }
+    ThreadLock();
+    SafeWrite(file, buffer.data(), (int)buffer.size());
+    ThreadUnlock();
+    buffer.clear();
+}
+
+// =====================================================================================
+//  FlushHullBuffers
+//      Writes out whatever the threads still hold, in thread order
+// =====================================================================================
+static void     FlushHullBuffers()
+{
+    int             i, hull;
+
+    for (i = 0; i < MAX_THREADS; i++)
+    {
+        for (hull = 0; hull < NUM_HULLS; hull++)
+        {
+            FlushHullBuffer(out_buffer[i][hull], out[hull], true);
+            FlushHullBuffer(out_detailbrush_buffer[i][hull], out_detailbrush[hull], true);
+        }
+    }
+}
+
 // =====================================================================================
 //  WriteFace
 // =====================================================================================
@@ -291,28 +358,44 @@ void            WriteFace(const int hull, const bface_t* const f
 {
     unsigned int    i;
     Winding*        w;
+    std::string&    buffer = out_buffer[GetThreadNum()][hull];
 
-    ThreadLock();
     if (!hull)
         c_csgfaces++;
 
     // .p0 format
     w = f->w;
 
+	if (!g_texthulls)
+	{
+		int summary[5] = {detaillevel, f->planenum, f->texinfo, f->contents, (int)w->m_NumPoints};
+
+		HullBufferInts (buffer, summary, 5);
+		for (i = 0; i < w->m_NumPoints; i++)
+		{
+			HullBufferPoint (buffer, w->m_Points[i]);
+		}
+	}
+	else
+	{
     // plane summary
-	fprintf (out[hull], "%i %i %i %i %u\n", detaillevel, f->planenum, f->texinfo, f->contents, w->m_NumPoints);
+	HullBufferPrintf (buffer, "%i %i %i %i %u\n", detaillevel, f->planenum, f->texinfo, f->contents, w->m_NumPoints);
 
     // for each of the points on the face
     for (i = 0; i < w->m_NumPoints; i++)
     {
         // write the co-ords
-        fprintf(out[hull], "%5.8f %5.8f %5.8f\n", w->m_Points[i][0], w->m_Points[i][1], w->m_Points[i][2]);
+        HullBufferPrintf(buffer, "%5.8f %5.8f %5.8f\n", w->m_Points[i][0], w->m_Points[i][1], w->m_Points[i][2]);
     }
 
     // put in an extra line break
-    fprintf(out[hull], "\n");
+    HullBufferPrintf(buffer, "\n");
+	}
+	FlushHullBuffer (buffer, out[hull], false);
+
 	if (g_viewsurface)
 	{
+		ThreadLock();
 		static bool side = false;
 		side = !side;
 		if (side)
@@ -333,25 +416,46 @@ void            WriteFace(const int hull, const bface_t* const f
 			fprintf (out_view[hull], "%5.2f %5.2f %5.2f\n", center[0], center[1], center[2]);
 			fprintf (out_view[hull], "%5.2f %5.2f %5.2f\n", center2[0], center2[1], center2[2]);
 		}
+		ThreadUnlock();
 	}
-
-    ThreadUnlock();
 }
 void WriteDetailBrush (int hull, const bface_t *faces)
 {
-	ThreadLock ();
-	fprintf (out_detailbrush[hull], "0\n");
+	std::string &buffer = out_detailbrush_buffer[GetThreadNum ()][hull];
+
+	if (!g_texthulls)
+	{
+		const int brushinfo = 0;
+		const int sideend[2] = {-1, -1};
+
+		HullBufferInts (buffer, &brushinfo, 1);
+		for (const bface_t *f = faces; f; f = f->next)
+		{
+			Winding *w = f->w;
+			int side[2] = {f->planenum, (int)w->m_NumPoints};
+			HullBufferInts (buffer, side, 2);
+			for (int i = 0; i < w->m_NumPoints; i++)
+			{
+				HullBufferPoint (buffer, w->m_Points[i]);
+			}
+		}
+		HullBufferInts (buffer, sideend, 2);
+	}
+	else
+	{
+	HullBufferPrintf (buffer, "0\n");
 	for (const bface_t *f = faces; f; f = f->next)
 	{
 		Winding *w = f->w;
-		fprintf (out_detailbrush[hull], "%i %u\n", f->planenum, w->m_NumPoints);
+		HullBufferPrintf (buffer, "%i %u\n", f->planenum, w->m_NumPoints);
 		for (int i = 0; i < w->m_NumPoints; i++)
 		{
-			fprintf (out_detailbrush[hull], "%5.8f %5.8f %5.8f\n", w->m_Points[i][0], w->m_Points[i][1], w->m_Points[i][2]);
+			HullBufferPrintf (buffer, "%5.8f %5.8f %5.8f\n", w->m_Points[i][0], w->m_Points[i][1], w->m_Points[i][2]);
 		}
 	}
-	fprintf (out_detailbrush[hull], "-1 -1\n");
-	ThreadUnlock ();
+	HullBufferPrintf (buffer, "-1 -1\n");
+	}
+	FlushHullBuffer (buffer, out_detailbrush[hull], false);
 }
 
 // =====================================================================================
@@ -1198,7 +1302,7 @@ void LoadWadValue ()
 			next = e->next;
 			free (e->key);
 			free (e->value);
-			free (e);
+			Free (e);
 		}
 	}
 	if (*wadvalue)
@@ -1452,10 +1556,20 @@ static void     ProcessModels()
         }
 
         // write end of model marker
+        FlushHullBuffers();
         for (j = 0; j < NUM_HULLS; j++)
         {
+			if (!g_texthulls)
+			{
+				const int modelend[5] = {-1, -1, -1, -1, -1};
+				SafeWrite (out[j], modelend, sizeof (modelend));
+				SafeWrite (out_detailbrush[j], modelend, sizeof (int));
+			}
+			else
+			{
 			fprintf (out[j], "-1 -1 -1 -1 -1\n");
 			fprintf (out_detailbrush[j], "-1\n");
+			}
         }
     }
 }
@@ -1569,6 +1683,7 @@ static void     Usage()
 
     Log("    -nonulltex       : Turns off null texture stripping\n");
 	Log("    -nonullifytrigger: don't remove 'aaatrigger' texture\n");
+	Log("    -texthulls       : write the hull files for hlbsp as text (for debugging)\n");
 
 
 	Log("    -nolightopt      : don't optimize engine light entities\n");
@@ -1675,6 +1790,7 @@ static void     Settings()
 	Log("wad.cfg group name    [ %7s ] [ %7s ]\n", g_wadconfigname? g_wadconfigname: "None", "None");
 	Log("nullfile              [ %7s ] [ %7s ]\n", g_nullfile ? g_nullfile : "None", "None");
 	Log("nullify trigger       [ %7s ] [ %7s ]\n", g_nullifytrigger? "on": "off", DEFAULT_NULLIFYTRIGGER? "on": "off");
+	Log("text hull files       [ %7s ] [ %7s ]\n", g_texthulls? "on": "off", DEFAULT_TEXTHULLS? "on": "off");
     // calc min surface area
     {
         char            tiny_penetration[10];
@@ -2059,6 +2175,10 @@ int             main(const int argc, char** argv)
 		{
 			g_viewsurface = true;
 		}
+		else if (!strcasecmp (argv[i], "-texthulls"))
+		{
+			g_texthulls = true;
+		}
 		else if (!strcasecmp (argv[i], "-nonullifytrigger"))
 		{
 			g_nullifytrigger = false;
@@ -2115,6 +2235,7 @@ int             main(const int argc, char** argv)
 		ResetLog();                          
     OpenLog(g_clientid);                  
     atexit(CloseLog);                       
+    atexit(WriteProfileReport);
     LogStart(argcold, argvold);
 	{
 		int			 i;
@@ -2230,7 +2351,9 @@ int             main(const int argc, char** argv)
 	FlipSlashes(name);
     DefaultExtension(name, ".map");                  // might be .reg
     
+    ProfileBeginStage("LoadMapFile");
     LoadMapFile(name);
+    ProfileEndStage();
     ThreadSetDefault();                    
     ThreadSetPriority(g_threadpriority);  
     Settings();
@@ -2361,14 +2484,20 @@ int             main(const int argc, char** argv)
 
         safe_snprintf(name, _MAX_PATH, "%s.p%i", g_Mapname, i);
 
-        out[i] = fopen(name, "w");
+        out[i] = fopen(name, g_texthulls? "w": "wb");
 
         if (!out[i]) 
             Error("Couldn't open %s", name);
 		safe_snprintf(name, _MAX_PATH, "%s.b%i", g_Mapname, i);
-		out_detailbrush[i] = fopen(name, "w");
+		out_detailbrush[i] = fopen(name, g_texthulls? "w": "wb");
 		if (!out_detailbrush[i])
 			Error("Couldn't open %s", name);
+		if (!g_texthulls)
+		{
+			const int header[2] = {HULLFILE_BINARY_IDENT, HULLFILE_BINARY_VERSION};
+			SafeWrite (out[i], header, sizeof (header));
+			SafeWrite (out_detailbrush[i], header, sizeof (header));
+		}
 		if (g_viewsurface)
 		{
 			safe_snprintf (name, _MAX_PATH, "%s_surface%i.pts", g_Mapname, i);
@@ -2399,9 +2528,11 @@ int             main(const int argc, char** argv)
 		fclose (f);
 	}
 
+    ProfileBeginStage("ProcessModels");
     ProcessModels();
+    ProfileEndStage();
 
-    Verbose("%5i csg faces\n", c_csgfaces);
+    Verbose("%5i csg faces\n", c_csgfaces.load());
     Verbose("%5i used faces\n", c_outfaces);
     Verbose("%5i tiny faces\n", c_tiny);
     Verbose("%5i tiny clips\n", c_tiny_clip);
@@ -2417,10 +2548,12 @@ int             main(const int argc, char** argv)
 		}
 	}
 
+    ProfileBeginStage("WriteBSP");
     EmitPlanes();
 
 
     WriteBSP(g_Mapname);
+    ProfileEndStage();
 
     // AJM: debug
 #if 0
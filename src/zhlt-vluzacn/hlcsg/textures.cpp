@@ -1,5 +1,7 @@
 #include "csg.h"
 
+#include <atomic>
+
 #define MAXWADNAME 16
 #define MAX_TEXFILES 128
 
@@ -38,15 +40,124 @@ static lumpinfo_t miptex[MAX_MAP_TEXTURES];
 static int      nTexLumps = 0;
 static lumpinfo_t* lumpinfo = NULL;
 static int      nTexFiles = 0;
-static FILE*    texfiles[MAX_TEXFILES];
+static byte*    texfiles[MAX_TEXFILES];                    // the wads are mapped into memory
+static size_t   texfilesizes[MAX_TEXFILES];
 static wadpath_t* texwadpathes[MAX_TEXFILES]; // maps index of the wad to its path
 
+// lumpinfo hashed on the name, which CleanupName has made upper case
+#define LUMPHASH_SIZE 16384                                // must be a power of 2
+static int      s_lumphash[LUMPHASH_SIZE];                 // first lump + 1 in each bucket, 0 if empty
+static int*     s_lumphashnext = NULL;                     // next lump + 1 in the same bucket
+
 // The old buggy code in effect limit the number of brush sides to MAX_MAP_BRUSHES
 
 static char *texmap[MAX_INTERNAL_MAP_TEXINFO];
 
 static int numtexmap = 0;
 
+// =====================================================================================
+//  Miptex and texinfo index
+//      Both lists are hashed so that FindMiptex and TexinfoForBrushTexture only compare the
+//      few entries that share a bucket. Entries are only added under ThreadLock() and
+//      published with a release store, so looking them up needs no lock. Each key is stored
+//      once, so a lookup finds the same entry the old linear search did.
+// =====================================================================================
+#define MIPTEXHASH_SIZE 8192                               // must be a power of 2
+#define TEXINFOHASH_SIZE 65536                             // must be a power of 2
+#define TEXINFOHASH_VEC_CELL (1.0 / 1024.0)                // the vecs are compared exactly, the cell only has to give equal values equal hashes
+
+static std::atomic<int> s_miptexhash[MIPTEXHASH_SIZE];     // first miptex + 1 in each bucket, 0 if empty
+static int      s_miptexhashnext[MAX_MAP_TEXTURES];        // next miptex + 1 in the same bucket
+static std::atomic<int> s_numhashedmiptex(0);
+
+static std::atomic<int> s_texinfohash[TEXINFOHASH_SIZE];   // first texinfo + 1 in each bucket, 0 if empty
+static int      s_texinfohashnext[MAX_INTERNAL_MAP_TEXINFO]; // next texinfo + 1 in the same bucket
+static std::atomic<int> s_numhashedtexinfo(0);
+
+static unsigned NameHash(const char* name)
+{
+	unsigned h = 2166136261u;
+	for (; *name; name++)
+	{
+		h = (h ^ (unsigned char)*name) * 16777619u;
+	}
+	return h;
+}
+
+static unsigned TexinfoHash(const char* const name, const texinfo_t* const tx)
+{
+	unsigned h = NameHash (name) ^ (unsigned)tx->flags * 2654435761u;
+	for (int j = 0; j < 2; j++)
+	{
+		for (int k = 0; k < 4; k++)
+		{
+			h = (h ^ (unsigned)(int)floor (tx->vecs[j][k] / TEXINFOHASH_VEC_CELL)) * 16777619u;
+		}
+	}
+	return h & (TEXINFOHASH_SIZE - 1);
+}
+
+static void AddMiptexToHash(const int index)
+{
+	unsigned h = NameHash (miptex[index].name) & (MIPTEXHASH_SIZE - 1);
+
+	s_miptexhashnext[index] = s_miptexhash[h].load (std::memory_order_relaxed);
+	s_miptexhash[h].store (index + 1, std::memory_order_release);
+}
+
+// after miptex has been sorted
+static void RehashMiptex()
+{
+	for (int h = 0; h < MIPTEXHASH_SIZE; h++)
+	{
+		s_miptexhash[h].store (0, std::memory_order_relaxed);
+	}
+	for (int i = 0; i < nummiptex; i++)
+	{
+		AddMiptexToHash (i);
+	}
+	s_numhashedmiptex.store (nummiptex, std::memory_order_release);
+}
+
+static void HashLumps()
+{
+	s_lumphashnext = (int *)realloc (s_lumphashnext, nTexLumps * sizeof (int));
+	hlassume (nTexLumps == 0 || s_lumphashnext != NULL, assume_NoMemory);
+	memset (s_lumphash, 0, sizeof (s_lumphash));
+	// from the last one, so that the lumps of each bucket stay in the order of the wads
+	for (int i = nTexLumps - 1; i >= 0; i--)
+	{
+		unsigned h = NameHash (lumpinfo[i].name) & (LUMPHASH_SIZE - 1);
+		s_lumphashnext[i] = s_lumphash[h];
+		s_lumphash[h] = i + 1;
+	}
+}
+
+// the first lump with this name, -1 if there is none
+static int FindLump(const char* const name)
+{
+	for (int i = s_lumphash[NameHash (name) & (LUMPHASH_SIZE - 1)]; i; i = s_lumphashnext[i - 1])
+	{
+		if (!strcmp (name, lumpinfo[i - 1].name))
+		{
+			return i - 1;
+		}
+	}
+	return -1;
+}
+
+static int NextLump(const int lump)
+{
+	for (int i = s_lumphashnext[lump]; i; i = s_lumphashnext[i - 1])
+	{
+		if (!strcmp (lumpinfo[lump].name, lumpinfo[i - 1].name))
+		{
+			return i - 1;
+		}
+	}
+	return -1;
+}
+
 static int texmap_store (char *texname, bool shouldlock = true)
 	// This function should never be called unless a new entry in g_texinfo is being allocated.
 {
@@ -128,14 +239,6 @@ static int CDECL lump_sorter_by_wad_and_name(const void* lump1, const void* lump
     }
 }
 
-static int CDECL lump_sorter_by_name(const void* lump1, const void* lump2)
-{
-    lumpinfo_t*     plump1 = (lumpinfo_t*)lump1;
-    lumpinfo_t*     plump2 = (lumpinfo_t*)lump2;
-
-    return strcmp(plump1->name, plump2->name);
-}
-
 // =====================================================================================
 //  FindMiptex
 //      Find and allocate a texture into the lump data
@@ -143,28 +246,44 @@ static int CDECL lump_sorter_by_name(const void* lump1, const void* lump2)
 static int      FindMiptex(const char* const name)
 {
     int             i;
+    int             count;
+    const unsigned  h = NameHash (name) & (MIPTEXHASH_SIZE - 1);
 	if (strlen (name) >= MAXWADNAME)
 	{
 		Error ("Texture name is too long (%s)\n", name);
 	}
 
-    ThreadLock();
-    for (i = 0; i < nummiptex; i++)
+find_miptex:
+    count = s_numhashedmiptex.load(std::memory_order_acquire);
+    for (i = s_miptexhash[h].load(std::memory_order_acquire); i; i = s_miptexhashnext[i - 1])
     {
-        if (!strcmp(name, miptex[i].name))
+        if (!strcmp(name, miptex[i - 1].name))
         {
-            ThreadUnlock();
-            return i;
+            return i - 1;
         }
     }
 
+    ThreadLock();
+    if (count != nummiptex) // another thread may have added it
+    {
+        ThreadUnlock();
+        goto find_miptex;
+    }
     hlassume(nummiptex < MAX_MAP_TEXTURES, assume_MAX_MAP_TEXTURES);
+    i = nummiptex;
     safe_strncpy(miptex[i].name, name, MAXWADNAME);
+    AddMiptexToHash(i);
     nummiptex++;
+    s_numhashedmiptex.store(nummiptex, std::memory_order_release);
     ThreadUnlock();
     return i;
 }
 
+static void     MapTexFile(const char* const path)
+{
+    texfiles[nTexFiles] = (byte*)MapFileRead(path, &texfilesizes[nTexFiles]);
+}
+
 // =====================================================================================
 //  TEX_InitFromWad
 // =====================================================================================
@@ -200,7 +319,7 @@ bool            TEX_InitFromWad()
     // for eachwadpath
     for (i = 0; i < g_iNumWadPaths; i++)
     {
-        FILE*           texfile;                           // temporary used in this loop
+        const byte*     texfile;                           // temporary used in this loop
 
         currentwad = g_pWadPaths[i];
         pszWadFile = currentwad->path;
@@ -208,7 +327,7 @@ bool            TEX_InitFromWad()
 
 
 		texwadpathes[nTexFiles] = currentwad;
-        texfiles[nTexFiles] = fopen(pszWadFile, "rb");
+        MapTexFile(pszWadFile);
 
         #ifdef SYSTEM_WIN32
         if (!texfiles[nTexFiles])
@@ -217,7 +336,7 @@ bool            TEX_InitFromWad()
             if (pszWadFile[1] == ':')
             {
                 pszWadFile += 2;                           // skip past the drive
-                texfiles[nTexFiles] = fopen(pszWadFile, "rb");
+                MapTexFile(pszWadFile);
             }
         }
         #endif
@@ -235,14 +354,14 @@ bool            TEX_InitFromWad()
 
             // szSubdir will have a trailing separator
             safe_snprintf(szTmp, _MAX_PATH, "%s" SYSTEM_SLASH_STR "%s%s", pszWadroot, szSubdir, szFile);
-            texfiles[nTexFiles] = fopen(szTmp, "rb");
+            MapTexFile(szTmp);
 
             #ifdef SYSTEM_POSIX
             if (!texfiles[nTexFiles])
             {
                 // if we cant find it, Convert to lower case and try again
                 strlwr(szTmp);
-                texfiles[nTexFiles] = fopen(szTmp, "rb");
+                MapTexFile(szTmp);
             }
             #endif
         }
@@ -255,7 +374,7 @@ bool            TEX_InitFromWad()
 			for (l = 'C'; l <= 'Z'; ++l)
 			{
 				safe_snprintf (tmp, _MAX_PATH, "%c:%s", l, pszWadFile);
-				texfiles[nTexFiles] = fopen (tmp, "rb");
+				MapTexFile(tmp);
 				if (texfiles[nTexFiles])
 				{
 					Developer (DEVELOPER_LEVEL_MESSAGE, "wad file found in drive '%c:' : %s\n", l, pszWadFile);
@@ -279,7 +398,12 @@ bool            TEX_InitFromWad()
         texfile = texfiles[nTexFiles];
 
         // read in this wadfiles information
-        SafeRead(texfile, &wadinfo, sizeof(wadinfo));
+        if (texfilesizes[nTexFiles] < sizeof(wadinfo))
+        {
+            Log(" - ");
+            Error("%s isn't a Wadfile!", pszWadFile);
+        }
+        memcpy(&wadinfo, texfile, sizeof(wadinfo));
 
         // make sure its a valid format
         if (strncmp(wadinfo.identification, "WAD2", 4) && strncmp(wadinfo.identification, "WAD3", 4))
@@ -291,17 +415,22 @@ bool            TEX_InitFromWad()
         wadinfo.numlumps        = LittleLong(wadinfo.numlumps);
         wadinfo.infotableofs    = LittleLong(wadinfo.infotableofs);
 
-        // read in lump
-        if (fseek(texfile, wadinfo.infotableofs, SEEK_SET))
-            Warning("fseek to %d in wadfile %s failed\n", wadinfo.infotableofs, pszWadFile);
+        // the lump directory is read straight from the mapping
+        if (wadinfo.numlumps < 0 || wadinfo.infotableofs < 0
+            || (size_t)wadinfo.infotableofs + (size_t)wadinfo.numlumps * (sizeof(lumpinfo_t) - sizeof(int)) > texfilesizes[nTexFiles])
+        {
+            Log(" - ");
+            Error("Invalid wad file '%s'.", pszWadFile);
+        }
 
         // memalloc for this lump
         lumpinfo = (lumpinfo_t*)realloc(lumpinfo, (nTexLumps + wadinfo.numlumps) * sizeof(lumpinfo_t));
+        hlassume(nTexLumps + wadinfo.numlumps == 0 || lumpinfo != NULL, assume_NoMemory);
 
         // for each texlump
         for (j = 0; j < wadinfo.numlumps; j++, nTexLumps++)
         {
-            SafeRead(texfile, &lumpinfo[nTexLumps], (sizeof(lumpinfo_t) - sizeof(int)) );  // iTexFile is NOT read from file
+            memcpy(&lumpinfo[nTexLumps], texfile + wadinfo.infotableofs + j * (sizeof(lumpinfo_t) - sizeof(int)), (sizeof(lumpinfo_t) - sizeof(int)) );  // iTexFile is NOT read from file
 
             if (!TerminatedString(lumpinfo[nTexLumps].name, MAXWADNAME))
             {
@@ -336,8 +465,7 @@ bool            TEX_InitFromWad()
     //Log("num of used textures: %i\n", g_numUsedTextures);
 
 
-    // sort texlumps in memory by name
-    qsort((void*)lumpinfo, (size_t) nTexLumps, sizeof(lumpinfo[0]), lump_sorter_by_name);
+    HashLumps();
 
     CheckFatal();
     return true;
@@ -351,9 +479,10 @@ lumpinfo_t*     FindTexture(const lumpinfo_t* const source)
     //Log("** PnFNFUNC: FindTexture\n");
 
     lumpinfo_t*     found = NULL;
+    int             lump;
 
-    found = (lumpinfo_t*)bsearch(source, (void*)lumpinfo, (size_t) nTexLumps, sizeof(lumpinfo[0]), lump_sorter_by_name);
-    if (!found)
+    lump = FindLump(source->name);
+    if (lump == -1)
     {
         Warning("::FindTexture() texture %s not found!", source->name);
         if (!strcmp(source->name, "NULL")
@@ -363,24 +492,13 @@ lumpinfo_t*     FindTexture(const lumpinfo_t* const source)
             Log("Are you sure you included zhlt.wad in your wadpath list?\n");
         }
     }
-
-	if (found)
+	else
 	{
-		// get the first and last matching lump
-		lumpinfo_t *first = found;
-		lumpinfo_t *last = found;
-		while (first - 1 >= lumpinfo && lump_sorter_by_name (first - 1, source) == 0)
-		{
-			first = first - 1;
-		}
-		while (last + 1 < lumpinfo + nTexLumps && lump_sorter_by_name (last + 1, source) == 0)
-		{
-			last = last + 1;
-		}
 		// find the best matching lump
 		lumpinfo_t *best = NULL;
-		for (found = first; found < last + 1; found++)
+		for (; lump != -1; lump = NextLump (lump))
 		{
+			found = &lumpinfo[lump];
 			bool better = false;
 			if (best == NULL)
 			{
@@ -429,9 +547,11 @@ int             LoadLump(const lumpinfo_t* const source, byte* dest, int* texsiz
     *texsize = 0;
     if (source->filepos)
     {
-        if (fseek(texfiles[source->iTexFile], source->filepos, SEEK_SET))
+        const byte* texfile = texfiles[source->iTexFile];
+        if (source->filepos < 0 || source->disksize < 0
+            || (size_t)source->filepos + (size_t)qmax(source->disksize, (int)sizeof(miptex_t)) > texfilesizes[source->iTexFile])
         {
-            Warning("fseek to %d failed\n", source->filepos);
+            Warning("texture %s lies outside its wad file\n", source->name);
 			Error ("File read failure");
         }
         *texsize = source->disksize;
@@ -443,15 +563,13 @@ int             LoadLump(const lumpinfo_t* const source, byte* dest, int* texsiz
             int             i;
             miptex_t*       miptex = (miptex_t*)dest;
 			hlassume ((int)sizeof (miptex_t) <= dest_maxsize, assume_MAX_MAP_MIPTEX);
-            SafeRead(texfiles[source->iTexFile], dest, sizeof(miptex_t));
+            memcpy(dest, texfile + source->filepos, sizeof(miptex_t));
 
             for (i = 0; i < MIPLEVELS; i++)
                 miptex->offsets[i] = 0;
 			writewad_data = (byte *)malloc (source->disksize);
 			hlassume (writewad_data != NULL, assume_NoMemory);
-			if (fseek (texfiles[source->iTexFile], source->filepos, SEEK_SET))
-				Error ("File read failure");
-			SafeRead (texfiles[source->iTexFile], writewad_data, source->disksize);
+			memcpy (writewad_data, texfile + source->filepos, source->disksize);
 			writewad_datasize = source->disksize;
             return sizeof(miptex_t);
         }
@@ -460,7 +578,7 @@ int             LoadLump(const lumpinfo_t* const source, byte* dest, int* texsiz
 			Developer(DEVELOPER_LEVEL_MESSAGE,"Including texture %s\n",source->name);
             // Load the entire texture here so the BSP contains the texture
 			hlassume (source->disksize <= dest_maxsize, assume_MAX_MAP_MIPTEX);
-            SafeRead(texfiles[source->iTexFile], dest, source->disksize);
+            memcpy(dest, texfile + source->filepos, source->disksize);
             return source->disksize;
         }
     }
@@ -475,7 +593,7 @@ int             LoadLump(const lumpinfo_t* const source, byte* dest, int* texsiz
 void            AddAnimatingTextures()
 {
     int             base;
-    int             i, j, k;
+    int             i, j;
     char            name[MAXWADNAME];
 
     base = nummiptex;
@@ -501,13 +619,9 @@ void            AddAnimatingTextures()
             }
 
             // see if this name exists in the wadfile
-            for (k = 0; k < nTexLumps; k++)
+            if (FindLump(name) != -1)
             {
-                if (!strcmp(name, lumpinfo[k].name))
-                {
-                    FindMiptex(name);                      // add to the miptex list
-                    break;
-                }
+                FindMiptex(name);                          // add to the miptex list
             }
         }
     }
@@ -616,6 +730,7 @@ void            WriteMiptex()
 
         // Sort them FIRST by wadfile and THEN by name for most efficient loading in the engine.
         qsort((void*)miptex, (size_t) nummiptex, sizeof(miptex[0]), lump_sorter_by_wad_and_name);
+        RehashMiptex();
 
         // Sleazy Hack 104 Pt 2 - After sorting the miptex array, reset the texinfos to point to the right miptexs
         for (i = 0; i < g_numtexinfo; i++, tx++)
@@ -711,6 +826,13 @@ void            WriteMiptex()
 			Error ("File write failure");
     }
     end = I_FloatTime();
+
+    // everything has been copied out of the wads
+    for (int i = 0; i < nTexFiles; i++)
+    {
+        UnmapFile(texfiles[i], texfilesizes[i]);
+        texfiles[i] = NULL;
+    }
     Log("Texture usage is at %1.2f mb (of %1.2f mb MAX)\n", (float)totaltexsize / (1024 * 1024),
         (float)g_max_map_miptex / (1024 * 1024));
     Verbose("LoadLump() elapsed time = %ldms\n", (long)(end - start));
@@ -731,6 +853,8 @@ int             TexinfoForBrushTexture(const plane_t* const plane, brush_texture
     texinfo_t       tx;
     texinfo_t*      tc;
     int             i, j, k;
+    int             count;
+    unsigned        h;
 
 	if (!strncasecmp(bt->name, "NULL", 4))
 	{
@@ -873,10 +997,12 @@ int             TexinfoForBrushTexture(const plane_t* const plane, brush_texture
     //
     // find the g_texinfo
     //
-    ThreadLock();
-    tc = g_texinfo;
-    for (i = 0; i < g_numtexinfo; i++, tc++)
+    h = TexinfoHash (bt->name, &tx);
+find_texinfo:
+    count = s_numhashedtexinfo.load(std::memory_order_acquire);
+    for (i = s_texinfohash[h].load(std::memory_order_acquire); i; i = s_texinfohashnext[i - 1])
     {
+        tc = &g_texinfo[i - 1];
         // Sleazy hack 104, Pt 3 - Use strcmp on names to avoid dups
 		if (strcmp (texmap_retrieve (tc->miptex), bt->name) != 0)
         {
@@ -896,16 +1022,26 @@ int             TexinfoForBrushTexture(const plane_t* const plane, brush_texture
                 }
             }
         }
-        ThreadUnlock();
-        return i;
+        return i - 1;
 skip:;
     }
 
+    ThreadLock();
+    if (count != g_numtexinfo) // another thread may have added it
+    {
+        ThreadUnlock();
+        goto find_texinfo;
+    }
     hlassume(g_numtexinfo < MAX_INTERNAL_MAP_TEXINFO, assume_MAX_MAP_TEXINFO);
 
+    i = g_numtexinfo;
+    tc = &g_texinfo[i];
     *tc = tx;
 	tc->miptex = texmap_store (bt->name, false);
+    s_texinfohashnext[i] = s_texinfohash[h].load(std::memory_order_relaxed);
+    s_texinfohash[h].store(i + 1, std::memory_order_release);
     g_numtexinfo++;
+    s_numhashedtexinfo.store(g_numtexinfo, std::memory_order_release);
     ThreadUnlock();
     return i;
 }
@@ -64,7 +64,7 @@ void LoadWadconfig (const char *filename, const char *configname)
 	{
 		Error ("Found more than one wad configuration for '%s' in file '%s'.\n", configname, filename);
 	}
-	free (buffer); // should not be freed because it is still being used as script buffer
+	Free (buffer); // should not be freed because it is still being used as script buffer
 	//Log ("Using custom wadfile configuration: '%s' (with %i wad%s)\n", configname, count, count > 1 ? "s" : "");
 }
 void LoadWadcfgfile (const char *filename)
@@ -96,6 +96,6 @@ void LoadWadcfgfile (const char *filename)
 		count++;
 		PushWadPath (g_token, !include);
 	}
-	free (buffer); // should not be freed because it is still being used as script buffer
+	Free (buffer); // should not be freed because it is still being used as script buffer
 	//Log ("Using custom wadfile configuration: '%s' (with %i wad%s)\n", filename, count, count > 1 ? "s" : "");
 }
@@ -144,6 +144,37 @@ inline void float_decompress
 	}
 }
 
+// Decompresses count values stored one after another, with the type switch out of the loop
+inline void float_decompress_block
+	(float_type t, const void *s, float *f, unsigned int count)
+{
+	const unsigned char *m = (const unsigned char *)s;
+	unsigned int *p = (unsigned int *)f;
+	unsigned int i;
+	switch (t)
+	{
+	case FLOAT32:
+		memcpy (p, m, count * sizeof (unsigned int));
+		break;
+	case FLOAT16:
+		for (i = 0; i < count; i++)
+		{
+			unsigned int h = m[2 * i] | (m[2 * i + 1] << 8);
+			p[i] = h == 0? 0: bitput (1, 11, 12) | bitput (h, 12, 28) | bitput (3, 28, 32);
+		}
+		break;
+	case FLOAT8:
+		for (i = 0; i < count; i++)
+		{
+			unsigned int h = m[i];
+			p[i] = h == 0? 0: bitput (1, 19, 20) | bitput (h, 20, 28) | bitput (3, 28, 32);
+		}
+		break;
+	default:
+		;
+	}
+}
+
 inline void vector_compress
 	(vector_type t, void *s, const float *f1, const float *f2, const float *f3)
 {
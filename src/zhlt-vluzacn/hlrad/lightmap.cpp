@@ -1605,6 +1605,373 @@ static facelight_t facelight[MAX_MAP_FACES];
 static int      numdlights;
 
 
+// =====================================================================================
+//  Sky cache
+//      With -skycache, the samples of a face every g_skycache lightmap pixels (and on its
+//      last row and column) are gathered first, and remember which of the sun and sky
+//      directions they saw the sky through. Any other sample takes a direction as settled
+//      when the four coarse samples around it agree on it, and only traces the others. An
+//      occluder small enough to fit between the coarse samples can be missed; that is the
+//      tolerance the option trades for speed.
+//      The sun normals of each light_environment have their own directions starting at
+//      skycacheslot, and the sky normals come after all of them.
+// =====================================================================================
+#define SKYCACHE_UNKNOWN	0                              // not traced, or the sample faces away from it
+#define SKYCACHE_OPEN		1
+#define SKYCACHE_BLOCKED	2
+
+typedef struct
+{
+	int				spacing;                               // between two coarse samples, in samples
+	int				width;                                 // of the lightmap cache
+	int				height;
+	int				numcols;                               // coarse samples
+	int				numrows;
+	unsigned char*	state;                                 // SKYCACHE_ of each coarse sample and direction
+	vec_t*			hitdist;                               // how far the sky is along an open direction
+	int				coarse;                                // the coarse sample being gathered, or -1
+	int				corners[4];                            // otherwise, the coarse samples around the sample being gathered
+}
+skycache_t;
+
+static int      s_numskycachedirections = 0;
+static int      s_skycacheskyslot = 0;                     // the direction of the first sky normal
+
+// results of the sky traces in GatherSampleLight, one row of g_numskynormals per thread
+static int*     s_skycontents = NULL;
+static vec3_t*  s_skyhits = NULL;
+
+// the coarse column or row of a sample, -1 if it is between two of them
+static int      SkyCacheCoarse(const int x, const int size, const int spacing, const int numcoarse)
+{
+	if (x == size - 1)
+	{
+		return numcoarse - 1;
+	}
+	return x % spacing == 0? x / spacing: -1;
+}
+
+// =====================================================================================
+//  SkyCacheSelect
+//      Prepares the cache for sample i of the lightmap cache and returns whether it is a
+//      coarse sample.
+// =====================================================================================
+static bool     SkyCacheSelect(skycache_t* const cache, const int i)
+{
+	const int x = i % cache->width;
+	const int y = i / cache->width;
+	const int col = SkyCacheCoarse (x, cache->width, cache->spacing, cache->numcols);
+	const int row = SkyCacheCoarse (y, cache->height, cache->spacing, cache->numrows);
+
+	if (col != -1 && row != -1)
+	{
+		cache->coarse = col + cache->numcols * row;
+		return true;
+	}
+	const int col0 = x / cache->spacing;
+	const int row0 = y / cache->spacing;
+	const int col1 = qmin (col0 + 1, cache->numcols - 1);
+	const int row1 = qmin (row0 + 1, cache->numrows - 1);
+	cache->coarse = -1;
+	cache->corners[0] = col0 + cache->numcols * row0;
+	cache->corners[1] = col1 + cache->numcols * row0;
+	cache->corners[2] = col0 + cache->numcols * row1;
+	cache->corners[3] = col1 + cache->numcols * row1;
+	return false;
+}
+
+// remembers a trace of the coarse sample being gathered
+static void     SkyCacheRecord(skycache_t* const cache, const int slot, const vec3_t pos, const int contents, const vec3_t skyhit)
+{
+	vec3_t			delta;
+
+	if (cache->coarse == -1)
+	{
+		return;
+	}
+	const int n = cache->coarse * s_numskycachedirections + slot;
+	if (contents == CONTENTS_SKY)
+	{
+		VectorSubtract (skyhit, pos, delta);
+		cache->state[n] = SKYCACHE_OPEN;
+		cache->hitdist[n] = VectorLength (delta);
+	}
+	else
+	{
+		cache->state[n] = SKYCACHE_BLOCKED;
+	}
+}
+
+// fills in the contents and sky hit of a ray toward the sky if the coarse samples around agree on it
+static bool     SkyCacheSettle(const skycache_t* const cache, const int slot, const vec3_t pos, const vec3_t direction, int* contents, vec3_t skyhit)
+{
+	int				state;
+	vec_t			hitdist = 0;
+
+	if (cache->coarse != -1)
+	{
+		return false;
+	}
+	state = cache->state[cache->corners[0] * s_numskycachedirections + slot];
+	if (state == SKYCACHE_UNKNOWN)
+	{
+		return false;
+	}
+	for (int k = 0; k < 4; k++)
+	{
+		const int n = cache->corners[k] * s_numskycachedirections + slot;
+		if (cache->state[n] != state)
+		{
+			return false;
+		}
+		if (state == SKYCACHE_OPEN)
+		{
+			hitdist = qmax (hitdist, cache->hitdist[n]);
+		}
+	}
+	if (state == SKYCACHE_OPEN)
+	{
+		*contents = CONTENTS_SKY;
+		VectorMA (pos, -hitdist, direction, skyhit);
+	}
+	else
+	{
+		*contents = CONTENTS_SOLID;
+	}
+	return true;
+}
+
+// TestLinePacket for the rays that are not settled, the others keep their contents and sky hit
+static void     TestSkyPacket(const int numrays, const vec3_t* starts, const vec3_t* stops, int* contents, vec3_t* skyhits, const bool* settled)
+{
+	vec3_t			tracestarts[TESTLINE_PACKET];
+	vec3_t			tracestops[TESTLINE_PACKET];
+	vec3_t			traceskyhits[TESTLINE_PACKET];
+	int				tracecontents[TESTLINE_PACKET];
+	int				traced[TESTLINE_PACKET];
+	int				numtraced = 0;
+
+	for (int k = 0; k < numrays; k++)
+	{
+		if (!settled[k])
+		{
+			traced[numtraced] = k;
+			VectorCopy (starts[k], tracestarts[numtraced]);
+			VectorCopy (stops[k], tracestops[numtraced]);
+			VectorCopy (skyhits[k], traceskyhits[numtraced]);
+			numtraced++;
+		}
+	}
+	if (numtraced == numrays)
+	{
+		TestLinePacket (numrays, starts, stops, contents, skyhits);
+		return;
+	}
+	TestLinePacket (numtraced, tracestarts, tracestops, tracecontents, traceskyhits);
+	for (int k = 0; k < numtraced; k++)
+	{
+		contents[traced[k]] = tracecontents[k];
+		VectorCopy (traceskyhits[k], skyhits[traced[k]]);
+	}
+}
+
+// =====================================================================================
+//  Leaf light lists
+//      For every group of leaves with the same visofs, the lights that a point in any of
+//      them can get light from, in the order GatherSampleLight used to find them in
+//      directlights. The lights of step 0 (samples) and step 1 (patches) are listed apart.
+//      A light is only left out when GatherSampleLight would skip it anywhere in the
+//      group: it is outside the PVS, has no intensity, belongs to the other step, is a
+//      spotlight whose cone misses the bounds of the group or is a texlight that the
+//      whole group is behind. Without vis data all leaves are in one group.
+// =====================================================================================
+#define LEAFLIGHTS_BOUNDS_PADDING 8.0                      // dleaf_t bounds are truncated to integers
+#define LEAFLIGHTS_BOUNDS_CLAMP 32767                      // hlbsp clamps dleaf_t bounds to this
+
+typedef struct
+{
+	directlight_t**	lights;                                // the lights of step 0, then the lights of step 1
+	int				numlights[2];
+	int				visofs;                                // -1 for no PVS, or any value without vis data
+	vec3_t			mins;                                  // bounds of all leaves in the group
+	vec3_t			maxs;
+	bool			cullbounds;                            // false if a leaf has bounds clamped by hlbsp
+}
+leaflights_t;
+
+static leaflights_t* s_leaflights = NULL;
+static int      s_numleaflights = 0;
+static int      s_leaflightsnum[MAX_MAP_LEAFS];            // index into s_leaflights for each leaf
+
+static bool     LightMissesBounds(const directlight_t* const dl, const vec3_t mins, const vec3_t maxs)
+{
+	switch (dl->type)
+	{
+	case emit_spotlight:
+		{
+			// every point of the bounding sphere of the leaf is outside the cone
+			vec3_t center;
+			vec3_t v;
+			vec_t radius;
+			vec_t dist;
+			vec_t angle;
+
+			VectorAdd (mins, maxs, center);
+			VectorScale (center, 0.5, center);
+			VectorSubtract (maxs, center, v);
+			radius = VectorLength (v);
+			VectorSubtract (center, dl->origin, v);
+			dist = VectorLength (v);
+			if (dist <= radius + 1.0)
+			{
+				return false;
+			}
+			angle = acos (qmax (-1.0, qmin (DotProduct (v, dl->normal) / dist, 1.0)));
+			return angle - asin (radius / dist) > acos (qmax (-1.0, qmin ((vec_t)dl->stopdot2, 1.0))) + 0.01;
+		}
+	case emit_surface:
+		{
+			// every point of the leaf is behind the texlight
+			vec_t front = PATCH_HUNT_OFFSET - DotProduct (dl->origin, dl->normal);
+			for (int k = 0; k < 3; k++)
+			{
+				front += dl->normal[k] * (dl->normal[k] > 0? maxs[k]: mins[k]);
+			}
+			return front < -ON_EPSILON;
+		}
+	default:
+		return false;
+	}
+}
+
+static int      LeafVisofs(const int leafnum)
+{
+	return g_visdatasize? g_dleafs[leafnum].visofs: 0;
+}
+
+static int CDECL CompareLeafVisofs(const void* a, const void* b)
+{
+	const int visofs1 = LeafVisofs(*(const int*)a);
+	const int visofs2 = LeafVisofs(*(const int*)b);
+
+	if (visofs1 != visofs2)
+	{
+		return visofs1 < visofs2? -1: 1;
+	}
+	return *(const int*)a - *(const int*)b;
+}
+
+// =====================================================================================
+//  GroupLeafLights
+//      Leaves that share a vis row share a light list, whose bounds cover all of them
+// =====================================================================================
+static void     GroupLeafLights()
+{
+	int *order = (int *)malloc (g_numleafs * sizeof (int));
+	hlassume (order != NULL, assume_NoMemory);
+	for (int i = 0; i < g_numleafs; i++)
+	{
+		order[i] = i;
+	}
+	qsort (order, g_numleafs, sizeof (int), CompareLeafVisofs);
+
+	s_leaflights = (leaflights_t *)calloc (qmax (g_numleafs, 1), sizeof (leaflights_t));
+	hlassume (s_leaflights != NULL, assume_NoMemory);
+	s_numleaflights = 0;
+	for (int i = 0; i < g_numleafs; i++)
+	{
+		const dleaf_t *leaf = &g_dleafs[order[i]];
+		leaflights_t *ll;
+
+		if (i == 0 || LeafVisofs (order[i]) != s_leaflights[s_numleaflights - 1].visofs)
+		{
+			ll = &s_leaflights[s_numleaflights++];
+			ll->visofs = LeafVisofs (order[i]);
+			VectorFill (ll->mins, BOGUS_RANGE);
+			VectorFill (ll->maxs, -BOGUS_RANGE);
+			ll->cullbounds = true;
+		}
+		else
+		{
+			ll = &s_leaflights[s_numleaflights - 1];
+		}
+		for (int k = 0; k < 3; k++)
+		{
+			ll->mins[k] = qmin (ll->mins[k], (vec_t)leaf->mins[k] - LEAFLIGHTS_BOUNDS_PADDING);
+			ll->maxs[k] = qmax (ll->maxs[k], (vec_t)leaf->maxs[k] + LEAFLIGHTS_BOUNDS_PADDING);
+			if (leaf->mins[k] <= -LEAFLIGHTS_BOUNDS_CLAMP || leaf->maxs[k] >= LEAFLIGHTS_BOUNDS_CLAMP)
+			{
+				ll->cullbounds = false;                    // the leaf may reach further than its bounds say
+			}
+		}
+		s_leaflightsnum[order[i]] = s_numleaflights - 1;
+	}
+	free (order);
+}
+
+static void     BuildLeafLights(int groupnum)
+{
+	byte pvs[(MAX_MAP_LEAFS + 7) / 8];
+	leaflights_t *ll = &s_leaflights[groupnum];
+	directlight_t *dl;
+	int count;
+
+	if (!g_visdatasize)
+	{
+		memset (pvs, 255, (g_dmodels[0].visleafs + 7) / 8);
+	}
+	else if (ll->visofs == -1)
+	{
+		memset (pvs, 0, (g_dmodels[0].visleafs + 7) / 8);
+	}
+	else
+	{
+		DecompressVis (&g_dvisdata[ll->visofs], pvs, sizeof (pvs));
+	}
+
+	// count first, then fill
+	for (int pass = 0; pass < 2; pass++)
+	{
+		count = 0;
+		for (int step = 0; step < 2; step++)
+		{
+			for (int i = 0; i < 1 + g_dmodels[0].visleafs; i++)
+			{
+				if (!(i == 0? g_sky_lighting_fix: pvs[(i - 1) >> 3] & (1 << ((i - 1) & 7))))
+				{
+					continue;
+				}
+				for (dl = directlights[i]; dl; dl = dl->next)
+				{
+					// skylights have parts in both steps
+					if (dl->type != emit_skylight)
+					{
+						if ((int)dl->topatch != step || VectorCompare (dl->intensity, vec3_origin)
+							|| (ll->cullbounds && LightMissesBounds (dl, ll->mins, ll->maxs)))
+						{
+							continue;
+						}
+					}
+					if (pass == 1)
+					{
+						ll->lights[count] = dl;
+					}
+					count++;
+				}
+			}
+			if (pass == 0)
+			{
+				ll->numlights[step] = count - (step? ll->numlights[0]: 0);
+			}
+		}
+		if (pass == 0)
+		{
+			ll->lights = (directlight_t **)malloc ((count + 1) * sizeof (directlight_t *));
+			hlassume (ll->lights != NULL, assume_NoMemory);
+		}
+	}
+}
+
 // =====================================================================================
 //  CreateDirectLights
 // =====================================================================================
@@ -2249,6 +2616,50 @@ void            CreateDirectLights()
 			Warning ("More than one light_environments are in use. Add entity info_sunlight to clarify the sunlight's brightness for in-game model(.mdl) rendering.");
 		}
 	}
+
+	// directions of the sky caches: the sun normals of each light_environment, then the sky normals
+	{
+		bool skylights = false;
+		s_numskycachedirections = 0;
+		for (int l = 0; l < 1 + g_dmodels[0].visleafs; l++)
+		{
+			for (dl = directlights[l]; dl; dl = dl->next)
+			{
+				if (dl->type == emit_skylight)
+				{
+					dl->skycacheslot = s_numskycachedirections;
+					s_numskycachedirections += dl->numsunnormals;
+					skylights = true;
+				}
+			}
+		}
+		s_skycacheskyslot = s_numskycachedirections;
+		if (skylights)
+		{
+			const int numskynormals = g_numskynormals[g_softsky? SKYLEVEL_SOFTSKYON: SKYLEVEL_SOFTSKYOFF];
+			s_numskycachedirections += numskynormals;
+			s_skycontents = (int *)malloc (g_numthreads * numskynormals * sizeof (int));
+			s_skyhits = (vec3_t *)malloc (g_numthreads * numskynormals * sizeof (vec3_t));
+			hlassume (s_skycontents != NULL && s_skyhits != NULL, assume_NoMemory);
+		}
+	}
+
+	GroupLeafLights ();
+	NamedRunThreadsOnIndividual (s_numleaflights, g_estimate, BuildLeafLights);
+	{
+		long long total = 0;
+		long long stored = 0;
+		for (int l = 0; l < g_numleafs; l++)
+		{
+			total += s_leaflights[s_leaflightsnum[l]].numlights[0] + s_leaflights[s_leaflightsnum[l]].numlights[1];
+		}
+		for (int l = 0; l < s_numleaflights; l++)
+		{
+			stored += s_leaflights[l].numlights[0] + s_leaflights[l].numlights[1];
+		}
+		Verbose ("%.1f lights per leaf after culling, %d light lists of %lld lights in total\n",
+			g_numleafs? (double)total / g_numleafs: 0.0, s_numleaflights, stored);
+	}
 }
 
 // =====================================================================================
@@ -2259,6 +2670,18 @@ void            DeleteDirectLights()
     int             l;
     directlight_t*  dl;
 
+	for (l = 0; l < s_numleaflights; l++)
+	{
+		free (s_leaflights[l].lights);
+	}
+	free (s_leaflights);
+	s_leaflights = NULL;
+	s_numleaflights = 0;
+	free (s_skycontents);
+	s_skycontents = NULL;
+	free (s_skyhits);
+	s_skyhits = NULL;
+
 	for (l = 0; l < 1 + g_dmodels[0].visleafs; l++)
     {
         dl = directlights[l];
@@ -2283,9 +2706,19 @@ void            DeleteDirectLights()
 int		g_numskynormals[SKYLEVELMAX+1];
 vec3_t	*g_skynormals[SKYLEVELMAX+1];
 vec_t	*g_skynormalsizes[SKYLEVELMAX+1];
+int		*g_skynormalorder[SKYLEVELMAX+1];
 typedef double point_t[3];
 typedef struct {int point[2]; bool divided; int child[2];} edge_t;
 typedef struct {int edge[3]; int dir[3];} triangle_t;
+typedef struct {unsigned int key; int index;} skynormalkey_t;
+static int CompareSkynormalKeys (const void *a, const void *b)
+{
+	const skynormalkey_t *ka = (const skynormalkey_t *)a;
+	const skynormalkey_t *kb = (const skynormalkey_t *)b;
+	if (ka->key != kb->key)
+		return ka->key < kb->key? -1: 1;
+	return ka->index - kb->index;
+}
 void CopyToSkynormals (int skylevel, int numpoints, point_t *points, int numedges, edge_t *edges, int numtriangles, triangle_t *triangles)
 {
 	hlassume (numpoints == (1 << (2 * skylevel)) + 2, assume_first);
@@ -2324,6 +2757,42 @@ void CopyToSkynormals (int skylevel, int numpoints, point_t *points, int numedge
 	{
 		g_skynormalsizes[skylevel][j] /= totalsize;
 	}
+	// sort the normals along a space-filling curve on each cube face, so that neighbours in the list point in nearly the same direction
+	skynormalkey_t *keys = (skynormalkey_t *)malloc (numpoints * sizeof (skynormalkey_t));
+	g_skynormalorder[skylevel] = (int *)malloc (numpoints * sizeof (int));
+	hlassume (keys != NULL && g_skynormalorder[skylevel] != NULL, assume_NoMemory);
+	for (j = 0; j < numpoints; j++)
+	{
+		const double *v = points[j];
+		int axis = 0;
+		for (k = 1; k < 3; k++)
+		{
+			if (fabs (v[k]) > fabs (v[axis]))
+			{
+				axis = k;
+			}
+		}
+		unsigned int coord[2];
+		for (k = 0; k < 2; k++)
+		{
+			double c = v[(axis + 1 + k) % 3] / fabs (v[axis]); // -1 to 1 on the cube face
+			coord[k] = (unsigned int)qmax (0, qmin ((c + 1) * 512, 1023));
+		}
+		unsigned int morton = 0;
+		for (k = 0; k < 10; k++)
+		{
+			morton |= ((coord[0] >> k) & 1) << (2 * k);
+			morton |= ((coord[1] >> k) & 1) << (2 * k + 1);
+		}
+		keys[j].key = ((axis * 2 + (v[axis] < 0)) << 20) | morton;
+		keys[j].index = j;
+	}
+	qsort (keys, numpoints, sizeof (skynormalkey_t), CompareSkynormalKeys);
+	for (j = 0; j < numpoints; j++)
+	{
+		g_skynormalorder[skylevel][j] = keys[j].index;
+	}
+	free (keys);
 #if 0
 	printf ("g_numskynormals[%i]=%i\n", skylevel, g_numskynormals[skylevel]);
 	for (j = 0; j < numpoints; j += (numpoints / 20 + 1))
@@ -2441,11 +2910,12 @@ void BuildDiffuseNormals ()
 	free (edges);
 	free (triangles);
 }
-static void     GatherSampleLight(const vec3_t pos, const byte* const pvs, const vec3_t normal, vec3_t* sample
+static void     GatherSampleLight(const vec3_t pos, const int leafnum, const vec3_t normal, vec3_t* sample
 								  , byte* styles
 								  , int step
 								  , int miptex
 								  , int texlightgap_surfacenum
+								  , skycache_t* skycache               // NULL traces every direction, only for front samples of step 0
 								  )
 {
     int             i;
@@ -2464,6 +2934,11 @@ static void     GatherSampleLight(const vec3_t pos, const byte* const pvs, const
 	vec3_t			adds[ALLSTYLES];
 	int				style;
 	memset (adds, 0, ALLSTYLES * sizeof(vec3_t));
+	vec3_t			packet_starts[TESTLINE_PACKET];
+	vec3_t			packet_stops[TESTLINE_PACKET];
+	vec3_t			packet_skyhits[TESTLINE_PACKET];
+	int				packet_contents[TESTLINE_PACKET];
+	bool			packet_settled[TESTLINE_PACKET];
 	bool			lighting_diversify;
 	vec_t			lighting_power;
 	vec_t			lighting_scale;
@@ -2494,401 +2969,441 @@ static void     GatherSampleLight(const vec3_t pos, const byte* const pvs, const
 		}
 	}
 
-    for (i = 0; i < 1 + g_dmodels[0].visleafs; i++)
+    const leaflights_t* leaflights = &s_leaflights[s_leaflightsnum[leafnum]];
+    directlight_t* const* lights = leaflights->lights + (step? leaflights->numlights[0]: 0);
+    const int       numlights = leaflights->numlights[step];
+
+    for (i = 0; i < numlights; i++)
     {
-        l = directlights[i];
-        if (l)
-		{
-            if (i == 0? g_sky_lighting_fix: pvs[(i - 1) >> 3] & (1 << ((i - 1) & 7)))
-            {
-                for (; l; l = l->next)
-                {
-                    // skylights work fundamentally differently than normal lights
-                    if (l->type == emit_skylight)
-                    {
-						if (!g_sky_lighting_fix)
+        l = lights[i];
+        // skylights work fundamentally differently than normal lights
+        if (l->type == emit_skylight)
+        {
+			if (!g_sky_lighting_fix)
+			{
+				if (sky_used)
+				{
+					continue;
+				}
+				sky_used = true;
+			}
+			do // add sun light
+			{
+				// check step
+				step_match = (int)l->topatch;
+				if (step != step_match)
+					continue;
+				// check intensity
+				if (!(l->intensity[0] || l->intensity[1] || l->intensity[2]))
+					continue;
+			  // loop over the normals
+			  for (int j = 0; j < l->numsunnormals; )
+			  {
+				// search back to see if we can hit a sky brush
+				int rays[TESTLINE_PACKET];
+				int numrays = 0;
+				for (; j < l->numsunnormals && numrays < TESTLINE_PACKET; j++)
+				{
+					// make sure the angle is okay
+					dot = -DotProduct (normal, l->sunnormals[j]);
+					if (dot <= NORMAL_EPSILON) //ON_EPSILON / 10 //--vluzacn
+					{
+						continue;
+					}
+					rays[numrays] = j;
+					VectorCopy (pos, packet_starts[numrays]);
+					VectorScale (l->sunnormals[j], -BOGUS_RANGE, delta);
+					VectorAdd(pos, delta, packet_stops[numrays]);
+					VectorCopy (packet_stops[numrays], packet_skyhits[numrays]);
+					packet_settled[numrays] = skycache && SkyCacheSettle (skycache, l->skycacheslot + j, pos, l->sunnormals[j], &packet_contents[numrays], packet_skyhits[numrays]);
+					numrays++;
+				}
+				TestSkyPacket (numrays, packet_starts, packet_stops, packet_contents, packet_skyhits, packet_settled);
+			   for (int k = 0; k < numrays; k++)
+			   {
+				const int n = rays[k];
+				if (skycache)
+				{
+					SkyCacheRecord (skycache, l->skycacheslot + n, pos, packet_contents[k], packet_skyhits[k]);
+				}
+				if (packet_contents[k] != CONTENTS_SKY)
+				{
+					continue;                      // occluded
+				}
+				dot = -DotProduct (normal, l->sunnormals[n]);
+
+				vec3_t transparency;
+				int opaquestyle;
+				if (TestSegmentAgainstOpaqueList(pos, 
+					packet_skyhits[k]
+					, transparency
+					, opaquestyle
+					))
+				{
+					continue;
+				}
+
+				vec3_t add_one;
+				if (lighting_diversify)
+				{
+					dot = lighting_scale * pow (dot, lighting_power);
+				}
+				VectorScale (l->intensity, dot * l->sunnormalweights[n], add_one);
+				VectorMultiply(add_one, transparency, add_one);
+				// add to the total brightness of this sample
+				style = l->style;
+				if (opaquestyle != -1)
+				{
+					if (style == 0 || style == opaquestyle)
+						style = opaquestyle;
+					else
+						continue; // dynamic light of other styles hits this toggleable opaque entity, then it completely vanishes.
+				}
+				VectorAdd (adds[style], add_one, adds[style]);
+			   }
+			  } // (loop over the normals)
+			}
+			while (0);
+			do // add sky light
+			{
+				// check step
+				step_match = 0;
+				if (g_softsky)
+					step_match = 1;
+				if (g_fastmode)
+					step_match = 1;
+				if (step != step_match)
+					continue;
+				// check intensity
+				if (g_indirect_sun <= 0.0 ||
+					VectorCompare (
+						l->diffuse_intensity,
+						vec3_origin)
+					&& VectorCompare (l->diffuse_intensity2, vec3_origin)
+					)
+					continue;
+
+				vec3_t sky_intensity;
+
+				// loop over the normals
+				vec3_t *skynormals = g_skynormals[g_softsky?SKYLEVEL_SOFTSKYON:SKYLEVEL_SOFTSKYOFF];
+				vec_t *skyweights = g_skynormalsizes[g_softsky?SKYLEVEL_SOFTSKYON:SKYLEVEL_SOFTSKYOFF];
+				const int *skyorder = g_skynormalorder[g_softsky?SKYLEVEL_SOFTSKYON:SKYLEVEL_SOFTSKYOFF];
+				const int numskynormals = g_numskynormals[g_softsky?SKYLEVEL_SOFTSKYON:SKYLEVEL_SOFTSKYOFF];
+				int *skycontents = &s_skycontents[GetThreadNum () * numskynormals];
+				vec3_t *skyhits = &s_skyhits[GetThreadNum () * numskynormals];
+				// search back to see if we can hit a sky brush
+				// trace all the normals first, neighbouring ones together, so that the packets stay coherent
+				for (int jj = 0; jj < numskynormals; )
+				{
+					int rays[TESTLINE_PACKET];
+					int numrays = 0;
+					for (; jj < numskynormals && numrays < TESTLINE_PACKET; jj++)
+					{
+						const int j = skyorder[jj];
+						// make sure the angle is okay
+						dot = -DotProduct (normal, skynormals[j]);
+						if (dot <= NORMAL_EPSILON) //ON_EPSILON / 10 //--vluzacn
 						{
-							if (sky_used)
-							{
-								continue;
-							}
-							sky_used = true;
+							continue;
 						}
-						do // add sun light
+						rays[numrays] = j;
+						VectorCopy (pos, packet_starts[numrays]);
+						VectorScale (skynormals[j], -BOGUS_RANGE, delta);
+						VectorAdd(pos, delta, packet_stops[numrays]);
+						VectorCopy (packet_stops[numrays], packet_skyhits[numrays]);
+						packet_settled[numrays] = skycache && SkyCacheSettle (skycache, s_skycacheskyslot + j, pos, skynormals[j], &packet_contents[numrays], packet_skyhits[numrays]);
+						numrays++;
+					}
+					TestSkyPacket (numrays, packet_starts, packet_stops, packet_contents, packet_skyhits, packet_settled);
+					for (int k = 0; k < numrays; k++)
+					{
+						skycontents[rays[k]] = packet_contents[k];
+						VectorCopy (packet_skyhits[k], skyhits[rays[k]]);
+						if (skycache)
 						{
-							// check step
-							step_match = (int)l->topatch;
-							if (step != step_match)
-								continue;
-							// check intensity
-							if (!(l->intensity[0] || l->intensity[1] || l->intensity[2]))
-								continue;
-						  // loop over the normals
-						  for (int j = 0; j < l->numsunnormals; j++)
-						  {
-							// make sure the angle is okay
-							dot = -DotProduct (normal, l->sunnormals[j]);
-							if (dot <= NORMAL_EPSILON) //ON_EPSILON / 10 //--vluzacn
-							{
-								continue;
-							}
+							SkyCacheRecord (skycache, s_skycacheskyslot + rays[k], pos, packet_contents[k], packet_skyhits[k]);
+						}
+					}
+				}
+				for (int j = 0; j < numskynormals; j++)
+				{
+					// make sure the angle is okay
+					dot = -DotProduct (normal, skynormals[j]);
+					if (dot <= NORMAL_EPSILON) //ON_EPSILON / 10 //--vluzacn
+					{
+						continue;
+					}
 
-							// search back to see if we can hit a sky brush
-							VectorScale (l->sunnormals[j], -BOGUS_RANGE, delta);
-							VectorAdd(pos, delta, delta);
-							vec3_t skyhit;
-							VectorCopy (delta, skyhit);
-							if (TestLine(pos, delta
-								, skyhit
-								) != CONTENTS_SKY)
-							{
-								continue;                      // occluded
-							}
+					if (skycontents[j] != CONTENTS_SKY)
+					{
+						continue;                                  // occluded
+					}
 
-							vec3_t transparency;
-							int opaquestyle;
-							if (TestSegmentAgainstOpaqueList(pos, 
-								skyhit
-								, transparency
-								, opaquestyle
-								))
-							{
-								continue;
-							}
+					vec3_t transparency;
+					int opaquestyle;
+					if (TestSegmentAgainstOpaqueList(pos, 
+						skyhits[j]
+						, transparency
+						, opaquestyle
+						))
+					{
+						continue;
+					}
 
-							vec3_t add_one;
-							if (lighting_diversify)
-							{
-								dot = lighting_scale * pow (dot, lighting_power);
-							}
-							VectorScale (l->intensity, dot * l->sunnormalweights[j], add_one);
-							VectorMultiply(add_one, transparency, add_one);
-							// add to the total brightness of this sample
-							style = l->style;
-							if (opaquestyle != -1)
-							{
-								if (style == 0 || style == opaquestyle)
-									style = opaquestyle;
-								else
-									continue; // dynamic light of other styles hits this toggleable opaque entity, then it completely vanishes.
-							}
-							VectorAdd (adds[style], add_one, adds[style]);
-						  } // (loop over the normals)
-						}
-						while (0);
-						do // add sky light
-						{
-							// check step
-							step_match = 0;
-							if (g_softsky)
-								step_match = 1;
-							if (g_fastmode)
-								step_match = 1;
-							if (step != step_match)
-								continue;
-							// check intensity
-							if (g_indirect_sun <= 0.0 ||
-								VectorCompare (
-									l->diffuse_intensity,
-									vec3_origin)
-								&& VectorCompare (l->diffuse_intensity2, vec3_origin)
-								)
-								continue;
-
-							vec3_t sky_intensity;
-
-							// loop over the normals
-							vec3_t *skynormals = g_skynormals[g_softsky?SKYLEVEL_SOFTSKYON:SKYLEVEL_SOFTSKYOFF];
-							vec_t *skyweights = g_skynormalsizes[g_softsky?SKYLEVEL_SOFTSKYON:SKYLEVEL_SOFTSKYOFF];
-							for (int j = 0; j < g_numskynormals[g_softsky?SKYLEVEL_SOFTSKYON:SKYLEVEL_SOFTSKYOFF]; j++)
-							{
-								// make sure the angle is okay
-								dot = -DotProduct (normal, skynormals[j]);
-								if (dot <= NORMAL_EPSILON) //ON_EPSILON / 10 //--vluzacn
-								{
-									continue;
-								}
-
-								// search back to see if we can hit a sky brush
-								VectorScale (skynormals[j], -BOGUS_RANGE, delta);
-								VectorAdd(pos, delta, delta);
-								vec3_t skyhit;
-								VectorCopy (delta, skyhit);
-								if (TestLine(pos, delta
-									, skyhit
-									) != CONTENTS_SKY)
-								{
-									continue;                                  // occluded
-								}
-
-								vec3_t transparency;
-								int opaquestyle;
-								if (TestSegmentAgainstOpaqueList(pos, 
-									skyhit
-									, transparency
-									, opaquestyle
-									))
-								{
-									continue;
-								}
-
-								vec_t factor = qmin (qmax (0.0, (1 - DotProduct (l->normal, skynormals[j])) / 2), 1.0); // how far this piece of sky has deviated from the sun
-								VectorScale (l->diffuse_intensity, 1 - factor, sky_intensity);
-								VectorMA (sky_intensity, factor, l->diffuse_intensity2, sky_intensity);
-								VectorScale (sky_intensity, skyweights[j] * g_indirect_sun / 2, sky_intensity);
-								vec3_t add_one;
-								if (lighting_diversify)
-								{
-									dot = lighting_scale * pow (dot, lighting_power);
-								}
-								VectorScale(sky_intensity, dot, add_one);
-								VectorMultiply(add_one, transparency, add_one);
-								// add to the total brightness of this sample
-								style = l->style;
-								if (opaquestyle != -1)
-								{
-									if (style == 0 || style == opaquestyle)
-										style = opaquestyle;
-									else
-										continue; // dynamic light of other styles hits this toggleable opaque entity, then it completely vanishes.
-								}
-								VectorAdd (adds[style], add_one, adds[style]);
-							} // (loop over the normals)
-
-						}
-						while (0);
-
-                    }
-                    else // not emit_skylight
-                    {
-						step_match = (int)l->topatch;
-						if (step != step_match)
-							continue;
-						if (!(l->intensity[0] || l->intensity[1] || l->intensity[2]))
-							continue;
-						VectorCopy (l->origin, testline_origin);
-                        float           denominator;
-
-                        VectorSubtract(l->origin, pos, delta);
-						if (l->type == emit_surface)
-						{
-							// move emitter back to its plane
-							VectorMA (delta, -PATCH_HUNT_OFFSET, l->normal, delta);
-						}
-                        dist = VectorNormalize(delta);
-                        dot = DotProduct(delta, normal);
-                        //                        if (dot <= 0.0)
-                        //                            continue;
-
-                        if (dist < 1.0)
-                        {
-                            dist = 1.0;
-                        }
+					vec_t factor = qmin (qmax (0.0, (1 - DotProduct (l->normal, skynormals[j])) / 2), 1.0); // how far this piece of sky has deviated from the sun
+					VectorScale (l->diffuse_intensity, 1 - factor, sky_intensity);
+					VectorMA (sky_intensity, factor, l->diffuse_intensity2, sky_intensity);
+					VectorScale (sky_intensity, skyweights[j] * g_indirect_sun / 2, sky_intensity);
+					vec3_t add_one;
+					if (lighting_diversify)
+					{
+						dot = lighting_scale * pow (dot, lighting_power);
+					}
+					VectorScale(sky_intensity, dot, add_one);
+					VectorMultiply(add_one, transparency, add_one);
+					// add to the total brightness of this sample
+					style = l->style;
+					if (opaquestyle != -1)
+					{
+						if (style == 0 || style == opaquestyle)
+							style = opaquestyle;
+						else
+							continue; // dynamic light of other styles hits this toggleable opaque entity, then it completely vanishes.
+					}
+					VectorAdd (adds[style], add_one, adds[style]);
+				} // (loop over the normals)
 
-						denominator = dist * dist * l->fade;
+			}
+			while (0);
 
-						vec3_t add;
-                        switch (l->type)
-                        {
-                        case emit_point:
-                        {
-							if (dot <= NORMAL_EPSILON)
-							{
-								continue;
-							}
-							vec_t denominator = dist * dist * l->fade;
-							if (lighting_diversify)
-							{
-								dot = lighting_scale * pow (dot, lighting_power);
-							}
-                            ratio = dot / denominator;
-                            VectorScale(l->intensity, ratio, add);
-                            break;
-                        }
+        }
+        else // not emit_skylight
+        {
+			step_match = (int)l->topatch;
+			if (step != step_match)
+				continue;
+			if (!(l->intensity[0] || l->intensity[1] || l->intensity[2]))
+				continue;
+			VectorCopy (l->origin, testline_origin);
+            float           denominator;
 
-                        case emit_surface:
-                        {
-							bool light_behind_surface = false;
-							if (dot <= NORMAL_EPSILON)
-							{
-								light_behind_surface = true;
-							}
-							if (lighting_diversify
-								&& !light_behind_surface
-								)
-							{
-								dot = lighting_scale * pow (dot, lighting_power);
-							}
-                            dot2 = -DotProduct(delta, l->normal);
-							// discard the texlight if the spot is too close to the texlight plane
-							if (l->texlightgap > 0)
-							{
-								vec_t test;
+            VectorSubtract(l->origin, pos, delta);
+			if (l->type == emit_surface)
+			{
+				// move emitter back to its plane
+				VectorMA (delta, -PATCH_HUNT_OFFSET, l->normal, delta);
+			}
+            dist = VectorNormalize(delta);
+            dot = DotProduct(delta, normal);
+            //                        if (dot <= 0.0)
+            //                            continue;
 
-								test = dot2 * dist; // distance from spot to texlight plane;
-								test -= l->texlightgap * fabs (DotProduct (l->normal, texlightgap_textoworld[0])); // maximum distance reduction if the spot is allowed to shift l->texlightgap pixels along s axis
-								test -= l->texlightgap * fabs (DotProduct (l->normal, texlightgap_textoworld[1])); // maximum distance reduction if the spot is allowed to shift l->texlightgap pixels along t axis
-								if (test < -ON_EPSILON)
-								{
-									continue;
-								}
-							}
-							if (dot2 * dist <= MINIMUM_PATCH_DISTANCE)
-							{
-								continue;
-							}
-							vec_t range = l->patch_emitter_range;
-							if (l->stopdot > 0.0) // stopdot2 > 0.0 or stopdot > 0.0
-							{
-								vec_t range_scale;
-								range_scale = 1 - l->stopdot2 * l->stopdot2;
-								range_scale = 1 / sqrt (qmax (NORMAL_EPSILON, range_scale));
-								// range_scale = 1 / sin (cone2)
-								range_scale = qmin (range_scale, 2); // restrict this to 2, because skylevel has limit.
-								range *= range_scale; // because smaller cones are more likely to create the ugly grid effect.
-
-								if (dot2 <= l->stopdot2 + NORMAL_EPSILON)
-								{
-									if (dist >= range) // use the old method, which will merely give 0 in this case
-									{
-										continue;
-									}
-									ratio = 0.0;
-								}
-								else if (dot2 <= l->stopdot)
-								{
-									ratio = dot * dot2 * (dot2 - l->stopdot2) / (dist * dist * (l->stopdot - l->stopdot2));
-								}
-								else
-								{
-									ratio = dot * dot2 / (dist * dist);
-								}
-							}
-							else
-							{
-								ratio = dot * dot2 / (dist * dist);
-							}
-							
-							// analogous to the one in MakeScales
-							// 0.4f is tested to be able to fully eliminate bright spots
-							if (ratio * l->patch_area > 0.4f)
-							{
-								ratio = 0.4f / l->patch_area;
-							}
-							if (dist < range - ON_EPSILON)
-							{ // do things slow
-								if (light_behind_surface)
-								{
-									dot = 0.0;
-									ratio = 0.0;
-								}
-								GetAlternateOrigin (pos, normal, l->patch, testline_origin);
-								vec_t sightarea;
-								int skylevel = l->patch->emitter_skylevel;
-								if (l->stopdot > 0.0) // stopdot2 > 0.0 or stopdot > 0.0
-								{
-									const vec_t *emitnormal = getPlaneFromFaceNumber (l->patch->faceNumber)->normal;
-									if (l->stopdot2 >= 0.8) // about 37deg
-									{
-										skylevel += 1; // because the range is larger
-									}
-									sightarea = CalcSightArea_SpotLight (pos, normal, l->patch->winding, emitnormal, l->stopdot, l->stopdot2, skylevel
-										, lighting_power, lighting_scale
-										); // because we have doubled the range
-								}
-								else
-								{
-									sightarea = CalcSightArea (pos, normal, l->patch->winding, skylevel
-										, lighting_power, lighting_scale
-										);
-								}
+            if (dist < 1.0)
+            {
+                dist = 1.0;
+            }
 
-								vec_t frac = dist / range;
-								frac = (frac - 0.5) * 2; // make a smooth transition between the two methods
-								frac = qmax (0, qmin (frac, 1));
+			denominator = dist * dist * l->fade;
 
-								vec_t ratio2 = (sightarea / l->patch_area); // because l->patch->area has been multiplied into l->intensity
-								ratio = frac * ratio + (1 - frac) * ratio2;
-							}
-							else
-							{
-								if (light_behind_surface)
-								{
-									continue;
-								}
-							}
-                            VectorScale(l->intensity, ratio, add);
-                            break;
-                        }
+			vec3_t add;
+            switch (l->type)
+            {
+            case emit_point:
+            {
+				if (dot <= NORMAL_EPSILON)
+				{
+					continue;
+				}
+				vec_t denominator = dist * dist * l->fade;
+				if (lighting_diversify)
+				{
+					dot = lighting_scale * pow (dot, lighting_power);
+				}
+                ratio = dot / denominator;
+                VectorScale(l->intensity, ratio, add);
+                break;
+            }
 
-                        case emit_spotlight:
-                        {
-							if (dot <= NORMAL_EPSILON)
-							{
-								continue;
-							}
-                            dot2 = -DotProduct(delta, l->normal);
-                            if (dot2 <= l->stopdot2)
-                            {
-                                continue;                  // outside light cone
-                            }
-
-                            // Variable power falloff (1 = inverse linear, 2 = inverse square
-                            vec_t           denominator = dist * l->fade;
-                            {
-                                denominator *= dist;
-                            }
-							if (lighting_diversify)
-							{
-								dot = lighting_scale * pow (dot, lighting_power);
-							}
-                            ratio = dot * dot2 / denominator;
-
-                            if (dot2 <= l->stopdot)
-                            {
-                                ratio *= (dot2 - l->stopdot2) / (l->stopdot - l->stopdot2);
-                            }
-                            VectorScale(l->intensity, ratio, add);
-                            break;
-                        }
+            case emit_surface:
+            {
+				bool light_behind_surface = false;
+				if (dot <= NORMAL_EPSILON)
+				{
+					light_behind_surface = true;
+				}
+				if (lighting_diversify
+					&& !light_behind_surface
+					)
+				{
+					dot = lighting_scale * pow (dot, lighting_power);
+				}
+                dot2 = -DotProduct(delta, l->normal);
+				// discard the texlight if the spot is too close to the texlight plane
+				if (l->texlightgap > 0)
+				{
+					vec_t test;
 
-                        default:
-                        {
-                            hlassume(false, assume_BadLightType);
-                            break;
-                        }
-                        }
-						if (TestLine (pos, 
-							testline_origin
-							) != CONTENTS_EMPTY)
-						{
-							continue;
-						}
-						vec3_t transparency;
-						int opaquestyle;
-						if (TestSegmentAgainstOpaqueList (pos, 
-							testline_origin
-							, transparency
-							, opaquestyle))
+					test = dot2 * dist; // distance from spot to texlight plane;
+					test -= l->texlightgap * fabs (DotProduct (l->normal, texlightgap_textoworld[0])); // maximum distance reduction if the spot is allowed to shift l->texlightgap pixels along s axis
+					test -= l->texlightgap * fabs (DotProduct (l->normal, texlightgap_textoworld[1])); // maximum distance reduction if the spot is allowed to shift l->texlightgap pixels along t axis
+					if (test < -ON_EPSILON)
+					{
+						continue;
+					}
+				}
+				if (dot2 * dist <= MINIMUM_PATCH_DISTANCE)
+				{
+					continue;
+				}
+				vec_t range = l->patch_emitter_range;
+				if (l->stopdot > 0.0) // stopdot2 > 0.0 or stopdot > 0.0
+				{
+					vec_t range_scale;
+					range_scale = 1 - l->stopdot2 * l->stopdot2;
+					range_scale = 1 / sqrt (qmax (NORMAL_EPSILON, range_scale));
+					// range_scale = 1 / sin (cone2)
+					range_scale = qmin (range_scale, 2); // restrict this to 2, because skylevel has limit.
+					range *= range_scale; // because smaller cones are more likely to create the ugly grid effect.
+
+					if (dot2 <= l->stopdot2 + NORMAL_EPSILON)
+					{
+						if (dist >= range) // use the old method, which will merely give 0 in this case
 						{
 							continue;
 						}
-						VectorMultiply (add, transparency, add);
-						// add to the total brightness of this sample
-						style = l->style;
-						if (opaquestyle != -1)
+						ratio = 0.0;
+					}
+					else if (dot2 <= l->stopdot)
+					{
+						ratio = dot * dot2 * (dot2 - l->stopdot2) / (dist * dist * (l->stopdot - l->stopdot2));
+					}
+					else
+					{
+						ratio = dot * dot2 / (dist * dist);
+					}
+				}
+				else
+				{
+					ratio = dot * dot2 / (dist * dist);
+				}
+							
+				// analogous to the one in MakeScales
+				// 0.4f is tested to be able to fully eliminate bright spots
+				if (ratio * l->patch_area > 0.4f)
+				{
+					ratio = 0.4f / l->patch_area;
+				}
+				if (dist < range - ON_EPSILON)
+				{ // do things slow
+					if (light_behind_surface)
+					{
+						dot = 0.0;
+						ratio = 0.0;
+					}
+					GetAlternateOrigin (pos, normal, l->patch, testline_origin);
+					vec_t sightarea;
+					int skylevel = l->patch->emitter_skylevel;
+					if (l->stopdot > 0.0) // stopdot2 > 0.0 or stopdot > 0.0
+					{
+						const vec_t *emitnormal = getPlaneFromFaceNumber (l->patch->faceNumber)->normal;
+						if (l->stopdot2 >= 0.8) // about 37deg
 						{
-							if (style == 0 || style == opaquestyle)
-								style = opaquestyle;
-							else
-								continue; // dynamic light of other styles hits this toggleable opaque entity, then it completely vanishes.
+							skylevel += 1; // because the range is larger
 						}
-						VectorAdd (adds[style], add, adds[style]);
-                    } // end emit_skylight
+						sightarea = CalcSightArea_SpotLight (pos, normal, l->patch->winding, emitnormal, l->stopdot, l->stopdot2, skylevel
+							, lighting_power, lighting_scale
+							); // because we have doubled the range
+					}
+					else
+					{
+						sightarea = CalcSightArea (pos, normal, l->patch->winding, skylevel
+							, lighting_power, lighting_scale
+							);
+					}
+
+					vec_t frac = dist / range;
+					frac = (frac - 0.5) * 2; // make a smooth transition between the two methods
+					frac = qmax (0, qmin (frac, 1));
+
+					vec_t ratio2 = (sightarea / l->patch_area); // because l->patch->area has been multiplied into l->intensity
+					ratio = frac * ratio + (1 - frac) * ratio2;
+				}
+				else
+				{
+					if (light_behind_surface)
+					{
+						continue;
+					}
+				}
+                VectorScale(l->intensity, ratio, add);
+                break;
+            }
+
+            case emit_spotlight:
+            {
+				if (dot <= NORMAL_EPSILON)
+				{
+					continue;
+				}
+                dot2 = -DotProduct(delta, l->normal);
+                if (dot2 <= l->stopdot2)
+                {
+                    continue;                  // outside light cone
+                }
 
+                // Variable power falloff (1 = inverse linear, 2 = inverse square
+                vec_t           denominator = dist * l->fade;
+                {
+                    denominator *= dist;
                 }
+				if (lighting_diversify)
+				{
+					dot = lighting_scale * pow (dot, lighting_power);
+				}
+                ratio = dot * dot2 / denominator;
+
+                if (dot2 <= l->stopdot)
+                {
+                    ratio *= (dot2 - l->stopdot2) / (l->stopdot - l->stopdot2);
+                }
+                VectorScale(l->intensity, ratio, add);
+                break;
             }
-        }
+
+            default:
+            {
+                hlassume(false, assume_BadLightType);
+                break;
+            }
+            }
+			if (TestLine (pos, 
+				testline_origin
+				) != CONTENTS_EMPTY)
+			{
+				continue;
+			}
+			vec3_t transparency;
+			int opaquestyle;
+			if (TestSegmentAgainstOpaqueList (pos, 
+				testline_origin
+				, transparency
+				, opaquestyle))
+			{
+				continue;
+			}
+			VectorMultiply (add, transparency, add);
+			// add to the total brightness of this sample
+			style = l->style;
+			if (opaquestyle != -1)
+			{
+				if (style == 0 || style == opaquestyle)
+					style = opaquestyle;
+				else
+					continue; // dynamic light of other styles hits this toggleable opaque entity, then it completely vanishes.
+			}
+			VectorAdd (adds[style], add, adds[style]);
+        } // end emit_skylight
     }
 
 	for (style = 0; style < ALLSTYLES; ++style)
@@ -3200,63 +3715,25 @@ void            GetPhongNormal(int facenum, const vec3_t spot, vec3_t phongnorma
     }
 }
 
-const vec3_t    s_circuscolors[] = {
-    {100000.0,  100000.0,   100000.0},                              // white
-    {100000.0,  0.0,        0.0     },                              // red
-    {0.0,       100000.0,   0.0     },                              // green
-    {0.0,       0.0,        100000.0},                              // blue
-    {0.0,       100000.0,   100000.0},                              // cyan
-    {100000.0,  0.0,        100000.0},                              // magenta
-    {100000.0,  100000.0,   0.0     }                               // yellow
-};
-
 // =====================================================================================
-//  BuildFacelights
+//  FindSampleSpot
+//      The world position of sample i of the lightmap cache. Returns false when the sample
+//      is blocked, that is, every position that could light it is outside the world.
 // =====================================================================================
-void CalcLightmap (lightinfo_t *l, byte *styles)
+static bool     FindSampleSpot (const lightinfo_t *l, const int i, vec3_t surfpt, vec3_t spot, int *surface, bool *nudged)
 {
-	int facenum;
-	int i, j;
-	byte pvs[(MAX_MAP_LEAFS + 7) / 8];
-	int lastoffset;
-	byte pvs2[(MAX_MAP_LEAFS + 7) / 8];
-	int lastoffset2;
-
-	facenum = l->surfnum;
-	memset (l->lmcache, 0, l->lmcachewidth * l->lmcacheheight * sizeof (vec3_t [ALLSTYLES]));
-
-	// for each sample whose light we need to calculate
-	for (i = 0; i < l->lmcachewidth * l->lmcacheheight; i++)
-	{
-		vec_t s, t;
-		vec_t s_vec, t_vec;
-		int nearest_s, nearest_t;
-		vec3_t spot;
-		vec_t square[2][2];  // the max possible range in which this sample point affects the lighting on a face
-		vec3_t surfpt; // the point on the surface (with no HUNT_OFFSET applied), used for getting phong normal and doing patch interpolation
-		int surface;
-		vec3_t pointnormal;
-		bool blocked;
-		vec3_t spot2;
-		vec3_t pointnormal2;
-		vec3_t *sampled;
-
-		vec3_t *normal_out;
-		bool nudged;
-		int *wallflags_out;
-
-		// prepare input parameter and output parameter
-		{
-			s = ((i % l->lmcachewidth) - l->lmcache_offset) / (vec_t)l->lmcache_density;
-			t = ((i / l->lmcachewidth) - l->lmcache_offset) / (vec_t)l->lmcache_density;
-			s_vec = l->texmins[0] * TEXTURE_STEP + s * TEXTURE_STEP;
-			t_vec = l->texmins[1] * TEXTURE_STEP + t * TEXTURE_STEP;
-			nearest_s = qmax (0, qmin ((int)floor (s + 0.5), l->texsize[0]));
-			nearest_t = qmax (0, qmin ((int)floor (t + 0.5), l->texsize[1]));
-			sampled = l->lmcache[i];
+	vec_t s, t;
+	vec_t s_vec, t_vec;
+	int nearest_s, nearest_t;
+	vec_t square[2][2];  // the max possible range in which this sample point affects the lighting on a face
+	int j;
 
-			normal_out = &l->lmcache_normal[i];
-			wallflags_out = &l->lmcache_wallflags[i];
+	s = ((i % l->lmcachewidth) - l->lmcache_offset) / (vec_t)l->lmcache_density;
+	t = ((i / l->lmcachewidth) - l->lmcache_offset) / (vec_t)l->lmcache_density;
+	s_vec = l->texmins[0] * TEXTURE_STEP + s * TEXTURE_STEP;
+	t_vec = l->texmins[1] * TEXTURE_STEP + t * TEXTURE_STEP;
+	nearest_s = qmax (0, qmin ((int)floor (s + 0.5), l->texsize[0]));
+	nearest_t = qmax (0, qmin ((int)floor (t + 0.5), l->texsize[1]));
 //
 // The following graph illustrates the range in which a sample point can affect the lighting of a face when g_blur = 1.5 and g_extra = on
 //              X : the sample point. They are placed on every TEXTURE_STEP/lmcache_density (=16.0/3) texture pixels. We calculate light for each sample point, which is the main time sink.
@@ -3294,36 +3771,128 @@ void CalcLightmap (lightinfo_t *l, byte *styles)
 //    || +     +-----+-----+     +     + || +     +-----+-----+-----+     + || +     +-----+-----+-----+     + || +     +     +-----+-----+     + ||
 //    ==============================================================================================================================================
 //
-			square[0][0] = l->texmins[0] * TEXTURE_STEP + ceil (s - (l->lmcache_side + 0.5) / (vec_t)l->lmcache_density) * TEXTURE_STEP - TEXTURE_STEP;
-			square[0][1] = l->texmins[1] * TEXTURE_STEP + ceil (t - (l->lmcache_side + 0.5) / (vec_t)l->lmcache_density) * TEXTURE_STEP - TEXTURE_STEP;
-			square[1][0] = l->texmins[0] * TEXTURE_STEP + floor (s + (l->lmcache_side + 0.5) / (vec_t)l->lmcache_density) * TEXTURE_STEP + TEXTURE_STEP;
-			square[1][1] = l->texmins[1] * TEXTURE_STEP + floor (t + (l->lmcache_side + 0.5) / (vec_t)l->lmcache_density) * TEXTURE_STEP + TEXTURE_STEP;
+	square[0][0] = l->texmins[0] * TEXTURE_STEP + ceil (s - (l->lmcache_side + 0.5) / (vec_t)l->lmcache_density) * TEXTURE_STEP - TEXTURE_STEP;
+	square[0][1] = l->texmins[1] * TEXTURE_STEP + ceil (t - (l->lmcache_side + 0.5) / (vec_t)l->lmcache_density) * TEXTURE_STEP - TEXTURE_STEP;
+	square[1][0] = l->texmins[0] * TEXTURE_STEP + floor (s + (l->lmcache_side + 0.5) / (vec_t)l->lmcache_density) * TEXTURE_STEP + TEXTURE_STEP;
+	square[1][1] = l->texmins[1] * TEXTURE_STEP + floor (t + (l->lmcache_side + 0.5) / (vec_t)l->lmcache_density) * TEXTURE_STEP + TEXTURE_STEP;
+	if (SetSampleFromST (
+						surfpt, spot, surface,
+						nudged,
+						l, s_vec, t_vec,
+						square,
+						g_face_lightmode[l->surfnum]) == LightOutside)
+	{
+		j = nearest_s + (l->texsize[0] + 1) * nearest_t;
+		if (l->surfpt_lightoutside[j])
+		{
+			return false;
+		}
+		// the area this light sample has effect on is completely covered by solid, so take whatever valid position.
+		VectorCopy (l->surfpt[j], surfpt);
+		VectorCopy (l->surfpt_position[j], spot);
+		*surface = l->surfpt_surface[j];
+	}
+	return true;
+}
+
+// =====================================================================================
+//  CreateSkyCache
+//      Returns NULL when the sky is to be traced for every sample.
+// =====================================================================================
+static skycache_t* CreateSkyCache (const lightinfo_t *l)
+{
+	skycache_t *cache;
+	int spacing;
+	int numcoarse;
+
+	if (g_skycache <= 0 || s_numskycachedirections == 0)
+	{
+		return NULL;
+	}
+	spacing = (int)floor (g_skycache * l->lmcache_density + 0.5);
+	if (spacing < 2)
+	{
+		return NULL; // every sample would be a coarse one
+	}
+
+	cache = (skycache_t *)malloc (sizeof (skycache_t));
+	hlassume (cache != NULL, assume_NoMemory);
+	cache->spacing = spacing;
+	cache->width = l->lmcachewidth;
+	cache->height = l->lmcacheheight;
+	cache->numcols = (cache->width - 1) / spacing + ((cache->width - 1) % spacing? 2: 1);
+	cache->numrows = (cache->height - 1) / spacing + ((cache->height - 1) % spacing? 2: 1);
+	numcoarse = cache->numcols * cache->numrows;
+	cache->state = (unsigned char *)calloc (numcoarse * s_numskycachedirections, sizeof (unsigned char));
+	cache->hitdist = (vec_t *)malloc (numcoarse * s_numskycachedirections * sizeof (vec_t));
+	hlassume (cache->state != NULL && cache->hitdist != NULL, assume_NoMemory);
+	cache->coarse = -1;
+	return cache;
+}
+
+static void     FreeSkyCache (skycache_t *cache)
+{
+	if (cache)
+	{
+		free (cache->state);
+		free (cache->hitdist);
+		free (cache);
+	}
+}
+
+const vec3_t    s_circuscolors[] = {
+    {100000.0,  100000.0,   100000.0},                              // white
+    {100000.0,  0.0,        0.0     },                              // red
+    {0.0,       100000.0,   0.0     },                              // green
+    {0.0,       0.0,        100000.0},                              // blue
+    {0.0,       100000.0,   100000.0},                              // cyan
+    {100000.0,  0.0,        100000.0},                              // magenta
+    {100000.0,  100000.0,   0.0     }                               // yellow
+};
+
+// =====================================================================================
+//  BuildFacelights
+// =====================================================================================
+void CalcLightmap (lightinfo_t *l, byte *styles, skycache_t *skycache)
+{
+	int i, j;
+	int leafnum;
+	int leafnum2 = 0;
+
+	memset (l->lmcache, 0, l->lmcachewidth * l->lmcacheheight * sizeof (vec3_t [ALLSTYLES]));
+
+	// for each sample whose light we need to calculate
+	// with a sky cache, the coarse samples go first so that the others can reuse their sky traces
+	for (int pass = 0; pass < (skycache? 2: 1); pass++)
+	for (i = 0; i < l->lmcachewidth * l->lmcacheheight; i++)
+	{
+		if (skycache && SkyCacheSelect (skycache, i) != (pass == 0))
+		{
+			continue;
+		}
+		vec3_t spot;
+		vec3_t surfpt; // the point on the surface (with no HUNT_OFFSET applied), used for getting phong normal and doing patch interpolation
+		int surface;
+		vec3_t pointnormal;
+		bool blocked;
+		vec3_t spot2;
+		vec3_t pointnormal2;
+		vec3_t *sampled;
+
+		vec3_t *normal_out;
+		bool nudged;
+		int *wallflags_out;
+
+		// prepare input parameter and output parameter
+		{
+			sampled = l->lmcache[i];
+
+			normal_out = &l->lmcache_normal[i];
+			wallflags_out = &l->lmcache_wallflags[i];
 		}
 		// find world's position for the sample
 		{
-			{
-				blocked = false;
-				if (SetSampleFromST (
-									surfpt, spot, &surface,
-									&nudged,
-									l, s_vec, t_vec,
-									square,
-									g_face_lightmode[facenum]) == LightOutside)
-				{
-					j = nearest_s + (l->texsize[0] + 1) * nearest_t;
-					if (l->surfpt_lightoutside[j])
-					{
-						blocked = true;
-					}
-					else
-					{
-						// the area this light sample has effect on is completely covered by solid, so take whatever valid position.
-						VectorCopy (l->surfpt[j], surfpt);
-						VectorCopy (l->surfpt_position[j], spot);
-						surface = l->surfpt_surface[j];
-					}
-				}
-			}
+			blocked = !FindSampleSpot (l, i, surfpt, spot, &surface, &nudged);
 			if (l->translucent_b)
 			{
 				const dplane_t *surfaceplane = getPlaneFromFaceNumber (surface);
@@ -3361,69 +3930,22 @@ void CalcLightmap (lightinfo_t *l, byte *styles)
 			}
 			VectorCopy (pointnormal, *normal_out);
 		}
-		// calculate visibility for the sample
+		// find the leaf of the sample, which has the lights that can reach it
+		leafnum = PointInLeaf (spot) - g_dleafs;
+		if (l->translucent_b)
 		{
-			if (!g_visdatasize)
-			{
-				if (i == 0)
-				{
-					memset (pvs, 255, (g_dmodels[0].visleafs + 7) / 8);
-				}
-			}
-			else
-			{
-				dleaf_t *leaf = PointInLeaf(spot);
-				int thisoffset = leaf->visofs;
-				if (i == 0 || thisoffset != lastoffset)
-				{
-					if (thisoffset == -1)
-					{
-						memset (pvs, 0, (g_dmodels[0].visleafs + 7) / 8);
-					}
-					else
-					{
-						DecompressVis(&g_dvisdata[leaf->visofs], pvs, sizeof(pvs));
-					}
-				}
-				lastoffset = thisoffset;
-			}
-			if (l->translucent_b)
-			{
-				if (!g_visdatasize)
-				{
-					if (i == 0)
-					{
-						memset (pvs2, 255, (g_dmodels[0].visleafs + 7) / 8);
-					}
-				}
-				else
-				{
-					dleaf_t *leaf2 = PointInLeaf(spot2);
-					int thisoffset2 = leaf2->visofs;
-					if (i == 0 || thisoffset2 != lastoffset2)
-					{
-						if (thisoffset2 == -1)
-						{
-							memset (pvs2, 0, (g_dmodels[0].visleafs + 7) / 8);
-						}
-						else
-						{
-							DecompressVis(&g_dvisdata[leaf2->visofs], pvs2, sizeof(pvs2));
-						}
-					}
-					lastoffset2 = thisoffset2;
-				}
-			}
+			leafnum2 = PointInLeaf (spot2) - g_dleafs;
 		}
 		// gather light
 		{
 			if (!blocked)
 			{
-				GatherSampleLight(spot, pvs, pointnormal, sampled
+				GatherSampleLight(spot, leafnum, pointnormal, sampled
 					, styles
 					, 0
 					, l->miptex
 					, surface
+					, skycache
 					);
 			}
 			if (l->translucent_b)
@@ -3432,12 +3954,13 @@ void CalcLightmap (lightinfo_t *l, byte *styles)
 				memset (sampled2, 0, ALLSTYLES * sizeof (vec3_t));
 				if (!blocked)
 				{
-					GatherSampleLight(spot2, pvs2, pointnormal2, sampled2
+					GatherSampleLight(spot2, leafnum2, pointnormal2, sampled2
 
 						, styles
 						, 0
 						, l->miptex
 						, surface
+						, NULL
 						);
 				}
 				for (j = 0; j < ALLSTYLES && styles[j] != 255; j++)
@@ -3484,17 +4007,16 @@ void            BuildFacelights(const int facenum)
     vec_t*          spot;
     patch_t*        patch;
     const dplane_t* plane;
-    byte            pvs[(MAX_MAP_LEAFS + 7) / 8];
-    int             thisoffset = -1, lastoffset = -1;
+    int             leafnum;
     int             lightmapwidth;
     int             lightmapheight;
     int             size;
 	vec3_t			spot2, normal2;
 	vec3_t			delta;
-	byte			pvs2[(MAX_MAP_LEAFS + 7) / 8];
-	int				thisoffset2 = -1, lastoffset2 = -1;
+	int				leafnum2;
 
 	int				*sample_wallflags;
+	skycache_t		*skycache;
 
     f = &g_dfaces[facenum];
 
@@ -3541,9 +4063,12 @@ void            BuildFacelights(const int facenum)
     CalcFaceVectors(&l);
     CalcFaceExtents(&l);
     CalcPoints(&l);
+	skycache = CreateSkyCache (&l);
 	CalcLightmap (&l
 		, f_styles
+		, skycache
 		);
+	FreeSkyCache (skycache);
 
     lightmapwidth = l.texsize[0] + 1;
     lightmapheight = l.texsize[1] + 1;
@@ -3738,56 +4263,12 @@ void            BuildFacelights(const int facenum)
     }
 	for (patch = g_face_patches[facenum]; patch; patch = patch->next)
 	{
-		// get the PVS for the pos to limit the number of checks
-		if (!g_visdatasize)
-		{
-			memset (pvs, 255, (g_dmodels[0].visleafs + 7) / 8);
-			lastoffset = -1;
-		}
-		else
-		{
-			dleaf_t*        leaf = PointInLeaf(patch->origin);
-
-			thisoffset = leaf->visofs;
-			if (patch == g_face_patches[facenum] || thisoffset != lastoffset)
-			{
-				if (thisoffset == -1)
-				{
-					memset (pvs, 0, (g_dmodels[0].visleafs + 7) / 8);
-				}
-				else
-				{
-					DecompressVis(&g_dvisdata[leaf->visofs], pvs, sizeof(pvs));
-				}
-			}
-			lastoffset = thisoffset;
-		}
+		// the leaf of the patch has the lights that can reach it
+		leafnum = PointInLeaf (patch->origin) - g_dleafs;
 		if (l.translucent_b)
 		{
-			if (!g_visdatasize)
-			{
-				memset (pvs2, 255, (g_dmodels[0].visleafs + 7) / 8);
-				lastoffset2 = -1;
-			}
-			else
-			{
-				VectorMA (patch->origin, -(g_translucentdepth+2*PATCH_HUNT_OFFSET), l.facenormal, spot2);
-				dleaf_t*        leaf2 = PointInLeaf(spot2);
-
-				thisoffset2 = leaf2->visofs;
-				if (l.numsurfpt == 0 || thisoffset2 != lastoffset2)
-				{
-					if (thisoffset2 == -1)
-					{
-						memset (pvs2, 0, (g_dmodels[0].visleafs + 7) / 8);
-					}
-					else
-					{
-						DecompressVis(&g_dvisdata[leaf2->visofs], pvs2, sizeof(pvs2));
-					}
-				}
-				lastoffset2 = thisoffset2;
-			}
+			VectorMA (patch->origin, -(g_translucentdepth+2*PATCH_HUNT_OFFSET), l.facenormal, spot2);
+			leafnum2 = PointInLeaf (spot2) - g_dleafs;
 			vec3_t frontsampled[ALLSTYLES], backsampled[ALLSTYLES];
 
 			for (j = 0; j < ALLSTYLES; j++)
@@ -3796,17 +4277,19 @@ void            BuildFacelights(const int facenum)
 				VectorClear (backsampled[j]);
 			}
 			VectorSubtract (vec3_origin, l.facenormal, normal2);
-			GatherSampleLight (patch->origin, pvs, l.facenormal, frontsampled, 
+			GatherSampleLight (patch->origin, leafnum, l.facenormal, frontsampled, 
 				patch->totalstyle_all
 				, 1
 				, l.miptex
 				, facenum
+				, NULL
 				);
-			GatherSampleLight (spot2, pvs2, normal2, backsampled, 
+			GatherSampleLight (spot2, leafnum2, normal2, backsampled, 
 				patch->totalstyle_all
 				, 1
 				, l.miptex
 				, facenum
+				, NULL
 				);
 			for (j = 0; j < ALLSTYLES && patch->totalstyle_all[j] != 255; j++)
 			{
@@ -3818,12 +4301,13 @@ void            BuildFacelights(const int facenum)
 		}
 		else
 		{
-			GatherSampleLight (patch->origin, pvs, l.facenormal, 
+			GatherSampleLight (patch->origin, leafnum, l.facenormal, 
 				patch->totallight_all, 
 				patch->totalstyle_all
 				, 1
 				, l.miptex
 				, facenum
+				, NULL
 				);
 		}
 	}
@@ -44,8 +44,8 @@ typedef struct wadfile_s
 {
 	struct wadfile_s *next;
 	char path[_MAX_PATH];
-	FILE *file;
-	int filesize;
+	byte *map; // the whole file is mapped into memory
+	size_t filesize;
 	int numlumps;
 	lumpinfo_t *lumpinfos;
 } wadfile_t;
@@ -53,11 +53,77 @@ typedef struct wadfile_s
 wadfile_t *g_wadfiles = NULL;
 bool g_wadfiles_opened;
 
-static int CDECL lump_sorter_by_name (const void *lump1, const void *lump2)
+// =====================================================================================
+//  Wad lump index
+//      The lumps of all the wads hashed on their name, case insensitive. The lumps of each
+//      bucket are in the order of the wads, and of the directory within a wad, so the first
+//      usable match is the one the wads give priority to.
+// =====================================================================================
+#define WADLUMPHASH_SIZE 16384 // must be a power of 2
+
+typedef struct
 {
-	lumpinfo_t *plump1 = (lumpinfo_t *)lump1;
-	lumpinfo_t *plump2 = (lumpinfo_t *)lump2;
-	return strcasecmp (plump1->name, plump2->name);
+	wadfile_t *wad;
+	int lump;
+	int next; // next lump + 1 in the same bucket
+} wadlump_t;
+
+static int s_wadlumphash[WADLUMPHASH_SIZE]; // first lump + 1 in each bucket, 0 if empty
+static wadlump_t *s_wadlumps = NULL;
+static int s_numwadlumps = 0;
+
+static unsigned WadLumpHash (const char *name)
+{
+	unsigned h = 2166136261u;
+	for (; *name; name++)
+	{
+		h = (h ^ (unsigned char)toupper (*name)) * 16777619u;
+	}
+	return h & (WADLUMPHASH_SIZE - 1);
+}
+
+static void HashWadLumps ()
+{
+	wadfile_t *wad;
+	int total = 0;
+	for (wad = g_wadfiles; wad; wad = wad->next)
+	{
+		total += wad->numlumps;
+	}
+	s_wadlumps = (wadlump_t *)malloc ((total + 1) * sizeof (wadlump_t));
+	hlassume (s_wadlumps != NULL, assume_NoMemory);
+	memset (s_wadlumphash, 0, sizeof (s_wadlumphash));
+	s_numwadlumps = 0;
+	for (wad = g_wadfiles; wad; wad = wad->next)
+	{
+		for (int i = 0; i < wad->numlumps; i++)
+		{
+			s_wadlumps[s_numwadlumps].wad = wad;
+			s_wadlumps[s_numwadlumps].lump = i;
+			s_numwadlumps++;
+		}
+	}
+	// from the last one, so that each bucket keeps the order of the wads
+	for (int i = s_numwadlumps - 1; i >= 0; i--)
+	{
+		unsigned h = WadLumpHash (s_wadlumps[i].wad->lumpinfos[s_wadlumps[i].lump].name);
+		s_wadlumps[i].next = s_wadlumphash[h];
+		s_wadlumphash[h] = i + 1;
+	}
+}
+
+// the next lump named name after lump + 1 (0 to start), or 0 when there are no more
+static int NextWadLump (const char *name, int lump)
+{
+	lump = lump? s_wadlumps[lump - 1].next: s_wadlumphash[WadLumpHash (name)];
+	for (; lump; lump = s_wadlumps[lump - 1].next)
+	{
+		if (!strcasecmp (s_wadlumps[lump - 1].wad->lumpinfos[s_wadlumps[lump - 1].lump].name, name))
+		{
+			return lump;
+		}
+	}
+	return 0;
 }
 
 void OpenWadFile (const char *name
@@ -78,8 +144,8 @@ void OpenWadFile (const char *name
    if (fullpath)
    {
 	safe_snprintf (wad->path, _MAX_PATH, "%s", name);
-	wad->file = fopen (wad->path, "rb");
-	if (!wad->file)
+	wad->map = (byte *)MapFileRead (wad->path, &wad->filesize);
+	if (!wad->map)
 	{
 		Error ("Couldn't open %s", wad->path);
 	}
@@ -90,8 +156,8 @@ void OpenWadFile (const char *name
 	for (dir = g_waddirs; dir; dir = dir->next)
 	{
 		safe_snprintf (wad->path, _MAX_PATH, "%s\\%s", dir->path, name);
-		wad->file = fopen (wad->path, "rb");
-		if (wad->file)
+		wad->map = (byte *)MapFileRead (wad->path, &wad->filesize);
+		if (wad->map)
 		{
 			break;
 		}
@@ -103,34 +169,31 @@ void OpenWadFile (const char *name
 	}
    }
 	Log ("Using Wadfile: %s\n", wad->path);
-	wad->filesize = q_filelength (wad->file);
 	struct
 	{
 		char identification[4];
 		int numlumps;
 		int infotableofs;
 	} wadinfo;
-	if (wad->filesize < (int)sizeof (wadinfo))
+	if (wad->filesize < sizeof (wadinfo))
 	{
 		Error ("Invalid wad file '%s'.", wad->path);
 	}
-	SafeRead (wad->file, &wadinfo, sizeof (wadinfo));
+	memcpy (&wadinfo, wad->map, sizeof (wadinfo));
 	wadinfo.numlumps  = LittleLong(wadinfo.numlumps);
 	wadinfo.infotableofs = LittleLong(wadinfo.infotableofs);
 	if (strncmp (wadinfo.identification, "WAD2", 4) && strncmp (wadinfo.identification, "WAD3", 4))
 		Error ("%s isn't a Wadfile!", wad->path);
 	wad->numlumps = wadinfo.numlumps;
-	if (wad->numlumps < 0 || wadinfo.infotableofs < 0 || wadinfo.infotableofs + wad->numlumps * (int)sizeof (lumpinfo_t) > wad->filesize)
+	if (wad->numlumps < 0 || wadinfo.infotableofs < 0 || (size_t)wadinfo.infotableofs + (size_t)wad->numlumps * sizeof (lumpinfo_t) > wad->filesize)
 	{
 		Error ("Invalid wad file '%s'.", wad->path);
 	}
-	wad->lumpinfos = (lumpinfo_t *)malloc (wad->numlumps * sizeof (lumpinfo_t));
+	wad->lumpinfos = (lumpinfo_t *)malloc ((wad->numlumps + 1) * sizeof (lumpinfo_t));
 	hlassume (wad->lumpinfos != NULL, assume_NoMemory);
-    if (fseek (wad->file, wadinfo.infotableofs, SEEK_SET))
-		Error ("File read failure: %s", wad->path);
+	memcpy (wad->lumpinfos, wad->map + wadinfo.infotableofs, wad->numlumps * sizeof (lumpinfo_t));
 	for (i = 0; i < wad->numlumps; i++)
 	{
-		SafeRead (wad->file, &wad->lumpinfos[i], sizeof (lumpinfo_t));
 		if (!TerminatedString(wad->lumpinfos[i].name, 16))
 		{
 			wad->lumpinfos[i].name[16 - 1] = 0;
@@ -140,7 +203,6 @@ void OpenWadFile (const char *name
 		wad->lumpinfos[i].disksize = LittleLong(wad->lumpinfos[i].disksize);
 		wad->lumpinfos[i].size = LittleLong(wad->lumpinfos[i].size);
 	}
-	qsort (wad->lumpinfos, wad->numlumps, sizeof (lumpinfo_t), lump_sorter_by_name);
 }
 
 void TryOpenWadFiles ()
@@ -195,6 +257,7 @@ void TryOpenWadFiles ()
 		}
 	   }
 		CheckFatal ();
+		HashWadLumps ();
 	}
 }
 
@@ -208,10 +271,75 @@ void TryCloseWadFiles ()
 		{
 			next = wadfile->next;
 			free (wadfile->lumpinfos);
-			fclose (wadfile->file);
+			UnmapFile (wadfile->map, wadfile->filesize);
 			free (wadfile);
 		}
 		g_wadfiles = NULL;
+		free (s_wadlumps);
+		s_wadlumps = NULL;
+		s_numwadlumps = 0;
+	}
+}
+
+// =====================================================================================
+//  Texture messages
+//      The textures are loaded by several threads, so the warnings and developer messages
+//      of each texture are kept with it and printed in texture order afterwards
+// =====================================================================================
+#define MAX_TEXTUREMESSAGE 2048
+
+typedef struct texturemessage_s
+{
+	struct texturemessage_s *next;
+	bool warning;                                          // printed with Warning, otherwise with Developer
+	char text[1];
+} texturemessage_t;
+
+static texturemessage_t **s_texturemessages = NULL;       // the messages of each texture, in the order they were made
+
+static void FORMAT_PRINTF(3,4) TextureMessage (const radtexture_t *tex, bool warning, const char *format, ...)
+{
+	char message[MAX_TEXTUREMESSAGE];
+	va_list argptr;
+	if (!warning && DEVELOPER_LEVEL_MESSAGE > g_developer)
+	{
+		return;
+	}
+	va_start (argptr, format);
+	vsnprintf (message, MAX_TEXTUREMESSAGE, Localize (format), argptr);
+	va_end (argptr);
+
+	texturemessage_t *m = (texturemessage_t *)malloc (sizeof (texturemessage_t) + strlen (message));
+	hlassume (m != NULL, assume_NoMemory);
+	m->next = NULL;
+	m->warning = warning;
+	strcpy (m->text, message);
+	texturemessage_t **last = &s_texturemessages[tex - g_textures];
+	while (*last)
+	{
+		last = &(*last)->next;
+	}
+	*last = m;
+}
+
+static void PrintTextureMessages ()
+{
+	for (int i = 0; i < g_numtextures; i++)
+	{
+		while (s_texturemessages[i])
+		{
+			texturemessage_t *m = s_texturemessages[i];
+			s_texturemessages[i] = m->next;
+			if (m->warning)
+			{
+				Warning ("%s", m->text);
+			}
+			else
+			{
+				Developer (DEVELOPER_LEVEL_MESSAGE, "%s", m->text);
+			}
+			free (m);
+		}
 	}
 }
 
@@ -289,121 +417,159 @@ void LoadTextureFromWad (radtexture_t *tex, const miptex_t *header)
 	tex->height = header->height;
 	strcpy (tex->name, header->name);
 	tex->name[16 - 1] = '\0';
-	wadfile_t *wad;
-	for (wad = g_wadfiles; wad; wad = wad->next)
+	int lump;
+	for (lump = NextWadLump (tex->name, 0); lump; lump = NextWadLump (tex->name, lump))
 	{
-		lumpinfo_t temp, *found;
-		strcpy (temp.name, tex->name);
-		found = (lumpinfo_t *)bsearch (&temp, wad->lumpinfos, wad->numlumps, sizeof (lumpinfo_t), lump_sorter_by_name);
-		if (found)
+		wadfile_t *wad = s_wadlumps[lump - 1].wad;
+		const lumpinfo_t *found = &wad->lumpinfos[s_wadlumps[lump - 1].lump];
+		TextureMessage (tex, false, "Texture '%s': found in '%s'.\n", tex->name, wad->path);
+		if (found->type != 67 || found->compression != 0)
+			continue;
+		if (found->disksize < (int)sizeof (miptex_t) || found->filepos < 0 || (size_t)found->filepos + (size_t)found->disksize > wad->filesize)
 		{
-			Developer (DEVELOPER_LEVEL_MESSAGE, "Texture '%s': found in '%s'.\n", tex->name, wad->path);
-			if (found->type != 67 || found->compression != 0)
-				continue;
-			if (found->disksize < (int)sizeof (miptex_t) || found->filepos < 0 || found->filepos + found->disksize > wad->filesize)
-			{
-				Warning ("Texture '%s': invalid texture data in '%s'.", tex->name, wad->path);
-				continue;
-			}
-			miptex_t *mt = (miptex_t *)malloc (found->disksize);
-			hlassume (mt != NULL, assume_NoMemory);
-			if (fseek (wad->file, found->filepos, SEEK_SET))
-				Error ("File read failure");
-			SafeRead (wad->file, mt, found->disksize);
-			if (!TerminatedString(mt->name, 16))
-			{
-				Warning("Texture '%s': invalid texture data in '%s'.", tex->name, wad->path);
-				free (mt);
-				continue;
-			}
-			Developer (DEVELOPER_LEVEL_MESSAGE, "Texture '%s': name '%s', width %d, height %d.\n", tex->name, mt->name, mt->width, mt->height);
-			if (strcasecmp (mt->name, tex->name))
-			{
-				Warning("Texture '%s': texture name '%s' differs from its reference name '%s' in '%s'.", tex->name, mt->name, tex->name, wad->path);
-			}
-			LoadTexture (tex, mt, found->disksize);
-			free (mt);
-			break;
+			TextureMessage (tex, true, "Texture '%s': invalid texture data in '%s'.", tex->name, wad->path);
+			continue;
+		}
+		// decoded straight from the mapping
+		miptex_t *mt = (miptex_t *)(wad->map + found->filepos);
+		if (!TerminatedString(mt->name, 16))
+		{
+			TextureMessage (tex, true, "Texture '%s': invalid texture data in '%s'.", tex->name, wad->path);
+			continue;
 		}
+		TextureMessage (tex, false, "Texture '%s': name '%s', width %d, height %d.\n", tex->name, mt->name, mt->width, mt->height);
+		if (strcasecmp (mt->name, tex->name))
+		{
+			TextureMessage (tex, true, "Texture '%s': texture name '%s' differs from its reference name '%s' in '%s'.", tex->name, mt->name, tex->name, wad->path);
+		}
+		LoadTexture (tex, mt, found->disksize);
+		break;
 	}
-	if (!wad)
+	if (!lump)
 	{
-		Warning ("Texture '%s': texture is not found in wad files.", tex->name);
+		TextureMessage (tex, true, "Texture '%s': texture is not found in wad files.", tex->name);
 		DefaultTexture (tex, tex->name);
 		return;
 	}
 }
 
-void LoadTextures ()
+static bool *s_texturereferenced = NULL;
+
+// =====================================================================================
+//  LoadTextureByIndex
+//      Decodes one miptex and computes its reflectivity. The wads are already open and
+//      only read from here, so the textures are loaded in parallel.
+// =====================================================================================
+static void LoadTextureByIndex (int i)
 {
-	if (!g_notextures)
+	int offset = ((dmiptexlump_t *)g_dtexdata)->dataofs[i];
+	int size = g_texdatasize - offset;
+	radtexture_t *tex = &g_textures[i];
+	if (g_notextures)
 	{
-		Log ("Load Textures:\n");
+		DefaultTexture (tex, "DEFAULT");
 	}
-	g_numtextures = g_texdatasize? ((dmiptexlump_t *)g_dtexdata)->nummiptex: 0;
-	g_textures = (radtexture_t *)malloc (g_numtextures * sizeof (radtexture_t));
-	hlassume (g_textures != NULL, assume_NoMemory);
-	int i;
-	for (i = 0; i < g_numtextures; i++)
+	else if (offset < 0 || size < (int)sizeof (miptex_t))
+	{
+		TextureMessage (tex, true, "Invalid texture data in '%s'.", g_source);
+		DefaultTexture (tex, "");
+	}
+	else
 	{
-		int offset = ((dmiptexlump_t *)g_dtexdata)->dataofs[i];
-		int size = g_texdatasize - offset;
-		radtexture_t *tex = &g_textures[i];
-		if (g_notextures)
+		miptex_t *mt = (miptex_t *)&g_dtexdata[offset];
+		if (!s_texturereferenced[i])
 		{
-			DefaultTexture (tex, "DEFAULT");
+			// no face can ever look at it (e.g. the other frames of an animating texture)
+			DefaultTexture (tex, mt->name);
 		}
-		else if (offset < 0 || size < (int)sizeof (miptex_t))
+		else if (mt->offsets[0])
 		{
-			Warning ("Invalid texture data in '%s'.", g_source);
-			DefaultTexture (tex, "");
+			TextureMessage (tex, false, "Texture '%s': found in '%s'.\n", mt->name, g_source);
+			TextureMessage (tex, false, "Texture '%s': name '%s', width %d, height %d.\n", mt->name, mt->name, mt->width, mt->height);
+			LoadTexture (tex, mt, size);
 		}
 		else
 		{
-			miptex_t *mt = (miptex_t *)&g_dtexdata[offset];
-			if (mt->offsets[0])
+			LoadTextureFromWad (tex, mt);
+		}
+	}
+	{
+		// the reflectivity of each palette entry, the pixels then only sum them up
+		vec3_t palettereflectivity[256];
+		for (int c = 0; c < 256; c++)
+		{
+			if (tex->name[0] == '{' && c == 0xFF)
 			{
-				Developer (DEVELOPER_LEVEL_MESSAGE, "Texture '%s': found in '%s'.\n", mt->name, g_source);
-				Developer (DEVELOPER_LEVEL_MESSAGE, "Texture '%s': name '%s', width %d, height %d.\n", mt->name, mt->name, mt->width, mt->height);
-				LoadTexture (tex, mt, size);
+				VectorFill (palettereflectivity[c], 0.0);
 			}
 			else
 			{
-				TryOpenWadFiles ();
-				LoadTextureFromWad (tex, mt);
-			}
-		}
-		{
-			vec3_t total;
-			VectorClear (total);
-			for (int j = 0; j < tex->width * tex->height; j++)
-			{
-				vec3_t reflectivity;
-				if (tex->name[0] == '{' && tex->canvas[j] == 0xFF)
+				VectorScale (tex->palette[c], 1.0/255.0, palettereflectivity[c]);
+				for (int k = 0; k < 3; k++)
 				{
-					VectorFill (reflectivity, 0.0);
+					palettereflectivity[c][k] = pow (palettereflectivity[c][k], g_texreflectgamma);
 				}
-				else
-				{
-					VectorScale (tex->palette[tex->canvas[j]], 1.0/255.0, reflectivity);
-					for (int k = 0; k < 3; k++)
-					{
-						reflectivity[k] = pow (reflectivity[k], g_texreflectgamma);
-					}
-					VectorScale (reflectivity, g_texreflectscale, reflectivity);
-				}
-				VectorAdd (total, reflectivity, total);
+				VectorScale (palettereflectivity[c], g_texreflectscale, palettereflectivity[c]);
 			}
-			VectorScale (total, 1.0 / (double)(tex->width * tex->height), total);
-			VectorCopy (total, tex->reflectivity);
-			Developer (DEVELOPER_LEVEL_MESSAGE, "Texture '%s': reflectivity is (%f,%f,%f).\n",
-				tex->name, tex->reflectivity[0], tex->reflectivity[1], tex->reflectivity[2]);
-			if (VectorMaximum (tex->reflectivity) > 1.0 + NORMAL_EPSILON)
+		}
+		vec3_t total;
+		VectorClear (total);
+		for (int j = 0; j < tex->width * tex->height; j++)
+		{
+			VectorAdd (total, palettereflectivity[tex->canvas[j]], total);
+		}
+		VectorScale (total, 1.0 / (double)(tex->width * tex->height), total);
+		VectorCopy (total, tex->reflectivity);
+		TextureMessage (tex, false, "Texture '%s': reflectivity is (%f,%f,%f).\n",
+			tex->name, tex->reflectivity[0], tex->reflectivity[1], tex->reflectivity[2]);
+		if (VectorMaximum (tex->reflectivity) > 1.0 + NORMAL_EPSILON)
+		{
+			TextureMessage (tex, true, "Texture '%s': reflectivity (%f,%f,%f) greater than 1.0.", tex->name, tex->reflectivity[0], tex->reflectivity[1], tex->reflectivity[2]);
+		}
+	}
+}
+
+void LoadTextures ()
+{
+	if (!g_notextures)
+	{
+		Log ("Load Textures:\n");
+	}
+	g_numtextures = g_texdatasize? ((dmiptexlump_t *)g_dtexdata)->nummiptex: 0;
+	g_textures = (radtexture_t *)malloc (g_numtextures * sizeof (radtexture_t));
+	hlassume (g_textures != NULL, assume_NoMemory);
+	s_texturereferenced = (bool *)calloc (g_numtextures + 1, sizeof (bool));
+	hlassume (s_texturereferenced != NULL, assume_NoMemory);
+	s_texturemessages = (texturemessage_t **)calloc (g_numtextures + 1, sizeof (texturemessage_t *));
+	hlassume (s_texturemessages != NULL, assume_NoMemory);
+	int i;
+	for (i = 0; i < g_numtexinfo; i++)
+	{
+		if (g_texinfo[i].miptex >= 0 && g_texinfo[i].miptex < g_numtextures)
+		{
+			s_texturereferenced[g_texinfo[i].miptex] = true;
+		}
+	}
+	if (!g_notextures)
+	{
+		// the wads are opened up front, so that the threads only read them
+		for (i = 0; i < g_numtextures; i++)
+		{
+			int offset = ((dmiptexlump_t *)g_dtexdata)->dataofs[i];
+			if (s_texturereferenced[i] && offset >= 0 && g_texdatasize - offset >= (int)sizeof (miptex_t)
+				&& !((miptex_t *)&g_dtexdata[offset])->offsets[0])
 			{
-				Warning ("Texture '%s': reflectivity (%f,%f,%f) greater than 1.0.", tex->name, tex->reflectivity[0], tex->reflectivity[1], tex->reflectivity[2]);
+				TryOpenWadFiles ();
+				break;
 			}
 		}
 	}
+	NamedRunThreadsOnIndividual (g_numtextures, g_estimate, LoadTextureByIndex);
+	PrintTextureMessages ();
+	free (s_texturemessages);
+	s_texturemessages = NULL;
+	free (s_texturereferenced);
+	s_texturereferenced = NULL;
 	if (!g_notextures)
 	{
 		Log ("%i textures referenced\n", g_numtextures);
@@ -185,10 +185,7 @@ void            MakeScalesNoVismatrix()
     if (!g_incremental || !readtransfers(transferfile, g_num_patches))
     {
         g_CheckVisBit = CheckVisBitNoVismatrix;
-	if(g_rgb_transfers)
-		{NamedRunThreadsOn(g_num_patches, g_estimate, MakeRGBScales);}
-	else
-		{NamedRunThreadsOn(g_num_patches, g_estimate, MakeScales);}
+        RunMakeScales();
 
         if (g_incremental)
         {
@@ -69,6 +69,8 @@ char            g_source[_MAX_PATH] = "";
 
 char            g_vismatfile[_MAX_PATH] = "";
 bool            g_incremental = DEFAULT_INCREMENTAL;
+unsigned        g_transfermemory = DEFAULT_TRANSFERMEMORY;
+vec_t           g_skycache = DEFAULT_SKYCACHE;
 float           g_indirect_sun = DEFAULT_INDIRECT_SUN;
 bool            g_extra = DEFAULT_EXTRA;
 bool            g_texscale = DEFAULT_TEXSCALE;
@@ -2054,6 +2056,170 @@ static void     CollectLight()
     }
 }
 
+// =====================================================================================
+//  Bounce emitters
+//      The light each patch sends out in the current bounce, packed by CollectEmitters so
+//      that GatherLight reads a few small arrays instead of patch_t and emitlight. The
+//      lights of patch i are s_emitlights[s_emitfirst[i]] to s_emitlights[s_emitfirst[i + 1] - 1].
+// =====================================================================================
+#define GATHER_BLOCK_SIZE 64                               // transfers decompressed at a time
+
+static unsigned* s_emitfirst;
+static vec3_t*   s_emitlights;
+static unsigned char* s_emitstyles;                        // already converted to the bouncestyle of the patch
+static unsigned  s_maxemitlights;
+static vec3_t*   s_emitreflectivity;
+static bool      s_emitstyle0only;                         // no style other than 0 is sent or picked up in this bounce
+
+static void     AddEmitLight(const patch_t* const patch, const vec3_t light, int style, unsigned& count, const bool fill)
+{
+    if (patch->bouncestyle != -1)
+    {
+        if (style == 0 || style == patch->bouncestyle)
+            style = patch->bouncestyle;
+        else
+            return;
+    }
+    if (style != 0)
+    {
+        s_emitstyle0only = false;
+    }
+    if (fill)
+    {
+        VectorCopy(light, s_emitlights[count]);
+        s_emitstyles[count] = style;
+    }
+    count++;
+}
+
+// =====================================================================================
+//  CollectEmitters
+//      The direct light of each patch goes first and then its bounced light, the order
+//      GatherLight has always added them in.
+// =====================================================================================
+static void     CollectEmitters()
+{
+    unsigned        i;
+    unsigned        j;
+    unsigned        count;
+    patch_t*        patch;
+
+    if (!s_emitfirst)
+    {
+        s_emitfirst = (unsigned*)AllocBlock((g_num_patches + 1) * sizeof(unsigned));
+        s_emitreflectivity = (vec3_t*)AllocBlock((g_num_patches + 1) * sizeof(vec3_t));
+        for (i = 0, patch = g_patches; i < g_num_patches; i++, patch++)
+        {
+            VectorCopy(patch->bouncereflectivity, s_emitreflectivity[i]);
+        }
+    }
+
+    // count first, then fill
+    for (int pass = 0; pass < 2; pass++)
+    {
+        s_emitstyle0only = !HasStyleArrays();
+        for (i = 0, count = 0, patch = g_patches; i < g_num_patches; i++, patch++)
+        {
+            s_emitfirst[i] = count;
+            for (j = 0; j < MAXLIGHTMAPS && patch->directstyle[j] != 255; j++)
+            {
+                AddEmitLight(patch, patch->directlight[j], patch->directstyle[j], count, pass == 1);
+            }
+            for (j = 0; j < MAXLIGHTMAPS && patch->totalstyle[j] != 255; j++)
+            {
+                AddEmitLight(patch, emitlight[i][j], patch->totalstyle[j], count, pass == 1);
+            }
+        }
+        s_emitfirst[g_num_patches] = count;
+
+        if (pass == 0 && count > s_maxemitlights)
+        {
+            if (s_emitlights)
+            {
+                FreeBlock(s_emitlights);
+                FreeBlock(s_emitstyles);
+            }
+            s_maxemitlights = count;
+            s_emitlights = (vec3_t*)AllocBlock((s_maxemitlights + 1) * sizeof(vec3_t));
+            s_emitstyles = (unsigned char*)AllocBlock((s_maxemitlights + 1) * sizeof(unsigned char));
+        }
+    }
+}
+
+static void     FreeEmitters()
+{
+    if (s_emitfirst)
+    {
+        FreeBlock(s_emitfirst);
+        FreeBlock(s_emitreflectivity);
+        s_emitfirst = NULL;
+        s_emitreflectivity = NULL;
+    }
+    if (s_emitlights)
+    {
+        FreeBlock(s_emitlights);
+        FreeBlock(s_emitstyles);
+        s_emitlights = NULL;
+        s_emitstyles = NULL;
+    }
+    s_maxemitlights = 0;
+}
+
+// =====================================================================================
+//  GatherFromEmitter
+//      Adds the light of emitter scaled by a transfer of f to adds
+// =====================================================================================
+inline void     GatherFromEmitter(const patch_t* const patch, const unsigned emitter, const vec3_t f, const int opaquestyle, vec3_t* const adds)
+{
+    const unsigned  last = s_emitfirst[emitter + 1];
+    vec3_t          v;
+
+    for (unsigned l = s_emitfirst[emitter]; l < last; l++)
+    {
+        VectorMultiply(s_emitlights[l], f, v);
+        VectorMultiply(v, s_emitreflectivity[emitter], v);
+        if (isPointFinite(v))
+        {
+            int addstyle = s_emitstyles[l];
+            if (opaquestyle != -1)
+            {
+                if (addstyle == 0 || addstyle == opaquestyle)
+                    addstyle = opaquestyle;
+                else
+                    continue;
+            }
+            VectorAdd(adds[addstyle], v, adds[addstyle]);
+        }
+        else
+        {
+            Verbose("GatherLight, v (%4.3f %4.3f %4.3f)@(%4.3f %4.3f %4.3f)\n",
+                v[0], v[1], v[2], patch->origin[0], patch->origin[1], patch->origin[2]);
+        }
+    }
+}
+
+// Same for when every light is style 0, which is all most maps have
+inline void     GatherFromEmitterStyle0(const patch_t* const patch, const unsigned emitter, const vec3_t f, vec_t* const add)
+{
+    const unsigned  last = s_emitfirst[emitter + 1];
+    vec3_t          v;
+
+    for (unsigned l = s_emitfirst[emitter]; l < last; l++)
+    {
+        VectorMultiply(s_emitlights[l], f, v);
+        VectorMultiply(v, s_emitreflectivity[emitter], v);
+        if (isPointFinite(v))
+        {
+            VectorAdd(add, v, add);
+        }
+        else
+        {
+            Verbose("GatherLight, v (%4.3f %4.3f %4.3f)@(%4.3f %4.3f %4.3f)\n",
+                v[0], v[1], v[2], patch->origin[0], patch->origin[1], patch->origin[2]);
+        }
+    }
+}
+
 // =====================================================================================
 //  GatherLight
 //      Get light from other g_patches
@@ -2074,7 +2240,7 @@ static void     GatherLight(int threadnum)
     unsigned        iIndex;
     transfer_data_t* tData;
     transfer_index_t* tIndex;
-	float f;
+	float			f[GATHER_BLOCK_SIZE];
 	vec3_t			adds[ALLSTYLES];
 
 	int				style;
@@ -2087,6 +2253,7 @@ static void     GatherLight(int threadnum)
         {
             break;
         }
+        j += g_segmentfirstpatch;
 		memset (adds, 0, ALLSTYLES * sizeof(vec3_t));
 
         patch = &g_patches[j];
@@ -2106,71 +2273,29 @@ static void     GatherLight(int threadnum)
             unsigned        size = (tIndex->size + 1);
             unsigned        patchnum = tIndex->index;
 
-            for (l = 0; l < size; l++, tData+=float_size[g_transfer_compress_type], patchnum++)
+            for (l = 0; l < size; l += GATHER_BLOCK_SIZE)
             {
-                vec3_t          v;
-                 //LRC:
-				patch_t*		emitpatch = &g_patches[patchnum];
-				unsigned		emitstyle;
-				int				opaquestyle = -1;
-				GetStyle (j, patchnum, opaquestyle, fastfind_index);
-				float_decompress (g_transfer_compress_type, tData, &f);
-
-				// for each style on the emitting patch
-				for (emitstyle = 0; emitstyle < MAXLIGHTMAPS && emitpatch->directstyle[emitstyle] != 255; emitstyle++)
-				{
-					VectorScale(emitpatch->directlight[emitstyle], f, v);
-					VectorMultiply(v, emitpatch->bouncereflectivity, v);
-					if (isPointFinite (v))
-					{
-						int addstyle = emitpatch->directstyle[emitstyle];
-						if (emitpatch->bouncestyle != -1)
-						{
-							if (addstyle == 0 || addstyle == emitpatch->bouncestyle)
-								addstyle = emitpatch->bouncestyle;
-							else
-								continue;
-						}
-						if (opaquestyle != -1)
-						{
-							if (addstyle == 0 || addstyle == opaquestyle)
-								addstyle = opaquestyle;
-							else
-								continue;
-						}
-						VectorAdd(adds[addstyle], v, adds[addstyle]);
-					}
-				}
-				for (emitstyle = 0; emitstyle < MAXLIGHTMAPS && emitpatch->totalstyle[emitstyle] != 255; emitstyle++)
-				{
-					VectorScale(emitlight[patchnum][emitstyle], f, v);
-					VectorMultiply(v, emitpatch->bouncereflectivity, v);
-					if (isPointFinite(v))
-					{
-						int addstyle = emitpatch->totalstyle[emitstyle];
-						if (emitpatch->bouncestyle != -1)
-						{
-							if (addstyle == 0 || addstyle == emitpatch->bouncestyle)
-								addstyle = emitpatch->bouncestyle;
-							else
-								continue;
-						}
-						if (opaquestyle != -1)
-						{
-							if (addstyle == 0 || addstyle == opaquestyle)
-								addstyle = opaquestyle;
-							else
-								continue;
-						}
-						VectorAdd(adds[addstyle], v, adds[addstyle]);
-					}
-					else
-					{
-						Verbose("GatherLight, v (%4.3f %4.3f %4.3f)@(%4.3f %4.3f %4.3f)\n",
-							v[0], v[1], v[2], patch->origin[0], patch->origin[1], patch->origin[2]);
-					}
-				}
-                //LRC (ends)
+                const unsigned  count = qmin(size - l, (unsigned)GATHER_BLOCK_SIZE);
+                unsigned        b;
+
+                float_decompress_block (g_transfer_compress_type, tData, f, count);
+                tData += count * float_size[g_transfer_compress_type];
+
+                for (b = 0; b < count; b++, patchnum++)
+                {
+                    const vec3_t    scale = {f[b], f[b], f[b]};
+
+                    if (s_emitstyle0only)
+                    {
+                        GatherFromEmitterStyle0 (patch, patchnum, scale, adds[0]);
+                    }
+                    else
+                    {
+                        int opaquestyle = -1;
+                        GetStyle (j, patchnum, opaquestyle, fastfind_index);
+                        GatherFromEmitter (patch, patchnum, scale, opaquestyle, adds);
+                    }
+                }
             }
         }
 
@@ -2249,6 +2374,7 @@ static void     GatherRGBLight(int threadnum)
         {
             break;
         }
+        j += g_segmentfirstpatch;
 		memset (adds, 0, ALLSTYLES * sizeof(vec3_t));
 
         patch = &g_patches[j];
@@ -2269,69 +2395,18 @@ static void     GatherRGBLight(int threadnum)
             unsigned        patchnum = tIndex->index;
             for (l = 0; l < size; l++, tRGBData+=vector_size[g_rgbtransfer_compress_type], patchnum++)
             {
-                vec3_t          v;
-                 //LRC:
-				patch_t*		emitpatch = &g_patches[patchnum];
-				unsigned		emitstyle;
-				int				opaquestyle = -1;
-				GetStyle (j, patchnum, opaquestyle, fastfind_index);
 				vector_decompress (g_rgbtransfer_compress_type, tRGBData, &f[0], &f[1], &f[2]);
 
-				// for each style on the emitting patch
-				for (emitstyle = 0; emitstyle < MAXLIGHTMAPS && emitpatch->directstyle[emitstyle] != 255; emitstyle++)
+				if (s_emitstyle0only)
 				{
-					VectorMultiply(emitpatch->directlight[emitstyle], f, v);
-					VectorMultiply(v, emitpatch->bouncereflectivity, v);
-					if (isPointFinite (v))
-					{
-						int addstyle = emitpatch->directstyle[emitstyle];
-						if (emitpatch->bouncestyle != -1)
-						{
-							if (addstyle == 0 || addstyle == emitpatch->bouncestyle)
-								addstyle = emitpatch->bouncestyle;
-							else
-								continue;
-						}
-						if (opaquestyle != -1)
-						{
-							if (addstyle == 0 || addstyle == opaquestyle)
-								addstyle = opaquestyle;
-							else
-								continue;
-						}
-						VectorAdd(adds[addstyle], v, adds[addstyle]);
-					}
+					GatherFromEmitterStyle0 (patch, patchnum, f, adds[0]);
 				}
-				for (emitstyle = 0; emitstyle < MAXLIGHTMAPS && emitpatch->totalstyle[emitstyle] != 255; emitstyle++)
+				else
 				{
-					VectorMultiply(emitlight[patchnum][emitstyle], f, v);
-					VectorMultiply(v, emitpatch->bouncereflectivity, v);
-					if (isPointFinite(v))
-					{
-						int addstyle = emitpatch->totalstyle[emitstyle];
-						if (emitpatch->bouncestyle != -1)
-						{
-							if (addstyle == 0 || addstyle == emitpatch->bouncestyle)
-								addstyle = emitpatch->bouncestyle;
-							else
-								continue;
-						}
-						if (opaquestyle != -1)
-						{
-							if (addstyle == 0 || addstyle == opaquestyle)
-								addstyle = opaquestyle;
-							else
-								continue;
-						}
-						VectorAdd(adds[addstyle], v, adds[addstyle]);
-					}
-					else
-					{
-						Verbose("GatherLight, v (%4.3f %4.3f %4.3f)@(%4.3f %4.3f %4.3f)\n",
-							v[0], v[1], v[2], patch->origin[0], patch->origin[1], patch->origin[2]);
-					}
+					int opaquestyle = -1;
+					GetStyle (j, patchnum, opaquestyle, fastfind_index);
+					GatherFromEmitter (patch, patchnum, f, opaquestyle, adds);
 				}
-                //LRC (ends)
             }
         }
 
@@ -2412,7 +2487,25 @@ static void     BounceLight()
     for (i = 0; i < g_numbounce; i++)
     {
         Log("Bounce %u ", i + 1);
-	if(g_rgb_transfers)
+        CollectEmitters();
+        if (g_transfermemory)
+        {
+            // the transfers are only in memory a segment at a time
+            unsigned        first;
+            unsigned        count;
+
+            Log("%s:\n", g_rgb_transfers? "GatherRGBLight": "GatherLight");
+            ProfileBeginStage(g_rgb_transfers? "GatherRGBLight": "GatherLight");
+            BeginTransferPass();
+            while (NextTransferSegment(first, count))
+            {
+                g_segmentfirstpatch = first;
+                RunThreadsOn(count, false, g_rgb_transfers? GatherRGBLight: GatherLight);
+            }
+            g_segmentfirstpatch = 0;
+            ProfileEndStage();
+        }
+	else if(g_rgb_transfers)
 	       	{NamedRunThreadsOn(g_num_patches, g_estimate, GatherRGBLight);}
         else
         	{NamedRunThreadsOn(g_num_patches, g_estimate, GatherLight);}
@@ -2432,6 +2525,7 @@ static void     BounceLight()
 			VectorCopy (emitlight[i][j], patch->totallight[j]);
 		}
 	}
+	FreeEmitters();
 }
 
 // =====================================================================================
@@ -2480,6 +2574,11 @@ static void     FreeTransfers()
     unsigned        x;
     patch_t*        patch = g_patches;
 
+	if (unmaptransfers() || FreeTransferStream())
+	{
+		// the transfers pointed into the mapped transfer file or the stream buffers
+		return;
+	}
     for (x = 0; x < g_num_patches; x++, patch++)
     {
         if (patch->tData)
@@ -2541,13 +2640,17 @@ static void     RadWorld()
     unsigned        i;
     unsigned        j;
 
+    ProfileBeginStage("MakeTnodes");
     MakeBackplanes();
     MakeParents(0, -1);
     MakeTnodes(&g_dmodels[0]);
 	CreateOpaqueNodes();
 	LoadOpaqueEntities();
+	BuildOpaqueBVHs();
+    ProfileEndStage();
 
     // turn each face into a single patch
+    ProfileBeginStage("MakePatches");
     MakePatches();
 
 	if (g_drawpatch)
@@ -2582,6 +2685,7 @@ static void     RadWorld()
     CheckMaxPatches(); // Check here for exceeding max patches, to prevent a lot of work from occuring before an error occurs
     SortPatches(); // Makes the runs in the Transfer Compression really good
     PairEdges();
+    ProfileEndStage();
 
 	if ( g_drawedge )
 	{
@@ -2643,7 +2747,9 @@ static void     RadWorld()
     if (g_numbounce > 0)
     {
         // build transfer lists
+        ProfileBeginStage("MakeScales");
         MakeScalesStub();
+        ProfileEndStage();
 
 		// these arrays are only used in CollectLight, GatherLight and BounceLight
 		emitlight = (vec3_t (*)[MAXLIGHTMAPS])AllocBlock ((g_num_patches + 1) * sizeof (vec3_t [MAXLIGHTMAPS]));
@@ -2651,7 +2757,9 @@ static void     RadWorld()
 		newstyles = (unsigned char (*)[MAXLIGHTMAPS])AllocBlock ((g_num_patches + 1) * sizeof (unsigned char [MAXLIGHTMAPS]));
        
 		// spread light around
+        ProfileBeginStage("BounceLight");
         BounceLight();
+        ProfileEndStage();
 
 		FreeBlock (emitlight);
 		emitlight = NULL;
@@ -2732,7 +2840,9 @@ static void     Usage()
     Log("    -sky #          : Set ambient sunlight contribution in the shade outside\n");
     Log("    -lights file    : Manually specify a lights.rad file to use\n");
     Log("    -noskyfix       : Disable light_environment being global\n");
-    Log("    -incremental    : Use or create an incremental transfer list file\n\n");
+    Log("    -skycache #     : Settle sky visibility once per face from probes # pixels apart\n");
+    Log("    -incremental    : Use or create an incremental transfer list file\n");
+    Log("    -transfermemory # : Keep the transfers in a file and only about # MB of them in memory\n\n");
     Log("    -dump           : Dumps light patches to a file for hlrad debugging info\n\n");
     Log("    -texdata #      : Alter maximum texture memory limit (in kb)\n");
     Log("    -lightdata #    : Alter maximum lighting memory limit (in kb)\n"); //lightdata
@@ -2930,7 +3040,17 @@ static void     Settings()
 	Log("spread angles        [ %17s ] [ %17s ]\n", g_allow_spread ? "on" : "off", DEFAULT_ALLOW_SPREAD ? "on" : "off");
     Log("opaque entities      [ %17s ] [ %17s ]\n", g_allow_opaques ? "on" : "off", DEFAULT_ALLOW_OPAQUES ? "on" : "off");
     Log("sky lighting fix     [ %17s ] [ %17s ]\n", g_sky_lighting_fix ? "on" : "off", DEFAULT_SKY_LIGHTING_FIX ? "on" : "off");
+    if (g_skycache > 0)
+        safe_snprintf(buf1, sizeof(buf1), "%3.1f", g_skycache);
+    else
+        safe_snprintf(buf1, sizeof(buf1), "off");
+    Log("sky cache            [ %17s ] [ %17s ]\n", buf1, "off");
     Log("incremental          [ %17s ] [ %17s ]\n", g_incremental ? "on" : "off", DEFAULT_INCREMENTAL ? "on" : "off");
+    if (g_transfermemory)
+        safe_snprintf(buf1, sizeof(buf1), "%u MB", g_transfermemory);
+    else
+        safe_snprintf(buf1, sizeof(buf1), "off");
+    Log("transfer memory      [ %17s ] [ %17s ]\n", buf1, "off");
     Log("dump                 [ %17s ] [ %17s ]\n", g_dumppatches ? "on" : "off", DEFAULT_DUMPPATCHES ? "on" : "off");
 
     // ------------------------------------------------------------------------
@@ -3439,6 +3559,34 @@ int             main(const int argc, char** argv)
 			{
 			    g_incremental = true;
 			}
+			else if (!strcasecmp(argv[i], "-skycache"))
+			{
+			    if (i + 1 < argc)
+			    {
+			        g_skycache = atof(argv[++i]);
+			    }
+			    else
+			    {
+			        Usage();
+			    }
+			}
+			else if (!strcasecmp(argv[i], "-transfermemory"))
+			{
+			    if (i + 1 < argc)
+			    {
+			        const int transfermemory = atoi(argv[++i]);
+			        if (transfermemory < 0)
+			        {
+			            Log("expected value of 0 or greater for '-transfermemory'\n");
+			            Usage();
+			        }
+			        g_transfermemory = transfermemory;
+			    }
+			    else
+			    {
+			        Usage();
+			    }
+			}
 			else if (!strcasecmp(argv[i], "-chart"))
 			{
 			    g_chart = true;
@@ -3928,6 +4076,7 @@ int             main(const int argc, char** argv)
 		StripExtension(g_Mapname);
 		OpenLog(g_clientid);
 		atexit(CloseLog);
+		atexit(WriteProfileReport);
 		ThreadSetDefault();
 		ThreadSetPriority(g_threadpriority);
 		LogStart(argcold, argvold);
@@ -3967,6 +4116,7 @@ int             main(const int argc, char** argv)
 		// normalise maxlight
 
 		safe_snprintf(g_source, _MAX_PATH, "%s.bsp", g_Mapname);
+		ProfileBeginStage("LoadBSPFile");
 		LoadBSPFile(g_source);
 
 #ifndef PLATFORM_CAN_CALC_EXTENT
@@ -3981,12 +4131,19 @@ int             main(const int argc, char** argv)
 #endif
     
 		ParseEntities();
+		ProfileEndStage();
 		
 		if (g_fastmode)
 		{
 			g_numbounce = 0;
 			g_softsky = false;
 		}
+		if (g_incremental && g_transfermemory)
+		{
+			// the incremental file is written from transfers that are all in memory
+			Warning("-incremental is ignored with -transfermemory");
+			g_incremental = false;
+		}
 
 		Settings();
 		DeleteEmbeddedLightmaps ();
@@ -4029,7 +4186,9 @@ int             main(const int argc, char** argv)
 			g_blur = 0.005;
 		}
 
+		ProfileBeginStage("RadWorld");
 		RadWorld();
+		ProfileEndStage();
 
 		FreeOpaqueFaceList();
 		FreePatches();
@@ -4039,7 +4198,9 @@ int             main(const int argc, char** argv)
 		if (g_chart)
 		    PrintBSPFileSizes();
 
+		ProfileBeginStage("WriteBSPFile");
 		WriteBSPFile(g_source);
+		ProfileEndStage();
 
 		end = I_FloatTime();
 		LogTimeElapsed(end - start);
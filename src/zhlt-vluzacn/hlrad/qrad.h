@@ -64,6 +64,8 @@
 #define DEFAULT_SMOOTHING_VALUE     50.0
 #define DEFAULT_SMOOTHING2_VALUE	-1.0
 #define DEFAULT_INCREMENTAL         false
+#define DEFAULT_TRANSFERMEMORY      0                      // MB, 0 keeps all transfers in memory
+#define DEFAULT_SKYCACHE            0.0                    // lightmap pixels between sky probes, 0 traces every sample
 
 
 // ------------------------------------------------------------------------
@@ -221,6 +223,7 @@ typedef struct directlight_s
 	int				numsunnormals;
 	vec3_t*			sunnormals;
 	vec_t*			sunnormalweights;
+	int				skycacheslot;                          // the sky cache direction of sunnormals[0]
 
 	vec_t			patch_area;
 	vec_t			patch_emitter_range;
@@ -404,9 +407,11 @@ extern bool     g_estimate;
 extern char     g_source[_MAX_PATH];
 extern vec_t    g_fade;
 extern bool     g_incremental;
+extern unsigned g_transfermemory;
 extern bool     g_circus;
 extern bool		g_allow_spread;
 extern bool     g_sky_lighting_fix;
+extern vec_t    g_skycache;
 extern vec_t    g_chop;    // Chop value for normal textures
 extern vec_t    g_texchop; // Chop value for texture lights
 extern opaqueList_t* g_opaque_face_list;
@@ -469,6 +474,7 @@ extern void     PairEdges();
 extern int		g_numskynormals[SKYLEVELMAX+1]; // 0, 6, 18, 66, 258, 1026, 4098, 16386, 65538
 extern vec3_t*	g_skynormals[SKYLEVELMAX+1]; //[numskynormals]
 extern vec_t*	g_skynormalsizes[SKYLEVELMAX+1]; // the weight of each normal
+extern int*		g_skynormalorder[SKYLEVELMAX+1]; // the normals sorted so that neighbours in the list are close together
 extern void     BuildDiffuseNormals ();
 extern void     BuildFacelights(int facenum);
 extern void     PrecompLightmapOffsets();
@@ -481,21 +487,27 @@ extern void		FreeFacelightDependencyList ();
 extern int      TestLine(const vec3_t start, const vec3_t stop
 						 , vec_t *skyhitout = NULL
 						 );
+#define TESTLINE_PACKET 8 // rays traced together by TestLinePacket
+extern void     TestLinePacket(int numrays, const vec3_t* starts, const vec3_t* stops, int* contents
+							   , vec3_t* skyhits = NULL
+							   );
 #define OPAQUE_NODE_INLINECALL
 #ifdef OPAQUE_NODE_INLINECALL
 typedef struct
 {
 	vec3_t mins, maxs;
 	int headnode;
+	int bvhnode; // -1 if the model has no faces or is not in g_opaque_face_list
 } opaquemodel_t;
 extern opaquemodel_t *opaquemodels;
 #endif
 extern void		CreateOpaqueNodes();
+extern void		BuildOpaqueBVHs();
 extern int		TestLineOpaque(int modelnum, const vec3_t modelorigin, const vec3_t start, const vec3_t stop);
 extern int		CountOpaqueFaces(int modelnum);
 extern void		DeleteOpaqueNodes();
 #ifdef OPAQUE_NODE_INLINECALL
-extern int TestPointOpaque_r (int nodenum, bool solid, const vec3_t point);
+extern int TestPointOpaque_r (const opaquemodel_t *model, bool solid, const vec3_t point);
 FORCEINLINE int TestPointOpaque (int modelnum, const vec3_t modelorigin, bool solid, const vec3_t point) // use "forceinline" because "inline" does nothing here
 {
 	opaquemodel_t *thismodel = &opaquemodels[modelnum];
@@ -509,7 +521,7 @@ FORCEINLINE int TestPointOpaque (int modelnum, const vec3_t modelorigin, bool so
 		if (newpoint[axial] < thismodel->mins[axial])
 			return 0;
 	}
-	return TestPointOpaque_r (thismodel->headnode, solid, newpoint);
+	return TestPointOpaque_r (thismodel, solid, newpoint);
 }
 #else
 extern int		TestPointOpaque (int modelnum, const vec3_t modelorigin, bool solid, const vec3_t point);
@@ -523,6 +535,9 @@ typedef bool (*funcCheckVisBit) (unsigned, unsigned
 								 , unsigned int&
 								 );
 extern funcCheckVisBit g_CheckVisBit;
+// Optional, returns the first patch from the second one on that the first can see, or g_num_patches
+typedef unsigned (*funcNextVisBit) (unsigned, unsigned);
+extern funcNextVisBit g_NextVisBit;
 extern bool CheckVisBitBackwards(unsigned receiver, unsigned emitter, const vec3_t &backorigin, const vec3_t &backnormal
 								, vec3_t &transparency_out
 								);
@@ -560,9 +575,16 @@ extern void     MakeScalesNoVismatrix();
 extern size_t   g_total_transfer;
 extern bool     readtransfers(const char* const transferfile, long numpatches);
 extern void     writetransfers(const char* const transferfile, long total_patches);
+extern bool     unmaptransfers();
+extern unsigned g_segmentfirstpatch;                      // patch of work 0 of MakeScales and GatherLight
+extern void     StreamMakeScales(q_threadfunction func, const char* name);
+extern void     BeginTransferPass();
+extern bool     NextTransferSegment(unsigned& firstpatch, unsigned& numpatches);
+extern bool     FreeTransferStream();
 
 // vismatrixutil.c (shared between vismatrix.c and sparse.c)
 extern void     MakeScales(int threadnum);
+extern void     RunMakeScales();
 extern void     DumpTransfersMemoryUsage();
 extern void     MakeRGBScales(int threadnum);
 
@@ -575,6 +597,7 @@ extern void GetStyle(const unsigned p1, const unsigned p2, int &style, unsigned
 extern void	AddStyleToStyleArray(const unsigned p1, const unsigned p2, const int style);
 extern void	CreateFinalStyleArrays(const char *print_name);
 extern void	FreeStyleArrays();
+extern bool	HasStyleArrays();
 
 // lerp.c
 extern void CreateTriangulations (int facenum);
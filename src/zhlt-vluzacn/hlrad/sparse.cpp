@@ -1,136 +1,207 @@
 #include "qrad.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 
 
+// =====================================================================================
+//
+//      SPARSE VISIBILITY MATRIX
+//      Each patch has a row with a bit for every other patch, kept as runs of nonzero
+//      64-bit words. Only the upper half (m > patchnum) is stored, BuildVisLeafs fills the
+//      rows of the patches in its leaf. The bit of a pair is in the row of the smaller patch.
+//
+// =====================================================================================
+
+typedef unsigned long long sparse_word_t;
 
 typedef struct
 {
-    unsigned        offset:24;
-    unsigned        values:8;
+    unsigned        firstword;                             // index in the full row of the first word of the run
+    unsigned        numwords;
+}
+sparse_run_t;
+
+typedef struct
+{
+    sparse_run_t*   runs;
+    sparse_word_t*  words;                                 // the words of all runs, one after another
+    unsigned        numruns;
+    unsigned        maxruns;
+    unsigned        numwords;
+    unsigned        maxwords;
 }
 sparse_row_t;
 
+// Position of the last lookup of a thread, MakeScales asks for the patches of a row in order
 typedef struct
 {
-    sparse_row_t*   row;
-    int             count;
+    const sparse_row_t* row;
+    unsigned        run;
+    unsigned        word;                                  // index in row->words of the first word of run
 }
-sparse_column_t;
+sparse_cursor_t;
 
-sparse_column_t* s_vismatrix;
+static sparse_row_t* s_vismatrix;
+static thread_local sparse_cursor_t t_sparsecursor;
 
-// Vismatrix protected
-static unsigned IsVisbitInArray(const unsigned x, const unsigned y)
+// Index of the lowest set bit, bits must not be 0
+static unsigned LowestBit(const sparse_word_t bits)
 {
-    int             first, last, current;
-    int             y_byte = y / 8;
-    sparse_row_t*  row;
-    sparse_column_t* column = s_vismatrix + x;
+#if defined(__GNUC__)
+    return (unsigned)__builtin_ctzll(bits);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long   bit;
+
+    _BitScanForward64(&bit, bits);
+    return (unsigned)bit;
+#elif defined(_MSC_VER)
+    unsigned long   bit;
 
-    if (!column->count)
+    if ((unsigned long)bits)
     {
-        return -1;
+        _BitScanForward(&bit, (unsigned long)bits);
+        return (unsigned)bit;
     }
+    _BitScanForward(&bit, (unsigned long)(bits >> 32));
+    return 32 + (unsigned)bit;
+#else
+    unsigned        bit = 0;
 
-    first = 0;
-    last = column->count - 1;
+    while (!(bits & ((sparse_word_t)1 << bit)))
+    {
+        bit++;
+    }
+    return bit;
+#endif
+}
 
-    //    Warning("Searching . . .");
-    // binary search to find visbit
-    while (1)
+// =====================================================================================
+//  AppendWordToRow
+//      Words must come in increasing order, a word equal to the last one is merged into it
+// =====================================================================================
+static void     AppendWordToRow(sparse_row_t* const row, const unsigned index, const sparse_word_t bits)
+{
+    if (row->numruns)
     {
-        current = (first + last) / 2;
-        row = column->row + current;
-        //        Warning("first %u, last %u, current %u, row %p, row->offset %u", first, last, current, row, row->offset);
-        if ((row->offset) < y_byte)
+        sparse_run_t*   run = &row->runs[row->numruns - 1];
+        const unsigned  last = run->firstword + run->numwords - 1;
+
+        hlassert(index >= last);
+        if (index == last)
         {
-            first = current + 1;
+            row->words[row->numwords - 1] |= bits;
+            return;
         }
-        else if ((row->offset) > y_byte)
+        if (index == last + 1)
         {
-            last = current - 1;
+            if (row->numwords >= row->maxwords)
+            {
+                row->maxwords = qmax(16u, row->maxwords * 2);
+                row->words = (sparse_word_t*)realloc(row->words, row->maxwords * sizeof(sparse_word_t));
+                hlassume(row->words != NULL, assume_NoMemory);
+            }
+            row->words[row->numwords++] = bits;
+            run->numwords++;
+            return;
         }
-        else
+    }
+    if (row->numruns >= row->maxruns)
+    {
+        row->maxruns = qmax(4u, row->maxruns * 2);
+        row->runs = (sparse_run_t*)realloc(row->runs, row->maxruns * sizeof(sparse_run_t));
+        hlassume(row->runs != NULL, assume_NoMemory);
+    }
+    if (row->numwords >= row->maxwords)
+    {
+        row->maxwords = qmax(16u, row->maxwords * 2);
+        row->words = (sparse_word_t*)realloc(row->words, row->maxwords * sizeof(sparse_word_t));
+        hlassume(row->words != NULL, assume_NoMemory);
+    }
+    row->runs[row->numruns].firstword = index;
+    row->runs[row->numruns].numwords = 1;
+    row->numruns++;
+    row->words[row->numwords++] = bits;
+}
+
+static void     ShrinkRow(sparse_row_t* const row)
+{
+    if (row->numruns < row->maxruns)
+    {
+        row->maxruns = row->numruns;
+        row->runs = (sparse_run_t*)realloc(row->runs, qmax(1u, row->maxruns) * sizeof(sparse_run_t));
+        hlassume(row->runs != NULL, assume_NoMemory);
+    }
+    if (row->numwords < row->maxwords)
+    {
+        row->maxwords = row->numwords;
+        row->words = (sparse_word_t*)realloc(row->words, qmax(1u, row->maxwords) * sizeof(sparse_word_t));
+        hlassume(row->words != NULL, assume_NoMemory);
+    }
+}
+
+static void     FreeRow(sparse_row_t* const row)
+{
+    free(row->runs);
+    free(row->words);
+    memset(row, 0, sizeof(sparse_row_t));
+}
+
+// =====================================================================================
+//  SeekRow
+//      Points the cursor of this thread at the first run of row that doesn't end before
+//      word index. Returns false if there is none.
+// =====================================================================================
+static bool     SeekRow(const sparse_row_t* const row, const unsigned index)
+{
+    sparse_cursor_t* const c = &t_sparsecursor;
+
+    if (c->row != row || c->run >= row->numruns || row->runs[c->run].firstword > index)
+    {
+        // binary search for the first run that ends at or after index
+        unsigned        first = 0;
+        unsigned        last = row->numruns;
+
+        while (first < last)
         {
-            return current;
+            const unsigned  current = (first + last) / 2;
+
+            if (row->runs[current].firstword + row->runs[current].numwords <= index)
+            {
+                first = current + 1;
+            }
+            else
+            {
+                last = current;
+            }
         }
-        if (first > last)
+        c->row = row;
+        c->run = first;
+        c->word = 0;
+        for (unsigned r = 0; r < first; r++)
         {
-            return -1;
+            c->word += row->runs[r].numwords;
         }
+        return c->run < row->numruns;
     }
+    while (c->run < row->numruns && row->runs[c->run].firstword + row->runs[c->run].numwords <= index)
+    {
+        c->word += row->runs[c->run].numwords;
+        c->run++;
+    }
+    return c->run < row->numruns;
 }
 
-static void		SetVisColumn (int patchnum, bool uncompressedcolumn[MAX_SPARSE_VISMATRIX_PATCHES])
+static bool     TestRowBit(const sparse_row_t* const row, const unsigned column)
 {
-	sparse_column_t *column;
-	int mbegin;
-	int m;
-	int i;
-	unsigned int bits;
-	
-	column = &s_vismatrix[patchnum];
-	if (column->count || column->row)
-	{
-		Error ("SetVisColumn: column has been set");
-	}
-
-	for (mbegin = 0; mbegin < g_num_patches; mbegin += 8)
-	{
-		bits = 0;
-		for (m = mbegin; m < mbegin + 8; m++)
-		{
-			if (m >= g_num_patches)
-			{
-				break;
-			}
-			if (uncompressedcolumn[m]) // visible
-			{
-				if (m < patchnum)
-				{
-					Error ("SetVisColumn: invalid parameter: m < patchnum");
-				}
-				bits |= (1 << (m - mbegin));
-			}
-		}
-		if (bits)
-		{
-			column->count++;
-		}
-	}
-
-	if (!column->count)
-	{
-		return;
-	}
-	column->row = (sparse_row_t *)malloc (column->count * sizeof (sparse_row_t));
-	hlassume (column->row != NULL, assume_NoMemory);
-	
-	i = 0;
-	for (mbegin = 0; mbegin < g_num_patches; mbegin += 8)
-	{
-		bits = 0;
-		for (m = mbegin; m < mbegin + 8; m++)
-		{
-			if (m >= g_num_patches)
-			{
-				break;
-			}
-			if (uncompressedcolumn[m]) // visible
-			{
-				bits |= (1 << (m - mbegin));
-			}
-		}
-		if (bits)
-		{
-			column->row[i].offset = mbegin / 8;
-			column->row[i].values = bits;
-			i++;
-		}
-	}
-	if (i != column->count)
-	{
-		Error ("SetVisColumn: internal error");
-	}
+    const unsigned  index = column >> 6;
+
+    if (!SeekRow(row, index) || row->runs[t_sparsecursor.run].firstword > index)
+    {
+        return false;
+    }
+    return (row->words[t_sparsecursor.word + index - row->runs[t_sparsecursor.run].firstword] & ((sparse_word_t)1 << (column & 63))) != 0;
 }
 
 // Vismatrix public
@@ -139,8 +210,6 @@ static bool     CheckVisBitSparse(unsigned x, unsigned y
 								  , unsigned int &next_index
 								  )
 {
-    int                offset;
-
     	VectorFill(transparency_out, 1.0);
 
     if (x == y)
@@ -148,15 +217,6 @@ static bool     CheckVisBitSparse(unsigned x, unsigned y
         return 1;
     }
 
-    const unsigned a = x;
-    const unsigned b = y;
-
-    if (x > y)
-    {
-        x = b;
-        y = a;
-    }
-
     if (x > g_num_patches)
     {
         Warning("in CheckVisBit(), x > num_patches");
@@ -166,18 +226,59 @@ static bool     CheckVisBitSparse(unsigned x, unsigned y
         Warning("in CheckVisBit(), y > num_patches");
     }
 
-    if ((offset = IsVisbitInArray(x, y)) != -1)
+    if (TestRowBit(s_vismatrix + qmin(x, y), qmax(x, y)))
     {
     	if(g_customshadow_with_bouncelight)
     	{
-    	     GetTransparency(a, b, transparency_out, next_index);
+    	     GetTransparency(x, y, transparency_out, next_index);
     	}
-        return s_vismatrix[x].row[offset].values & (1 << (y & 7));
+        return true;
     }
 
 	return false;
 }
 
+// =====================================================================================
+//  NextVisBitSparse
+//      Returns the first patch from y on that x can see, or g_num_patches. The patches
+//      before x have x in their own rows, so they are tested one by one as CheckVisBit would.
+// =====================================================================================
+static unsigned NextVisBitSparse(unsigned x, unsigned y)
+{
+    const sparse_row_t* row = s_vismatrix + x;
+
+    for (; y < x; y++)
+    {
+        if (TestRowBit(s_vismatrix + y, x))
+        {
+            return y;
+        }
+    }
+    if (y == x)
+    {
+        y++;
+    }
+
+    while (y < g_num_patches && SeekRow(row, y >> 6))
+    {
+        const sparse_run_t* run = &row->runs[t_sparsecursor.run];
+        unsigned        index = qmax(y >> 6, run->firstword);
+        sparse_word_t   bits;
+
+        if (index > (y >> 6))
+        {
+            y = index << 6;
+        }
+        bits = row->words[t_sparsecursor.word + index - run->firstword] & (~(sparse_word_t)0 << (y & 63));
+        if (bits)
+        {
+            return qmin(g_num_patches, (index << 6) + LowestBit(bits));
+        }
+        y = (index + 1) << 6;
+    }
+    return g_num_patches;
+}
+
 /*
  * ==============
  * TestPatchToFace
@@ -187,7 +288,8 @@ static bool     CheckVisBitSparse(unsigned x, unsigned y
  */
 static void     TestPatchToFace(const unsigned patchnum, const int facenum, const int head
 								, byte *pvs
-								, bool uncompressedcolumn[MAX_SPARSE_VISMATRIX_PATCHES]
+								, sparse_word_t *uncompressedrow
+								, unsigned &lastvisible
 								)
 {
     patch_t*        patch = &g_patches[patchnum];
@@ -275,7 +377,8 @@ static void     TestPatchToFace(const unsigned patchnum, const int facenum, cons
                     {
                     	AddTransparencyToRawArray(patchnum, m, transparency);
                     }
-					uncompressedcolumn[m] = true;
+					uncompressedrow[m >> 6] |= (sparse_word_t)1 << (m & 63);
+					lastvisible = qmax(lastvisible, m);
                 }
             }
         }
@@ -304,8 +407,9 @@ static void     BuildVisLeafs(int threadnum)
     patch_t*        patch;
     int             head;
     unsigned        patchnum;
-	bool *uncompressedcolumn = (bool *)malloc (MAX_SPARSE_VISMATRIX_PATCHES * sizeof (bool));
-	hlassume (uncompressedcolumn != NULL, assume_NoMemory);
+	// only the words from patchnum to the last visible patch are set, and they are cleared again when the row is copied
+	sparse_word_t *uncompressedrow = (sparse_word_t *)calloc ((g_num_patches + 63) / 64, sizeof (sparse_word_t));
+	hlassume (uncompressedrow != NULL, assume_NoMemory);
 
     while (1)
     {
@@ -347,20 +451,26 @@ static void     BuildVisLeafs(int threadnum)
 				if (patch->leafnum != i)
 					continue;
 				patchnum = patch - g_patches;
-				for (int m = 0; m < g_num_patches; m++)
-				{
-					uncompressedcolumn[m] = false;
-				}
+				unsigned lastvisible = patchnum;
 				for (facenum2 = facenum + 1; facenum2 < g_numfaces; facenum2++)
 					TestPatchToFace (patchnum, facenum2, head, pvs
-									, uncompressedcolumn
+									, uncompressedrow
+									, lastvisible
 									);
-				SetVisColumn (patchnum, uncompressedcolumn);
+				// the row of a patch is only written by the thread that does its leaf
+				for (unsigned index = patchnum >> 6; index <= lastvisible >> 6; index++)
+				{
+					if (uncompressedrow[index])
+					{
+						AppendWordToRow (&s_vismatrix[patchnum], index, uncompressedrow[index]);
+						uncompressedrow[index] = 0;
+					}
+				}
 			}
 		}
 
     }
-	free (uncompressedcolumn);
+	free (uncompressedrow);
 }
 
 #ifdef SYSTEM_WIN32
@@ -374,7 +484,7 @@ static void     BuildVisLeafs(int threadnum)
  */
 static void     BuildVisMatrix()
 {
-    s_vismatrix = (sparse_column_t*)AllocBlock(g_num_patches * sizeof(sparse_column_t));
+    s_vismatrix = (sparse_row_t*)AllocBlock(g_num_patches * sizeof(sparse_row_t));
 
     if (!s_vismatrix)
     {
@@ -383,6 +493,11 @@ static void     BuildVisMatrix()
     }
 
     NamedRunThreadsOn(g_dmodels[0].visleafs, g_estimate, BuildVisLeafs);
+
+    for (unsigned x = 0; x < g_num_patches; x++)
+    {
+        ShrinkRow(&s_vismatrix[x]);
+    }
 }
 
 static void     FreeVisMatrix()
@@ -390,14 +505,10 @@ static void     FreeVisMatrix()
     if (s_vismatrix)
     {
         unsigned        x;
-        sparse_column_t* item;
 
-        for (x = 0, item = s_vismatrix; x < g_num_patches; x++, item++)
+        for (x = 0; x < g_num_patches; x++)
         {
-            if (item->row)
-            {
-                free(item->row);
-            }
+            FreeRow(&s_vismatrix[x]);
         }
         if (FreeBlock(s_vismatrix))
         {
@@ -414,19 +525,16 @@ static void     FreeVisMatrix()
 
 static void     DumpVismatrixInfo()
 {
-    unsigned        totals[8];
     size_t          total_vismatrix_memory;
-	total_vismatrix_memory = sizeof(sparse_column_t) * g_num_patches;
-
-    sparse_column_t* column_end = s_vismatrix + g_num_patches;
-    sparse_column_t* column = s_vismatrix;
+	total_vismatrix_memory = sizeof(sparse_row_t) * g_num_patches;
 
-    memset(totals, 0, sizeof(totals));
+    sparse_row_t*   row_end = s_vismatrix + g_num_patches;
+    sparse_row_t*   row = s_vismatrix;
 
-    while (column < column_end)
+    while (row < row_end)
     {
-        total_vismatrix_memory += column->count * sizeof(sparse_row_t);
-        column++;
+        total_vismatrix_memory += row->numruns * sizeof(sparse_run_t) + row->numwords * sizeof(sparse_word_t);
+        row++;
     }
 
     Log("%-20s: %5.1f megs\n", "visibility matrix", total_vismatrix_memory / (1024 * 1024.0));
@@ -450,13 +558,12 @@ void            MakeScalesSparseVismatrix()
         BuildVisMatrix();
         DumpVismatrixInfo();
         g_CheckVisBit = CheckVisBitSparse;
+        g_NextVisBit = NextVisBitSparse;
 
         CreateFinalTransparencyArrays("custom shadow array");
         
-	if(g_rgb_transfers)
-		{NamedRunThreadsOn(g_num_patches, g_estimate, MakeRGBScales);}
-	else
-		{NamedRunThreadsOn(g_num_patches, g_estimate, MakeScales);}
+        RunMakeScales();
+        g_NextVisBit = NULL;
         FreeVisMatrix();
         FreeTransparencyArrays();
 
@@ -5,6 +5,11 @@
 #include "winding.h"
 #include "qrad.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HLRAD_TRACE_SSE2
+#include <emmintrin.h>
+#endif
+
 // #define      ON_EPSILON      0.001
 
 typedef struct tnode_s
@@ -290,6 +295,8 @@ void ViewTNode ()
 	}
 }
 #endif
+static void     InitPacketTrace ();
+
 void            MakeTnodes(dmodel_t* /*bm*/)
 {
     // 32 byte align the structs
@@ -304,6 +311,7 @@ void            MakeTnodes(dmodel_t* /*bm*/)
 #if 0 //debug. vluzacn
 	ViewTNode ();
 #endif
+	InitPacketTrace ();
 }
 
 //==========================================================
@@ -421,12 +429,397 @@ int             TestLine(const vec3_t start, const vec3_t stop
 						 )
 {
 	int linecontent = 0;
+	ProfileCount(eProfileRaysTraced);
     return TestLine_r(0, start, stop
 		, linecontent
 		, skyhit
 		);
 }
 
+// =====================================================================================
+//  Packet tracing
+//      TestLinePacket traces up to TESTLINE_PACKET rays through the tnodes together, doing
+//      the plane tests for the whole packet at once. A packet walks down as one piece while
+//      all of its rays stay on the same side of the planes, and only splits where they
+//      don't. Every ray still visits the same leafs in the same order as in TestLine_r, so
+//      the results are bit-identical.
+// =====================================================================================
+
+typedef struct
+{
+	float           start[3][TESTLINE_PACKET];
+	float           stop[3][TESTLINE_PACKET];
+} tracepacket_t;
+
+typedef struct
+{
+	unsigned        solid;     // rays that hit CONTENTS_SOLID
+	unsigned        sky;       // rays that hit CONTENTS_SKY; the other rays are CONTENTS_EMPTY
+} tracehits_t;
+
+#define TESTLINE_PACKET_MINRAYS 4 // packets with fewer rays than this are traced one ray at a time
+
+// ON_EPSILON is a double; comparing a float against these gives the same answer as comparing against ON_EPSILON
+static float    g_trace_epsilon;
+static float    g_trace_halfepsilon;
+
+#ifdef HLRAD_TRACE_SSE2
+static inline __m128 LaneMask(const unsigned mask)
+{
+	return _mm_castsi128_ps(_mm_set_epi32(-(int)((mask >> 3) & 1), -(int)((mask >> 2) & 1), -(int)((mask >> 1) & 1), -(int)(mask & 1)));
+}
+#endif
+
+static inline int CountLanes(unsigned mask)
+{
+	int             count;
+
+	for (count = 0; mask; count++)
+		mask &= mask - 1;
+	return count;
+}
+
+// dst[k] = src[k] for the lanes in mask
+static inline void CopyLanes(float* dst, const float* src, const unsigned mask)
+{
+#ifdef HLRAD_TRACE_SSE2
+	int             k;
+
+	for (k = 0; k < TESTLINE_PACKET; k += 4)
+	{
+		const __m128    m = LaneMask(mask >> k);
+		_mm_storeu_ps(dst + k, _mm_or_ps(_mm_and_ps(m, _mm_loadu_ps(src + k)), _mm_andnot_ps(m, _mm_loadu_ps(dst + k))));
+	}
+#else
+	int             k;
+
+	for (k = 0; k < TESTLINE_PACKET; k++)
+	{
+		if (mask & (1 << k))
+			dst[k] = src[k];
+	}
+#endif
+}
+
+// Sorts the rays in mask the same way TestLine_r does. mid is only set for the rays that cross the plane.
+static inline void SplitPacket(const tnode_t* tnode, const unsigned mask, const tracepacket_t* p
+							   , unsigned& front, unsigned& back, unsigned& on, unsigned& backfirst
+							   , float mid[3][TESTLINE_PACKET]
+							   )
+{
+#ifdef HLRAD_TRACE_SSE2
+	const __m128    dist = _mm_set1_ps(tnode->dist);
+	const __m128    zero = _mm_setzero_ps();
+	const __m128    one = _mm_set1_ps(1.0f);
+	const __m128    epsilon = _mm_set1_ps(g_trace_epsilon);
+	const __m128    halfepsilon = _mm_set1_ps(g_trace_halfepsilon);
+	const __m128    neghalfepsilon = _mm_set1_ps(-g_trace_halfepsilon);
+	const __m128    absmask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128          start[3], stop[3];
+	__m128          f, b, diff, frac, over;
+	int             i, k;
+
+	front = back = on = backfirst = 0;
+	for (k = 0; k < TESTLINE_PACKET; k += 4)
+	{
+		if (!((mask >> k) & 15))
+			continue;
+		for (i = 0; i < 3; i++)
+		{
+			start[i] = _mm_loadu_ps(&p->start[i][k]);
+			stop[i] = _mm_loadu_ps(&p->stop[i][k]);
+		}
+		switch (tnode->type)
+		{
+		case plane_x:
+		case plane_y:
+		case plane_z:
+			f = _mm_sub_ps(start[tnode->type], dist);
+			b = _mm_sub_ps(stop[tnode->type], dist);
+			break;
+		default:
+			{
+				const __m128 n0 = _mm_set1_ps(tnode->normal[0]);
+				const __m128 n1 = _mm_set1_ps(tnode->normal[1]);
+				const __m128 n2 = _mm_set1_ps(tnode->normal[2]);
+				f = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(start[0], n0), _mm_mul_ps(start[1], n1)), _mm_mul_ps(start[2], n2)), dist);
+				b = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(stop[0], n0), _mm_mul_ps(stop[1], n1)), _mm_mul_ps(stop[2], n2)), dist);
+			}
+			break;
+		}
+		const unsigned  f4 = _mm_movemask_ps(_mm_and_ps(_mm_cmpgt_ps(f, halfepsilon), _mm_cmpgt_ps(b, halfepsilon)));
+		const unsigned  b4 = _mm_movemask_ps(_mm_and_ps(_mm_cmplt_ps(f, neghalfepsilon), _mm_cmplt_ps(b, neghalfepsilon)));
+		front |= f4 << k;
+		back |= b4 << k;
+		if (((f4 | b4) & (mask >> k) & 15) == ((mask >> k) & 15))
+			continue; // no ray in these lanes needs more than that
+		on |= _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(_mm_and_ps(f, absmask), epsilon), _mm_cmple_ps(_mm_and_ps(b, absmask), epsilon))) << k;
+		diff = _mm_sub_ps(f, b);
+		backfirst |= _mm_movemask_ps(_mm_cmplt_ps(diff, zero)) << k;
+		frac = _mm_div_ps(f, diff);
+		frac = _mm_andnot_ps(_mm_cmplt_ps(frac, zero), frac);
+		over = _mm_cmpgt_ps(frac, one);
+		frac = _mm_or_ps(_mm_and_ps(over, one), _mm_andnot_ps(over, frac));
+		for (i = 0; i < 3; i++)
+		{
+			_mm_storeu_ps(&mid[i][k], _mm_add_ps(start[i], _mm_mul_ps(_mm_sub_ps(stop[i], start[i]), frac)));
+		}
+	}
+	on &= ~(front | back);
+#else
+	float           f, b;
+	float           frac;
+	int             k;
+
+	front = back = on = backfirst = 0;
+	for (k = 0; k < TESTLINE_PACKET; k++)
+	{
+		if (!(mask & (1 << k)))
+			continue;
+		switch (tnode->type)
+		{
+		case plane_x:
+		case plane_y:
+		case plane_z:
+			f = p->start[tnode->type][k] - tnode->dist;
+			b = p->stop[tnode->type][k] - tnode->dist;
+			break;
+		default:
+			f = (p->start[0][k] * tnode->normal[0] + p->start[1][k] * tnode->normal[1] + p->start[2][k] * tnode->normal[2]) - tnode->dist;
+			b = (p->stop[0][k] * tnode->normal[0] + p->stop[1][k] * tnode->normal[1] + p->stop[2][k] * tnode->normal[2]) - tnode->dist;
+			break;
+		}
+		if (f > ON_EPSILON/2 && b > ON_EPSILON/2)
+		{
+			front |= 1 << k;
+			continue;
+		}
+		if (f < -ON_EPSILON/2 && b < -ON_EPSILON/2)
+		{
+			back |= 1 << k;
+			continue;
+		}
+		if (fabs(f) <= ON_EPSILON && fabs(b) <= ON_EPSILON)
+		{
+			on |= 1 << k;
+			continue;
+		}
+		if ((f - b) < 0)
+			backfirst |= 1 << k;
+		frac = f / (f - b);
+		if (frac < 0) frac = 0;
+		if (frac > 1) frac = 1;
+		mid[0][k] = p->start[0][k] + (p->stop[0][k] - p->start[0][k]) * frac;
+		mid[1][k] = p->start[1][k] + (p->stop[1][k] - p->start[1][k]) * frac;
+		mid[2][k] = p->start[2][k] + (p->stop[2][k] - p->start[2][k]) * frac;
+	}
+#endif
+}
+
+// largest float that is not greater than d
+static float    FloatNotAbove(double d)
+{
+	float           f = (float)d;
+
+	if ((double)f > d)
+		f = nextafterf(f, -HUGE_VALF);
+	return f;
+}
+
+static void     InitPacketTrace()
+{
+	g_trace_epsilon = FloatNotAbove(ON_EPSILON);
+	g_trace_halfepsilon = FloatNotAbove(ON_EPSILON/2);
+}
+
+static tracehits_t TestLinePacket_r(int node, const unsigned mask, const tracepacket_t* p
+									, int* linecontent
+									, vec3_t* skyhit
+									)
+{
+	const tnode_t*  tnode;
+	tracepacket_t   sub;
+	const tracepacket_t* q;
+	float           mid[3][TESTLINE_PACKET];
+	tracehits_t     hits, hits0, hits1, hits2;
+	unsigned        front, back, on, backfirst, frontcross, backcross;
+	unsigned        mask0, mask1, mask2;
+	int             i, k;
+
+	hits.solid = hits.sky = 0;
+	// walk down for as long as the whole packet stays on one side of the planes
+	while (1)
+	{
+		if (node < 0)
+		{
+			// linecontent is never CONTENTS_SOLID or CONTENTS_SKY
+			if (node == CONTENTS_SOLID)
+			{
+				hits.solid = mask;
+			}
+			else if (node == CONTENTS_SKY)
+			{
+				hits.sky = mask;
+				if (skyhit)
+				{
+					for (k = 0; k < TESTLINE_PACKET; k++)
+					{
+						if (mask & (1 << k))
+						{
+							for (i = 0; i < 3; i++)
+								skyhit[k][i] = p->start[i][k];
+						}
+					}
+				}
+			}
+			else
+			{
+				for (k = 0; k < TESTLINE_PACKET; k++)
+				{
+					if (!(mask & (1 << k)) || node == linecontent[k])
+						continue;
+					if (linecontent[k])
+						hits.solid |= 1 << k;
+					else
+						linecontent[k] = node;
+				}
+			}
+			return hits;
+		}
+		if (CountLanes(mask) < TESTLINE_PACKET_MINRAYS)
+		{
+			// too few rays left to make the plane tests pay; the scalar version is faster
+			vec3_t          start, stop;
+			int             r;
+
+			for (k = 0; k < TESTLINE_PACKET; k++)
+			{
+				if (!(mask & (1 << k)))
+					continue;
+				for (i = 0; i < 3; i++)
+				{
+					start[i] = p->start[i][k];
+					stop[i] = p->stop[i][k];
+				}
+				r = TestLine_r(node, start, stop
+					, linecontent[k]
+					, skyhit? skyhit[k]: NULL
+					);
+				if (r == CONTENTS_SOLID)
+					hits.solid |= 1 << k;
+				else if (r == CONTENTS_SKY)
+					hits.sky |= 1 << k;
+			}
+			return hits;
+		}
+		tnode = &tnodes[node];
+		SplitPacket(tnode, mask, p, front, back, on, backfirst, mid);
+		if ((front & mask) == mask)
+		{
+			node = tnode->children[0];
+			continue;
+		}
+		if ((back & mask) == mask)
+		{
+			node = tnode->children[1];
+			continue;
+		}
+		break;
+	}
+	front &= mask;
+	back &= mask;
+	on &= mask;
+	frontcross = mask & ~(front | back | on) & ~backfirst;
+	backcross = mask & ~(front | back | on) & backfirst;
+
+	// children[0]: rays in front of or on the plane, and the first half of crossing rays that start in front
+	mask0 = front | on | frontcross;
+	hits0 = hits;
+	if (mask0)
+	{
+		q = p;
+		if (frontcross)
+		{
+			sub = *p;
+			for (i = 0; i < 3; i++)
+				CopyLanes(sub.stop[i], mid[i], frontcross);
+			q = &sub;
+		}
+		hits0 = TestLinePacket_r(tnode->children[0], mask0, q, linecontent, skyhit);
+	}
+
+	// children[1]: rays behind the plane, on-plane rays that didn't hit solid, and the other half of crossing rays
+	mask1 = back | backcross | (on & ~hits0.solid) | (frontcross & ~hits0.solid & ~hits0.sky);
+	hits1 = hits;
+	if (mask1)
+	{
+		q = p;
+		if (mask1 & (frontcross | backcross))
+		{
+			sub = *p;
+			for (i = 0; i < 3; i++)
+			{
+				CopyLanes(sub.start[i], mid[i], mask1 & frontcross);
+				CopyLanes(sub.stop[i], mid[i], backcross);
+			}
+			q = &sub;
+		}
+		hits1 = TestLinePacket_r(tnode->children[1], mask1, q, linecontent, skyhit);
+	}
+
+	// children[0] again: the second half of crossing rays that start behind the plane
+	mask2 = backcross & ~hits1.solid & ~hits1.sky;
+	hits2 = hits;
+	if (mask2)
+	{
+		sub = *p;
+		for (i = 0; i < 3; i++)
+			CopyLanes(sub.start[i], mid[i], mask2);
+		hits2 = TestLinePacket_r(tnode->children[0], mask2, &sub, linecontent, skyhit);
+	}
+
+	// each ray only went on after an empty result, so the hits never overlap
+	hits.solid = ((front | on | frontcross) & hits0.solid) | ((back | on | frontcross | backcross) & hits1.solid) | (backcross & hits2.solid);
+	hits.sky = (((front | on | frontcross) & hits0.sky) | ((back | on | frontcross | backcross) & hits1.sky) | (backcross & hits2.sky)) & ~hits.solid;
+	return hits;
+}
+
+// Same as calling TestLine for each ray. skyhits may be NULL.
+void            TestLinePacket(const int numrays, const vec3_t* starts, const vec3_t* stops, int* contents
+							   , vec3_t* skyhits
+							   )
+{
+	tracepacket_t   p;
+	tracehits_t     hits;
+	int             linecontent[TESTLINE_PACKET];
+	int             first, num;
+	int             i, k;
+
+	ProfileCount(eProfileRaysTraced, numrays);
+	for (first = 0; first < numrays; first += TESTLINE_PACKET)
+	{
+		num = qmin(numrays - first, TESTLINE_PACKET);
+		for (k = 0; k < TESTLINE_PACKET; k++)
+		{
+			// fill the unused lanes with a real ray so that the plane tests never see garbage
+			const int       r = first + (k < num? k: 0);
+			for (i = 0; i < 3; i++)
+			{
+				p.start[i][k] = starts[r][i];
+				p.stop[i][k] = stops[r][i];
+			}
+			linecontent[k] = 0;
+		}
+		hits = TestLinePacket_r(0, (1u << num) - 1, &p
+			, linecontent
+			, skyhits? skyhits + first: NULL
+			);
+		for (k = 0; k < num; k++)
+		{
+			contents[first + k] = (hits.solid & (1 << k))? CONTENTS_SOLID: (hits.sky & (1 << k))? CONTENTS_SKY: CONTENTS_EMPTY;
+		}
+	}
+}
 
 typedef struct
 {
@@ -459,10 +852,575 @@ typedef struct
 {
 	vec3_t mins, maxs;
 	int headnode;
+	int bvhnode; // -1 if the model has no faces or is not in g_opaque_face_list
 } opaquemodel_t;
 #endif
 opaquemodel_t *opaquemodels;
 
+// =====================================================================================
+//  Opaque face BVH
+//      The faces of each opaque model are kept in a flattened bounding volume hierarchy
+//      built with the surface area heuristic. The first child of an interior node is
+//      stored right after it, so a node only needs the index of its second child. The
+//      planes of the faces are kept apart from the rest of opaqueface_t, so that the
+//      plane test, which rejects almost every face, touches as little memory as possible.
+//      A face that passes it is tested with the part of the segment that the old bsp walk
+//      would have passed down to its node, so the results are exactly those of the walk.
+// =====================================================================================
+int TestLineOpaque_face (int facenum, const vec3_t hit);
+
+#define OPAQUE_BVH_MAXDEPTH 64
+#define OPAQUE_BVH_LEAFFACES 4 // leafs are not split any further
+#define OPAQUE_BVH_BINS 16
+#define OPAQUE_BVH_PADDING 1.0 // more than the epsilons used by the face tests
+
+typedef struct
+{
+	float mins[3];
+	float maxs[3];
+	int child; // interior nodes: the second child; leafs: the first face slot
+	unsigned short numfaces; // 0 for interior nodes
+	unsigned short axis; // interior nodes: the split axis
+} opaquebvhnode_t; // 32 bytes
+
+typedef struct
+{
+	int facenum;
+	int nodenum;
+	float mins[3];
+	float maxs[3];
+	float center[3];
+} opaquebvhface_t;
+
+static opaquebvhnode_t *opaquebvhnodes;
+static void *opaquebvhnodes_alloc;
+static int opaquebvhnumnodes;
+// one slot for each face in the leafs; the plane is that of the bsp node the face was on
+static float *opaqueslotplane[4];
+static int *opaqueslotface;
+static int *opaqueslotnode;
+static int opaquenumslots;
+static int *opaquenodeparent; // -1 for the head nodes
+
+// the part of the segment that reached each bsp node in the old walk, worked out at most once
+// for each node in a line test; every thread has g_numnodes of them
+typedef struct
+{
+	vec3_t start, stop;
+	unsigned stamp; // of the line test that filled it in
+	bool reached;
+} opaquenodesegment_t;
+static opaquenodesegment_t *opaquenodesegments;
+static unsigned *opaquelineteststamps; // last line test of each thread
+
+static float BoundsArea (const float *mins, const float *maxs)
+{
+	float d[3];
+	for (int k = 0; k < 3; k++)
+	{
+		d[k] = qmax (0, maxs[k] - mins[k]);
+	}
+	return d[0] * d[1] + d[1] * d[2] + d[2] * d[0];
+}
+
+static void AddToBounds (float *mins, float *maxs, const float *mins2, const float *maxs2)
+{
+	for (int k = 0; k < 3; k++)
+	{
+		mins[k] = qmin (mins[k], mins2[k]);
+		maxs[k] = qmax (maxs[k], maxs2[k]);
+	}
+}
+
+static int BuildOpaqueBVH_r (opaquebvhface_t *faces, int numfaces, int depth)
+{
+	int nodenum = opaquebvhnumnodes++;
+	opaquebvhnode_t *node = &opaquebvhnodes[nodenum];
+	float cmins[3], cmaxs[3];
+	int i, k;
+
+	for (k = 0; k < 3; k++)
+	{
+		node->mins[k] = cmins[k] = BOGUS_RANGE;
+		node->maxs[k] = cmaxs[k] = -BOGUS_RANGE;
+	}
+	for (i = 0; i < numfaces; i++)
+	{
+		AddToBounds (node->mins, node->maxs, faces[i].mins, faces[i].maxs);
+		AddToBounds (cmins, cmaxs, faces[i].center, faces[i].center);
+	}
+
+	// find the cheapest split
+	int bestaxis = -1;
+	int bestbin = 0;
+	float bestcost = numfaces; // the cost of not splitting, in units of face tests
+	if (numfaces > OPAQUE_BVH_LEAFFACES && depth < OPAQUE_BVH_MAXDEPTH - 1)
+	{
+		float area = BoundsArea (node->mins, node->maxs);
+		for (k = 0; k < 3; k++)
+		{
+			if (cmaxs[k] - cmins[k] < ON_EPSILON)
+			{
+				continue;
+			}
+			int bincounts[OPAQUE_BVH_BINS];
+			float binmins[OPAQUE_BVH_BINS][3], binmaxs[OPAQUE_BVH_BINS][3];
+			float scale = OPAQUE_BVH_BINS / (cmaxs[k] - cmins[k]);
+			int b, j;
+			for (b = 0; b < OPAQUE_BVH_BINS; b++)
+			{
+				bincounts[b] = 0;
+				for (j = 0; j < 3; j++)
+				{
+					binmins[b][j] = BOGUS_RANGE;
+					binmaxs[b][j] = -BOGUS_RANGE;
+				}
+			}
+			for (i = 0; i < numfaces; i++)
+			{
+				b = qmin ((int)((faces[i].center[k] - cmins[k]) * scale), OPAQUE_BVH_BINS - 1);
+				bincounts[b]++;
+				AddToBounds (binmins[b], binmaxs[b], faces[i].mins, faces[i].maxs);
+			}
+			// sweep from the right to get the area and count of everything above each split
+			float rightareas[OPAQUE_BVH_BINS];
+			int rightcounts[OPAQUE_BVH_BINS];
+			float mins[3], maxs[3];
+			int count = 0;
+			VectorFill (mins, BOGUS_RANGE);
+			VectorFill (maxs, -BOGUS_RANGE);
+			for (b = OPAQUE_BVH_BINS - 1; b > 0; b--)
+			{
+				count += bincounts[b];
+				AddToBounds (mins, maxs, binmins[b], binmaxs[b]);
+				rightcounts[b] = count;
+				rightareas[b] = BoundsArea (mins, maxs);
+			}
+			count = 0;
+			VectorFill (mins, BOGUS_RANGE);
+			VectorFill (maxs, -BOGUS_RANGE);
+			for (b = 0; b < OPAQUE_BVH_BINS - 1; b++)
+			{
+				count += bincounts[b];
+				AddToBounds (mins, maxs, binmins[b], binmaxs[b]);
+				if (count == 0 || rightcounts[b + 1] == 0)
+				{
+					continue;
+				}
+				float cost = 1 + (count * BoundsArea (mins, maxs) + rightcounts[b + 1] * rightareas[b + 1]) / area;
+				if (cost < bestcost)
+				{
+					bestcost = cost;
+					bestaxis = k;
+					bestbin = b;
+				}
+			}
+		}
+	}
+	if (bestaxis == -1)
+	{
+		hlassume (numfaces < 65536, assume_first);
+		node->child = opaquenumslots;
+		node->numfaces = numfaces;
+		node->axis = 0;
+		for (i = 0; i < numfaces; i++)
+		{
+			const dplane_t *dp = &g_dplanes[g_dnodes[faces[i].nodenum].planenum];
+			opaqueslotplane[0][opaquenumslots] = dp->normal[0];
+			opaqueslotplane[1][opaquenumslots] = dp->normal[1];
+			opaqueslotplane[2][opaquenumslots] = dp->normal[2];
+			opaqueslotplane[3][opaquenumslots] = dp->dist;
+			opaqueslotface[opaquenumslots] = faces[i].facenum;
+			opaqueslotnode[opaquenumslots] = faces[i].nodenum;
+			opaquenumslots++;
+		}
+		return nodenum;
+	}
+
+	// partition the faces by the bin their center falls into
+	float scale = OPAQUE_BVH_BINS / (cmaxs[bestaxis] - cmins[bestaxis]);
+	int numleft = 0;
+	for (i = 0; i < numfaces; i++)
+	{
+		if (qmin ((int)((faces[i].center[bestaxis] - cmins[bestaxis]) * scale), OPAQUE_BVH_BINS - 1) <= bestbin)
+		{
+			opaquebvhface_t tmp = faces[i];
+			faces[i] = faces[numleft];
+			faces[numleft] = tmp;
+			numleft++;
+		}
+	}
+	node->numfaces = 0;
+	node->axis = bestaxis;
+	BuildOpaqueBVH_r (faces, numleft, depth + 1);
+	int child = BuildOpaqueBVH_r (faces + numleft, numfaces - numleft, depth + 1);
+	node->child = child;
+	return nodenum;
+}
+
+// TestLineOpaque_face accepts points up to ON_EPSILON outside of each edge, which reaches
+// well past the winding at a sharp corner, so the bounds are taken from the widened face
+static void OpaqueFaceBounds (const opaqueface_t *of, float *mins, float *maxs)
+{
+	const Winding *w = of->winding;
+	Winding *wide = new Winding (of->plane.normal, of->plane.dist);
+	int x, k;
+	for (x = 0; x < of->numedges; x++)
+	{
+		const dplane_t *edge = &of->edges[x];
+		vec3_t normal;
+		if (VectorCompare (edge->normal, vec3_origin))
+		{
+			continue;
+		}
+		VectorSubtract (vec3_origin, edge->normal, normal);
+		if (!wide->Chop (normal, -edge->dist - ON_EPSILON))
+		{
+			break;
+		}
+	}
+	if (wide->m_NumPoints > 0)
+	{
+		w = wide;
+	}
+	for (k = 0; k < 3; k++)
+	{
+		mins[k] = BOGUS_RANGE;
+		maxs[k] = -BOGUS_RANGE;
+	}
+	for (x = 0; x < w->m_NumPoints; x++)
+	{
+		for (k = 0; k < 3; k++)
+		{
+			mins[k] = qmin (mins[k], w->m_Points[x][k]);
+			maxs[k] = qmax (maxs[k], w->m_Points[x][k]);
+		}
+	}
+	delete wide;
+}
+
+static void CollectOpaqueFaces_r (int nodenum, int parent, opaquebvhface_t *faces, int &numfaces)
+{
+	if (nodenum < 0)
+	{
+		return;
+	}
+	const opaquenode_t *on = &opaquenodes[nodenum];
+	opaquenodeparent[nodenum] = parent;
+	for (int facenum = on->firstface; facenum < on->firstface + on->numfaces; facenum++)
+	{
+		opaquebvhface_t *f = &faces[numfaces];
+		int k;
+		f->facenum = facenum;
+		f->nodenum = nodenum;
+		OpaqueFaceBounds (&opaquefaces[facenum], f->mins, f->maxs);
+		for (k = 0; k < 3; k++)
+		{
+			f->mins[k] -= OPAQUE_BVH_PADDING;
+			f->maxs[k] += OPAQUE_BVH_PADDING;
+			f->center[k] = (f->mins[k] + f->maxs[k]) / 2;
+		}
+		numfaces++;
+	}
+	CollectOpaqueFaces_r (on->children[0], nodenum, faces, numfaces);
+	CollectOpaqueFaces_r (on->children[1], nodenum, faces, numfaces);
+}
+
+// =====================================================================================
+//  BuildOpaqueBVHs
+//      Only for the models of g_opaque_face_list, no other model is ever traced
+// =====================================================================================
+void BuildOpaqueBVHs ()
+{
+	int i, k;
+	unsigned x;
+	bool *opaque = (bool *)calloc (g_nummodels + 1, sizeof (bool));
+	hlassume (opaque != NULL, assume_NoMemory);
+	int totalfaces = 0;
+	for (x = 0; x < g_opaque_face_count; x++)
+	{
+		if (!opaque[g_opaque_face_list[x].modelnum])
+		{
+			opaque[g_opaque_face_list[x].modelnum] = true;
+			totalfaces += CountOpaqueFaces (g_opaque_face_list[x].modelnum);
+		}
+	}
+	// a binary tree has fewer than twice as many nodes as leafs, and there are no more leafs than faces
+	int maxnodes = 2 * totalfaces + g_nummodels;
+	opaquebvhnodes_alloc = calloc (maxnodes + 1, sizeof (opaquebvhnode_t));
+	hlassume (opaquebvhnodes_alloc != NULL, assume_NoMemory);
+	opaquebvhnodes = (opaquebvhnode_t *)(((uintptr_t)opaquebvhnodes_alloc + (uintptr_t)31) & ~(uintptr_t)31);
+	opaquebvhnumnodes = 0;
+	for (k = 0; k < 4; k++)
+	{
+		opaqueslotplane[k] = (float *)malloc ((totalfaces + 1) * sizeof (float));
+		hlassume (opaqueslotplane[k] != NULL, assume_NoMemory);
+	}
+	opaqueslotface = (int *)malloc ((totalfaces + 1) * sizeof (int));
+	hlassume (opaqueslotface != NULL, assume_NoMemory);
+	opaqueslotnode = (int *)malloc ((totalfaces + 1) * sizeof (int));
+	hlassume (opaqueslotnode != NULL, assume_NoMemory);
+	opaquenumslots = 0;
+	opaquenodeparent = (int *)malloc ((g_numnodes + 1) * sizeof (int));
+	hlassume (opaquenodeparent != NULL, assume_NoMemory);
+	if (totalfaces > 0)
+	{
+		opaquenodesegments = (opaquenodesegment_t *)calloc (g_numthreads * (g_numnodes + 1), sizeof (opaquenodesegment_t));
+		hlassume (opaquenodesegments != NULL, assume_NoMemory);
+		opaquelineteststamps = (unsigned *)calloc (g_numthreads, sizeof (unsigned));
+		hlassume (opaquelineteststamps != NULL, assume_NoMemory);
+	}
+
+	opaquebvhface_t *faces = (opaquebvhface_t *)malloc ((totalfaces + 1) * sizeof (opaquebvhface_t));
+	hlassume (faces != NULL, assume_NoMemory);
+	for (i = 0; i < g_nummodels; i++)
+	{
+		int numfaces = 0;
+		if (opaque[i])
+		{
+			CollectOpaqueFaces_r (opaquemodels[i].headnode, -1, faces, numfaces);
+		}
+		opaquemodels[i].bvhnode = numfaces? BuildOpaqueBVH_r (faces, numfaces, 0): -1;
+	}
+	free (faces);
+	free (opaque);
+	hlassume (opaquebvhnumnodes <= maxnodes, assume_first);
+}
+
+// how the old bsp walk passed start-stop through a node: 0 or 1 if only to that child, -1 if
+// to both of them, 2 if it was split at mid, with start-mid going to child side
+static int OpaqueNodeSplit (const opaquenode_t *node, const vec3_t start, const vec3_t stop, vec3_t mid, int &side)
+{
+	vec_t front, back, frac;
+	switch (node->type)
+	{
+	case plane_x:
+		front = start[0] - node->dist;
+		back = stop[0] - node->dist;
+		break;
+	case plane_y:
+		front = start[1] - node->dist;
+		back = stop[1] - node->dist;
+		break;
+	case plane_z:
+		front = start[2] - node->dist;
+		back = stop[2] - node->dist;
+		break;
+	default:
+		front = DotProduct (start, node->normal) - node->dist;
+		back = DotProduct (stop, node->normal) - node->dist;
+	}
+	if (front > ON_EPSILON / 2 && back > ON_EPSILON / 2)
+	{
+		return 0;
+	}
+	if (front < -ON_EPSILON / 2 && back < -ON_EPSILON / 2)
+	{
+		return 1;
+	}
+	if (fabs (front) <= ON_EPSILON && fabs (back) <= ON_EPSILON)
+	{
+		return -1;
+	}
+	side = (front - back) < 0;
+	frac = front / (front - back);
+	if (frac < 0) frac = 0;
+	if (frac > 1) frac = 1;
+	mid[0] = start[0] + (stop[0] - start[0]) * frac;
+	mid[1] = start[1] + (stop[1] - start[1]) * frac;
+	mid[2] = start[2] + (stop[2] - start[2]) * frac;
+	return 2;
+}
+
+// the part of start-stop that reached nodenum in the old bsp walk
+static const opaquenodesegment_t *OpaqueNodeSegment_r (int nodenum, const vec3_t start, const vec3_t stop, opaquenodesegment_t *segments, unsigned stamp)
+{
+	opaquenodesegment_t *segment = &segments[nodenum];
+	if (segment->stamp == stamp)
+	{
+		return segment;
+	}
+	segment->stamp = stamp;
+	int parent = opaquenodeparent[nodenum];
+	if (parent == -1)
+	{
+		VectorCopy (start, segment->start);
+		VectorCopy (stop, segment->stop);
+		segment->reached = true;
+		return segment;
+	}
+	const opaquenodesegment_t *up = OpaqueNodeSegment_r (parent, start, stop, segments, stamp);
+	segment->reached = false;
+	if (!up->reached)
+	{
+		return segment;
+	}
+	const opaquenode_t *node = &opaquenodes[parent];
+	vec3_t mid;
+	int side;
+	int child = node->children[0] == nodenum? 0: 1;
+	int split = OpaqueNodeSplit (node, up->start, up->stop, mid, side);
+	if (split == 2)
+	{
+		if (child == side)
+		{
+			VectorCopy (up->start, segment->start);
+			VectorCopy (mid, segment->stop);
+		}
+		else
+		{
+			VectorCopy (mid, segment->start);
+			VectorCopy (up->stop, segment->stop);
+		}
+	}
+	else if (split == -1 || split == child)
+	{
+		VectorCopy (up->start, segment->start);
+		VectorCopy (up->stop, segment->stop);
+	}
+	else
+	{
+		return segment;
+	}
+	segment->reached = true;
+	return segment;
+}
+
+static int TestLineOpaque_slot (int slot, const vec3_t start, const vec3_t stop, opaquenodesegment_t *segments, unsigned stamp)
+{
+	vec_t front, back;
+	front = (start[0] * opaqueslotplane[0][slot] + start[1] * opaqueslotplane[1][slot] + start[2] * opaqueslotplane[2][slot]) - opaqueslotplane[3][slot];
+	back = (stop[0] * opaqueslotplane[0][slot] + stop[1] * opaqueslotplane[1][slot] + stop[2] * opaqueslotplane[2][slot]) - opaqueslotplane[3][slot];
+	// the part that reached the node lies on start-stop, so it stays on the same side up to rounding
+	if ((front > ON_EPSILON / 2 + OPAQUE_BVH_PADDING && back > ON_EPSILON / 2 + OPAQUE_BVH_PADDING)
+		|| (front < -ON_EPSILON / 2 - OPAQUE_BVH_PADDING && back < -ON_EPSILON / 2 - OPAQUE_BVH_PADDING))
+	{
+		return 0;
+	}
+	const opaquenodesegment_t *segment = OpaqueNodeSegment_r (opaqueslotnode[slot], start, stop, segments, stamp);
+	vec3_t mid;
+	int side;
+	if (!segment->reached
+		|| OpaqueNodeSplit (&opaquenodes[opaqueslotnode[slot]], segment->start, segment->stop, mid, side) != 2)
+	{
+		return 0;
+	}
+	return TestLineOpaque_face (opaqueslotface[slot], mid);
+}
+
+static int TestLineOpaque_bvh (int nodenum, const vec3_t start, const vec3_t stop)
+{
+	int stack[OPAQUE_BVH_MAXDEPTH];
+	int stacksize = 0;
+	vec3_t delta;
+	VectorSubtract (stop, start, delta);
+	const int thread = GetThreadNum ();
+	opaquenodesegment_t *segments = &opaquenodesegments[thread * (g_numnodes + 1)];
+	unsigned stamp = ++opaquelineteststamps[thread];
+	if (stamp == 0)
+	{
+		// wrapped around, so an old segment could pass for one of this test
+		memset (segments, 0, (g_numnodes + 1) * sizeof (opaquenodesegment_t));
+		stamp = opaquelineteststamps[thread] = 1;
+	}
+	while (1)
+	{
+		const opaquebvhnode_t *node = &opaquebvhnodes[nodenum];
+		// clip the segment to the box
+		vec_t tmin = 0, tmax = 1;
+		int k;
+		for (k = 0; k < 3; k++)
+		{
+			if (fabs (delta[k]) < NORMAL_EPSILON)
+			{
+				if (start[k] < node->mins[k] || start[k] > node->maxs[k])
+				{
+					break;
+				}
+				continue;
+			}
+			vec_t t1 = (node->mins[k] - start[k]) / delta[k];
+			vec_t t2 = (node->maxs[k] - start[k]) / delta[k];
+			tmin = qmax (tmin, qmin (t1, t2));
+			tmax = qmin (tmax, qmax (t1, t2));
+			if (tmin > tmax)
+			{
+				break;
+			}
+		}
+		if (k == 3)
+		{
+			if (node->numfaces)
+			{
+				for (int slot = node->child; slot < node->child + node->numfaces; slot++)
+				{
+					if (TestLineOpaque_slot (slot, start, stop, segments, stamp))
+					{
+						return 1;
+					}
+				}
+			}
+			else
+			{
+				// go to the near child first
+				if (delta[node->axis] < 0)
+				{
+					stack[stacksize++] = nodenum + 1;
+					nodenum = node->child;
+				}
+				else
+				{
+					stack[stacksize++] = node->child;
+					nodenum = nodenum + 1;
+				}
+				continue;
+			}
+		}
+		if (stacksize == 0)
+		{
+			return 0;
+		}
+		nodenum = stack[--stacksize];
+	}
+}
+
+static int TestPointOpaque_bvh (int nodenum, const vec3_t point)
+{
+	int stack[OPAQUE_BVH_MAXDEPTH];
+	int stacksize = 0;
+	while (1)
+	{
+		const opaquebvhnode_t *node = &opaquebvhnodes[nodenum];
+		if (point[0] >= node->mins[0] && point[0] <= node->maxs[0]
+			&& point[1] >= node->mins[1] && point[1] <= node->maxs[1]
+			&& point[2] >= node->mins[2] && point[2] <= node->maxs[2])
+		{
+			if (node->numfaces)
+			{
+				for (int slot = node->child; slot < node->child + node->numfaces; slot++)
+				{
+					vec_t dist = (point[0] * opaqueslotplane[0][slot] + point[1] * opaqueslotplane[1][slot] + point[2] * opaqueslotplane[2][slot]) - opaqueslotplane[3][slot];
+					if (fabs (dist) <= HUNT_WALL_EPSILON && TestLineOpaque_face (opaqueslotface[slot], point))
+					{
+						return 1;
+					}
+				}
+			}
+			else
+			{
+				stack[stacksize++] = node->child;
+				nodenum = nodenum + 1;
+				continue;
+			}
+		}
+		if (stacksize == 0)
+		{
+			return 0;
+		}
+		nodenum = stack[--stacksize];
+	}
+}
+
 bool TryMerge (opaqueface_t *f, const opaqueface_t *f2)
 {
 	if (!f->winding || !f2->winding)
@@ -710,6 +1668,7 @@ void CreateOpaqueNodes ()
 			om->mins[j] = dm->mins[j] - 1;
 			om->maxs[j] = dm->maxs[j] + 1;
 		}
+		om->bvhnode = -1;
 	}
 }
 
@@ -727,6 +1686,16 @@ void DeleteOpaqueNodes ()
 	free (opaquefaces);
 	free (opaquenodes);
 	free (opaquemodels);
+	free (opaquebvhnodes_alloc);
+	for (i = 0; i < 4; i++)
+	{
+		free (opaqueslotplane[i]);
+	}
+	free (opaqueslotface);
+	free (opaqueslotnode);
+	free (opaquenodeparent);
+	free (opaquenodesegments);
+	free (opaquelineteststamps);
 }
 
 int TestLineOpaque_face (int facenum, const vec3_t hit)
@@ -762,70 +1731,6 @@ int TestLineOpaque_face (int facenum, const vec3_t hit)
 	return 1;
 }
 
-int TestLineOpaque_r (int nodenum, const vec3_t start, const vec3_t stop)
-{
-	opaquenode_t *thisnode;
-	vec_t front, back;
-	if (nodenum < 0)
-	{
-		return 0;
-	}
-	thisnode = &opaquenodes[nodenum];
-	switch (thisnode->type)
-	{
-	case plane_x:
-		front = start[0] - thisnode->dist;
-		back = stop[0] - thisnode->dist;
-		break;
-	case plane_y:
-		front = start[1] - thisnode->dist;
-		back = stop[1] - thisnode->dist;
-		break;
-	case plane_z:
-		front = start[2] - thisnode->dist;
-		back = stop[2] - thisnode->dist;
-		break;
-	default:
-		front = DotProduct (start, thisnode->normal) - thisnode->dist;
-		back = DotProduct (stop, thisnode->normal) - thisnode->dist;
-	}
-	if (front > ON_EPSILON / 2 && back > ON_EPSILON / 2)
-	{
-		return TestLineOpaque_r (thisnode->children[0], start, stop);
-	}
-	if (front < -ON_EPSILON / 2 && back < -ON_EPSILON / 2)
-	{
-		return TestLineOpaque_r (thisnode->children[1], start, stop);
-	}
-	if (fabs (front) <= ON_EPSILON && fabs (back) <= ON_EPSILON)
-	{
-		return TestLineOpaque_r (thisnode->children[0], start, stop)
-			|| TestLineOpaque_r (thisnode->children[1], start, stop);
-	}
-	{
-		int side;
-		vec_t frac;
-		vec3_t mid;
-		int facenum;
-		side = (front - back) < 0;
-		frac = front / (front - back);
-		if (frac < 0) frac = 0;
-		if (frac > 1) frac = 1;
-		mid[0] = start[0] + (stop[0] - start[0]) * frac;
-		mid[1] = start[1] + (stop[1] - start[1]) * frac;
-		mid[2] = start[2] + (stop[2] - start[2]) * frac;
-		for (facenum = thisnode->firstface; facenum < thisnode->firstface + thisnode->numfaces; facenum++)
-		{
-			if (TestLineOpaque_face (facenum, mid))
-			{
-				return 1;
-			}
-		}
-		return TestLineOpaque_r (thisnode->children[side], start, mid)
-			|| TestLineOpaque_r (thisnode->children[!side], mid, stop);
-	}
-}
-
 int TestLineOpaque (int modelnum, const vec3_t modelorigin, const vec3_t start, const vec3_t stop)
 {
 	opaquemodel_t *thismodel = &opaquemodels[modelnum];
@@ -881,7 +1786,11 @@ int TestLineOpaque (int modelnum, const vec3_t modelorigin, const vec3_t start,
 			}
 		}
 	}
-	return TestLineOpaque_r (thismodel->headnode, p1, p2);
+	if (thismodel->bvhnode == -1)
+	{
+		return 0;
+	}
+	return TestLineOpaque_bvh (thismodel->bvhnode, p1, p2);
 }
 
 int CountOpaqueFaces_r (opaquenode_t *node)
@@ -904,7 +1813,7 @@ int CountOpaqueFaces (int modelnum)
 	return CountOpaqueFaces_r (&opaquenodes[opaquemodels[modelnum].headnode]);
 }
 
-int TestPointOpaque_r (int nodenum, bool solid, const vec3_t point)
+static int TestPointSolid_r (int nodenum, const vec3_t point)
 {
 	opaquenode_t *thisnode;
 	vec_t dist;
@@ -912,10 +1821,7 @@ int TestPointOpaque_r (int nodenum, bool solid, const vec3_t point)
 	{
 		if (nodenum < 0)
 		{
-			if (solid && g_dleafs[-nodenum-1].contents == CONTENTS_SOLID)
-				return 1;
-			else
-				return 0;
+			return g_dleafs[-nodenum-1].contents == CONTENTS_SOLID;
 		}
 		thisnode = &opaquenodes[nodenum];
 		switch (thisnode->type)
@@ -945,18 +1851,17 @@ int TestPointOpaque_r (int nodenum, bool solid, const vec3_t point)
 			break;
 		}
 	}
+	return TestPointSolid_r (thisnode->children[0], point)
+		|| TestPointSolid_r (thisnode->children[1], point);
+}
+
+int TestPointOpaque_r (const opaquemodel_t *model, bool solid, const vec3_t point)
+{
+	if (model->bvhnode != -1 && TestPointOpaque_bvh (model->bvhnode, point))
 	{
-		int facenum;
-		for (facenum = thisnode->firstface; facenum < thisnode->firstface + thisnode->numfaces; facenum++)
-		{
-			if (TestLineOpaque_face (facenum, point))
-			{
-				return 1;
-			}
-		}
+		return 1;
 	}
-	return TestPointOpaque_r (thisnode->children[0], solid, point)
-		|| TestPointOpaque_r (thisnode->children[1], solid, point);
+	return solid && TestPointSolid_r (model->headnode, point);
 }
 
 #ifndef OPAQUE_NODE_INLINECALL
@@ -973,7 +1878,7 @@ int TestPointOpaque (int modelnum, const vec3_t modelorigin, bool solid, const v
 		if (newpoint[axial] < thismodel->mins[axial])
 			return 0;
 	}
-	return TestPointOpaque_r (thismodel->headnode, solid, newpoint);
+	return TestPointOpaque_r (thismodel, solid, newpoint);
 }
 #endif
 
@@ -1,15 +1,102 @@
+#include <thread>
+
 #include "qrad.h"
 
 #ifdef SYSTEM_WIN32
 #include <sys/stat.h>
 #include <fcntl.h>
 #include "win32fix.h"
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
 #endif
 
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
 
+#ifdef SYSTEM_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+// =====================================================================================
+//  Transfer file layout
+//      The file is mapped into memory by readtransfers and the patches point straight
+//      into the mapping, so GatherLight reads the transfers without copying them and
+//      the operating system pages them in and out as the bounces need them.
+//
+//      transferheader_t
+//      transferentry_t[numpatches]   (offsets are from the start of the file)
+//      transfer_index_t[]            (all patches, contiguous, in patch order)
+//      transfer_data_t[]             (all patches, contiguous, in patch order)
+//      unused_size bytes of padding  (decompression may read past the last block)
+// =====================================================================================
+
+#define TRANSFERFILE_IDENT		(('T' << 24) + ('F' << 16) + ('R' << 8) + 'H') // "HRFT"
+#define TRANSFERFILE_VERSION	2
+#define TRANSFERFILE_ALIGN		16
+
+typedef struct
+{
+	int				ident;
+	int				version;
+	int				numpatches;
+	int				rgb;			// whether the data is rgb_transfer_data_t
+	int				compresstype;	// g_transfer_compress_type or g_rgbtransfer_compress_type
+	int				datasize;		// bytes per transfer
+	int				indexsize;		// sizeof (transfer_index_t)
+	int				unused;
+	unsigned long long filesize;
+} transferheader_t;
+
+typedef struct
+{
+	unsigned		iIndex;
+	unsigned		iData;
+	unsigned long long indexofs;
+	unsigned long long dataofs;
+} transferentry_t;
+
+static void *g_transfermap = NULL;
+static unsigned long long g_transfermapsize = 0;
+#ifdef SYSTEM_WIN32
+static HANDLE g_transfermapfile = INVALID_HANDLE_VALUE;
+static HANDLE g_transfermapping = NULL;
+#endif
+
+static unsigned long long AlignTransferOffset (unsigned long long ofs)
+{
+	return (ofs + (TRANSFERFILE_ALIGN - 1)) & ~(unsigned long long)(TRANSFERFILE_ALIGN - 1);
+}
+
+static void SetTransferHeader (transferheader_t *header, const long numpatches)
+{
+	memset (header, 0, sizeof (transferheader_t));
+	header->ident = TRANSFERFILE_IDENT;
+	header->version = TRANSFERFILE_VERSION;
+	header->numpatches = numpatches;
+	header->rgb = g_rgb_transfers? 1: 0;
+	header->compresstype = g_rgb_transfers? (int)g_rgbtransfer_compress_type: (int)g_transfer_compress_type;
+	header->datasize = g_rgb_transfers? (int)vector_size[g_rgbtransfer_compress_type]: (int)float_size[g_transfer_compress_type];
+	header->indexsize = sizeof (transfer_index_t);
+}
+
+static bool WriteTransferPadding (FILE *file, unsigned long long from, unsigned long long to)
+{
+	static const char zeros[TRANSFERFILE_ALIGN] = {0};
+	while (from < to)
+	{
+		size_t n = (size_t)qmin (to - from, (unsigned long long)TRANSFERFILE_ALIGN);
+		if (fwrite (zeros, 1, n, file) != n)
+		{
+			return false;
+		}
+		from += n;
+	}
+	return true;
+}
+
 /*
  * =============
  * writetransfers
@@ -23,58 +110,92 @@ void            writetransfers(const char* const transferfile, const long total_
     file = fopen(transferfile, "w+b");
     if (file != NULL)
     {
-        unsigned        amtwritten;
         patch_t*        patch;
+		long			patchcount;
+		transferheader_t header;
+		transferentry_t *entries;
+		unsigned long long ofs;
 
         Log("Writing transfers file [%s]\n", transferfile);
 
-        amtwritten = fwrite(&total_patches, sizeof(total_patches), 1, file);
-        if (amtwritten != 1)
-        {
-            goto FailedWrite;
-        }
-
-        long patchcount = total_patches;
-        for (patch = g_patches; patchcount-- > 0; patch++)
-        {
-            amtwritten = fwrite(&patch->iIndex, sizeof(patch->iIndex), 1, file);
-            if (amtwritten != 1)
-            {
-                goto FailedWrite;
-            }
-
-            if (patch->iIndex)
-            {
-                amtwritten = fwrite(patch->tIndex, sizeof(transfer_index_t), patch->iIndex, file);
-                if (amtwritten != patch->iIndex)
-                {
-                    goto FailedWrite;
-                }
-            }
-
-            amtwritten = fwrite(&patch->iData, sizeof(patch->iData), 1, file);
-            if (amtwritten != 1)
-            {
-                goto FailedWrite;
-            }
-            if (patch->iData)
-            {
-				if(g_rgb_transfers)
+		SetTransferHeader (&header, total_patches);
+
+		// lay out the index and data blocks before writing anything, so the file is written in one pass
+		entries = (transferentry_t *)malloc (total_patches * sizeof (transferentry_t) + 1);
+		hlassume (entries != NULL, assume_NoMemory);
+		ofs = AlignTransferOffset (sizeof (transferheader_t) + total_patches * sizeof (transferentry_t));
+		for (patchcount = 0, patch = g_patches; patchcount < total_patches; patchcount++, patch++)
+		{
+			entries[patchcount].iIndex = patch->iIndex;
+			entries[patchcount].indexofs = ofs;
+			ofs += (unsigned long long)patch->iIndex * sizeof (transfer_index_t);
+		}
+		ofs = AlignTransferOffset (ofs);
+		for (patchcount = 0, patch = g_patches; patchcount < total_patches; patchcount++, patch++)
+		{
+			entries[patchcount].iData = patch->iData;
+			entries[patchcount].dataofs = ofs;
+			ofs += (unsigned long long)patch->iData * header.datasize;
+		}
+		header.filesize = ofs + unused_size;
+
+		ofs = 0;
+		if (fwrite (&header, sizeof (transferheader_t), 1, file) != 1
+			|| fwrite (entries, sizeof (transferentry_t), total_patches, file) != (size_t)total_patches)
+		{
+			free (entries);
+			goto FailedWrite;
+		}
+		ofs = sizeof (transferheader_t) + total_patches * sizeof (transferentry_t);
+
+		for (patchcount = 0, patch = g_patches; patchcount < total_patches; patchcount++, patch++)
+		{
+			if (!WriteTransferPadding (file, ofs, entries[patchcount].indexofs))
+			{
+				free (entries);
+				goto FailedWrite;
+			}
+			ofs = entries[patchcount].indexofs;
+			if (patch->iIndex)
+			{
+				if (fwrite (patch->tIndex, sizeof (transfer_index_t), patch->iIndex, file) != patch->iIndex)
 				{
-			amtwritten = fwrite(patch->tRGBData, vector_size[g_rgbtransfer_compress_type], patch->iData, file);
+					free (entries);
+					goto FailedWrite;
 				}
-				else
+				ofs += (unsigned long long)patch->iIndex * sizeof (transfer_index_t);
+			}
+		}
+		for (patchcount = 0, patch = g_patches; patchcount < total_patches; patchcount++, patch++)
+		{
+			if (!WriteTransferPadding (file, ofs, entries[patchcount].dataofs))
+			{
+				free (entries);
+				goto FailedWrite;
+			}
+			ofs = entries[patchcount].dataofs;
+			if (patch->iData)
+			{
+				const void *data = g_rgb_transfers? (const void *)patch->tRGBData: (const void *)patch->tData;
+				if (fwrite (data, header.datasize, patch->iData, file) != patch->iData)
 				{
-			amtwritten = fwrite(patch->tData, float_size[g_transfer_compress_type], patch->iData, file);
+					free (entries);
+					goto FailedWrite;
 				}
-                if (amtwritten != patch->iData)
-                {
-                    goto FailedWrite;
-                }
-            }
-        }
-
-        fclose(file);
+				ofs += (unsigned long long)patch->iData * header.datasize;
+			}
+		}
+		free (entries);
+		if (!WriteTransferPadding (file, ofs, header.filesize))
+		{
+			goto FailedWrite;
+		}
+
+        if (fclose(file) != 0)
+		{
+			unlink(transferfile);
+			Warning("Failed to generate incremental file [%s] (probably ran out of disk space)\n", transferfile);
+		}
     }
     else
     {
@@ -89,6 +210,113 @@ void            writetransfers(const char* const transferfile, const long total_
     Warning("Failed to generate incremental file [%s] (probably ran out of disk space)\n", transferfile); //--vluzacn
 }
 
+/*
+ * =============
+ * MapTransferFile
+ * =============
+ */
+
+static bool MapTransferFile (const char* const transferfile)
+{
+#ifdef SYSTEM_WIN32
+	LARGE_INTEGER size;
+
+	g_transfermapfile = CreateFileA (transferfile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (g_transfermapfile == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	if (!GetFileSizeEx (g_transfermapfile, &size) || size.QuadPart < (LONGLONG)sizeof (transferheader_t)
+		|| (unsigned long long)size.QuadPart != (unsigned long long)(size_t)size.QuadPart)
+	{
+		CloseHandle (g_transfermapfile);
+		g_transfermapfile = INVALID_HANDLE_VALUE;
+		return false;
+	}
+	g_transfermapping = CreateFileMappingA (g_transfermapfile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (g_transfermapping == NULL)
+	{
+		CloseHandle (g_transfermapfile);
+		g_transfermapfile = INVALID_HANDLE_VALUE;
+		return false;
+	}
+	g_transfermap = MapViewOfFile (g_transfermapping, FILE_MAP_READ, 0, 0, 0);
+	if (g_transfermap == NULL)
+	{
+		CloseHandle (g_transfermapping);
+		g_transfermapping = NULL;
+		CloseHandle (g_transfermapfile);
+		g_transfermapfile = INVALID_HANDLE_VALUE;
+		return false;
+	}
+	g_transfermapsize = size.QuadPart;
+	return true;
+#else
+	int fd;
+	struct stat st;
+	void *map;
+
+	fd = open (transferfile, O_RDONLY);
+	if (fd == -1)
+	{
+		return false;
+	}
+	if (fstat (fd, &st) != 0 || st.st_size < (off_t)sizeof (transferheader_t)
+		|| (unsigned long long)st.st_size != (unsigned long long)(size_t)st.st_size)
+	{
+		close (fd);
+		return false;
+	}
+	map = mmap (NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd); // the mapping keeps its own reference to the file
+	if (map == MAP_FAILED)
+	{
+		return false;
+	}
+	g_transfermap = map;
+	g_transfermapsize = st.st_size;
+	return true;
+#endif
+}
+
+/*
+ * =============
+ * unmaptransfers
+ * =============
+ */
+
+bool            unmaptransfers()
+{
+	if (!g_transfermap)
+	{
+		return false;
+	}
+#ifdef SYSTEM_WIN32
+	UnmapViewOfFile (g_transfermap);
+	CloseHandle (g_transfermapping);
+	g_transfermapping = NULL;
+	CloseHandle (g_transfermapfile);
+	g_transfermapfile = INVALID_HANDLE_VALUE;
+#else
+	munmap (g_transfermap, (size_t)g_transfermapsize);
+#endif
+	g_transfermap = NULL;
+	g_transfermapsize = 0;
+
+	unsigned        x;
+	patch_t*        patch = g_patches;
+
+	for (x = 0; x < g_num_patches; x++, patch++)
+	{
+		patch->iData = 0;
+		patch->iIndex = 0;
+		patch->tData = NULL;
+		patch->tRGBData = NULL;
+		patch->tIndex = NULL;
+	}
+	return true;
+}
+
 /*
  * =============
  * readtransfers
@@ -97,96 +325,386 @@ void            writetransfers(const char* const transferfile, const long total_
 
 bool            readtransfers(const char* const transferfile, const long numpatches)
 {
-    FILE*           file;
-    long            total_patches;
+	const transferheader_t *header;
+	const transferentry_t *entries;
+	transferheader_t expected;
+	const unsigned char *base;
+	patch_t*        patch;
+	long			patchcount;
 
-    file = fopen(transferfile, "rb");
-    if (file != NULL)
-    {
-        unsigned        amtread;
-        patch_t*        patch;
+	if (!MapTransferFile (transferfile))
+	{
+		Warning("Failed to open transfers file [%s]\n", transferfile);
+		return false;
+	}
 
-        Log("Reading transfers file [%s]\n", transferfile);
-
-        amtread = fread(&total_patches, sizeof(total_patches), 1, file);
-        if (amtread != 1)
-        {
-            goto FailedRead;
-        }
-        if (total_patches != numpatches)
-        {
-            goto FailedRead;
-        }
-
-        long patchcount = total_patches;
-        for (patch = g_patches; patchcount-- > 0; patch++)
-        {
-            amtread = fread(&patch->iIndex, sizeof(patch->iIndex), 1, file);
-            if (amtread != 1)
-            {
-                goto FailedRead;
-            }
-            if (patch->iIndex)
-            {
-                patch->tIndex = (transfer_index_t*)AllocBlock(patch->iIndex * sizeof(transfer_index_t *));
-                hlassume(patch->tIndex != NULL, assume_NoMemory);
-                amtread = fread(patch->tIndex, sizeof(transfer_index_t), patch->iIndex, file);
-                if (amtread != patch->iIndex)
-                {
-                    goto FailedRead;
-                }
-            }
-
-            amtread = fread(&patch->iData, sizeof(patch->iData), 1, file);
-            if (amtread != 1)
-            {
-                goto FailedRead;
-            }
-            if (patch->iData)
-            {
-				if(g_rgb_transfers)
-				{
-                    patch->tRGBData = (rgb_transfer_data_t*)AllocBlock(patch->iData * vector_size[g_rgbtransfer_compress_type] + unused_size);
-                    hlassume(patch->tRGBData != NULL, assume_NoMemory);
-                    amtread = fread(patch->tRGBData, vector_size[g_rgbtransfer_compress_type], patch->iData, file);		    
-				}
-				else
-				{
-                    patch->tData = (transfer_data_t*)AllocBlock(patch->iData * float_size[g_transfer_compress_type] + unused_size);
-                    hlassume(patch->tData != NULL, assume_NoMemory);
-                    amtread = fread(patch->tData, float_size[g_transfer_compress_type], patch->iData, file);		    
-				}
-                if (amtread != patch->iData)
-                {
-                    goto FailedRead;
-                }
-            }
-        }
-
-        fclose(file);
-        //Warning("Finished reading transfers file [%s] %d\n", transferfile);
-        Warning("Finished reading transfers file [%s]\n", transferfile); //--vluzacn
-        return true;
-    }
-    Warning("Failed to open transfers file [%s]\n", transferfile);
-    return false;
+	Log("Reading transfers file [%s]\n", transferfile);
+
+	base = (const unsigned char *)g_transfermap;
+	header = (const transferheader_t *)base;
+	SetTransferHeader (&expected, numpatches);
+	if (header->ident != expected.ident || header->version != expected.version || header->numpatches != expected.numpatches
+		|| header->rgb != expected.rgb || header->compresstype != expected.compresstype
+		|| header->datasize != expected.datasize || header->indexsize != expected.indexsize
+		|| header->filesize != g_transfermapsize
+		|| g_transfermapsize < sizeof (transferheader_t) + (unsigned long long)numpatches * sizeof (transferentry_t) + unused_size)
+	{
+		goto FailedRead;
+	}
+
+	entries = (const transferentry_t *)(base + sizeof (transferheader_t));
+	for (patchcount = 0, patch = g_patches; patchcount < numpatches; patchcount++, patch++)
+	{
+		const transferentry_t *e = &entries[patchcount];
+		if (e->indexofs % sizeof (transfer_index_t) != 0
+			|| e->indexofs + (unsigned long long)e->iIndex * sizeof (transfer_index_t) > g_transfermapsize - unused_size
+			|| e->dataofs + (unsigned long long)e->iData * header->datasize > g_transfermapsize - unused_size)
+		{
+			goto FailedRead;
+		}
+		patch->iIndex = e->iIndex;
+		patch->iData = e->iData;
+		patch->tIndex = e->iIndex? (transfer_index_t *)(base + e->indexofs): NULL;
+		if (g_rgb_transfers)
+		{
+			patch->tRGBData = e->iData? (rgb_transfer_data_t *)(base + e->dataofs): NULL;
+		}
+		else
+		{
+			patch->tData = e->iData? (transfer_data_t *)(base + e->dataofs): NULL;
+		}
+	}
+
+	//Warning("Finished reading transfers file [%s] %d\n", transferfile);
+	Warning("Finished reading transfers file [%s]\n", transferfile); //--vluzacn
+	return true;
 
   FailedRead:
-    {
-        unsigned        x;
-        patch_t*        patch = g_patches;
-
-        for (x = 0; x < g_num_patches; x++, patch++)
-        {
-            FreeBlock(patch->tData);
-            FreeBlock(patch->tIndex);
-            patch->iData = 0;
-            patch->iIndex = 0;
-            patch->tData = NULL;
-            patch->tIndex = NULL;
-        }
-    }
-    fclose(file);
-    unlink(transferfile);
-    return false;
+	unmaptransfers ();
+	unlink(transferfile);
+	return false;
+}
+
+// =====================================================================================
+//  Transfer stream (-transfermemory)
+//      MakeScales builds the transfers a range of patches at a time. Each range is then
+//      appended to "<mapname>.tfs" as a segment and freed. Every bounce reads the segments
+//      back in order, the next one while GatherLight works on the current one, so no more
+//      than two segments are in memory at a time. The ranges are sized so that a segment
+//      takes about half of g_transfermemory.
+//
+//      segment: transfer_index_t[] of its patches, the data of its patches, unused_size bytes
+// =====================================================================================
+
+typedef struct
+{
+	unsigned		firstpatch;
+	unsigned		numpatches;
+	unsigned long long indexsize;	// bytes of transfer_index_t
+	unsigned long long size;		// bytes in the file, padding included
+} transfersegment_t;
+
+unsigned		g_segmentfirstpatch = 0;
+
+static FILE *s_streamfile = NULL;
+static char s_streamname[_MAX_PATH];
+static transfersegment_t *s_segments = NULL;
+static unsigned s_numsegments = 0;
+static unsigned s_maxsegments = 0;
+static unsigned long long s_maxsegmentsize = 0;
+static unsigned long long s_streamsize = 0;
+static unsigned char *s_streambuffers[2] = {NULL, NULL};
+static unsigned s_readsegment = 0;		// the segment that is read next, or being read
+static int s_readbuffer = 0;
+static bool s_readok = false;
+static std::thread s_streamreader;
+
+static size_t TransferDataSize ()
+{
+	return g_rgb_transfers? vector_size[g_rgbtransfer_compress_type]: float_size[g_transfer_compress_type];
+}
+
+static void WriteTransferSegment (const unsigned firstpatch, const unsigned numpatches)
+{
+	static const unsigned char zeros[16] = {0};
+	const size_t datasize = TransferDataSize ();
+	transfersegment_t *segment;
+	patch_t *patch;
+	unsigned x;
+
+	if (s_numsegments >= s_maxsegments)
+	{
+		s_maxsegments = qmax (16u, s_maxsegments * 2);
+		s_segments = (transfersegment_t *)realloc (s_segments, s_maxsegments * sizeof (transfersegment_t));
+		hlassume (s_segments != NULL, assume_NoMemory);
+	}
+	segment = &s_segments[s_numsegments++];
+	segment->firstpatch = firstpatch;
+	segment->numpatches = numpatches;
+	segment->indexsize = 0;
+	segment->size = 0;
+
+	for (x = 0, patch = &g_patches[firstpatch]; x < numpatches; x++, patch++)
+	{
+		if (patch->iIndex && fwrite (patch->tIndex, sizeof (transfer_index_t), patch->iIndex, s_streamfile) != patch->iIndex)
+		{
+			goto FailedWrite;
+		}
+		segment->indexsize += (unsigned long long)patch->iIndex * sizeof (transfer_index_t);
+	}
+	segment->size = segment->indexsize;
+	for (x = 0, patch = &g_patches[firstpatch]; x < numpatches; x++, patch++)
+	{
+		const void *data = g_rgb_transfers? (const void *)patch->tRGBData: (const void *)patch->tData;
+		if (patch->iData && fwrite (data, datasize, patch->iData, s_streamfile) != patch->iData)
+		{
+			goto FailedWrite;
+		}
+		segment->size += (unsigned long long)patch->iData * datasize;
+	}
+	hlassert (unused_size <= sizeof (zeros));
+	if (fwrite (zeros, 1, unused_size, s_streamfile) != unused_size)
+	{
+		goto FailedWrite;
+	}
+	segment->size += unused_size;
+	s_maxsegmentsize = qmax (s_maxsegmentsize, segment->size);
+	s_streamsize += segment->size;
+
+	for (x = 0, patch = &g_patches[firstpatch]; x < numpatches; x++, patch++)
+	{
+		if (patch->tData)
+		{
+			FreeBlock (patch->tData);
+			patch->tData = NULL;
+		}
+		if (patch->tRGBData)
+		{
+			FreeBlock (patch->tRGBData);
+			patch->tRGBData = NULL;
+		}
+		if (patch->tIndex)
+		{
+			FreeBlock (patch->tIndex);
+			patch->tIndex = NULL;
+		}
+	}
+	return;
+
+  FailedWrite:
+	Error ("Failed to write transfer stream file [%s] (probably ran out of disk space)\n", s_streamname);
+}
+
+/*
+ * =============
+ * CloseTransferStreamAtExit
+ * Error may exit while a segment is being read, and a joinable std::thread would terminate the program when
+ * it is destroyed. Also removes the stream file, which FreeTransferStream would have done.
+ * =============
+ */
+
+static void CloseTransferStreamAtExit ()
+{
+	if (s_streamreader.joinable ())
+	{
+		s_streamreader.join ();
+	}
+	if (s_streamfile)
+	{
+		fclose (s_streamfile);
+		s_streamfile = NULL;
+		unlink (s_streamname);
+	}
+}
+
+/*
+ * =============
+ * StreamMakeScales
+ * Runs func (MakeScales or MakeRGBScales) over all patches and writes the transfers to the stream file
+ * =============
+ */
+
+void StreamMakeScales (q_threadfunction func, const char *name)
+{
+	const unsigned long long budget = qmax ((unsigned long long)g_transfermemory * 1024 * 1024 / 2, (unsigned long long)1);
+	unsigned first;
+	unsigned count;
+	unsigned chunk;
+
+	static bool registered = false;
+	if (!registered)
+	{
+		atexit (CloseTransferStreamAtExit);
+		registered = true;
+	}
+	safe_snprintf (s_streamname, _MAX_PATH, "%s.tfs", g_Mapname);
+	s_streamfile = fopen (s_streamname, "w+b");
+	if (s_streamfile == NULL)
+	{
+		Error ("Failed to open transfer stream file [%s] for writing\n", s_streamname);
+	}
+
+	Log ("%s:\n", name);
+	ProfileBeginStage (name);
+	chunk = qmin (g_num_patches, (unsigned)qmax (g_numthreads, 1) * 64);
+	for (first = 0; first < g_num_patches; first += count)
+	{
+		unsigned long long size;
+
+		count = qmin (chunk, g_num_patches - first);
+		g_segmentfirstpatch = first;
+		RunThreadsOn (count, false, func);
+		WriteTransferSegment (first, count);
+
+		// aim the next range at the budget, judging by how big this one turned out
+		size = s_segments[s_numsegments - 1].size;
+		chunk = (unsigned)qmax (1ull, qmin ((unsigned long long)count * budget / size, (unsigned long long)count * 2));
+		Verbose ("Transfer segment %u: patches %u to %u, %llu bytes\n", s_numsegments - 1, first, first + count - 1, size);
+	}
+	g_segmentfirstpatch = 0;
+	ProfileEndStage ();
+
+	if (fflush (s_streamfile) != 0)
+	{
+		Error ("Failed to write transfer stream file [%s] (probably ran out of disk space)\n", s_streamname);
+	}
+	Log ("Transfer stream [%s]: %u segments, %.2f MB, largest %.2f MB\n", s_streamname, s_numsegments,
+		s_streamsize / (1024.0 * 1024.0), s_maxsegmentsize / (1024.0 * 1024.0));
+}
+
+static void ReadTransferSegment (const transfersegment_t *segment, unsigned char *buffer)
+{
+	s_readok = fread (buffer, 1, (size_t)segment->size, s_streamfile) == segment->size;
+}
+
+static void StartReadingSegment ()
+{
+	s_streamreader = std::thread (ReadTransferSegment, &s_segments[s_readsegment], s_streambuffers[s_readbuffer]);
+}
+
+/*
+ * =============
+ * BeginTransferPass
+ * Starts reading the stream from its first segment
+ * =============
+ */
+
+void BeginTransferPass ()
+{
+	hlassume (s_streamfile != NULL, assume_ValidPointer);
+	if (s_streamreader.joinable ())
+	{
+		s_streamreader.join ();
+	}
+	if (!s_streambuffers[0])
+	{
+		s_streambuffers[0] = (unsigned char *)AllocBlock ((size_t)s_maxsegmentsize);
+		s_streambuffers[1] = (unsigned char *)AllocBlock ((size_t)s_maxsegmentsize);
+	}
+	rewind (s_streamfile);
+	s_readsegment = 0;
+	s_readbuffer = 0;
+	if (s_numsegments)
+	{
+		StartReadingSegment ();
+	}
+}
+
+/*
+ * =============
+ * NextTransferSegment
+ * Points the patches of the next segment at its transfers, the ones of the segment before are no longer valid
+ * =============
+ */
+
+bool NextTransferSegment (unsigned &firstpatch, unsigned &numpatches)
+{
+	const transfersegment_t *segment;
+	const unsigned char *index;
+	const unsigned char *data;
+	patch_t *patch;
+	unsigned x;
+
+	if (s_readsegment >= s_numsegments)
+	{
+		return false;
+	}
+	s_streamreader.join ();
+	if (!s_readok)
+	{
+		Error ("Failed to read transfer stream file [%s]\n", s_streamname);
+	}
+
+	segment = &s_segments[s_readsegment];
+	index = s_streambuffers[s_readbuffer];
+	data = index + segment->indexsize;
+	for (x = 0, patch = &g_patches[segment->firstpatch]; x < segment->numpatches; x++, patch++)
+	{
+		patch->tIndex = patch->iIndex? (transfer_index_t *)index: NULL;
+		index += patch->iIndex * sizeof (transfer_index_t);
+		if (g_rgb_transfers)
+		{
+			patch->tRGBData = patch->iData? (rgb_transfer_data_t *)data: NULL;
+		}
+		else
+		{
+			patch->tData = patch->iData? (transfer_data_t *)data: NULL;
+		}
+		data += patch->iData * TransferDataSize ();
+	}
+	firstpatch = segment->firstpatch;
+	numpatches = segment->numpatches;
+
+	s_readsegment++;
+	s_readbuffer ^= 1;
+	if (s_readsegment < s_numsegments)
+	{
+		StartReadingSegment ();
+	}
+	return true;
+}
+
+/*
+ * =============
+ * FreeTransferStream
+ * =============
+ */
+
+bool FreeTransferStream ()
+{
+	if (!s_streamfile)
+	{
+		return false;
+	}
+	if (s_streamreader.joinable ())
+	{
+		s_streamreader.join ();
+	}
+	fclose (s_streamfile);
+	s_streamfile = NULL;
+	unlink (s_streamname);
+
+	if (s_streambuffers[0])
+	{
+		FreeBlock (s_streambuffers[0]);
+		FreeBlock (s_streambuffers[1]);
+		s_streambuffers[0] = s_streambuffers[1] = NULL;
+	}
+	free (s_segments);
+	s_segments = NULL;
+	s_numsegments = s_maxsegments = 0;
+	s_maxsegmentsize = s_streamsize = 0;
+
+	unsigned        x;
+	patch_t*        patch = g_patches;
+
+	for (x = 0; x < g_num_patches; x++, patch++)
+	{
+		patch->iData = 0;
+		patch->iIndex = 0;
+		patch->tData = NULL;
+		patch->tRGBData = NULL;
+		patch->tIndex = NULL;
+	}
+	return true;
 }
@@ -17,26 +17,82 @@ static vec3_t *		s_trans_list	= NULL;
 static unsigned int	s_trans_count	= 0;
 static unsigned int	s_max_trans_count = 0;
 
-static transList_t*	s_raw_list	= NULL;
-static unsigned int	s_raw_count	= 0;
-static unsigned int	s_max_raw_count	= 0;	// Current array maximum (used for reallocs)
+// Hash of EQUAL_EPSILON sized cells for AddTransparencyToDataList. Values that VectorCompare
+// calls equal lie in the same or a neighbouring cell.
+static int*			s_trans_cells	= NULL;	// first value in the cell (or a cell with the same hash), -1 if none
+static int*			s_trans_next	= NULL;	// next value with the same hash, -1 if none
+static unsigned int	s_trans_cells_size = 0;	// power of 2
+
+typedef struct {
+	unsigned	p1;
+	unsigned	p2;
+	vec3_t		trans;
+} rawTrans_t;
+
+// Each thread adds to a list of its own, so no locking is needed.
+// CreateFinalTransparencyArrays merges them.
+static rawTrans_t*	s_raw_list[MAX_THREADS];
+static unsigned int	s_raw_count[MAX_THREADS];
+static unsigned int	s_max_raw_count[MAX_THREADS];	// Current array maximum (used for reallocs)
 
 static transList_t*	s_sorted_list	= NULL;	// Sorted first by p1 then p2
 static unsigned int	s_sorted_count	= 0;
+static unsigned int*	s_sorted_rowstart = NULL;	// first item of each p1, g_num_patches + 1 entries
 
 const vec3_t vec3_one = {1.0,1.0,1.0};
 
 //===============================================
-// AddTransparencyToRawArray
+// TransparencyCell
+//===============================================
+static inline int TransparencyCell(const vec_t v)
+{
+	return (int)floor(v / EQUAL_EPSILON);
+}
+
+static inline unsigned int HashTransparencyCell(const int x, const int y, const int z)
+{
+	unsigned int hash = (unsigned int)x * 73856093u ^ (unsigned int)y * 19349663u ^ (unsigned int)z * 83492791u;
+
+	return (hash ^ (hash >> 16)) & (s_trans_cells_size - 1);
+}
+
+static void LinkTransparencyToCells(const unsigned int index)
+{
+	const vec_t *v = s_trans_list[index];
+	unsigned int hash = HashTransparencyCell(TransparencyCell(v[0]), TransparencyCell(v[1]), TransparencyCell(v[2]));
+
+	s_trans_next[index] = s_trans_cells[hash];
+	s_trans_cells[hash] = index;
+}
+
+//===============================================
+// AddTransparencyToDataList
 //===============================================
 static unsigned AddTransparencyToDataList(const vec3_t trans)
 {
-	//Check if this value is in list already
-	for(unsigned int i = 0; i < s_trans_count; i++)
+	//Check if this value is in list already, the first match wins like the linear search did
+	if( s_trans_count > 0 )
 	{
-		if( VectorCompare( trans, s_trans_list[i] ) )
+		const int cx = TransparencyCell(trans[0]);
+		const int cy = TransparencyCell(trans[1]);
+		const int cz = TransparencyCell(trans[2]);
+		int best = -1;
+
+		for( int dx = -1; dx <= 1; dx++ )
+		for( int dy = -1; dy <= 1; dy++ )
+		for( int dz = -1; dz <= 1; dz++ )
+		{
+			for( int i = s_trans_cells[HashTransparencyCell(cx + dx, cy + dy, cz + dz)]; i != -1; i = s_trans_next[i] )
+			{
+				if( (best == -1 || i < best) && VectorCompare( trans, s_trans_list[i] ) )
+				{
+					best = i;
+				}
+			}
+		}
+		if( best != -1 )
 		{
-			return i;
+			return best;
 		}
 	}
 	
@@ -51,19 +107,33 @@ static unsigned AddTransparencyToDataList(const vec3_t trans)
 		}
 		
 		s_trans_list = (vec3_t *)realloc( s_trans_list, sizeof(vec3_t) * s_max_trans_count );
+		s_trans_next = (int *)realloc( s_trans_next, sizeof(int) * s_max_trans_count );
 
-		hlassume (s_trans_list != NULL, assume_NoMemory);
+		hlassume (s_trans_list != NULL && s_trans_next != NULL, assume_NoMemory);
 		
 		memset( &s_trans_list[old_max_count], 0, sizeof(vec3_t) * (s_max_trans_count - old_max_count) );
+
+		//keep the hash at most half full
+		free( s_trans_cells );
+		for( s_trans_cells_size = 64; s_trans_cells_size < s_max_trans_count * 2; s_trans_cells_size <<= 1 )
+			;
+		s_trans_cells = (int *)malloc( sizeof(int) * s_trans_cells_size );
+		hlassume (s_trans_cells != NULL, assume_NoMemory);
+		memset( s_trans_cells, -1, sizeof(int) * s_trans_cells_size );
 		
 		if( old_max_count == 0 )
 		{
 			VectorFill(s_trans_list[0], 1.0);
 			s_trans_count++;
 		}
+		for( unsigned int i = 0; i < s_trans_count; i++ )
+		{
+			LinkTransparencyToCells( i );
+		}
 	}
 	
 	VectorCopy(trans, s_trans_list[s_trans_count]);
+	LinkTransparencyToCells( s_trans_count );
 	
 	return ( s_trans_count++ );
 }
@@ -73,54 +143,63 @@ static unsigned AddTransparencyToDataList(const vec3_t trans)
 //===============================================
 void	AddTransparencyToRawArray(const unsigned p1, const unsigned p2, const vec3_t trans)
 {
-	//make thread safe
-	ThreadLock();
-	
-	unsigned data_index = AddTransparencyToDataList(trans);
+	const int thread = GetThreadNum();
 	
 	//realloc if needed
-	while( s_raw_count >= s_max_raw_count )
+	while( s_raw_count[thread] >= s_max_raw_count[thread] )
 	{
-		unsigned int old_max_count = s_max_raw_count;
-		s_max_raw_count = qmax (64u, (unsigned int)((double)s_max_raw_count * 1.41));
-		if (s_max_raw_count >= (unsigned int)INT_MAX)
+		unsigned int old_max_count = s_max_raw_count[thread];
+		s_max_raw_count[thread] = qmax (64u, (unsigned int)((double)s_max_raw_count[thread] * 1.41));
+		if (s_max_raw_count[thread] >= (unsigned int)INT_MAX)
 		{
 			Error ("AddTransparencyToRawArray: array size exceeded INT_MAX");
 		}
 		
-		s_raw_list = (transList_t *)realloc( s_raw_list, sizeof(transList_t) * s_max_raw_count );
+		s_raw_list[thread] = (rawTrans_t *)realloc( s_raw_list[thread], sizeof(rawTrans_t) * s_max_raw_count[thread] );
 
-		hlassume (s_raw_list != NULL, assume_NoMemory);
+		hlassume (s_raw_list[thread] != NULL, assume_NoMemory);
 		
-		memset( &s_raw_list[old_max_count], 0, sizeof(transList_t) * (s_max_raw_count - old_max_count) );
+		memset( &s_raw_list[thread][old_max_count], 0, sizeof(rawTrans_t) * (s_max_raw_count[thread] - old_max_count) );
 	}
 	
-	s_raw_list[s_raw_count].p1 = p1;
-	s_raw_list[s_raw_count].p2 = p2;
-	s_raw_list[s_raw_count].data_index = data_index;
-	
-	s_raw_count++;
+	s_raw_list[thread][s_raw_count[thread]].p1 = p1;
+	s_raw_list[thread][s_raw_count[thread]].p2 = p2;
+	VectorCopy(trans, s_raw_list[thread][s_raw_count[thread]].trans);
 	
-	//unlock list
-	ThreadUnlock();
+	s_raw_count[thread]++;
 }
 
 //===============================================
-// SortList
+// SortByPatch
+//	Stable counting sort of count items of the given size on the patch number at keyofs.
+//	Two passes, on p2 and then on p1, make a radix sort of the pairs. rowstart
+//	(g_num_patches + 1 entries) receives the first item of each patch number.
 //===============================================
-static int CDECL SortList(const void *a, const void *b)
+static void SortByPatch(const void *src, void *dst, const unsigned int count, const size_t size, const size_t keyofs, unsigned int *rowstart)
 {
-	const transList_t* item1 = (transList_t *)a;
-	const transList_t* item2 = (transList_t *)b;
-	
-	if( item1->p1 == item2->p1 )
+	unsigned int i;
+
+	memset( rowstart, 0, sizeof(unsigned int) * (g_num_patches + 1) );
+	for( i = 0; i < count; i++ )
 	{
-		return item1->p2 - item2->p2;
+		rowstart[*(const unsigned *)((const byte *)src + i * size + keyofs) + 1]++;
 	}
-	else
+	for( i = 1; i <= g_num_patches; i++ )
 	{
-		return item1->p1 - item2->p1;
+		rowstart[i] += rowstart[i - 1];
 	}
+	for( i = 0; i < count; i++ )
+	{
+		const byte *item = (const byte *)src + i * size;
+
+		memcpy( (byte *)dst + (rowstart[*(const unsigned *)(item + keyofs)]++) * size, item, size );
+	}
+	//each entry now holds the start of the next patch
+	for( i = g_num_patches; i > 0; i-- )
+	{
+		rowstart[i] = rowstart[i - 1];
+	}
+	rowstart[0] = 0;
 }
 
 //===============================================
@@ -128,38 +207,78 @@ static int CDECL SortList(const void *a, const void *b)
 //===============================================
 void	CreateFinalTransparencyArrays(const char *print_name)
 {
-	if( s_raw_count == 0 )
+	unsigned int raw_count = 0;
+	int thread;
+	unsigned int i;
+
+	for( thread = 0; thread < MAX_THREADS; thread++ )
+	{
+		raw_count += s_raw_count[thread];
+	}
+	if( raw_count == 0 )
 	{
-		s_raw_list = NULL;
-		s_raw_count = s_max_raw_count = 0;
 		return;
 	}
 
-	//double sized (faster find function for sorted list)
-	s_sorted_count = s_raw_count * 2;
+	s_sorted_rowstart = (unsigned int *)malloc( sizeof(unsigned int) * (g_num_patches + 1) );
+	hlassume (s_sorted_rowstart != NULL, assume_NoMemory);
+
+	//merge the lists of all threads and put them in patch order, so the values are numbered
+	//the same way whichever thread found them
+	rawTrans_t *raw = (rawTrans_t *)malloc( sizeof(rawTrans_t) * raw_count * 2 );
+	hlassume (raw != NULL, assume_NoMemory);
+	unsigned int n = 0;
+	for( thread = 0; thread < MAX_THREADS; thread++ )
+	{
+		if( s_raw_count[thread] )
+		{
+			memcpy( &raw[raw_count + n], s_raw_list[thread], sizeof(rawTrans_t) * s_raw_count[thread] );
+			n += s_raw_count[thread];
+		}
+	
+		//free old array
+		free( s_raw_list[thread] );
+		s_raw_list[thread] = NULL;
+		s_raw_count[thread] = s_max_raw_count[thread] = 0;
+	}
+	SortByPatch( &raw[raw_count], raw, raw_count, sizeof(rawTrans_t), myoffsetof(rawTrans_t, p2), s_sorted_rowstart );
+	SortByPatch( raw, &raw[raw_count], raw_count, sizeof(rawTrans_t), myoffsetof(rawTrans_t, p1), s_sorted_rowstart );
+
+	//double sized (each pair can be looked up from both patches)
+	s_sorted_count = raw_count * 2;
 	s_sorted_list = (transList_t *)malloc( sizeof(transList_t) * s_sorted_count );
+	transList_t *unsorted = (transList_t *)malloc( sizeof(transList_t) * s_sorted_count );
 
-	hlassume (s_sorted_list != NULL, assume_NoMemory);
+	hlassume (s_sorted_list != NULL && unsorted != NULL, assume_NoMemory);
 	
-	//First half have p1>p2
-	for( unsigned int i = 0; i < s_raw_count; i++ )
+	//First half have p1>p2, second half have p1<p2
+	for( i = 0; i < raw_count; i++ )
 	{
-		s_sorted_list[i].p1 		= s_raw_list[i].p2;
-		s_sorted_list[i].p2 		= s_raw_list[i].p1;
-		s_sorted_list[i].data_index	= s_raw_list[i].data_index;
+		const rawTrans_t* item = &raw[raw_count + i];
+		unsigned data_index = AddTransparencyToDataList(item->trans);
+
+		unsorted[i].p1				= item->p2;
+		unsorted[i].p2				= item->p1;
+		unsorted[i].data_index		= data_index;
+		unsorted[raw_count + i].p1			= item->p1;
+		unsorted[raw_count + i].p2			= item->p2;
+		unsorted[raw_count + i].data_index	= data_index;
 	}
-	//Second half have p1<p2
-	memcpy( &s_sorted_list[s_raw_count], s_raw_list, sizeof(transList_t) * s_raw_count );
-	
-	//free old array
-	free( s_raw_list );
-	s_raw_list = NULL;
-	s_raw_count = s_max_raw_count = 0;
+	free( raw );
 	
 	//need to sorted for fast search function
-	qsort( s_sorted_list, s_sorted_count, sizeof(transList_t), SortList );
+	SortByPatch( unsorted, s_sorted_list, s_sorted_count, sizeof(transList_t), myoffsetof(transList_t, p2), s_sorted_rowstart );
+	SortByPatch( s_sorted_list, unsorted, s_sorted_count, sizeof(transList_t), myoffsetof(transList_t, p1), s_sorted_rowstart );
+	free( s_sorted_list );
+	s_sorted_list = unsorted;
+
+	//the dedup hash isn't needed any more
+	free( s_trans_cells );
+	free( s_trans_next );
+	s_trans_cells = s_trans_next = NULL;
+	s_trans_cells_size = 0;
 	
-	size_t size = s_sorted_count * sizeof(transList_t) + s_max_trans_count * sizeof(vec3_t);
+	size_t size = s_sorted_count * sizeof(transList_t) + s_max_trans_count * sizeof(vec3_t) + (g_num_patches + 1) * sizeof(unsigned int);
 	if ( size > 1024 * 1024 )
         	Log("%-20s: %5.1f megs \n", print_name, (double)size / (1024.0 * 1024.0));
         else if ( size > 1024 )
@@ -217,55 +336,55 @@ void	FreeTransparencyArrays( )
 {
 	if (s_sorted_list) free(s_sorted_list);
 	if (s_trans_list)  free(s_trans_list);
+	if (s_sorted_rowstart) free(s_sorted_rowstart);
 	
 	s_trans_list = NULL;
 	s_sorted_list = NULL;
+	s_sorted_rowstart = NULL;
 	
 	s_max_trans_count = s_trans_count = s_sorted_count = 0;
 }
 
 //===============================================
 // GetTransparency -- find transparency from list. remembers last location
+//	Jumps to the row of p1 unless next_index is already in it before p2
 //===============================================
 void GetTransparency(const unsigned p1, const unsigned p2, vec3_t &trans, unsigned int &next_index)
 {
 	VectorFill( trans, 1.0 );
-	
-	for( unsigned i = next_index; i < s_sorted_count; i++ )
+
+	if( !s_sorted_count )
 	{
-		if ( s_sorted_list[i].p1 < p1 )
+		return;
+	}
+
+	const unsigned rowend = s_sorted_rowstart[p1 + 1];
+	unsigned i = next_index;
+
+	if( i < s_sorted_rowstart[p1] || i > rowend || (i > s_sorted_rowstart[p1] && s_sorted_list[i - 1].p2 >= p2) )
+	{
+		i = s_sorted_rowstart[p1];
+	}
+	for( ; i < rowend; i++ )
+	{
+		if ( s_sorted_list[i].p2 < p2 )
 		{
 			continue;
 		}
-		else if ( s_sorted_list[i].p1 == p1 )
+		else if ( s_sorted_list[i].p2 == p2 )
 		{
-			if ( s_sorted_list[i].p2 < p2 )
-			{
-				continue;
-			}
-			else if ( s_sorted_list[i].p2 == p2 )
-			{
-				VectorCopy( s_trans_list[s_sorted_list[i].data_index], trans );
-				next_index = i + 1;
-			
-				return;
-			}
-			else //if ( s_sorted_list[i].p2 > p2 )
-			{
-				next_index = i;
-			
-				return;
-			}
+			VectorCopy( s_trans_list[s_sorted_list[i].data_index], trans );
+			next_index = i + 1;
+		
+			return;
 		}
-		else //if ( s_sorted_list[i].p1 > p1 )
+		else //if ( s_sorted_list[i].p2 > p2 )
 		{
-			next_index = i;
-			
-			return;
+			break;
 		}
 	}
 	
-	next_index = s_sorted_count;
+	next_index = i;
 }
 
 
@@ -281,63 +400,77 @@ typedef struct {
 static styleList_t* s_style_list = NULL;
 static unsigned int	s_style_count = 0;
 static unsigned int	s_max_style_count = 0;
+static unsigned int*	s_style_rowstart = NULL;	// first item of each p1, g_num_patches + 1 entries
+// Each thread adds to a list of its own, CreateFinalStyleArrays merges them
+static styleList_t* s_raw_style_list[MAX_THREADS];
+static unsigned int	s_raw_style_count[MAX_THREADS];
+static unsigned int	s_max_raw_style_count[MAX_THREADS];
 void	AddStyleToStyleArray(const unsigned p1, const unsigned p2, const int style)
 {
 	if (style == -1)
 		return;
-	//make thread safe
-	ThreadLock();
+	const int thread = GetThreadNum();
 	
 	//realloc if needed
-	while( s_style_count >= s_max_style_count )
+	while( s_raw_style_count[thread] >= s_max_raw_style_count[thread] )
 	{
-		unsigned int old_max_count = s_max_style_count;
-		s_max_style_count = qmax (64u, (unsigned int)((double)s_max_style_count * 1.41));
-		if (s_max_style_count >= (unsigned int)INT_MAX)
+		unsigned int old_max_count = s_max_raw_style_count[thread];
+		s_max_raw_style_count[thread] = qmax (64u, (unsigned int)((double)s_max_raw_style_count[thread] * 1.41));
+		if (s_max_raw_style_count[thread] >= (unsigned int)INT_MAX)
 		{
 			Error ("AddStyleToStyleArray: array size exceeded INT_MAX");
 		}
 		
-		s_style_list = (styleList_t *)realloc( s_style_list, sizeof(styleList_t) * s_max_style_count );
+		s_raw_style_list[thread] = (styleList_t *)realloc( s_raw_style_list[thread], sizeof(styleList_t) * s_max_raw_style_count[thread] );
 
-		hlassume (s_style_list != NULL, assume_NoMemory);
+		hlassume (s_raw_style_list[thread] != NULL, assume_NoMemory);
 		
-		memset( &s_style_list[old_max_count], 0, sizeof(styleList_t) * (s_max_style_count - old_max_count) );
+		memset( &s_raw_style_list[thread][old_max_count], 0, sizeof(styleList_t) * (s_max_raw_style_count[thread] - old_max_count) );
 	}
 	
-	s_style_list[s_style_count].p1 = p1;
-	s_style_list[s_style_count].p2 = p2;
-	s_style_list[s_style_count].style = (char)style;
-	
-	s_style_count++;
+	s_raw_style_list[thread][s_raw_style_count[thread]].p1 = p1;
+	s_raw_style_list[thread][s_raw_style_count[thread]].p2 = p2;
+	s_raw_style_list[thread][s_raw_style_count[thread]].style = (char)style;
 	
-	//unlock list
-	ThreadUnlock();
+	s_raw_style_count[thread]++;
 }
-static int CDECL SortStyleList(const void *a, const void *b)
+void	CreateFinalStyleArrays(const char *print_name)
 {
-	const styleList_t* item1 = (styleList_t *)a;
-	const styleList_t* item2 = (styleList_t *)b;
-	
-	if( item1->p1 == item2->p1 )
-	{
-		return item1->p2 - item2->p2;
-	}
-	else
+	int thread;
+
+	s_style_count = 0;
+	for( thread = 0; thread < MAX_THREADS; thread++ )
 	{
-		return item1->p1 - item2->p1;
+		s_style_count += s_raw_style_count[thread];
 	}
-}
-void	CreateFinalStyleArrays(const char *print_name)
-{
 	if( s_style_count == 0 )
 	{
 		return;
 	}
+	s_max_style_count = s_style_count;
+	styleList_t *unsorted = (styleList_t *)malloc( sizeof(styleList_t) * s_max_style_count );
+	s_style_list = (styleList_t *)malloc( sizeof(styleList_t) * s_max_style_count );
+	s_style_rowstart = (unsigned int *)malloc( sizeof(unsigned int) * (g_num_patches + 1) );
+	hlassume (unsorted != NULL && s_style_list != NULL && s_style_rowstart != NULL, assume_NoMemory);
+	s_style_count = 0;
+	for( thread = 0; thread < MAX_THREADS; thread++ )
+	{
+		if( s_raw_style_count[thread] )
+		{
+			memcpy( &unsorted[s_style_count], s_raw_style_list[thread], sizeof(styleList_t) * s_raw_style_count[thread] );
+			s_style_count += s_raw_style_count[thread];
+		}
+		free( s_raw_style_list[thread] );
+		s_raw_style_list[thread] = NULL;
+		s_raw_style_count[thread] = s_max_raw_style_count[thread] = 0;
+	}
 	//need to sorted for fast search function
-	qsort( s_style_list, s_style_count, sizeof(styleList_t), SortStyleList );
+	SortByPatch( unsorted, s_style_list, s_style_count, sizeof(styleList_t), myoffsetof(styleList_t, p2), s_style_rowstart );
+	SortByPatch( s_style_list, unsorted, s_style_count, sizeof(styleList_t), myoffsetof(styleList_t, p1), s_style_rowstart );
+	free( s_style_list );
+	s_style_list = unsorted;
 	
-	size_t size = s_max_style_count * sizeof(styleList_t);
+	size_t size = s_max_style_count * sizeof(styleList_t) + (g_num_patches + 1) * sizeof(unsigned int);
 	if ( size > 1024 * 1024 )
         	Log("%-20s: %5.1f megs \n", print_name, (double)size / (1024.0 * 1024.0));
         else if ( size > 1024 )
@@ -348,48 +481,51 @@ void	CreateFinalStyleArrays(const char *print_name)
 void	FreeStyleArrays( )
 {
 	if (s_style_count) free(s_style_list);
+	if (s_style_rowstart) free(s_style_rowstart);
 	
 	s_style_list = NULL;
+	s_style_rowstart = NULL;
 	
 	s_max_style_count = s_style_count = 0;
 }
+bool	HasStyleArrays( )
+{
+	return s_style_count != 0;
+}
 void GetStyle(const unsigned p1, const unsigned p2, int &style, unsigned int &next_index)
 {
 	style = -1;
-	
-	for( unsigned i = next_index; i < s_style_count; i++ )
+
+	if( !s_style_count )
 	{
-		if ( s_style_list[i].p1 < p1 )
+		return;
+	}
+
+	const unsigned rowend = s_style_rowstart[p1 + 1];
+	unsigned i = next_index;
+
+	if( i < s_style_rowstart[p1] || i > rowend || (i > s_style_rowstart[p1] && s_style_list[i - 1].p2 >= p2) )
+	{
+		i = s_style_rowstart[p1];
+	}
+	for( ; i < rowend; i++ )
+	{
+		if ( s_style_list[i].p2 < p2 )
 		{
 			continue;
 		}
-		else if ( s_style_list[i].p1 == p1 )
+		else if ( s_style_list[i].p2 == p2 )
 		{
-			if ( s_style_list[i].p2 < p2 )
-			{
-				continue;
-			}
-			else if ( s_style_list[i].p2 == p2 )
-			{
-				style = (int)s_style_list[i].style;
-				next_index = i + 1;
-			
-				return;
-			}
-			else //if ( s_style_list[i].p2 > p2 )
-			{
-				next_index = i;
-			
-				return;
-			}
+			style = (int)s_style_list[i].style;
+			next_index = i + 1;
+		
+			return;
 		}
-		else //if ( s_style_list[i].p1 > p1 )
+		else //if ( s_style_list[i].p2 > p2 )
 		{
-			next_index = i;
-			
-			return;
+			break;
 		}
 	}
 	
-	next_index = s_style_count;
+	next_index = i;
 }
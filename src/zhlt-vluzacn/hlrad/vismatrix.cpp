@@ -11,9 +11,25 @@
 //      Determine which patches can see each other
 //      Use the PVS to accelerate if available
 //
+//      Every patch has a row of its own that starts on a word boundary. A patch is only
+//      ever tested by the thread that does its leaf, so the rows are filled without locks.
+//
 // =====================================================================================
 
-static byte*    s_vismatrix;
+typedef unsigned long long vismatrixword_t;
+
+static vismatrixword_t* s_vismatrix;
+static unsigned* s_vismatrixrows;                          // first word of the row of each patch
+
+// column of p2 in the row of p1 (p1 < p2)
+static inline unsigned VisMatrixColumn(const unsigned p1, const unsigned p2)
+{
+#ifdef HALFBIT
+    return p2 - p1 - 1;
+#else
+    return p2;
+#endif
+}
 
 
 
@@ -22,7 +38,7 @@ static byte*    s_vismatrix;
 //  TestPatchToFace
 //      Sets vis bits for all patches in the face
 // =====================================================================================
-static void     TestPatchToFace(const unsigned patchnum, const int facenum, const int head, const unsigned int bitpos
+static void     TestPatchToFace(const unsigned patchnum, const int facenum, const int head, vismatrixword_t* const row
 								, byte *pvs
 								)
 {
@@ -109,7 +125,7 @@ static void     TestPatchToFace(const unsigned patchnum, const int facenum, cons
                     //Log("SDF::3\n");
 
                     // patchnum can see patch m
-                    unsigned        bitset = bitpos + m;
+                    unsigned        column = VisMatrixColumn(patchnum, m);
 
                     if(g_customshadow_with_bouncelight && !VectorCompare(transparency, vec3_one))
 					// zhlt3.4: if(g_customshadow_with_bouncelight && VectorCompare(transparency, vec3_one)) . --vluzacn
@@ -117,9 +133,7 @@ static void     TestPatchToFace(const unsigned patchnum, const int facenum, cons
 						AddTransparencyToRawArray(patchnum, m, transparency);
                     }
 
-					ThreadLock (); //--vluzacn
-                    s_vismatrix[bitset >> 3] |= 1 << (bitset & 7);
-					ThreadUnlock (); //--vluzacn
+                    row[column >> 6] |= (vismatrixword_t)1 << (column & 63);
                 }
             }
         }
@@ -144,7 +158,7 @@ static void     BuildVisLeafs(int threadnum)
     dleaf_t*        leaf;
     patch_t*        patch;
     int             head;
-    unsigned        bitpos;
+    vismatrixword_t* row;
     unsigned        patchnum;
 
     while (1)
@@ -185,13 +199,9 @@ static void     BuildVisLeafs(int threadnum)
 				if (patch->leafnum != i)
 					continue;
 				patchnum = patch - g_patches;
-#ifdef HALFBIT
-				bitpos = patchnum * g_num_patches - (patchnum * (patchnum + 1)) / 2;
-#else
-				bitpos = patchnum * g_num_patches;
-#endif
+				row = s_vismatrix + s_vismatrixrows[patchnum];
 				for (facenum2 = facenum + 1; facenum2 < g_numfaces; facenum2++)
-					TestPatchToFace (patchnum, facenum2, head, bitpos, pvs);
+					TestPatchToFace (patchnum, facenum2, head, row, pvs);
 			}
 		}
 
@@ -207,18 +217,27 @@ static void     BuildVisLeafs(int threadnum)
 // =====================================================================================
 static void     BuildVisMatrix()
 {
-    int             c;
+    unsigned        numwords;
+    unsigned        patchnum;
+    unsigned long   c;
 
+    s_vismatrixrows = (unsigned*)malloc((g_num_patches + 1) * sizeof(unsigned));
+    hlassume(s_vismatrixrows != NULL, assume_NoMemory);
+    numwords = 0;
+    for (patchnum = 0; patchnum < g_num_patches; patchnum++)
+    {
+        s_vismatrixrows[patchnum] = numwords;
 #ifdef HALFBIT
-    c = ((g_num_patches + 1) * (g_num_patches + 1)) / 16;
-	c += 1; //--vluzacn
+        numwords += (g_num_patches - patchnum - 1 + 63) / 64;
 #else
-    c = g_num_patches * ((g_num_patches + 7) / 8);
+        numwords += (g_num_patches + 63) / 64;
 #endif
+    }
+    c = (unsigned long)(numwords + 1) * sizeof(vismatrixword_t);
 
     Log("%-20s: %5.1f megs\n", "visibility matrix", c / (1024 * 1024.0));
 
-    s_vismatrix = (byte*)AllocBlock(c);
+    s_vismatrix = (vismatrixword_t*)AllocBlock(c);
 
     if (!s_vismatrix)
     {
@@ -242,6 +261,8 @@ static void     FreeVisMatrix()
             Warning("Unable to free s_vismatrix");
         }
     }
+    free(s_vismatrixrows);
+    s_vismatrixrows = NULL;
 
 
 }
@@ -254,7 +275,7 @@ static bool     CheckVisBitVismatrix(unsigned p1, unsigned p2
 									 , unsigned int &next_index
 									 )
 {
-    unsigned        bitpos;
+    unsigned        column;
 
     const unsigned a = p1;
     const unsigned b = p2;
@@ -277,12 +298,14 @@ static bool     CheckVisBitVismatrix(unsigned p1, unsigned p2
     }
 
 #ifdef HALFBIT
-    bitpos = p1 * g_num_patches - (p1 * (p1 + 1)) / 2 + p2;
-#else
-    bitpos = p1 * g_num_patches + p2;
+    if (p1 == p2)
+    {
+        return false;                                      // a patch has no bit for itself
+    }
 #endif
+    column = VisMatrixColumn(p1, p2);
 
-    if (s_vismatrix[bitpos >> 3] & (1 << (bitpos & 7)))
+    if (s_vismatrix[s_vismatrixrows[p1] + (column >> 6)] & ((vismatrixword_t)1 << (column & 63)))
     {
     	if(g_customshadow_with_bouncelight)
     	{
@@ -317,10 +340,7 @@ void            MakeScalesVismatrix()
 
         CreateFinalTransparencyArrays("custom shadow array");
 
-	if(g_rgb_transfers)
-		{NamedRunThreadsOn(g_num_patches, g_estimate, MakeRGBScales);}
-	else
-		{NamedRunThreadsOn(g_num_patches, g_estimate, MakeScales);}
+        RunMakeScales();
         FreeVisMatrix();
         FreeTransparencyArrays();
 
@@ -1,6 +1,7 @@
 #include "qrad.h"
 
 funcCheckVisBit g_CheckVisBit = NULL;
+funcNextVisBit  g_NextVisBit = NULL;
 
 size_t          g_total_transfer = 0;
 size_t          g_transfer_index_bytes = 0;
@@ -205,6 +206,7 @@ void            MakeScales(const int threadnum)
         i = GetThreadWork();
         if (i == -1)
             break;
+        i += g_segmentfirstpatch;
 
         patch = g_patches + i;
         patch->iIndex = 0;
@@ -242,6 +244,17 @@ void            MakeScales(const int threadnum)
             vec_t           dot1;
             vec_t           dot2;
 
+            if (g_NextVisBit && !patch->translucent_b)
+            {
+                // skip straight to the next patch in the row
+                j = g_NextVisBit(i, j);
+                if (j >= g_num_patches)
+                {
+                    break;
+                }
+                patch2 = g_patches + j;
+            }
+
             vec3_t          transparency = {1.0,1.0,1.0};
 			bool useback;
 			useback = false;
@@ -416,6 +429,25 @@ void            MakeScales(const int threadnum)
 #pragma warning(pop)
 #endif
 
+// =====================================================================================
+//  RunMakeScales
+//      Builds the transfers of all patches, in memory or into the transfer stream
+// =====================================================================================
+void            RunMakeScales()
+{
+    if (g_transfermemory)
+    {
+        if (g_rgb_transfers)
+            StreamMakeScales(MakeRGBScales, "MakeRGBScales");
+        else
+            StreamMakeScales(MakeScales, "MakeScales");
+    }
+    else if (g_rgb_transfers)
+        {NamedRunThreadsOn(g_num_patches, g_estimate, MakeRGBScales);}
+    else
+        {NamedRunThreadsOn(g_num_patches, g_estimate, MakeScales);}
+}
+
 /*
  * =============
  * SwapTransfersTask
@@ -472,6 +504,7 @@ void            MakeRGBScales(const int threadnum)
         i = GetThreadWork();
         if (i == -1)
             break;
+        i += g_segmentfirstpatch;
 
         patch = g_patches + i;
         patch->iIndex = 0;
@@ -508,6 +541,17 @@ void            MakeRGBScales(const int threadnum)
         {
             vec_t           dot1;
             vec_t           dot2;
+
+            if (g_NextVisBit && !patch->translucent_b)
+            {
+                // skip straight to the next patch in the row
+                j = g_NextVisBit(i, j);
+                if (j >= g_num_patches)
+                {
+                    break;
+                }
+                patch2 = g_patches + j;
+            }
             vec3_t          transparency = {1.0,1.0,1.0};
 			bool useback;
 			useback = false;
@@ -1,5 +1,212 @@
 #include "vis.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HLVIS_FLOW_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) || (defined(_MSC_VER) && _MSC_VER >= 1700)
+#define HLVIS_FLOW_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+#endif
+
+// =====================================================================================
+//  Mightsee kernels
+//      MightseeAnd sets dst = a & b and tells whether dst has any bit that is not in vis
+//      yet. It is the inner loop of RecursiveLeafFlow, so the widest version the cpu
+//      supports is picked when the program starts. dst must be aligned to MIGHTSEE_ALIGN,
+//      the other bit strings need not be. numqwords counts 64 bit words, g_bitbytes is
+//      always a multiple of 8.
+// =====================================================================================
+#define MIGHTSEE_ALIGN 32
+
+typedef bool    (*mightseeand_t) (byte* const dst, const byte* const a, const byte* const b, const byte* const vis, const unsigned numqwords);
+
+static bool     MightseeAnd_C(byte* const dst, const byte* const a, const byte* const b, const byte* const vis, const unsigned numqwords)
+{
+    unsigned long long* d = (unsigned long long*)dst;
+    const unsigned long long* pa = (const unsigned long long*)a;
+    const unsigned long long* pb = (const unsigned long long*)b;
+    const unsigned long long* pv = (const unsigned long long*)vis;
+    unsigned long long anynew = 0;
+    unsigned        i;
+
+    for (i = 0; i < numqwords; i++)
+    {
+        d[i] = pa[i] & pb[i];
+        anynew |= d[i] & ~pv[i];
+    }
+    return anynew != 0;
+}
+
+#ifdef HLVIS_FLOW_SSE2
+static bool     MightseeAnd_SSE2(byte* const dst, const byte* const a, const byte* const b, const byte* const vis, const unsigned numqwords)
+{
+    __m128i         anynew = _mm_setzero_si128();
+    unsigned        i;
+
+    for (i = 0; i + 2 <= numqwords; i += 2)
+    {
+        const __m128i   m = _mm_and_si128(_mm_loadu_si128((const __m128i*)(a + i * 8)), _mm_loadu_si128((const __m128i*)(b + i * 8)));
+        _mm_store_si128((__m128i*)(dst + i * 8), m);
+        anynew = _mm_or_si128(anynew, _mm_andnot_si128(_mm_loadu_si128((const __m128i*)(vis + i * 8)), m));
+    }
+    if (i < numqwords)
+    {
+        if (MightseeAnd_C(dst + i * 8, a + i * 8, b + i * 8, vis + i * 8, numqwords - i))
+        {
+            return true;
+        }
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(anynew, _mm_setzero_si128())) != 0xFFFF;
+}
+#endif
+
+#ifdef HLVIS_FLOW_AVX2
+#ifdef __GNUC__
+__attribute__((target("avx2")))
+#endif
+static bool     MightseeAnd_AVX2(byte* const dst, const byte* const a, const byte* const b, const byte* const vis, const unsigned numqwords)
+{
+    __m256i         anynew = _mm256_setzero_si256();
+    unsigned        i;
+
+    for (i = 0; i + 4 <= numqwords; i += 4)
+    {
+        const __m256i   m = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(a + i * 8)), _mm256_loadu_si256((const __m256i*)(b + i * 8)));
+        _mm256_store_si256((__m256i*)(dst + i * 8), m);
+        anynew = _mm256_or_si256(anynew, _mm256_andnot_si256(_mm256_loadu_si256((const __m256i*)(vis + i * 8)), m));
+    }
+    if (i < numqwords)
+    {
+        if (MightseeAnd_C(dst + i * 8, a + i * 8, b + i * 8, vis + i * 8, numqwords - i))
+        {
+            return true;
+        }
+    }
+    return !_mm256_testz_si256(anynew, anynew);
+}
+
+static bool     CpuHasAVX2()
+{
+#ifdef __GNUC__
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    int             info[4];
+
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+    {
+        return false;                                      // the os does not save the ymm registers
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#endif
+}
+#endif
+
+static mightseeand_t SelectMightseeAnd()
+{
+#ifdef HLVIS_FLOW_AVX2
+    if (CpuHasAVX2())
+    {
+        return MightseeAnd_AVX2;
+    }
+#endif
+#ifdef HLVIS_FLOW_SSE2
+    return MightseeAnd_SSE2;
+#else
+    return MightseeAnd_C;
+#endif
+}
+
+static const mightseeand_t MightseeAnd = SelectMightseeAnd();
+
+// =====================================================================================
+//  MightseeArena
+//      The mightsee bit strings of the flow stack, one row of g_bitbytes per recursion
+//      depth, instead of a MAX_MAP_LEAFS / 8 array in every pstack_t. Each thread keeps
+//      its arena for all the portals it flows; rows are allocated one at a time, so the
+//      rows in use stay where they are when a deeper flow adds more.
+// =====================================================================================
+class MightseeArena
+{
+public:
+    MightseeArena()
+        : m_rowbytes(0), m_numrows(0), m_maxrows(0), m_rows(NULL), m_blocks(NULL)
+    {
+    }
+    ~MightseeArena()
+    {
+        Clear();
+    }
+
+    byte*           Row(const unsigned depth)
+    {
+        if (depth < m_numrows && m_rowbytes == g_bitbytes)
+        {
+            return m_rows[depth];
+        }
+        return Grow(depth);
+    }
+
+private:
+    byte*           Grow(const unsigned depth);
+    void            Clear();
+
+    unsigned        m_rowbytes;
+    unsigned        m_numrows;
+    unsigned        m_maxrows;
+    byte**          m_rows;                                // aligned to MIGHTSEE_ALIGN
+    void**          m_blocks;                              // as returned by malloc
+};
+
+byte*           MightseeArena::Grow(const unsigned depth)
+{
+    if (m_rowbytes != g_bitbytes)
+    {
+        Clear();
+        m_rowbytes = g_bitbytes;
+    }
+    if (depth >= m_maxrows)
+    {
+        m_maxrows = qmax(depth + 1, m_maxrows * 2);
+        m_rows = (byte**)realloc(m_rows, m_maxrows * sizeof(byte*));
+        m_blocks = (void**)realloc(m_blocks, m_maxrows * sizeof(void*));
+        hlassume(m_rows != NULL && m_blocks != NULL, assume_NoMemory);
+    }
+    for (; m_numrows <= depth; m_numrows++)
+    {
+        void*           block = malloc(m_rowbytes + MIGHTSEE_ALIGN);
+
+        hlassume(block != NULL, assume_NoMemory);
+        m_blocks[m_numrows] = block;
+        m_rows[m_numrows] = (byte*)(((uintptr_t)block + MIGHTSEE_ALIGN - 1) & ~(uintptr_t)(MIGHTSEE_ALIGN - 1));
+    }
+    return m_rows[depth];
+}
+
+void            MightseeArena::Clear()
+{
+    unsigned        i;
+
+    for (i = 0; i < m_numrows; i++)
+    {
+        free(m_blocks[i]);
+    }
+    free(m_rows);
+    free(m_blocks);
+    m_rows = NULL;
+    m_blocks = NULL;
+    m_numrows = 0;
+    m_maxrows = 0;
+}
+
+static thread_local MightseeArena t_mightseearena;
+
 // =====================================================================================
 //  CheckStack
 // =====================================================================================
@@ -398,6 +605,8 @@ inline static void     RecursiveLeafFlow(const int leafnum, const threaddata_t*
     stack.next = NULL;
 #endif
     stack.head = prevstack->head;
+    stack.depth = prevstack->depth + 1;
+    stack.mightsee = t_mightseearena.Row(stack.depth);
     stack.leaf = leaf;
     stack.portal = NULL;
 #ifdef RVIS_LEVEL_2
@@ -437,48 +646,11 @@ inline static void     RecursiveLeafFlow(const int leafnum, const threaddata_t*
 
         // if the portal can't see anything we haven't allready seen, skip it
         {
-            long* test;
-
-            if (p->status == stat_done)
-            {
-                test = (long*)p->visbits;
-            }
-            else
-            {
-                test = (long*)p->mightsee;
-            }
-    
-            {
-                const int bitlongs = g_bitlongs;
+            const byte* test = p->status == stat_done? p->visbits: p->mightsee;
 
-                {
-                    long* prevmight = (long*)prevstack->mightsee;
-                    long* might = (long*)stack.mightsee;
-                
-                    unsigned j;
-                    for (j = 0; j < bitlongs; j++, test++, might++, prevmight++)
-                    {
-                        (*might) = (*prevmight) & (*test);
-                    }
-                }
-        
-                {
-                    long* might = (long*)stack.mightsee;
-                    long* vis = (long*)thread->leafvis;
-                    unsigned j;
-                    for (j = 0; j < bitlongs; j++, might++, vis++)
-                    {
-                        if ((*might) & ~(*vis))
-                        {
-                            break;
-                        }
-                    }
-            
-                    if (j == g_bitlongs)
-                    {                                                  // can't see anything new
-                        continue;
-                    }
-                }
+            if (!MightseeAnd(stack.mightsee, prevstack->mightsee, test, thread->leafvis, g_bitbytes / 8))
+            {                                                  // can't see anything new
+                continue;
             }
         }
 
@@ -596,10 +768,10 @@ inline static void     RecursiveLeafFlow(const int leafnum, const threaddata_t*
 void            PortalFlow(portal_t* p)
 {
     threaddata_t    data;
-    unsigned        i;
 
     if (p->status != stat_working)
         Error("PortalFlow: reflowed");
+    ProfileCount(eProfilePortalsFlowed);
 
     p->visbits = (byte*)calloc(1, g_bitbytes);
 
@@ -611,10 +783,9 @@ void            PortalFlow(portal_t* p)
     data.pstack_head.portal = p;
     data.pstack_head.source = p->winding;
     data.pstack_head.portalplane = &p->plane;
-    for (i = 0; i < g_bitlongs; i++)
-    {
-        ((long*)data.pstack_head.mightsee)[i] = ((long*)p->mightsee)[i];
-    }
+    data.pstack_head.depth = 0;
+    data.pstack_head.mightsee = t_mightseearena.Row(0);
+    memcpy(data.pstack_head.mightsee, p->mightsee, g_bitbytes);
     RecursiveLeafFlow(p->leaf, &data, &data.pstack_head);
 
 #ifdef ZHLT_NETVIS
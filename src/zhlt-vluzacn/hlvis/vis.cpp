@@ -19,6 +19,8 @@
 #include "zlib.h"
 #endif
 
+#include <atomic>
+
 /*
 
  NOTES
@@ -53,6 +55,7 @@ bool            g_fullvis = DEFAULT_FULLVIS;
 bool            g_estimate = DEFAULT_ESTIMATE;
 bool            g_chart = DEFAULT_CHART;
 bool            g_info = DEFAULT_INFO;
+bool            g_incremental = DEFAULT_INCREMENTAL;
 
 // AJM: MVD
 unsigned int	g_maxdistance = DEFAULT_MAXDISTANCE_RANGE;
@@ -66,6 +69,12 @@ leafinfo_t*		g_leafinfos = NULL;
 
 static int      totalvis = 0;
 
+#ifndef ZHLT_NETVIS
+// Portal indices in the order LeafThread flows them: least complex (nummightsee) first, ties by index
+static int*     s_portalorder = NULL;
+static std::atomic<int> s_portalorder_next(0);
+#endif
+
 #if ZHLT_ZONES
 Zones*          g_Zones;
 #endif
@@ -317,6 +326,22 @@ static int      AllPortalsDone()
 //      Returns the next portal for a thread to work on
 //      Returns the portals from the least complex, so the later ones can reuse the earlier information.
 // =====================================================================================
+#ifndef ZHLT_NETVIS
+static portal_t* GetNextPortal()
+{
+    portal_t*       p;
+
+    // GetThreadWork only counts the portals out for the pacifier, the order comes from s_portalorder
+    if (GetThreadWork() == -1)
+    {
+        return NULL;
+    }
+
+    p = g_portals + s_portalorder[s_portalorder_next++];
+    p->status = stat_working;
+    return p;
+}
+#else
 static portal_t* GetNextPortal()
 {
     int             j;
@@ -324,16 +349,8 @@ static portal_t* GetNextPortal()
     portal_t*       tp;
     int             min;
 
-#ifdef ZHLT_NETVIS
     if (g_vismode == VIS_MODE_SERVER)
     {
-#else
-    {
-        if (GetThreadWork() == -1)
-        {
-            return NULL;
-        }
-#endif
         ThreadLock();
 
         min = 99999;
@@ -345,9 +362,7 @@ static portal_t* GetNextPortal()
             {
                 min = tp->nummightsee;
                 p = tp;
-#ifdef ZHLT_NETVIS
                 g_visportalindex = j;
-#endif
             }
         }
 
@@ -360,7 +375,6 @@ static portal_t* GetNextPortal()
 
         return p;
     }
-#ifdef ZHLT_NETVIS
     else                                                   // AS CLIENT
     {
         while (getWorkFromClientQueue() == WAITING_FOR_PORTAL_INDEX)
@@ -391,8 +405,8 @@ static portal_t* GetNextPortal()
         }
         return (tp);
     }
-#endif
 }
+#endif
 
 
 
@@ -503,6 +517,37 @@ static void     LeafThread(int unused)
 #pragma warning(pop)
 #endif
 
+// =====================================================================================
+//  Leaf vis assembly
+//      LeafFlow runs on all threads and leaves each leaf's compressed row in its own
+//      buffer. PlaceLeafVis then walks the leafs in order and copies the rows into
+//      g_dvisdata, so the lump is laid out the same way regardless of thread timing.
+//      A row that is identical to one already placed shares its visofs.
+// =====================================================================================
+typedef struct
+{
+    byte*           compressed;                            // malloc'ed, NULL once placed
+    int             size;
+    unsigned        hash;
+    int             numvis;
+    int             sawinto;                               // index in leaf->portals of the portal that saw into the leaf, -1 if none
+}
+leafvis_t;
+
+static leafvis_t* s_leafvis = NULL;
+
+static unsigned HashVisRow(const byte* const row, const int size)
+{
+    unsigned        hash = 2166136261u;                    // FNV-1a
+    int             i;
+
+    for (i = 0; i < size; i++)
+    {
+        hash = (hash ^ row[i]) * 16777619u;
+    }
+    return hash;
+}
+
 // =====================================================================================
 //  LeafFlow
 //      Builds the entire visibility list for a leaf
@@ -514,19 +559,16 @@ static void     LeafFlow(const int leafnum)
     byte            compressed[MAX_MAP_LEAFS / 8];
     unsigned        i;
     unsigned        j;
-    int             k;
-    int             tmp;
     int             numvis;
-    byte*           dest;
     portal_t*       p;
+    leafvis_t*      lv = &s_leafvis[leafnum];
 
     //
     // flow through all portals, collecting visible bits
     //
-    memset(compressed, 0, sizeof(compressed));
     outbuffer = g_uncompressed + leafnum * g_bitbytes;
     leaf = &g_leafs[leafnum];
-    tmp = 0;
+    lv->sawinto = -1;
 
     const unsigned offset = leafnum >> 3;
     const unsigned bit = (1 << (leafnum & 7));
@@ -548,16 +590,9 @@ static void     LeafFlow(const int leafnum)
             }
         }
 
-        if ((tmp == 0) && (outbuffer[offset] & bit))
+        if ((lv->sawinto == -1) && (outbuffer[offset] & bit))
         {
-            tmp = 1;
-            Warning("Leaf portals saw into leaf");
-            Log("    Problem at portal between leaves %i and %i:\n   ", leafnum, p->leaf);
-            for (k = 0; k < p->winding->numpoints; k++)
-            {
-                Log("    (%4.3f %4.3f %4.3f)\n", p->winding->points[k][0], p->winding->points[k][1], p->winding->points[k][2]);
-            }
-            Log("\n");
+            lv->sawinto = i;
         }
     }
 
@@ -585,13 +620,11 @@ static void     LeafFlow(const int leafnum)
             numvis++;
         }
     }
+    lv->numvis = numvis;
 
     //
     // compress the bit string
     //
-    Verbose("leaf %4i : %4i visible\n", leafnum, numvis);
-    totalvis += numvis;
-
 	byte buffer2[MAX_MAP_LEAFS / 8];
 	int diskbytes = (g_leafcount_all + 7) >> 3;
 	memset (buffer2, 0, diskbytes);
@@ -609,24 +642,467 @@ static void     LeafFlow(const int leafnum)
 			}
 		}
 	}
-	i = CompressVis (buffer2, diskbytes, compressed, sizeof (compressed));
+	lv->size = CompressVis (buffer2, diskbytes, compressed, sizeof (compressed));
+	lv->hash = HashVisRow (compressed, lv->size);
+	lv->compressed = (byte*)malloc (lv->size + 1);
+	hlassume (lv->compressed != NULL, assume_NoMemory);
+	memcpy (lv->compressed, compressed, lv->size);
+}
 
-    dest = vismap_p;
-    vismap_p += i;
+// =====================================================================================
+//  PlaceLeafVis
+//      Writes the rows LeafFlow built in leaf order, sharing identical rows
+// =====================================================================================
+static void     PlaceLeafVis()
+{
+    unsigned        leafnum;
+    int             j;
+    int             k;
+    int             numslots;
+    int*            slots;                                 // open addressing on hash, leaf whose row was placed or -1
+    int*            leafofs;
+    int             numshared = 0;
+
+    for (numslots = 1; numslots < (int)g_portalleafs * 2; numslots <<= 1)
+        ;
+    slots = (int*)malloc(numslots * sizeof(int));
+    leafofs = (int*)malloc(qmax(g_portalleafs, 1u) * sizeof(int)); // malloc(0) may return NULL
+    hlassume(slots != NULL && leafofs != NULL, assume_NoMemory);
+    for (k = 0; k < numslots; k++)
+    {
+        slots[k] = -1;
+    }
 
-    if (vismap_p > vismap_end)
+    for (leafnum = 0; leafnum < g_portalleafs; leafnum++)
     {
-        Error("Vismap expansion overflow");
+        leafvis_t*      lv = &s_leafvis[leafnum];
+        int             slot;
+        int             ofs = -1;
+
+        if (lv->sawinto != -1)
+        {
+            const portal_t* p = g_leafs[leafnum].portals[lv->sawinto];
+
+            Warning("Leaf portals saw into leaf");
+            Log("    Problem at portal between leaves %i and %i:\n   ", leafnum, p->leaf);
+            for (k = 0; k < p->winding->numpoints; k++)
+            {
+                Log("    (%4.3f %4.3f %4.3f)\n", p->winding->points[k][0], p->winding->points[k][1], p->winding->points[k][2]);
+            }
+            Log("\n");
+        }
+        Verbose("leaf %4i : %4i visible\n", leafnum, lv->numvis);
+        totalvis += lv->numvis;
+
+        for (slot = lv->hash & (numslots - 1); slots[slot] != -1; slot = (slot + 1) & (numslots - 1))
+        {
+            const leafvis_t* other = &s_leafvis[slots[slot]];
+
+            if (other->hash == lv->hash && other->size == lv->size
+                && !memcmp(vismap + leafofs[slots[slot]], lv->compressed, lv->size))
+            {
+                ofs = leafofs[slots[slot]];
+                numshared++;
+                break;
+            }
+        }
+        if (ofs == -1)
+        {
+            if (vismap_p + lv->size > vismap_end)
+            {
+                Error("Vismap expansion overflow");
+            }
+            ofs = vismap_p - vismap;
+            memcpy(vismap_p, lv->compressed, lv->size);
+            vismap_p += lv->size;
+            slots[slot] = leafnum;
+        }
+        leafofs[leafnum] = ofs;
+        free(lv->compressed);
+        lv->compressed = NULL;
+
+        for (j = 0; j < g_leafcounts[leafnum]; j++)
+        {
+            g_dleafs[g_leafstarts[leafnum] + j + 1].visofs = ofs;
+        }
     }
+    Verbose("%i leafs share the vis data of an earlier leaf\n", numshared);
 
-	for (j = 0; j < g_leafcounts[leafnum]; j++)
-	{
-		g_dleafs[g_leafstarts[leafnum] + j + 1].visofs = dest - vismap;
-	}
+    free(slots);
+    free(leafofs);
+}
+
+// =====================================================================================
+//  AssembleLeafVis
+//      ORs the portal vis lists of each leaf and compresses them into g_dvisdata
+// =====================================================================================
+static void     AssembleLeafVis()
+{
+    s_leafvis = (leafvis_t*)calloc(g_portalleafs + 1, sizeof(leafvis_t));
+    hlassume(s_leafvis != NULL, assume_NoMemory);
+
+    NamedRunThreadsOnIndividual(g_portalleafs, g_estimate, LeafFlow);
+    PlaceLeafVis();
+
+    free(s_leafvis);
+    s_leafvis = NULL;
+}
+
+#ifndef ZHLT_NETVIS
+// =====================================================================================
+//  Portal vis cache
+//      With -incremental the visbits of every portal are saved to "<mapname>.pvc" and the
+//      next run reuses them for each portal whose inputs did not change. The flow of a portal
+//      only walks through the leafs in its mightsee, so its key covers its own winding and
+//      the portals of every one of those leafs. Leafs are known by the hash of their portals
+//      rather than by number, so a portal survives the renumbering caused by an edit elsewhere.
+// =====================================================================================
+#define VISCACHE_IDENT      (('C'<<24)+('V'<<16)+('P'<<8)+'H')      // "HPVC"
+#define VISCACHE_VERSION    1
+
+typedef struct
+{
+    int             ident;
+    int             version;
+    int             fullvis;
+    int             numleafs;                              // followed by a hash for each leaf
+    int             numentries;                            // followed by a key and a row of numleafs bits for each portal
+}
+viscacheheader_t;
+
+typedef struct
+{
+    unsigned long long key;
+    const byte*     row;
+}
+viscacheentry_t;
+
+static unsigned long long* s_leafhash = NULL;
+static unsigned long long* s_portalkey = NULL;
+
+static unsigned long long HashBytes(unsigned long long hash, const void* const data, const int size)
+{
+    const byte*     b = (const byte*)data;
+    int             i;
+
+    for (i = 0; i < size; i++)
+    {
+        hash = (hash ^ b[i]) * 0x100000001b3ULL;           // FNV-1a
+    }
+    return hash;
+}
+
+static unsigned long long HashMix(unsigned long long x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// =====================================================================================
+//  HashPortalInputs
+//      Needs the mightsee of BasePortalVis. Sums are used where the order doesn't matter to the flow.
+// =====================================================================================
+static void     HashPortalInputs()
+{
+    const int       numportals = g_numportals * 2;
+    unsigned long long* portalhash;
+    int             i;
+    unsigned        j;
+
+    portalhash = (unsigned long long*)malloc(qmax(numportals, 1) * sizeof(unsigned long long));
+    s_leafhash = (unsigned long long*)calloc(g_portalleafs + 1, sizeof(unsigned long long));
+    s_portalkey = (unsigned long long*)malloc(qmax(numportals, 1) * sizeof(unsigned long long));
+    hlassume(portalhash != NULL && s_leafhash != NULL && s_portalkey != NULL, assume_NoMemory);
+
+    for (i = 0; i < numportals; i++)
+    {
+        const portal_t* p = &g_portals[i];
+        unsigned long long hash = 0xcbf29ce484222325ULL;
+
+        hash = HashBytes(hash, &p->winding->numpoints, sizeof(int));
+        hash = HashBytes(hash, p->winding->points, p->winding->numpoints * sizeof(vec3_t));
+        hash = HashBytes(hash, &p->plane, sizeof(plane_t));
+        hash = HashBytes(hash, &p->zone, sizeof(UINT32));
+        portalhash[i] = hash;
+    }
+    for (j = 0; j < g_portalleafs; j++)
+    {
+        const leaf_t*   leaf = &g_leafs[j];
+        unsigned long long hash = HashMix(leaf->numportals);
+        unsigned        k;
+
+        for (k = 0; k < leaf->numportals; k++)
+        {
+            hash += HashMix(portalhash[leaf->portals[k] - g_portals]);
+        }
+        s_leafhash[j] = HashMix(hash);
+    }
+    for (i = 0; i < numportals; i++)
+    {
+        const portal_t* p = &g_portals[i];
+        unsigned long long sum = 0;
+        unsigned long long hash = 0xcbf29ce484222325ULL;
+        const int       fullvis = g_fullvis;
+
+        for (j = 0; j < g_portalleafs; j++)
+        {
+            if (p->mightsee[j >> 3] & (1 << (j & 7)))
+            {
+                sum += HashMix(s_leafhash[j]);
+            }
+        }
+        hash = HashBytes(hash, &fullvis, sizeof(int));
+        hash = HashBytes(hash, &portalhash[i], sizeof(unsigned long long));
+        hash = HashBytes(hash, &s_leafhash[p->leaf], sizeof(unsigned long long));
+        hash = HashBytes(hash, &p->nummightsee, sizeof(unsigned));
+        hash = HashBytes(hash, &sum, sizeof(unsigned long long));
+        s_portalkey[i] = hash;
+    }
+
+    free(portalhash);
+}
+
+static int CDECL CompareLeafHash(const void* a, const void* b)
+{
+    const unsigned long long ha = s_leafhash[*(const int*)a];
+    const unsigned long long hb = s_leafhash[*(const int*)b];
+
+    return ha < hb? -1: ha > hb? 1: *(const int*)a - *(const int*)b;
+}
+
+static int CDECL CompareCacheEntry(const void* a, const void* b)
+{
+    const unsigned long long ka = ((const viscacheentry_t*)a)->key;
+    const unsigned long long kb = ((const viscacheentry_t*)b)->key;
+
+    return ka < kb? -1: ka > kb? 1: 0;
+}
+
+// =====================================================================================
+//  LoadPortalVisCache
+//      Marks the portals it could fill in as done, returns how many
+// =====================================================================================
+static int      LoadPortalVisCache(const char* const filename)
+{
+    char*           buffer;
+    int             size;
+    viscacheheader_t header;
+    const unsigned long long* oldleafhash;
+    const byte*     rows;
+    int             rowbytes;
+    int*            sorted;
+    int*            leafmap;                               // old leaf number to new, -1 if it is gone or ambiguous
+    viscacheentry_t* entries;
+    int             numreused = 0;
+    int             i;
+    unsigned        j;
+
+    if (!q_exists(filename))
+    {
+        return 0;
+    }
+    size = LoadFile(filename, &buffer);
+    if (size < (int)sizeof(viscacheheader_t))
+    {
+        Warning("Portal vis cache %s is damaged, ignoring it", filename);
+        Free(buffer);
+        return 0;
+    }
+    memcpy(&header, buffer, sizeof(viscacheheader_t));
+    rowbytes = (header.numleafs + 7) >> 3;
+    if (header.ident != VISCACHE_IDENT || header.version != VISCACHE_VERSION
+        || header.numleafs < 0 || header.numleafs > MAX_MAP_LEAFS || header.numentries < 0
+        || (long long)size != (long long)sizeof(viscacheheader_t) + header.numleafs * (long long)sizeof(unsigned long long)
+                              + header.numentries * ((long long)sizeof(unsigned long long) + rowbytes))
+    {
+        Warning("Portal vis cache %s is damaged or from another version, ignoring it", filename);
+        Free(buffer);
+        return 0;
+    }
+    if (header.fullvis != (int)g_fullvis)
+    {
+        Log("Portal vis cache %s was made with different settings, ignoring it\n", filename);
+        Free(buffer);
+        return 0;
+    }
+    oldleafhash = (const unsigned long long*)(buffer + sizeof(viscacheheader_t));
+    rows = (const byte*)(oldleafhash + header.numleafs);
+
+    // match the old leafs to the new ones by hash
+    sorted = (int*)malloc((g_portalleafs + 1) * sizeof(int));
+    leafmap = (int*)malloc((header.numleafs + 1) * sizeof(int));
+    entries = (viscacheentry_t*)malloc((header.numentries + 1) * sizeof(viscacheentry_t));
+    hlassume(sorted != NULL && leafmap != NULL && entries != NULL, assume_NoMemory);
+    for (j = 0; j < g_portalleafs; j++)
+    {
+        sorted[j] = j;
+    }
+    qsort(sorted, g_portalleafs, sizeof(int), CompareLeafHash);
+    for (i = 0; i < header.numleafs; i++)
+    {
+        int             lo = 0;
+        int             hi = g_portalleafs;
+
+        while (lo < hi)
+        {
+            const int       mid = (lo + hi) / 2;
+
+            if (s_leafhash[sorted[mid]] < oldleafhash[i])
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        leafmap[i] = -1;
+        if (lo < (int)g_portalleafs && s_leafhash[sorted[lo]] == oldleafhash[i]
+            && (lo + 1 == (int)g_portalleafs || s_leafhash[sorted[lo + 1]] != oldleafhash[i]))
+        {
+            leafmap[i] = sorted[lo];
+        }
+    }
+
+    for (i = 0; i < header.numentries; i++)
+    {
+        const byte*     entry = rows + i * (sizeof(unsigned long long) + rowbytes);
+
+        memcpy(&entries[i].key, entry, sizeof(unsigned long long));
+        entries[i].row = entry + sizeof(unsigned long long);
+    }
+    qsort(entries, header.numentries, sizeof(viscacheentry_t), CompareCacheEntry);
+
+    for (i = 0; i < g_numportals * 2; i++)
+    {
+        portal_t*       p = &g_portals[i];
+        viscacheentry_t search;
+        const viscacheentry_t* found;
+        byte*           visbits;
+        int             numcansee = 0;
+        int             k;
+
+        search.key = s_portalkey[i];
+        found = (const viscacheentry_t*)bsearch(&search, entries, header.numentries, sizeof(viscacheentry_t), CompareCacheEntry);
+        if (!found)
+        {
+            continue;
+        }
+        visbits = (byte*)calloc(1, g_bitbytes);
+        hlassume(visbits != NULL, assume_NoMemory);
+        for (k = 0; k < header.numleafs; k++)
+        {
+            if (found->row[k >> 3] & (1 << (k & 7)))
+            {
+                if (leafmap[k] == -1)
+                {
+                    break;
+                }
+                visbits[leafmap[k] >> 3] |= 1 << (leafmap[k] & 7);
+                numcansee++;
+            }
+        }
+        if (k < header.numleafs)
+        {
+            free(visbits);
+            continue;
+        }
+        p->visbits = visbits;
+        p->numcansee = numcansee;
+        p->status = stat_done;
+        numreused++;
+    }
 
-    memcpy(dest, compressed, i);
+    free(sorted);
+    free(leafmap);
+    free(entries);
+    Free(buffer);
+    return numreused;
 }
 
+// =====================================================================================
+//  SavePortalVisCache
+// =====================================================================================
+static void     SavePortalVisCache(const char* const filename)
+{
+    viscacheheader_t header;
+    const int       rowbytes = (g_portalleafs + 7) >> 3;
+    FILE*           f;
+    int             i;
+
+    header.ident = VISCACHE_IDENT;
+    header.version = VISCACHE_VERSION;
+    header.fullvis = g_fullvis;
+    header.numleafs = g_portalleafs;
+    header.numentries = g_numportals * 2;
+
+    f = SafeOpenWrite(filename);
+    SafeWrite(f, &header, sizeof(viscacheheader_t));
+    SafeWrite(f, s_leafhash, g_portalleafs * sizeof(unsigned long long));
+    for (i = 0; i < header.numentries; i++)
+    {
+        SafeWrite(f, &s_portalkey[i], sizeof(unsigned long long));
+        SafeWrite(f, g_portals[i].visbits, rowbytes);
+    }
+    fclose(f);
+}
+
+// =====================================================================================
+//  SortPortalsByMightsee
+//      Fills s_portalorder with a counting sort on nummightsee, which is known after BasePortalVis
+//      and does not change during the flow, so GetNextPortal doesn't have to search for the next one.
+//      Portals that are already done are left out. Returns the number of portals in s_portalorder.
+// =====================================================================================
+static int      SortPortalsByMightsee()
+{
+    const int       numportals = g_numportals * 2;
+    unsigned        maxmightsee;
+    int*            counts;
+    int             numorder;
+    int             i;
+
+    maxmightsee = 0;
+    for (i = 0; i < numportals; i++)
+    {
+        maxmightsee = qmax(maxmightsee, g_portals[i].nummightsee);
+    }
+
+    counts = (int*)calloc(maxmightsee + 2, sizeof(int));
+    hlassume(counts != NULL, assume_NoMemory);
+    numorder = 0;
+    for (i = 0; i < numportals; i++)
+    {
+        if (g_portals[i].status == stat_none)
+        {
+            counts[g_portals[i].nummightsee + 1]++;
+            numorder++;
+        }
+    }
+    for (i = 1; i <= (int)maxmightsee + 1; i++)
+    {
+        counts[i] += counts[i - 1];
+    }
+
+    s_portalorder = (int*)malloc(qmax(numportals, 1) * sizeof(int));
+    hlassume(s_portalorder != NULL, assume_NoMemory);
+    for (i = 0; i < numportals; i++)
+    {
+        if (g_portals[i].status == stat_none)
+        {
+            s_portalorder[counts[g_portals[i].nummightsee]++] = i;
+        }
+    }
+    s_portalorder_next = 0;
+
+    free(counts);
+    return numorder;
+}
+#endif
+
 // =====================================================================================
 //  CalcPortalVis
 // =====================================================================================
@@ -650,7 +1126,30 @@ static void     CalcPortalVis()
 #ifdef ZHLT_NETVIS
     LeafThread(0);
 #else
-    NamedRunThreadsOn(g_numportals * 2, g_estimate, LeafThread);
+    char            cachefile[_MAX_PATH];
+    int             numportals;
+
+    if (g_incremental)
+    {
+        safe_snprintf(cachefile, _MAX_PATH, "%s.pvc", g_Mapname);
+        HashPortalInputs();
+        numportals = LoadPortalVisCache(cachefile);
+        Log("%i of %i portals reused from %s\n", numportals, g_numportals * 2, cachefile);
+    }
+
+    numportals = SortPortalsByMightsee();
+    NamedRunThreadsOn(numportals, g_estimate, LeafThread);
+    free(s_portalorder);
+    s_portalorder = NULL;
+
+    if (g_incremental)
+    {
+        SavePortalVisCache(cachefile);
+        free(s_leafhash);
+        s_leafhash = NULL;
+        free(s_portalkey);
+        s_portalkey = NULL;
+    }
 #endif
 }
 
@@ -708,12 +1207,7 @@ static void     CalcVis()
 
     if (g_vismode == VIS_MODE_SERVER)
     {
-        unsigned int    i;
-
-        for (i = 0; i < g_portalleafs; i++)
-        {
-            LeafFlow(i);
-        }
+        AssembleLeafVis();
 
         Log("average leafs visible: %i\n", totalvis / g_portalleafs);
     }
@@ -758,7 +1252,6 @@ void		SaveVisData(const char *filename)
 // =====================================================================================
 static void     CalcVis()
 {
-    unsigned        i;
 	char visdatafile[_MAX_PATH];
 
 	safe_snprintf(visdatafile, _MAX_PATH, "%s.vdt", g_Mapname);
@@ -798,10 +1291,7 @@ static void     CalcVis()
 		//
 		// assemble the leaf vis lists by oring and compressing the portal lists
 		//
-		for (i = 0; i < g_portalleafs; i++)
-		{
-	        LeafFlow(i);
-	    }
+		AssembleLeafVis();
 
 		Log("average leafs visible: %i\n", totalvis / g_portalleafs);
 
@@ -824,10 +1314,7 @@ static void     CalcVis()
 			// No need to run this - MaxDistVis now writes directly to visbits after the initial VIS
 			//CalcPortalVis();
 		
-			for (i = 0; i < g_portalleafs; i++)
-			{
-			    LeafFlow(i);
-			}
+			AssembleLeafVis();
 
 
 			Log("average maxdistance leafs visible: %i\n", totalvis / g_portalleafs);
@@ -851,34 +1338,11 @@ static INLINE void FASTCALL CheckNullToken(const char*const token)
 }
 
 // =====================================================================================
-//  LoadPortals
+//  AllocPortals
+//      Once g_portalleafs and g_numportals are known
 // =====================================================================================
-static void     LoadPortals(char* portal_image)
+static void     AllocPortals()
 {
-    int             i, j;
-    portal_t*       p;
-    leaf_t*         l;
-    int             numpoints;
-    winding_t*      w;
-    int             leafnums[2];
-    plane_t         plane;
-    const char* const seperators = " ()\r\n\t";
-    char*           token;
-
-    token = strtok(portal_image, seperators);
-    CheckNullToken(token);
-    if (!sscanf(token, "%u", &g_portalleafs))
-    {
-        Error("LoadPortals: failed to read header: number of leafs");
-    }
-
-    token = strtok(NULL, seperators);
-    CheckNullToken(token);
-    if (!sscanf(token, "%i", &g_numportals))
-    {
-        Error("LoadPortals: failed to read header: number of portals");
-    }
-    
     Log("%4i portalleafs\n", g_portalleafs);
     Log("%4i numportals\n", g_numportals);
 
@@ -901,17 +1365,19 @@ static void     LoadPortals(char* portal_image)
 	{ // this may cause hlvis to overflow, because numportalleafs can be larger than g_numleafs in some special cases
 		Error ("Too many portalleafs (g_portalleafs(%d) > MAX_MAP_LEAFS(%d)).", g_portalleafs, MAX_MAP_LEAFS);
 	}
+}
+
+// =====================================================================================
+//  MapLeafCounts
+//      Once g_leafcounts is read
+// =====================================================================================
+static void     MapLeafCounts()
+{
+    int             i, j;
+
 	g_leafcount_all = 0;
 	for (i = 0; i < g_portalleafs; i++)
 	{
-		unsigned rval = 0;
-		token = strtok(NULL, seperators);
-		CheckNullToken(token);
-		rval += sscanf(token, "%i", &g_leafcounts[i]);
-		if (rval != 1)
-		{
-			Error("LoadPortals: read leaf %i failed", i);
-		}
 		g_leafstarts[i] = g_leafcount_all;
 		g_leafcount_all += g_leafcounts[i];
 	}
@@ -937,6 +1403,91 @@ static void     LoadPortals(char* portal_image)
 			}
 		}
 	}
+}
+
+// =====================================================================================
+//  AddPortal
+//      Makes the two memory portals of file portal w, back is where the reversed winding goes
+// =====================================================================================
+static void     AddPortal(portal_t* p, winding_t* const w, winding_t* const back, const int* const leafnums)
+{
+    leaf_t*         l;
+    plane_t         plane;
+    int             j;
+
+    // calc plane
+    PlaneFromWinding(w, &plane);
+
+    // create forward portal
+    l = &g_leafs[leafnums[0]];
+    hlassume(l->numportals < MAX_PORTALS_ON_LEAF, assume_MAX_PORTALS_ON_LEAF);
+    l->portals[l->numportals] = p;
+    l->numportals++;
+
+    p->winding = w;
+    VectorSubtract(vec3_origin, plane.normal, p->plane.normal);
+    p->plane.dist = -plane.dist;
+    p->leaf = leafnums[1];
+    p++;
+
+    // create backwards portal
+    l = &g_leafs[leafnums[1]];
+    hlassume(l->numportals < MAX_PORTALS_ON_LEAF, assume_MAX_PORTALS_ON_LEAF);
+    l->portals[l->numportals] = p;
+    l->numportals++;
+
+    p->winding = back;
+    p->winding->numpoints = w->numpoints;
+    for (j = 0; j < w->numpoints; j++)
+    {
+        VectorCopy(w->points[w->numpoints - 1 - j], p->winding->points[j]);
+    }
+
+    p->plane = plane;
+    p->leaf = leafnums[0];
+}
+
+// =====================================================================================
+//  LoadPortals
+// =====================================================================================
+static void     LoadPortals(char* portal_image)
+{
+    int             i, j;
+    portal_t*       p;
+    int             numpoints;
+    winding_t*      w;
+    int             leafnums[2];
+    const char* const seperators = " ()\r\n\t";
+    char*           token;
+
+    token = strtok(portal_image, seperators);
+    CheckNullToken(token);
+    if (!sscanf(token, "%u", &g_portalleafs))
+    {
+        Error("LoadPortals: failed to read header: number of leafs");
+    }
+
+    token = strtok(NULL, seperators);
+    CheckNullToken(token);
+    if (!sscanf(token, "%i", &g_numportals))
+    {
+        Error("LoadPortals: failed to read header: number of portals");
+    }
+    
+    AllocPortals();
+
+	for (i = 0; i < g_portalleafs; i++)
+	{
+		unsigned rval = 0;
+		token = strtok(NULL, seperators);
+		CheckNullToken(token);
+		rval += sscanf(token, "%i", &g_leafcounts[i]);
+		if (rval != 1)
+		{
+			Error("LoadPortals: read leaf %i failed", i);
+		}
+	}
+	MapLeafCounts();
     for (i = 0, p = g_portals; i < g_numportals; i++)
     {
         unsigned rval = 0;
@@ -995,55 +1546,137 @@ static void     LoadPortals(char* portal_image)
             }
         }
 
-        // calc plane
-        PlaneFromWinding(w, &plane);
+        AddPortal(p, w, NewWinding(w->numpoints), leafnums);
+        p += 2;
+    }
+}
 
-        // create forward portal
-        l = &g_leafs[leafnums[0]];
-        hlassume(l->numportals < MAX_PORTALS_ON_LEAF, assume_MAX_PORTALS_ON_LEAF);
-        l->portals[l->numportals] = p;
-        l->numportals++;
+// =====================================================================================
+//  LoadPortalsBinary
+//      Reads the binary form written by hlbsp straight from the mapped file. All the windings
+//      are carved out of one block.
+// =====================================================================================
+static void     LoadPortalsBinary(const byte* const image, const size_t size)
+{
+    portalfileheader_t header;
+    const int*      leafnumportals;
+    const int*      records;
+    const byte*     points;
+    long long       needed;
+    long long       poolsize;
+    int             numpoints;
+    byte*           pool;
+    portal_t*       p;
+    int             i, j, k;
 
-        p->winding = w;
-        VectorSubtract(vec3_origin, plane.normal, p->plane.normal);
-        p->plane.dist = -plane.dist;
-        p->leaf = leafnums[1];
-        p++;
+    memcpy(&header, image, sizeof(header));
+    if (header.version != PORTALFILE_BINARY_VERSION)
+    {
+        Error("Portal file is version %i, expected %i. Please rerun hlbsp.", header.version, PORTALFILE_BINARY_VERSION);
+    }
+    needed = (long long)sizeof(header) + 2LL * header.numleafs * sizeof(int) + 3LL * header.numportals * sizeof(int)
+        + 3LL * header.numpoints * sizeof(double);
+    if (header.numleafs < 0 || header.numportals < 0 || header.numpoints < 0 || needed != (long long)size)
+    {
+        Error("LoadPortals: Damaged or invalid .prt file\n");
+    }
+    leafnumportals = (const int*)(image + sizeof(header)) + header.numleafs;
+    records = leafnumportals + header.numleafs;
+    points = (const byte*)(records + 3 * header.numportals);
+
+    g_portalleafs = header.numleafs;
+    g_numportals = header.numportals;
+    AllocPortals();
+    memcpy(g_leafcounts, image + sizeof(header), g_portalleafs * sizeof(int));
+    MapLeafCounts();
+    for (i = 0; i < g_portalleafs; i++)
+    {
+        hlassume(leafnumportals[i] <= MAX_PORTALS_ON_LEAF, assume_MAX_PORTALS_ON_LEAF);
+    }
 
-        // create backwards portal
-        l = &g_leafs[leafnums[1]];
-        hlassume(l->numportals < MAX_PORTALS_ON_LEAF, assume_MAX_PORTALS_ON_LEAF);
-        l->portals[l->numportals] = p;
-        l->numportals++;
+    poolsize = 0;
+    numpoints = 0;
+    for (i = 0; i < g_numportals; i++)
+    {
+        const int*      record = &records[3 * i];
 
-        p->winding = NewWinding(w->numpoints);
-        p->winding->numpoints = w->numpoints;
-        for (j = 0; j < w->numpoints; j++)
+        if (record[0] > MAX_POINTS_ON_WINDING)
+        {
+            Error("LoadPortals: portal %i has too many points", i);
+        }
+        if (record[0] < 3 || (unsigned)record[1] >= g_portalleafs || (unsigned)record[2] >= g_portalleafs)
         {
-            VectorCopy(w->points[w->numpoints - 1 - j], p->winding->points[j]);
+            Error("LoadPortals: reading portal %i", i);
         }
+        poolsize += 2 * (long long)(intptr_t)((winding_t*)0)->points[record[0]];
+        numpoints += record[0];
+    }
+    if (numpoints != header.numpoints)
+    {
+        Error("LoadPortals: Damaged or invalid .prt file\n");
+    }
+    pool = (byte*)calloc(1, qmax(poolsize, 1));
+    hlassume(pool != NULL, assume_NoMemory);
+
+    for (i = 0, p = g_portals; i < g_numportals; i++, p += 2)
+    {
+        const int*      record = &records[3 * i];
+        const int       windingsize = (int)(intptr_t)((winding_t*)0)->points[record[0]];
+        winding_t*      w = (winding_t*)pool;
+        winding_t*      back = (winding_t*)(pool + windingsize);
 
-        p->plane = plane;
-        p->leaf = leafnums[0];
-        p++;
+        pool += 2 * windingsize;
+        w->original = true;
+        w->numpoints = record[0];
+        for (j = 0; j < w->numpoints; j++, points += 3 * sizeof(double))
+        {
+            double          v[3];
 
+            memcpy(v, points, sizeof(v));
+            for (k = 0; k < 3; k++)
+            {
+                w->points[j][k] = v[k];
+            }
+        }
+        AddPortal(p, w, back, &record[1]);
+    }
+    for (i = 0; i < g_portalleafs; i++)
+    {
+        if (g_leafs[i].numportals != (unsigned)leafnumportals[i])
+        {
+            Error("LoadPortals: Damaged or invalid .prt file\n");
+        }
     }
 }
 
 // =====================================================================================
 //  LoadPortalsByFilename
+//      The file from hlbsp is binary, but a text portal file is still read
 // =====================================================================================
 static void     LoadPortalsByFilename(const char* const filename)
 {
     char* file_image;
+    byte* map;
+    size_t size;
 
     if (!q_exists(filename))
     {
         Error("Portal file '%s' does not exist, cannot vis the map\n", filename);
     }
+    map = (byte*)MapFileRead(filename, &size);
+    if (map && size >= sizeof(portalfileheader_t) && ((const portalfileheader_t*)map)->ident == PORTALFILE_BINARY_IDENT)
+    {
+        LoadPortalsBinary(map, size);
+        UnmapFile(map, size);
+        return;
+    }
+    if (map)
+    {
+        UnmapFile(map, size);
+    }
     LoadFile(filename, &file_image);
     LoadPortals(file_image);
-    free(file_image);
+    Free(file_image);
 }
 
 
@@ -1124,6 +1757,9 @@ static void     Usage()
     Log("    -noestimate     : do not display continuous compile time estimates\n");
 #endif
 	Log("    -maxdistance #  : Alter the maximum distance for visibility\n");
+#ifndef ZHLT_NETVIS
+    Log("    -incremental    : Use or create a portal vis cache file\n");
+#endif
     Log("    -verbose        : compile with verbose messages\n");
     Log("    -noinfo         : Do not show tool configuration information\n");
     Log("    -dev #          : compile with developer message\n\n");
@@ -1197,6 +1833,9 @@ static void     Settings()
     // HLVIS Specific Settings
     Log("fast vis            [ %7s ] [ %7s ]\n", g_fastvis ? "on" : "off", DEFAULT_FASTVIS ? "on" : "off");
     Log("full vis            [ %7s ] [ %7s ]\n", g_fullvis ? "on" : "off", DEFAULT_FULLVIS ? "on" : "off");
+#ifndef ZHLT_NETVIS
+    Log("incremental         [ %7s ] [ %7s ]\n", g_incremental ? "on" : "off", DEFAULT_INCREMENTAL ? "on" : "off");
+#endif
 
 #ifdef ZHLT_NETVIS
     if (g_vismode == VIS_MODE_SERVER)
@@ -1367,6 +2006,10 @@ int             main(const int argc, char** argv)
             Log("g_fastvis = true\n");
             g_fastvis = true;
         }
+        else if (!strcasecmp(argv[i], "-incremental"))
+        {
+            g_incremental = true;
+        }
 #endif
         else if (!strcasecmp(argv[i], "-full"))
         {
@@ -1552,6 +2195,7 @@ int             main(const int argc, char** argv)
     StripExtension(g_Mapname);
     OpenLog(g_clientid);
     atexit(CloseLog);
+    atexit(WriteProfileReport);
     ThreadSetDefault();
     ThreadSetPriority(g_threadpriority);
     LogStart(argcold, argvold);
@@ -1634,8 +2278,8 @@ int             main(const int argc, char** argv)
             Error("zlib Compression error with prt image\n");
         }
 
-        free(bsp_image);
-        free(prt_image);
+        Free(bsp_image);
+        Free(prt_image);
 
         g_bsp_image = bsp_compressed_image;
         g_prt_image = prt_compressed_image;
@@ -1666,6 +2310,7 @@ int             main(const int argc, char** argv)
 
 #else // NOT ZHLT_NETVIS
 
+    ProfileBeginStage("LoadBSPFile");
     LoadBSPFile(source);
     ParseEntities();
 	{
@@ -1692,13 +2337,16 @@ int             main(const int argc, char** argv)
         g_Zones = MakeZones();
         AssignPortalsToZones();
 #   endif
+    ProfileEndStage();
 
 #endif
 
     Settings();
     g_uncompressed = (byte*)calloc(g_portalleafs, g_bitbytes);
 
+    ProfileBeginStage("CalcVis");
     CalcVis();
+    ProfileEndStage();
 
 #ifdef ZHLT_NETVIS
 
@@ -1752,7 +2400,9 @@ int             main(const int argc, char** argv)
         PrintBSPFileSizes();
     }
 
+    ProfileBeginStage("WriteBSPFile");
     WriteBSPFile(source);
+    ProfileEndStage();
 
     end = I_FloatTime();
     LogTimeElapsed(end - start);
@@ -13,6 +13,7 @@
 #include "mathlib.h"
 #include "bspfile.h"
 #include "threads.h"
+#include "blockmem.h"
 #include "filelib.h"
 
 #include "zones.h"
@@ -31,6 +32,7 @@
 #define DEFAULT_ESTIMATE    true
 #endif
 #define DEFAULT_FASTVIS     false
+#define DEFAULT_INCREMENTAL false
 #define DEFAULT_NETVIS_PORT 21212
 #define DEFAULT_NETVIS_RATE 60
 
@@ -103,7 +105,8 @@ typedef struct leaf_s
 
 typedef struct pstack_s
 {
-    byte            mightsee[MAX_MAP_LEAFS / 8];           // bit string
+    byte*           mightsee;                              // bit string of g_bitbytes, a row of the thread's mightsee arena
+    unsigned        depth;                                 // row of mightsee, 0 for pstack_head
 #ifdef USE_CHECK_STACK
     struct pstack_s* next;
 #endif
@@ -136,6 +139,7 @@ typedef struct
 
 extern bool     g_fastvis;
 extern bool     g_fullvis;
+extern bool     g_incremental;
 
 extern int      g_numportals;
 extern unsigned g_portalleafs;